@@ -88,10 +88,36 @@ dma_sg_size(void);
  */
 #define LIBVFIO_USER_FLAG_ATTACH_NB  (1 << 0)
 
+/*
+ * Don't quiesce the device for VFIO_USER_DMA_MAP.
+ *
+ * A DMA_MAP can only add a region that doesn't overlap any existing one, so it
+ * can't invalidate translations the device is using; the new region is
+ * published atomically to vfu_addr_to_sgl() and friends. Only DMA_UNMAP then
+ * quiesces the device. As a consequence, the dma_register callback may run
+ * while the device is operating.
+ */
+#define LIBVFIO_USER_FLAG_DMA_MAP_NO_QUIESCE  (1 << 1)
+
+/*
+ * Let the client negotiate the "posted_writes" capability, in which case region
+ * writes aren't replied to and a failed write is reported by signalling the
+ * VFU_DEV_ERR_IRQ eventfd instead. The capability is only granted if the device
+ * has set up VFU_DEV_ERR_IRQ. A write that fails while the client has no
+ * eventfd configured for it is logged, and signalled once the client sets one.
+ */
+#define LIBVFIO_USER_FLAG_POSTED_WRITES  (1 << 2)
+
 typedef enum {
     VFU_TRANS_SOCK,
     // For internal testing only
     VFU_TRANS_PIPE,
+    /*
+     * Like VFU_TRANS_SOCK, but requests are received and replied to through
+     * io_uring (Linux 6.0 or later), if built with -Dtran-uring=true.
+     * Server-to-client requests then need the twin_socket feature.
+     */
+    VFU_TRANS_SOCK_URING,
     VFU_TRANS_MAX
 } vfu_trans_t;
 
@@ -155,7 +181,8 @@ vfu_get_poll_fd(vfu_ctx_t *vfu_ctx);
  *   Blocks until new request is received from client and continues processing
  *   the requests. Exits only in case of error or if the client disconnects.
  * - Non-blocking vfu_ctx(LIBVFIO_USER_FLAG_ATTACH_NB):
- *   Processes one request from client if it's available, otherwise it
+ *   Processes one request from client if it's available, along with any
+ *   further requests the library has already received with it, otherwise it
  *   immediately returns and the caller is responsible for periodically
  *   calling again.
  *
@@ -171,6 +198,154 @@ vfu_get_poll_fd(vfu_ctx_t *vfu_ctx);
 int
 vfu_run_ctx(vfu_ctx_t *vfu_ctx);
 
+/*
+ * A reactor serves many contexts from a single epoll set and a pool of worker
+ * threads, so that a process hosting many devices needs neither a thread nor a
+ * hand-written event loop per device. For each registered context the reactor
+ * accepts and negotiates with the client (vfu_attach_ctx()), processes its
+ * requests (vfu_run_ctx()), and waits for a new client when one disconnects.
+ * A context is only ever handled by one worker at a time, so its callbacks are
+ * never called concurrently; callbacks of different contexts may be.
+ */
+typedef struct vfu_reactor vfu_reactor_t;
+
+/**
+ * Creates a reactor.
+ *
+ * @nr_workers: number of threads handling contexts in vfu_reactor_run()
+ *
+ * @returns the reactor, or NULL on failure. Sets errno.
+ */
+vfu_reactor_t *
+vfu_reactor_create(unsigned int nr_workers);
+
+/**
+ * Registers a context with the reactor. The context must be realized, created
+ * with LIBVFIO_USER_FLAG_ATTACH_NB, and not yet attached; it can be added
+ * while the reactor is running.
+ *
+ * If the quiesce callback returns EBUSY, the context is not handled until the
+ * device calls vfu_device_quiesced().
+ *
+ * @reactor: the reactor
+ * @vfu_ctx: the libvfio-user context
+ *
+ * @returns 0 on success, -1 on failure. Sets errno.
+ */
+int
+vfu_reactor_add_ctx(vfu_reactor_t *reactor, vfu_ctx_t *vfu_ctx);
+
+/**
+ * Unregisters a context from the reactor, waiting for a worker that is
+ * handling it to finish. Must not be called from a callback of @vfu_ctx.
+ *
+ * @reactor: the reactor
+ * @vfu_ctx: the libvfio-user context
+ *
+ * @returns 0 on success, -1 on failure. Sets errno: ENOENT if @vfu_ctx is not
+ * registered with @reactor.
+ */
+int
+vfu_reactor_remove_ctx(vfu_reactor_t *reactor, vfu_ctx_t *vfu_ctx);
+
+/**
+ * Handles the registered contexts until vfu_reactor_stop() is called. The
+ * calling thread is one of the workers; the others are started here and have
+ * exited by the time this returns.
+ *
+ * Errors from vfu_run_ctx() other than ENOTCONN and EBUSY are logged on the
+ * context and otherwise ignored. If a context can't be re-added to the epoll
+ * set, which would leave it unhandled, the reactor stops and this fails with
+ * that error; calling it again retries.
+ *
+ * @reactor: the reactor
+ *
+ * @returns 0 on success, -1 on failure. Sets errno.
+ */
+int
+vfu_reactor_run(vfu_reactor_t *reactor);
+
+/**
+ * Makes vfu_reactor_run() return once its workers have finished handling their
+ * current contexts. Safe to call from any thread, including callbacks.
+ *
+ * @reactor: the reactor
+ */
+void
+vfu_reactor_stop(vfu_reactor_t *reactor);
+
+/**
+ * Unregisters all contexts and frees the reactor. The contexts themselves are
+ * not destroyed. Must not be called while vfu_reactor_run() is running.
+ *
+ * @reactor: the reactor
+ */
+void
+vfu_reactor_destroy(vfu_reactor_t *reactor);
+
+/*
+ * A pool of threads that handle selected slow requests (such as migration
+ * data, which may call a slow read_data callback) on behalf of vfu_run_ctx(),
+ * which then goes on to handle region accesses and other requests without
+ * waiting; replies are sent as requests complete, so they may be out of order,
+ * and the client matches them up by message ID. A pool can be shared by any
+ * number of contexts.
+ */
+typedef struct vfu_worker_pool vfu_worker_pool_t;
+
+/**
+ * Creates a worker pool.
+ *
+ * @nr_threads: number of worker threads
+ *
+ * @returns the pool, or NULL on failure. Sets errno.
+ */
+vfu_worker_pool_t *
+vfu_worker_pool_create(unsigned int nr_threads);
+
+/**
+ * Stops the pool's threads and frees it. All contexts using the pool must have
+ * been destroyed.
+ *
+ * @pool: the worker pool
+ */
+void
+vfu_worker_pool_destroy(vfu_worker_pool_t *pool);
+
+/* VFIO_USER_MIG_DATA_READ and VFIO_USER_MIG_DATA_WRITE */
+#define VFU_WORKER_CMD_MIGRATION_DATA   (1 << 0)
+/*
+ * VFIO_USER_DMA_MAP, with LIBVFIO_USER_FLAG_DMA_MAP_NO_QUIESCE only.
+ * VFIO_USER_DMA_UNMAP is always handled by vfu_run_ctx().
+ */
+#define VFU_WORKER_CMD_DMA              (1 << 1)
+/* VFIO_USER_DEVICE_FEATURE */
+#define VFU_WORKER_CMD_DEVICE_FEATURE   (1 << 2)
+
+/**
+ * Makes vfu_run_ctx() hand requests of the given classes to a worker pool.
+ *
+ * Offloaded requests are handled one at a time and in the order received, by
+ * whichever worker is free, and so are any device callbacks they call; those
+ * may run concurrently with callbacks for region accesses, interrupt setup
+ * and device information requests, which are still handled by vfu_run_ctx().
+ * A region access may therefore be handled before an earlier offloaded request
+ * has completed: a client that depends on the order must wait for the reply.
+ * Any other request, and any request that needs the device to quiesce, waits
+ * for all offloaded requests to complete before it is handled.
+ *
+ * Must be called before vfu_realize_ctx().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @pool: the worker pool
+ * @cmd_classes: bitmask of VFU_WORKER_CMD_*
+ *
+ * @returns 0 on success, -1 on failure. Sets errno.
+ */
+int
+vfu_setup_worker_pool(vfu_ctx_t *vfu_ctx, vfu_worker_pool_t *pool,
+                      int cmd_classes);
+
 /**
  * Destroys libvfio-user context. During this call the device must already be
  * in quiesced state; the quiesce callback is not called. Any other device
@@ -326,6 +501,87 @@ vfu_setup_region(vfu_ctx_t *vfu_ctx, int region_idx, size_t size,
                  struct iovec *mmap_areas, uint32_t nr_mmap_areas,
                  int fd, uint64_t offset);
 
+/*
+ * Prototype for region range access callback, see vfu_setup_region_range().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @arg: the argument passed to vfu_setup_region_range()
+ * @buf: buffer containing the data to be written or data to be read into
+ * @count: number of bytes being read or written
+ * @offset: byte offset within the range
+ * @is_write: whether or not this is a write
+ *
+ * @returns the number of bytes read or written, or -1 on error, setting errno.
+ */
+typedef ssize_t (vfu_region_range_access_cb_t)(vfu_ctx_t *vfu_ctx, void *arg,
+                                               char *buf, size_t count,
+                                               loff_t offset, bool is_write);
+
+/**
+ * Registers a handler for accesses to a range of a region, such as a register
+ * block or a doorbell array. Accesses that fall within the range are passed
+ * to @range_access instead of the region callback, so the device doesn't
+ * need to decode the offset again; accesses outside of any range still go to
+ * the region callback.
+ *
+ * If @access_sizes is not zero, it's the bitwise OR of the permitted access
+ * sizes (1, 2, 4 and 8 bytes), and accesses must also be naturally aligned.
+ * Accesses that straddle the start or end of the range, or don't match
+ * @access_sizes, fail with EINVAL without calling @range_access or the region
+ * callback.
+ *
+ * Ranges are not supported for the PCI config space region, and must not
+ * overlap. The region must have been set up with vfu_setup_region() first.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @region_idx: region index
+ * @offset: offset of the range within the region
+ * @size: size of the range
+ * @access_sizes: permitted access sizes, or 0 for any
+ * @range_access: callback function to access the range
+ * @arg: argument passed to @range_access
+ *
+ * @returns 0 on success, -1 on error, Sets errno.
+ */
+int
+vfu_setup_region_range(vfu_ctx_t *vfu_ctx, int region_idx, uint64_t offset,
+                       uint64_t size, uint32_t access_sizes,
+                       vfu_region_range_access_cb_t *range_access, void *arg);
+
+/* Also expose the shadow range to the client as a sparse mmap area. */
+#define VFU_REGION_SHADOW_FLAG_MMAP (1 << 0)
+
+/**
+ * Declares a range of a region as shadow registers: plain storage (such as
+ * status, capability or version registers) that the device keeps up to date
+ * in @shadow. Reads from the range are served from @shadow by the library
+ * without calling any device callback; writes still go to the region
+ * callback. Naturally aligned 2, 4 and 8 byte reads are single-copy atomic,
+ * so the device can update registers concurrently using atomic stores.
+ *
+ * With VFU_REGION_SHADOW_FLAG_MMAP, the range is additionally added to the
+ * region's sparse mmap areas, so that clients can read the registers
+ * directly. This requires the region to be backed by a file descriptor (see
+ * vfu_setup_region()), @offset and @size to be page-aligned, and @shadow to
+ * be a shared mapping of that file at the corresponding offset. Note that the
+ * client can then also write to the range directly.
+ *
+ * Shadow ranges must not overlap each other or ranges set up with
+ * vfu_setup_region_range().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @region_idx: region index
+ * @offset: offset of the range within the region
+ * @size: size of the range
+ * @shadow: memory backing the range, @size bytes
+ * @flags: VFU_REGION_SHADOW_FLAG_*
+ *
+ * @returns 0 on success, -1 on error, Sets errno.
+ */
+int
+vfu_setup_region_shadow(vfu_ctx_t *vfu_ctx, int region_idx, uint64_t offset,
+                        uint64_t size, void *shadow, int flags);
+
 typedef enum vfu_reset_type {
     /*
      * Client requested a device reset (for example, as part of a guest VM
@@ -371,6 +627,11 @@ typedef enum vfu_reset_type {
  * the migration transition callback. These callbacks are only called after the
  * device has been quiesced.
  *
+ * After quiescing for a DMA map or unmap, libvfio-user also handles any further
+ * DMA maps and unmaps the client has already queued before unquiescing, so a
+ * burst of DMA changes costs a single quiesce. The first other request is only
+ * handled once the device is unquiesced.
+ *
  * The following example demonstrates how a device can use the SG routines and
  * friends while quiesced:
  *
@@ -418,7 +679,8 @@ vfu_setup_device_quiesce_cb(vfu_ctx_t *vfu_ctx,
 
 /*
  * Called by the device to complete a pending quiesce operation. After the
- * function returns the device is unquiesced.
+ * function returns the device is unquiesced. For a non-blocking context, the
+ * poll fd is readable if the library has already received further requests.
  *
  * @vfu_ctx: the libvfio-user context
  * @quiesce_errno: 0 for success or errno in case the device fails to quiesce,
@@ -644,6 +906,67 @@ vfu_setup_device_migration_callbacks(vfu_ctx_t *vfu_ctx,
 int
 vfu_irq_trigger(vfu_ctx_t *vfu_ctx, uint32_t subindex);
 
+/**
+ * Triggers a set of interrupts at once.
+ *
+ * @vectors is a bitmap of sub-indices: bit N of vectors[N / 64] requests
+ * sub-index N. Callers can accumulate completions into the bitmap over a poll
+ * iteration; however many times a vector was requested it is signalled at most
+ * once per call. All requested vectors are validated before any is signalled,
+ * so on failure none of them were.
+ *
+ * Vectors with a coalescing policy (see vfu_irq_set_coalescing()) may be held
+ * back instead of being signalled.
+ *
+ * @vfu_ctx: the libvfio-user context to trigger interrupts on
+ * @vectors: bitmap of vector sub-indices
+ * @nr_vectors: number of valid bits in @vectors
+ *
+ * @returns the number of eventfds written, or -1 on failure. Sets errno:
+ * EINVAL if a vector is out of range, ENOENT if a vector has no eventfd.
+ */
+int
+vfu_irq_trigger_batch(vfu_ctx_t *vfu_ctx, const uint64_t *vectors,
+                      uint32_t nr_vectors);
+
+/**
+ * Sets an interrupt coalescing policy for a vector.
+ *
+ * Once set, triggers of @subindex (via vfu_irq_trigger() or
+ * vfu_irq_trigger_batch()) are counted rather than signalled. The vector is
+ * signalled once, and the count reset, when @max_count triggers have
+ * accumulated or when @max_delay_us have elapsed since the first of them. As
+ * nothing else runs the timer, the device must call vfu_irq_flush() from its
+ * poll loop when using @max_delay_us.
+ *
+ * Passing 0 for both disables coalescing and signals any held-back interrupt.
+ * Must be called after vfu_realize_ctx(). Coalesced vectors must be triggered
+ * and flushed from a single thread.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @subindex: vector sub-index
+ * @max_count: deliver after this many triggers, 0 for no count limit
+ * @max_delay_us: deliver this many microseconds after the first trigger, 0 for
+ *  no time limit
+ *
+ * @returns 0 on success, or -1 on failure. Sets errno.
+ */
+int
+vfu_irq_set_coalescing(vfu_ctx_t *vfu_ctx, uint32_t subindex,
+                       uint32_t max_count, uint32_t max_delay_us);
+
+/**
+ * Signals coalesced interrupts whose delay has elapsed, or all held-back
+ * interrupts if @force is set.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @force: signal pending interrupts regardless of their policy
+ *
+ * @returns the number of eventfds written, or -1 on failure. Sets errno.
+ */
+int
+vfu_irq_flush(vfu_ctx_t *vfu_ctx, bool force);
+
 /**
  * Takes a guest physical address range and populates an array of scatter/gather
  * entries than can be individually mapped in the program's virtual memory.  A
@@ -670,6 +993,73 @@ int
 vfu_addr_to_sgl(vfu_ctx_t *vfu_ctx, vfu_dma_addr_t dma_addr, size_t len,
                 dma_sg_t *sgl, size_t max_nr_sgs, int prot);
 
+#define VFU_MAX_IO_CTXS 64
+
+/*
+ * Called when a DMA region used by an I/O context is being unmapped, see
+ * vfu_setup_io_ctx(). The callback must not return until the I/O context has
+ * reached a quiescent point, i.e. no longer holds any scatter/gather entries,
+ * mappings or addresses obtained through vfu_io_ctx_addr_to_sgl() before the
+ * callback was called. The I/O context may carry on running afterwards.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @arg: the argument passed to vfu_setup_io_ctx()
+ */
+typedef void (vfu_io_ctx_quiesce_cb_t)(vfu_ctx_t *vfu_ctx, void *arg);
+
+/**
+ * Registers an I/O context, such as a queue or a polling thread, for partial
+ * quiescing.
+ *
+ * By default every DMA unmap quiesces the whole device. Once I/O contexts are
+ * registered, an unmap instead only waits for the I/O contexts that have used
+ * the region since their last quiescent point, calling their @quiesce
+ * callback; the rest of the device keeps running. The device quiesce
+ * callback is still used for everything else, including unmapping all regions
+ * and unmaps that collect dirty pages.
+ *
+ * I/O contexts must then translate guest addresses with
+ * vfu_io_ctx_addr_to_sgl() rather than vfu_addr_to_sgl(), so libvfio-user can
+ * track which contexts use which regions.
+ *
+ * Must be called before vfu_realize_ctx().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @quiesce: callback called when a region used by the I/O context is unmapped
+ * @arg: argument passed to @quiesce
+ *
+ * @returns the I/O context ID on success, or -1 on failure. Sets errno: ENOSPC
+ * if VFU_MAX_IO_CTXS are already registered.
+ */
+int
+vfu_setup_io_ctx(vfu_ctx_t *vfu_ctx, vfu_io_ctx_quiesce_cb_t *quiesce,
+                 void *arg);
+
+/**
+ * Same as vfu_addr_to_sgl(), but also records that I/O context @io_ctx uses
+ * the regions returned, so that unmapping them waits for it.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @io_ctx: the I/O context ID returned by vfu_setup_io_ctx()
+ *
+ * See vfu_addr_to_sgl() for the other arguments and the return value.
+ */
+int
+vfu_io_ctx_addr_to_sgl(vfu_ctx_t *vfu_ctx, int io_ctx, vfu_dma_addr_t dma_addr,
+                       size_t len, dma_sg_t *sgl, size_t max_nr_sgs, int prot);
+
+/**
+ * Declares that I/O context @io_ctx has reached a quiescent point: it holds no
+ * references to guest memory obtained with vfu_io_ctx_addr_to_sgl(). Unmaps
+ * won't wait for it until it translates addresses again. Idle I/O contexts
+ * should call this so that unmaps don't need to call their quiesce callback.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @io_ctx: the I/O context ID returned by vfu_setup_io_ctx()
+ */
+void
+vfu_io_ctx_quiescent(vfu_ctx_t *vfu_ctx, int io_ctx);
+
 /**
  * Populate the given iovec array (accessible in the process's virtual memory),
  * based upon the SGL previously built via vfu_addr_to_sgl().
@@ -723,6 +1113,11 @@ vfu_sgl_put(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, struct iovec *iov, size_t cnt);
  * alternative to reading from a vfu_sgl_get() mapping, if the region is not
  * directly mappable, or DMA notification callbacks have not been provided.
  *
+ * vfu_sgl_read() and vfu_sgl_write() (and their asynchronous variants) can be
+ * called from several threads at once; replies are matched to the requesting
+ * thread by message ID. This requires the client to support the twin_socket
+ * feature, otherwise transfers are serialized.
+ *
  * @vfu_ctx: the libvfio-user context
  * @sg: a DMA segment obtained from dma_addr_to_sg
  * @data: data buffer to read into
@@ -749,6 +1144,154 @@ vfu_sgl_read(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, size_t cnt, void *data);
 int
 vfu_sgl_write(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, size_t cnt, void *data);
 
+#define VFU_DMA_TRANSFER_MAX_WINDOW 64
+
+/**
+ * Sets the maximum number of DMA read/write messages vfu_sgl_read() and
+ * vfu_sgl_write() keep in flight. Transfers larger than the client's
+ * max_data_xfer_size are split into several messages; by default (a window of
+ * 1) each reply is waited for before sending the next request. A larger
+ * window pipelines these messages, which is only safe if the client supports
+ * the twin_socket feature.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @window: maximum number of messages in flight, 1 to
+ *          VFU_DMA_TRANSFER_MAX_WINDOW
+ *
+ * @returns 0 on success, -1 on failure. Sets errno.
+ */
+int
+vfu_setup_dma_transfer_window(vfu_ctx_t *vfu_ctx, size_t window);
+
+/*
+ * Completion callback for vfu_sgl_read_async() and vfu_sgl_write_async().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @arg: the argument passed when the transfer was submitted
+ * @err: 0 on success, otherwise the errno value describing the failure
+ */
+typedef void (vfu_dma_done_cb_t)(vfu_ctx_t *vfu_ctx, void *arg, int err);
+
+/**
+ * Asynchronous version of vfu_sgl_read(): sends the DMA read request(s) and
+ * returns without waiting for the reply. @data must remain valid until @done
+ * has been called.
+ *
+ * Replies are received by vfu_process_dma_replies(), which should be called
+ * whenever the file descriptor returned by vfu_get_dma_poll_fd() becomes
+ * readable. @done is called from within vfu_process_dma_replies(), or from
+ * any other libvfio-user call on this context that receives DMA replies:
+ * synchronous vfu_sgl_read()/vfu_sgl_write(), or a context reset, in which
+ * case the transfer fails with ENOTCONN.
+ *
+ * Requires the client to support the twin_socket feature.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @sg: a DMA segment obtained from dma_addr_to_sg
+ * @cnt: number of DMA segments, must be 1
+ * @data: data buffer to read into
+ * @done: completion callback
+ * @arg: argument passed to @done
+ *
+ * @returns 0 if the transfer was submitted, -1 on failure. Sets errno. Once
+ * the transfer has been submitted, @done is called exactly once; this may
+ * already have happened when this function returns, for example if the
+ * connection failed.
+ */
+int
+vfu_sgl_read_async(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, size_t cnt, void *data,
+                   vfu_dma_done_cb_t *done, void *arg);
+
+/**
+ * Asynchronous version of vfu_sgl_write(), see vfu_sgl_read_async().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @sg: a DMA segment obtained from dma_addr_to_sg
+ * @cnt: number of DMA segments, must be 1
+ * @data: data buffer to write
+ * @done: completion callback
+ * @arg: argument passed to @done
+ *
+ * @returns 0 if the transfer was submitted, -1 on failure. Sets errno.
+ */
+int
+vfu_sgl_write_async(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, size_t cnt, void *data,
+                    vfu_dma_done_cb_t *done, void *arg);
+
+/**
+ * Returns a file descriptor that becomes readable when replies to
+ * asynchronous DMA transfers are available, see vfu_process_dma_replies().
+ * If several command sockets are in use, this is the socket the calling thread
+ * is bound to, see vfu_bind_cmd_socket().
+ *
+ * @vfu_ctx: the libvfio-user context
+ *
+ * @returns the file descriptor, or -1 on failure. Sets errno; ENOTSUP means
+ * the client doesn't support asynchronous DMA transfers.
+ */
+int
+vfu_get_dma_poll_fd(vfu_ctx_t *vfu_ctx);
+
+/**
+ * Processes all replies to asynchronous DMA transfers that are available
+ * without blocking, calling the completion callbacks of finished transfers.
+ * Only transfers submitted on the command socket the calling thread is bound
+ * to are processed.
+ *
+ * @vfu_ctx: the libvfio-user context
+ *
+ * @returns 0 on success, -1 on failure. Sets errno.
+ */
+int
+vfu_process_dma_replies(vfu_ctx_t *vfu_ctx);
+
+#define VFU_MAX_CMD_SOCKETS 64
+
+/**
+ * Sets the maximum number of twin command sockets to request from the client
+ * during negotiation. Server-to-client requests (such as DMA reads and writes)
+ * on different command sockets are independent of each other, so several I/O
+ * threads or queues can each use their own socket, see vfu_bind_cmd_socket().
+ *
+ * The client may provide fewer sockets than requested; the number actually
+ * available is returned by vfu_get_nr_cmd_sockets() once attached. Must be
+ * called before vfu_attach_ctx().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @nr: maximum number of command sockets, 1 (the default) to
+ *      VFU_MAX_CMD_SOCKETS
+ *
+ * @returns 0 on success, -1 on failure. Sets errno.
+ */
+int
+vfu_setup_cmd_sockets(vfu_ctx_t *vfu_ctx, size_t nr);
+
+/**
+ * Returns the number of twin command sockets negotiated with the client, or 0
+ * if the client doesn't support the twin_socket feature (or no client is
+ * attached).
+ *
+ * @vfu_ctx: the libvfio-user context
+ */
+size_t
+vfu_get_nr_cmd_sockets(vfu_ctx_t *vfu_ctx);
+
+/**
+ * Binds the calling thread to command socket @index: message-based DMA issued
+ * by this thread is sent on that socket. Threads that are not bound use socket
+ * 0. If the client provided fewer sockets than requested, @index is taken
+ * modulo vfu_get_nr_cmd_sockets(), so a binding stays valid across client
+ * reconnects.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @index: socket index, less than the number passed to
+ *         vfu_setup_cmd_sockets()
+ *
+ * @returns 0 on success, -1 on failure. Sets errno.
+ */
+int
+vfu_bind_cmd_socket(vfu_ctx_t *vfu_ctx, size_t index);
+
 /*
  * Supported PCI regions.
  *
@@ -838,6 +1381,43 @@ vfu_pci_set_class(vfu_ctx_t *vfu_ctx, uint8_t base, uint8_t sub, uint8_t pi);
 vfu_pci_config_space_t *
 vfu_pci_get_config_space(vfu_ctx_t *vfu_ctx);
 
+/**
+ * Returns the config space generation: a counter that is incremented after
+ * every client write to config space (including writes to capabilities), and
+ * after every vfu_pci_add_capability(). A device thread that caches values
+ * derived from config space can compare generations to cheaply tell whether
+ * they may be stale. Safe to call from any thread.
+ *
+ * @vfu_ctx: the libvfio-user context
+ */
+uint64_t
+vfu_pci_config_space_generation(vfu_ctx_t *vfu_ctx);
+
+/**
+ * Copies @count bytes of config space starting at @offset into @buf, such that
+ * the copy is consistent: it never contains a partially applied config space
+ * write. Unlike reading via vfu_pci_get_config_space(), this is safe to call
+ * from any thread, concurrently with vfu_run_ctx(), and takes no locks; it
+ * retries if a write happens during the copy.
+ *
+ * Only the library's own updates of config space count as writes; changes the
+ * device makes itself, for example via vfu_pci_get_config_space() from a
+ * region access callback, are not covered.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @buf: buffer to copy into
+ * @offset: offset within config space
+ * @count: number of bytes to copy
+ * @generation: if not NULL, set to the config space generation (see
+ *   vfu_pci_config_space_generation()) the copy corresponds to
+ *
+ * @returns 0 on success, or -1 on failure. Sets errno: EINVAL if the range is
+ * outside config space.
+ */
+int
+vfu_pci_config_space_snapshot(vfu_ctx_t *vfu_ctx, void *buf, size_t offset,
+                              size_t count, uint64_t *generation);
+
 #define VFU_CAP_FLAG_EXTENDED (1 << 0)
 #define VFU_CAP_FLAG_CALLBACK (1 << 1)
 #define VFU_CAP_FLAG_READONLY (1 << 2)
@@ -867,7 +1447,7 @@ vfu_pci_get_config_space(vfu_ctx_t *vfu_ctx);
  * in configuration space.
  *
  * If @pos is zero, the capability will be placed at a suitable offset
- * automatically.
+ * automatically. Otherwise it must be dword-aligned.
  *
  * The @flags field can be set as follows:
  *
@@ -924,6 +1504,99 @@ size_t
 vfu_pci_find_next_capability(vfu_ctx_t *vfu_ctx, bool extended,
                              size_t pos, int cap_id);
 
+/**
+ * Makes libvfio-user emulate the MSI-X table and Pending Bit Array of the
+ * device's MSI-X capability, so the device needs no code of its own for
+ * per-vector masking.
+ *
+ * The table and PBA are served from the BARs and offsets given by the
+ * capability, which must have been added with vfu_pci_add_capability()
+ * (without VFU_CAP_FLAG_CALLBACK), as region ranges (see
+ * vfu_setup_region_range()); the BARs must already be set up. All vectors
+ * start out masked.
+ *
+ * While MSI-X is enabled, vfu_irq_trigger() and vfu_irq_trigger_batch() on a
+ * vector that is masked, either by its Vector Control mask bit or by Function
+ * Mask, set its pending bit instead of signalling it; the interrupt is
+ * delivered when the vector is unmasked. This is safe to race with the client
+ * unmasking the vector from any thread.
+ *
+ * Must be called before vfu_realize_ctx().
+ *
+ * @vfu_ctx: the libvfio-user context
+ *
+ * @returns 0 on success, or -1 on failure. Sets errno: ENOENT if there is no
+ * MSI-X capability.
+ */
+int
+vfu_pci_setup_msix_emulation(vfu_ctx_t *vfu_ctx);
+
+typedef enum {
+    /*
+     * Events were dropped because the queue was full; the device should
+     * re-read config space (see vfu_pci_config_space_snapshot()).
+     */
+    VFU_CONFIG_EVENT_OVERFLOW,
+    /* The client requested a function level reset. */
+    VFU_CONFIG_EVENT_FLR,
+    /* A BAR was written: @index is the BAR, @value its new contents. */
+    VFU_CONFIG_EVENT_BAR,
+    /* MSI Enable or Multiple Message Enable changed: @value is MSI control. */
+    VFU_CONFIG_EVENT_MSI,
+    /* MSI-X Enable or Function Mask changed: @value is MSI-X control. */
+    VFU_CONFIG_EVENT_MSIX,
+    /* The power state changed: @value is the new PCI_PM_CTRL_STATE_MASK. */
+    VFU_CONFIG_EVENT_POWER_STATE,
+} vfu_config_event_type_t;
+
+typedef struct {
+    vfu_config_event_type_t type;
+    uint32_t index;
+    uint64_t value;
+    /*
+     * The config space generation once the write that caused the event has
+     * been applied, see vfu_pci_config_space_generation().
+     */
+    uint64_t generation;
+} vfu_config_event_t;
+
+/**
+ * Makes the side effects of client writes to config space available as events
+ * on a queue, to be consumed with vfu_get_config_event(), rather than handled
+ * synchronously in vfu_run_ctx(), so a slow device reaction never holds up the
+ * message loop.
+ *
+ * In particular, a function level reset no longer quiesces the device nor
+ * calls the reset callback: the device must handle VFU_CONFIG_EVENT_FLR
+ * itself. It's delivered in order with the other events, except that several
+ * FLRs requested before the device consumes the first one are reported once,
+ * after the events preceding the last of them. An overflow is reported ahead
+ * of everything else.
+ *
+ * Must be called before vfu_realize_ctx().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @nr_events: size of the queue, must be a power of two
+ *
+ * @returns 0 on success, or -1 on failure. Sets errno.
+ */
+int
+vfu_setup_config_events(vfu_ctx_t *vfu_ctx, uint32_t nr_events);
+
+/**
+ * Takes the next event off the config event queue (see
+ * vfu_setup_config_events()). Does not block, takes no locks, and can be
+ * called from any thread, but only from one thread at a time.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @event: the event
+ *
+ * @returns 0 on success, or -1 on failure. Sets errno: EAGAIN if there are no
+ * pending events, EINVAL if the queue has not been set up.
+ */
+int
+vfu_get_config_event(vfu_ctx_t *vfu_ctx, vfu_config_event_t *event);
+
 bool
 vfu_sg_is_mappable(vfu_ctx_t *vfu_ctx, dma_sg_t *sg);
 
@@ -931,13 +1604,18 @@ vfu_sg_is_mappable(vfu_ctx_t *vfu_ctx, dma_sg_t *sg);
  * Creates a new ioeventfd at the given setup memory region with @offset, @size,
  * @fd, @flags and @datamatch.
  *
- * Returns 0 on success and -1 on failure with errno set.
+ * Ioeventfds may not overlap, except that several ioeventfds can cover the
+ * same range if they all set VFIO_USER_IO_FD_FLAG_DATAMATCH with distinct
+ * @datamatch values. They are reported to the client in @gpa_offset order.
+ *
+ * Returns 0 on success and -1 on failure with errno set; EEXIST if the
+ * ioeventfd overlaps an existing one.
  *
  * @vfu_ctx: the libvfio-user context
  * @region_idx: The index of the memory region to set up the ioeventfd
  * @fd: the value of the file descriptor
  * @gpa_offset: The offset into the memory region
- * @size: size of the ioeventfd
+ * @size: size of the ioeventfd, must not be zero
  * @flags: Any flags to set up the ioeventfd
  * @datamatch: sets the datamatch value
  * @shadow_fd: File descriptor that can be mmap'ed, KVM will write there the
@@ -953,6 +1631,147 @@ int
 vfu_create_ioeventfd(vfu_ctx_t *vfu_ctx, uint32_t region_idx, int fd,
                      size_t gpa_offset, uint32_t size, uint32_t flags,
                      uint64_t datamatch, int shadow_fd, size_t shadow_offset);
+
+/*
+ * Deletes the ioeventfds backed by @fd at @gpa_offset in the given region. The
+ * client keeps using its registration until it queries the region's IO fds
+ * again, see vfu_notify_region_io_fds_changed().
+ *
+ * Returns 0 on success and -1 on failure with errno set; ENOENT if there is no
+ * such ioeventfd.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @region_idx: the region the ioeventfd was created in
+ * @fd: the fd passed to vfu_create_ioeventfd()
+ * @gpa_offset: the offset passed to vfu_create_ioeventfd()
+ */
+int
+vfu_delete_ioeventfd(vfu_ctx_t *vfu_ctx, uint32_t region_idx, int fd,
+                     size_t gpa_offset);
+
+/*
+ * Replaces the @size, @flags, @datamatch and shadow memory of the ioeventfd
+ * backed by @fd at @gpa_offset, keeping its handler and polling mode. The
+ * arguments are as for vfu_create_ioeventfd().
+ *
+ * Returns 0 on success and -1 on failure with errno set; ENOENT if there is no
+ * such ioeventfd, EEXIST if the updated ioeventfd would overlap another one.
+ */
+int
+vfu_update_ioeventfd(vfu_ctx_t *vfu_ctx, uint32_t region_idx, int fd,
+                     size_t gpa_offset, uint32_t size, uint32_t flags,
+                     uint64_t datamatch, int shadow_fd, size_t shadow_offset);
+
+/*
+ * Tells the client that the ioeventfds of the given region changed, so that it
+ * queries them again and updates its KVM registrations, without a device
+ * reset. The client must have negotiated the "io_fds_changed" capability.
+ *
+ * Returns 0 on success and -1 on failure with errno set; ENOTSUP if the client
+ * doesn't support the notification.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @region_idx: the region whose ioeventfds changed
+ */
+int
+vfu_notify_region_io_fds_changed(vfu_ctx_t *vfu_ctx, uint32_t region_idx);
+
+/*
+ * Handler invoked by vfu_dispatch_ioeventfds() when an ioeventfd fires.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @arg: the argument passed to vfu_set_ioeventfd_handler()
+ * @value: for a shadow ioeventfd, the value currently at @shadow_offset in
+ *  shadow memory, i.e. the most recently written one; 0 otherwise
+ * @kicks: number of writes to the ioeventfd since the handler last ran, these
+ *  are batched into a single invocation; 0 for polled ioeventfds, see
+ *  vfu_set_ioeventfd_polled()
+ */
+typedef void (vfu_ioeventfd_handler_t)(vfu_ctx_t *vfu_ctx, void *arg,
+                                       uint64_t value, uint64_t kicks);
+
+/*
+ * Sets up a library-owned dispatcher for ioeventfds: an epoll set containing
+ * every ioeventfd with a handler (see vfu_set_ioeventfd_handler()) as well as
+ * the transport poll fd. The context must have been created with
+ * LIBVFIO_USER_FLAG_ATTACH_NB.
+ *
+ * Returns 0 on success and -1 on failure with errno set.
+ *
+ * @vfu_ctx: the libvfio-user context
+ */
+int
+vfu_setup_ioeventfd_dispatch(vfu_ctx_t *vfu_ctx);
+
+/*
+ * Returns the file descriptor of the ioeventfd dispatcher, which becomes
+ * readable when vfu_dispatch_ioeventfds() has work to do, or -1 with errno set
+ * if vfu_setup_ioeventfd_dispatch() has not been called.
+ *
+ * @vfu_ctx: the libvfio-user context
+ */
+int
+vfu_get_ioeventfd_dispatch_fd(vfu_ctx_t *vfu_ctx);
+
+/*
+ * Sets the handler for the ioeventfd created with @fd, replacing any previous
+ * one. Passing a NULL @handler removes the ioeventfd from the dispatcher. @fd
+ * must back exactly one ioeventfd.
+ *
+ * Returns 0 on success and -1 on failure with errno set.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @fd: the fd passed to vfu_create_ioeventfd()
+ * @handler: the handler to invoke, or NULL
+ * @arg: argument passed to @handler
+ */
+int
+vfu_set_ioeventfd_handler(vfu_ctx_t *vfu_ctx, int fd,
+                          vfu_ioeventfd_handler_t *handler, void *arg);
+
+/*
+ * Waits up to @timeout milliseconds (as in epoll_wait(2)) for ioeventfds or
+ * the transport to become ready, then invokes the handler of every ready
+ * ioeventfd once and, if the transport is ready, calls vfu_run_ctx().
+ *
+ * Returns the number of handlers invoked on success and -1 on failure with
+ * errno set; failures of vfu_run_ctx(), such as ENOTCONN, are passed through.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @timeout: maximum time to wait in milliseconds, -1 to wait indefinitely
+ */
+int
+vfu_dispatch_ioeventfds(vfu_ctx_t *vfu_ctx, int timeout);
+
+/*
+ * Switches the shadow ioeventfd created with @fd to polled mode, or back. A
+ * polled ioeventfd is not part of the dispatcher's epoll set; instead
+ * vfu_poll_ioeventfds() compares its shadow memory against the last value seen,
+ * which avoids the eventfd wakeup and read altogether. Since only changes are
+ * detected, the device must make consecutive doorbell values differ, e.g. by
+ * writing a ring index or sequence number.
+ *
+ * Returns 0 on success and -1 on failure with errno set.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @fd: the fd passed to vfu_create_ioeventfd(), which must have a shadow fd
+ * @polled: whether to poll the ioeventfd
+ */
+int
+vfu_set_ioeventfd_polled(vfu_ctx_t *vfu_ctx, int fd, bool polled);
+
+/*
+ * Scans the shadow memory of all polled ioeventfds once and invokes the
+ * handler of each one whose value changed. Meant to be called in a loop from a
+ * dedicated poller thread; the set of polled ioeventfds and their handlers
+ * must not change concurrently.
+ *
+ * Returns the number of handlers invoked.
+ *
+ * @vfu_ctx: the libvfio-user context
+ */
+int
+vfu_poll_ioeventfds(vfu_ctx_t *vfu_ctx);
 #ifdef __cplusplus
 }
 #endif
@@ -70,6 +70,7 @@ enum vfio_user_command {
     VFIO_USER_DEVICE_FEATURE            = 16,
     VFIO_USER_MIG_DATA_READ             = 17,
     VFIO_USER_MIG_DATA_WRITE            = 18,
+    VFIO_USER_REGION_IO_FDS_CHANGED     = 19,
     VFIO_USER_MAX,
 };
 
@@ -150,6 +151,25 @@ struct vfio_user_region_access {
     uint8_t     data[];
 } __attribute__((packed));
 
+#define VFIO_USER_MULTI_DATA    (8)
+#define VFIO_USER_MULTI_MAX     (200)
+
+/*
+ * A single write of a VFIO_USER_REGION_WRITE_MULTI request; only the first
+ * count bytes of data are valid.
+ */
+struct vfio_user_write_multi_data {
+    uint64_t    offset;
+    uint32_t    region;
+    uint32_t    count;
+    uint8_t     data[VFIO_USER_MULTI_DATA];
+} __attribute__((packed));
+
+struct vfio_user_write_multi {
+    uint64_t    wr_cnt;
+    struct vfio_user_write_multi_data wrs[];
+} __attribute__((packed));
+
 struct vfio_user_dma_region_access {
     uint64_t    addr;
     uint64_t    count;
@@ -171,6 +191,8 @@ typedef struct vfio_user_region_io_fds_request {
 #define VFIO_USER_IO_FD_TYPE_IOREGIONFD 1
 #define VFIO_USER_IO_FD_TYPE_IOEVENTFD_SHADOW 2
 
+#define VFIO_USER_IO_FD_FLAG_DATAMATCH (1 << 0)
+
 typedef struct vfio_user_sub_region_ioeventfd {
     uint64_t gpa_offset;
     uint64_t size;
@@ -192,6 +214,15 @@ typedef struct vfio_user_sub_region_ioregionfd {
     uint64_t user_data;
 } __attribute__((packed)) vfio_user_sub_region_ioregionfd_t;
 
+/*
+ * Server to client, sent with VFIO_USER_F_NO_REPLY: the IO fds of region
+ * @index changed and should be queried again.
+ */
+struct vfio_user_region_io_fds_changed {
+    uint32_t index;
+    uint32_t flags;
+} __attribute__((packed));
+
 typedef struct vfio_user_region_io_fds_reply {
     uint32_t argsz;
     uint32_t flags;
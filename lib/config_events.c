@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2023 Rivos Inc. All rights reserved.
+ *
+ * Authors: Mattias Nissler <mnissler@rivosinc.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "config_events.h"
+#include "libvfio-user.h"
+#include "private.h"
+
+/* Set in ce->flr, along with the tail the FLR was posted at. */
+#define FLR_PENDING (1ULL << 32)
+
+EXPORT int
+vfu_setup_config_events(vfu_ctx_t *vfu_ctx, uint32_t nr_events)
+{
+    struct config_events *ce;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->realized || vfu_ctx->config_events != NULL ||
+        nr_events == 0 || (nr_events & (nr_events - 1)) != 0) {
+        return ERROR_INT(EINVAL);
+    }
+
+    ce = calloc(1, sizeof(*ce) + nr_events * sizeof(ce->events[0]));
+    if (ce == NULL) {
+        return ERROR_INT(ENOMEM);
+    }
+
+    ce->nr_events = nr_events;
+    vfu_ctx->config_events = ce;
+    return 0;
+}
+
+void
+config_event_post(vfu_ctx_t *vfu_ctx, vfu_config_event_type_t type,
+                  uint32_t index, uint64_t value)
+{
+    struct config_events *ce = vfu_ctx->config_events;
+    /* We're posted in the middle of the write, see pci_config_space_access(). */
+    uint64_t generation = (vfu_ctx->pci.config_seq >> 1) + 1;
+    vfu_config_event_t *event;
+    uint32_t head;
+
+    assert(ce != NULL);
+
+    /*
+     * An FLR goes after the events queued so far. If the device hasn't
+     * consumed an earlier one yet, that one is moved here: resetting after
+     * the events in between has the same effect as resetting twice.
+     */
+    if (type == VFU_CONFIG_EVENT_FLR) {
+        __atomic_store_n(&ce->flr_generation, generation, __ATOMIC_RELAXED);
+        __atomic_store_n(&ce->flr, FLR_PENDING | ce->tail, __ATOMIC_RELEASE);
+        return;
+    }
+
+    head = __atomic_load_n(&ce->head, __ATOMIC_ACQUIRE);
+    if (ce->tail - head == ce->nr_events) {
+        vfu_log(vfu_ctx, LOG_WARNING, "config event queue full, dropping "
+                "event %d", type);
+        __atomic_store_n(&ce->overflow, true, __ATOMIC_RELEASE);
+        return;
+    }
+
+    event = &ce->events[ce->tail & (ce->nr_events - 1)];
+    event->type = type;
+    event->index = index;
+    event->value = value;
+    event->generation = generation;
+
+    __atomic_store_n(&ce->tail, ce->tail + 1, __ATOMIC_RELEASE);
+}
+
+EXPORT int
+vfu_get_config_event(vfu_ctx_t *vfu_ctx, vfu_config_event_t *event)
+{
+    struct config_events *ce;
+    uint64_t generation;
+    uint64_t flr;
+    uint32_t tail;
+
+    assert(vfu_ctx != NULL);
+    assert(event != NULL);
+
+    ce = vfu_ctx->config_events;
+    if (ce == NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (__atomic_exchange_n(&ce->overflow, false, __ATOMIC_ACQUIRE)) {
+        *event = (vfu_config_event_t) {
+            .type = VFU_CONFIG_EVENT_OVERFLOW,
+            .generation = vfu_pci_config_space_generation(vfu_ctx),
+        };
+        return 0;
+    }
+
+    /* The FLR is due once the events queued before it are consumed. */
+    flr = __atomic_load_n(&ce->flr, __ATOMIC_ACQUIRE);
+    while ((flr & FLR_PENDING) && (uint32_t)flr == ce->head) {
+        generation = __atomic_load_n(&ce->flr_generation, __ATOMIC_RELAXED);
+        /* Fails if another FLR moved it meanwhile. */
+        if (__atomic_compare_exchange_n(&ce->flr, &flr, 0, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            *event = (vfu_config_event_t) {
+                .type = VFU_CONFIG_EVENT_FLR,
+                .generation = generation,
+            };
+            return 0;
+        }
+    }
+
+    tail = __atomic_load_n(&ce->tail, __ATOMIC_ACQUIRE);
+    if (ce->head == tail) {
+        return ERROR_INT(EAGAIN);
+    }
+
+    *event = ce->events[ce->head & (ce->nr_events - 1)];
+    __atomic_store_n(&ce->head, ce->head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void
+config_events_free(vfu_ctx_t *vfu_ctx)
+{
+    free(vfu_ctx->config_events);
+    vfu_ctx->config_events = NULL;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2023 Rivos Inc. All rights reserved.
+ *
+ * Authors: Mattias Nissler <mnissler@rivosinc.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_CONFIG_EVENTS_H
+#define LIB_VFIO_USER_CONFIG_EVENTS_H
+
+#include "private.h"
+
+static inline bool
+config_events_enabled(const vfu_ctx_t *vfu_ctx)
+{
+    return vfu_ctx->config_events != NULL;
+}
+
+/*
+ * Queues an event for the consumer of vfu_get_config_event(). Only called
+ * from within a config space write, on the thread running the context.
+ */
+void
+config_event_post(vfu_ctx_t *vfu_ctx, vfu_config_event_type_t type,
+                  uint32_t index, uint64_t value);
+
+void
+config_events_free(vfu_ctx_t *vfu_ctx);
+
+#endif /* LIB_VFIO_USER_CONFIG_EVENTS_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
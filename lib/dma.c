@@ -142,25 +142,152 @@ array_remove(void *array, size_t elem_size, size_t index, int *nr_elemsp)
     (*nr_elemsp)--;
 }
 
-/* FIXME not thread safe */
+/*
+ * Removes the dead slots left by unmaps done without quiescing the device, see
+ * dma_region_dead(). Must only be called while the device is quiesced, as it
+ * moves regions around.
+ */
+static void
+dma_controller_reclaim(dma_controller_t *dma)
+{
+    int i = 0;
+
+    while (i < dma->nregions) {
+        if (dma->regions[i].dead) {
+            array_remove(&dma->regions, sizeof(dma->regions[0]), i,
+                         &dma->nregions);
+        } else {
+            i++;
+        }
+    }
+}
+
+/*
+ * Whether regions are unmapped without the device being quiesced, waiting for
+ * just the I/O contexts using them instead.
+ */
+static bool
+dma_partial_quiesce(dma_controller_t *dma)
+{
+    return dma->vfu_ctx->nr_io_ctxs > 0 && !dma->vfu_ctx->quiesced;
+}
+
+/* Calls the quiesce callback of the I/O contexts in @io_ctxs, by ID. */
+static void
+dma_quiesce_io_ctxs(dma_controller_t *dma, uint64_t io_ctxs)
+{
+    vfu_ctx_t *vfu_ctx = dma->vfu_ctx;
+    int i;
+
+    while (io_ctxs != 0) {
+        i = __builtin_ctzll(io_ctxs);
+        io_ctxs &= io_ctxs - 1;
+
+        vfu_log(vfu_ctx, LOG_DEBUG, "waiting for I/O context %d", i);
+        vfu_ctx->in_cb = CB_QUIESCE;
+        vfu_ctx->io_ctxs[i].quiesce(vfu_ctx, vfu_ctx->io_ctxs[i].arg);
+        vfu_ctx->in_cb = CB_NONE;
+    }
+}
+
+/*
+ * Marks @region dead and waits for the I/O contexts using it to reach a
+ * quiescent point.
+ */
+static void
+dma_region_quiesce_users(dma_controller_t *dma, dma_memory_region_t *region)
+{
+    uint64_t all = UINT64_MAX >> (64 - dma->vfu_ctx->nr_io_ctxs);
+    uint64_t users;
+
+    /*
+     * Pairs with vfu_io_ctx_addr_to_sgl(), which marks the region as used
+     * before checking that it's still alive: either the I/O context sees the
+     * region dead, or we see the I/O context as a user.
+     */
+    __atomic_store_n(&region->dead, true, __ATOMIC_SEQ_CST);
+    users = __atomic_exchange_n(&region->io_ctx_users, 0, __ATOMIC_SEQ_CST);
+
+    /*
+     * The others may be in the middle of a lookup that read the region before
+     * it died, so the slot isn't reused until they reach a quiescent point,
+     * see dma_reusable_slot().
+     */
+    __atomic_store_n(&region->io_ctx_pending, all & ~users, __ATOMIC_SEQ_CST);
+
+    dma_quiesce_io_ctxs(dma, users);
+}
+
+/*
+ * Returns the index of a dead slot that a new region can be put in while the
+ * device is running, or -1 if there's none. That's once no lookup can still be
+ * reading the old region, i.e. every I/O context has reached a quiescent point
+ * since it died. If @force, the I/O contexts that haven't are quiesced.
+ */
+static int
+dma_reusable_slot(dma_controller_t *dma, bool force)
+{
+    dma_memory_region_t *region;
+    uint64_t io_ctxs = 0;
+    int reuse = -1;
+    int idx;
+
+    for (idx = 0; idx < dma->nregions; idx++) {
+        region = &dma->regions[idx];
+        if (region->dead &&
+            __atomic_load_n(&region->io_ctx_pending, __ATOMIC_ACQUIRE) == 0) {
+            return idx;
+        }
+    }
+
+    if (!force) {
+        return -1;
+    }
+
+    /* Quiescing them once frees up every dead slot. */
+    for (idx = 0; idx < dma->nregions; idx++) {
+        region = &dma->regions[idx];
+        if (region->dead) {
+            io_ctxs |= __atomic_exchange_n(&region->io_ctx_pending, 0,
+                                           __ATOMIC_ACQUIRE);
+            if (reuse == -1) {
+                reuse = idx;
+            }
+        }
+    }
+
+    dma_quiesce_io_ctxs(dma, io_ctxs);
+    return reuse;
+}
+
 int
 MOCK_DEFINE(dma_controller_remove_region)(dma_controller_t *dma,
                                           vfu_dma_addr_t dma_addr, size_t size,
                                           vfu_dma_unregister_cb_t *dma_unregister,
                                           void *data)
 {
+    bool partial;
     int idx;
     dma_memory_region_t *region;
 
     assert(dma != NULL);
 
+    partial = dma_partial_quiesce(dma);
+    if (!partial) {
+        dma_controller_reclaim(dma);
+    }
+
     for (idx = 0; idx < dma->nregions; idx++) {
         region = &dma->regions[idx];
-        if (region->info.iova.iov_base != dma_addr ||
+        if (region->dead || region->info.iova.iov_base != dma_addr ||
             region->info.iova.iov_len != size) {
             continue;
         }
 
+        if (partial) {
+            dma_region_quiesce_users(dma, region);
+        }
+
         if (dma_unregister != NULL) {
             dma->vfu_ctx->in_cb = CB_DMA_UNREGISTER;
             dma_unregister(data, &region->info);
@@ -173,7 +300,12 @@ MOCK_DEFINE(dma_controller_remove_region)(dma_controller_t *dma,
             assert(region->fd == -1);
         }
 
-        array_remove(&dma->regions, sizeof (*region), idx, &dma->nregions);
+        if (partial) {
+            free(region->dirty_bitmap);
+            region->dirty_bitmap = NULL;
+        } else {
+            array_remove(&dma->regions, sizeof (*region), idx, &dma->nregions);
+        }
         return 0;
     }
     return ERROR_INT(ENOENT);
@@ -191,6 +323,10 @@ dma_controller_remove_all_regions(dma_controller_t *dma,
     for (i = 0; i < dma->nregions; i++) {
         dma_memory_region_t *region = &dma->regions[i];
 
+        if (region->dead) {
+            continue;
+        }
+
         vfu_log(dma->vfu_ctx, LOG_DEBUG, "removing DMA region "
                 "iova=[%p, %p) vaddr=%p mapping=[%p, %p)",
                 region->info.iova.iov_base, iov_end(&region->info.iova),
@@ -280,6 +416,7 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
     dma_memory_region_t *region;
     int page_size = 0;
     char rstr[1024];
+    int reuse;
     int idx;
 
     assert(dma != NULL);
@@ -287,6 +424,10 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
     snprintf(rstr, sizeof(rstr), "[%p, %p) fd=%d offset=%#llx prot=%#x",
              dma_addr, dma_addr + size, fd, (ull_t)offset, prot);
 
+    if (!dma_partial_quiesce(dma)) {
+        dma_controller_reclaim(dma);
+    }
+
     if (size > dma->max_size) {
         vfu_log(dma->vfu_ctx, LOG_ERR, "DMA region size %llu > max %zu",
                 (unsigned long long)size, dma->max_size);
@@ -296,6 +437,10 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
     for (idx = 0; idx < dma->nregions; idx++) {
         region = &dma->regions[idx];
 
+        if (region->dead) {
+            continue;
+        }
+
         /* First check if this is the same exact region. */
         if (region->info.iova.iov_base == dma_addr &&
             region->info.iova.iov_len == size) {
@@ -336,12 +481,19 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
         }
     }
 
-    if (dma->nregions == dma->max_regions) {
+    idx = dma->nregions;
+    if (dma_partial_quiesce(dma)) {
+        reuse = dma_reusable_slot(dma, dma->nregions == dma->max_regions);
+        if (reuse != -1) {
+            idx = reuse;
+        }
+    }
+
+    if (idx == dma->max_regions) {
         vfu_log(dma->vfu_ctx, LOG_ERR, "hit max regions %d", dma->max_regions);
         return ERROR_INT(EINVAL);
     }
 
-    idx = dma->nregions;
     region = &dma->regions[idx];
 
     if (fd != -1) {
@@ -353,7 +505,13 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
     }
     page_size = MAX(page_size, getpagesize());
 
-    memset(region, 0, sizeof (*region));
+    if (idx == dma->nregions) {
+        memset(region, 0, sizeof (*region));
+    } else {
+        /* A reused slot stays dead, and so unseen, until published below. */
+        memset(&region->info, 0, sizeof (region->info));
+        region->io_ctx_users = 0;
+    }
 
     region->info.iova.iov_base = (void *)dma_addr;
     region->info.iova.iov_len = size;
@@ -392,7 +550,16 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
         }
     }
 
-    dma->nregions++;
+    /*
+     * Publish the fully initialized region: lock-free readers that see the
+     * new count, or the reused slot alive, also see its contents, see
+     * dma_nregions().
+     */
+    if (idx < dma->nregions) {
+        __atomic_store_n(&region->dead, false, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&dma->nregions, idx + 1, __ATOMIC_RELEASE);
+    }
     return idx;
 }
 
@@ -407,10 +574,17 @@ _dma_addr_sg_split(const dma_controller_t *dma,
 
     while (found && len > 0) {
         found = false;
-        for (idx = 0; idx < dma->nregions; idx++) {
+        for (idx = 0; idx < dma_nregions(dma); idx++) {
             const dma_memory_region_t *const region = &dma->regions[idx];
-            vfu_dma_addr_t region_start = region->info.iova.iov_base;
-            vfu_dma_addr_t region_end = iov_end(&region->info.iova);
+            vfu_dma_addr_t region_start;
+            vfu_dma_addr_t region_end;
+
+            /* A dead slot may be being reused, see dma_reusable_slot(). */
+            if (dma_region_dead(region)) {
+                continue;
+            }
+            region_start = region->info.iova.iov_base;
+            region_end = iov_end(&region->info.iova);
 
             while (dma_addr >= region_start && dma_addr < region_end) {
                 size_t region_len = MIN((uint64_t)(region_end - dma_addr), len);
@@ -97,6 +97,9 @@ typedef struct {
     int fd;                     // File descriptor to mmap
     off_t offset;               // File offset
     uint8_t *dirty_bitmap;         // Dirty page bitmap
+    uint64_t io_ctx_users;      // I/O contexts using the region, by ID
+    uint64_t io_ctx_pending;    // I/O contexts that may still see it, if dead
+    bool dead;                  // Unmapped, slot not yet reclaimed
 } dma_memory_region_t;
 
 typedef struct dma_controller {
@@ -135,6 +138,31 @@ MOCK_DECLARE(int, dma_controller_remove_region, dma_controller_t *dma,
 MOCK_DECLARE(void, dma_controller_unmap_region, dma_controller_t *dma,
              dma_memory_region_t *region);
 
+/*
+ * Returns the number of regions. New regions may be published without the
+ * device being quiesced (LIBVFIO_USER_FLAG_DMA_MAP_NO_QUIESCE), so lookups on
+ * device threads must go through here: the acquire pairs with the release in
+ * dma_controller_add_region().
+ */
+static inline int
+dma_nregions(const dma_controller_t *dma)
+{
+    return __atomic_load_n(&dma->nregions, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * With I/O contexts (see vfu_setup_io_ctx()) regions are unmapped while the
+ * device is running; their slots are then only marked dead, so that lock-free
+ * lookups never see the array shift. A dead slot is reused in place once every
+ * I/O context has reached a quiescent point since, and reclaimed the next time
+ * the device is quiesced.
+ */
+static inline bool
+dma_region_dead(const dma_memory_region_t *region)
+{
+    return __atomic_load_n(&region->dead, __ATOMIC_ACQUIRE);
+}
+
 // Helper for dma_addr_to_sgl() slow path.
 int
 _dma_addr_sg_split(const dma_controller_t *dma,
@@ -244,13 +272,13 @@ dma_addr_to_sgl(const dma_controller_t *dma,
     int cnt, ret;
 
     const dma_memory_region_t *const region = &dma->regions[region_hint];
-    const void *region_end = iov_end(&region->info.iova);
 
     // Fast path: single region.
     if (likely(max_nr_sgs > 0 && len > 0 &&
+               region_hint < dma_nregions(dma) &&
+               !dma_region_dead(region) &&
                dma_addr >= region->info.iova.iov_base &&
-               dma_addr + len <= region_end &&
-               region_hint < dma->nregions)) {
+               dma_addr + len <= iov_end(&region->info.iova))) {
         ret = dma_init_sg(dma, sgl, dma_addr, len, prot, region_hint);
         if (ret < 0) {
             return ret;
@@ -280,7 +308,7 @@ dma_sgl_get(dma_controller_t *dma, dma_sg_t *sgl, struct iovec *iov, size_t cnt)
     sg = sgl;
 
     do {
-        if (sg->region >= dma->nregions) {
+        if (sg->region >= dma_nregions(dma)) {
             return ERROR_INT(EINVAL);
         }
         region = &dma->regions[sg->region];
@@ -319,7 +347,7 @@ dma_sgl_mark_dirty(dma_controller_t *dma, dma_sg_t *sgl, size_t cnt)
     sg = sgl;
 
     do {
-        if (sg->region >= dma->nregions) {
+        if (sg->region >= dma_nregions(dma)) {
             return;
         }
 
@@ -354,7 +382,7 @@ dma_sgl_put(dma_controller_t *dma, dma_sg_t *sgl, size_t cnt)
     sg = sgl;
 
     do {
-        if (sg->region >= dma->nregions) {
+        if (sg->region >= dma_nregions(dma)) {
             return;
         }
 
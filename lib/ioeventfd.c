@@ -0,0 +1,808 @@
+/*
+ * Copyright (c) 2023 Rivos Inc. All rights reserved.
+ *
+ * Authors: Mattias Nissler <mnissler@rivosinc.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "ioeventfd.h"
+#include "libvfio-user.h"
+#include "private.h"
+#include "tran.h"
+
+/* maximum number of ready fds handled per vfu_dispatch_ioeventfds() call */
+#define IOEVENTFD_DISPATCH_BATCH 64
+
+static ioeventfd_t *
+ioeventfd_find(vfu_ctx_t *vfu_ctx, int fd, size_t *nr)
+{
+    ioeventfd_t *found = NULL;
+    size_t i, j;
+
+    *nr = 0;
+    for (i = 0; i < vfu_ctx->nr_regions; i++) {
+        vfu_reg_info_t *vfu_reg = &vfu_ctx->reg_info[i];
+
+        for (j = 0; j < vfu_reg->nr_ioeventfds; j++) {
+            if (vfu_reg->ioeventfds[j]->fd == fd) {
+                found = vfu_reg->ioeventfds[j];
+                (*nr)++;
+            }
+        }
+    }
+    return found;
+}
+
+static bool
+ioeventfds_overlap(const ioeventfd_t *a, const ioeventfd_t *b)
+{
+    return a->gpa_offset < b->gpa_offset + b->size &&
+           b->gpa_offset < a->gpa_offset + a->size;
+}
+
+/*
+ * Like KVM, several ioeventfds may cover the same range as long as each of
+ * them matches a different value; any other overlap is ambiguous.
+ */
+static bool
+ioeventfds_conflict(const ioeventfd_t *a, const ioeventfd_t *b)
+{
+    if (!ioeventfds_overlap(a, b)) {
+        return false;
+    }
+    return a->gpa_offset != b->gpa_offset || a->size != b->size ||
+           !(a->flags & VFIO_USER_IO_FD_FLAG_DATAMATCH) ||
+           !(b->flags & VFIO_USER_IO_FD_FLAG_DATAMATCH) ||
+           a->datamatch == b->datamatch;
+}
+
+/*
+ * Finds in @posp where @ioefd goes in the region's ioeventfds, which are kept
+ * sorted by gpa_offset. Since overlaps other than identical datamatch ranges
+ * are rejected, only the entries at that position need to be checked.
+ */
+static int
+ioeventfd_find_slot(vfu_ctx_t *vfu_ctx, vfu_reg_info_t *vfu_reg,
+                    const ioeventfd_t *ioefd, size_t *posp)
+{
+    size_t lo = 0, hi = vfu_reg->nr_ioeventfds;
+    size_t i;
+
+    /* find the first entry starting after ioefd */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (vfu_reg->ioeventfds[mid]->gpa_offset <= ioefd->gpa_offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < vfu_reg->nr_ioeventfds &&
+        ioeventfds_conflict(ioefd, vfu_reg->ioeventfds[lo])) {
+        goto overlap;
+    }
+    for (i = lo; i-- > 0; ) {
+        if (ioeventfds_conflict(ioefd, vfu_reg->ioeventfds[i])) {
+            goto overlap;
+        }
+        if (vfu_reg->ioeventfds[i]->gpa_offset != ioefd->gpa_offset) {
+            break;
+        }
+    }
+
+    *posp = lo;
+    return 0;
+
+overlap:
+    vfu_log(vfu_ctx, LOG_DEBUG, "ioeventfd [%#llx, %#llx) overlaps existing "
+            "ioeventfd", (ull_t)ioefd->gpa_offset,
+            (ull_t)(ioefd->gpa_offset + ioefd->size));
+    return ERROR_INT(EEXIST);
+}
+
+static int
+ioeventfd_insert(vfu_ctx_t *vfu_ctx, vfu_reg_info_t *vfu_reg,
+                 ioeventfd_t *ioefd)
+{
+    ioeventfd_t **ioeventfds;
+    size_t pos;
+
+    if (ioeventfd_find_slot(vfu_ctx, vfu_reg, ioefd, &pos) == -1) {
+        return -1;
+    }
+
+    ioeventfds = realloc(vfu_reg->ioeventfds, (vfu_reg->nr_ioeventfds + 1) *
+                         sizeof(*ioeventfds));
+    if (ioeventfds == NULL) {
+        return -1;
+    }
+    memmove(&ioeventfds[pos + 1], &ioeventfds[pos],
+            (vfu_reg->nr_ioeventfds - pos) * sizeof(*ioeventfds));
+    ioeventfds[pos] = ioefd;
+    vfu_reg->ioeventfds = ioeventfds;
+    vfu_reg->nr_ioeventfds++;
+    return 0;
+}
+
+/*
+ * Returns the index of the first ioeventfd at @gpa_offset backed by @fd, or
+ * vfu_reg->nr_ioeventfds if there is none.
+ */
+static size_t
+ioeventfd_lookup(vfu_reg_info_t *vfu_reg, int fd, uint64_t gpa_offset)
+{
+    size_t lo = 0, hi = vfu_reg->nr_ioeventfds;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (vfu_reg->ioeventfds[mid]->gpa_offset < gpa_offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (; lo < vfu_reg->nr_ioeventfds &&
+           vfu_reg->ioeventfds[lo]->gpa_offset == gpa_offset; lo++) {
+        if (vfu_reg->ioeventfds[lo]->fd == fd) {
+            return lo;
+        }
+    }
+    return vfu_reg->nr_ioeventfds;
+}
+
+EXPORT int
+vfu_create_ioeventfd(vfu_ctx_t *vfu_ctx, uint32_t region_idx, int fd,
+                     size_t gpa_offset, uint32_t size, uint32_t flags,
+                     uint64_t datamatch, int shadow_fd, size_t shadow_offset)
+{
+    vfu_reg_info_t *vfu_reg;
+    ioeventfd_t *elem;
+
+    assert(vfu_ctx != NULL);
+
+#ifndef SHADOW_IOEVENTFD
+    if (shadow_fd != -1) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "shadow ioeventfd not compiled");
+        return ERROR_INT(EINVAL);
+    }
+#endif
+
+    if (region_idx >= VFU_PCI_DEV_NUM_REGIONS) {
+        return ERROR_INT(EINVAL);
+    }
+
+    vfu_reg = &vfu_ctx->reg_info[region_idx];
+
+    /* A zero-sized ioeventfd would never overlap, see ioeventfds_overlap(). */
+    if (size == 0 || gpa_offset + size > vfu_reg->size) {
+        return ERROR_INT(EINVAL);
+    }
+
+    elem = calloc(1, sizeof(ioeventfd_t));
+    if (elem == NULL) {
+        return -1;
+    }
+
+    elem->fd = fd;
+    elem->gpa_offset = gpa_offset;
+    elem->size = size;
+    elem->flags = flags;
+    elem->datamatch = datamatch;
+    elem->shadow_fd = shadow_fd;
+    elem->shadow_offset = shadow_offset;
+
+    if (ioeventfd_insert(vfu_ctx, vfu_reg, elem) == -1) {
+        int err = errno;
+        free(elem);
+        return ERROR_INT(err);
+    }
+
+    return 0;
+}
+
+static int
+ioeventfd_map_shadow(vfu_ctx_t *vfu_ctx, ioeventfd_t *ioefd)
+{
+    size_t pgsize = (size_t)sysconf(_SC_PAGE_SIZE);
+    size_t start, len;
+    void *map;
+
+    if (ioefd->shadow_fd == -1 || ioefd->shadow_map != NULL) {
+        return 0;
+    }
+
+    start = ROUND_DOWN(ioefd->shadow_offset, pgsize);
+    len = ROUND_UP(ioefd->shadow_offset + ioefd->size, pgsize) - start;
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, ioefd->shadow_fd, start);
+    if (map == MAP_FAILED) {
+        vfu_log(vfu_ctx, LOG_ERR, "failed to map shadow memory of ioeventfd "
+                "%d: %m", ioefd->fd);
+        return -1;
+    }
+
+    ioefd->shadow_map = map;
+    ioefd->shadow_map_len = len;
+    ioefd->shadow = (char *)map + (ioefd->shadow_offset - start);
+    return 0;
+}
+
+static void
+ioeventfd_free(ioeventfd_t *ioefd)
+{
+    if (ioefd->shadow_map != NULL) {
+        munmap(ioefd->shadow_map, ioefd->shadow_map_len);
+    }
+    free(ioefd);
+}
+
+void
+ioeventfds_free(vfu_reg_info_t *vfu_reg)
+{
+    size_t i;
+
+    for (i = 0; i < vfu_reg->nr_ioeventfds; i++) {
+        ioeventfd_free(vfu_reg->ioeventfds[i]);
+    }
+    free(vfu_reg->ioeventfds);
+    vfu_reg->ioeventfds = NULL;
+    vfu_reg->nr_ioeventfds = 0;
+}
+
+static int
+ioeventfd_epoll_ctl(vfu_ctx_t *vfu_ctx, int op, int fd, void *ptr)
+{
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = ptr };
+
+    if (epoll_ctl(vfu_ctx->ioeventfd_epoll_fd, op, fd, &event) == -1) {
+        vfu_log(vfu_ctx, LOG_ERR, "failed to %s fd %d in ioeventfd "
+                "dispatcher: %m", op == EPOLL_CTL_DEL ? "remove" : "add", fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The transport poll fd changes on attach and goes away on detach, so it is
+ * (re-)registered lazily on each dispatch.
+ */
+static int
+ioeventfd_dispatch_sync_poll_fd(vfu_ctx_t *vfu_ctx)
+{
+    int fd = vfu_get_poll_fd(vfu_ctx);
+
+    if (fd == vfu_ctx->ioeventfd_poll_fd) {
+        return 0;
+    }
+
+    ioeventfd_dispatch_detach(vfu_ctx);
+
+    if (fd == -1) {
+        return 0;
+    }
+    if (ioeventfd_epoll_ctl(vfu_ctx, EPOLL_CTL_ADD, fd, NULL) == -1) {
+        return -1;
+    }
+    vfu_ctx->ioeventfd_poll_fd = fd;
+    return 0;
+}
+
+void
+ioeventfd_dispatch_detach(vfu_ctx_t *vfu_ctx)
+{
+    if (vfu_ctx->ioeventfd_poll_fd == -1) {
+        return;
+    }
+    /* The fd might already be closed, in which case epoll dropped it. */
+    (void)epoll_ctl(vfu_ctx->ioeventfd_epoll_fd, EPOLL_CTL_DEL,
+                    vfu_ctx->ioeventfd_poll_fd, NULL);
+    vfu_ctx->ioeventfd_poll_fd = -1;
+}
+
+void
+ioeventfd_dispatch_fini(vfu_ctx_t *vfu_ctx)
+{
+    if (vfu_ctx->ioeventfd_epoll_fd != -1) {
+        close(vfu_ctx->ioeventfd_epoll_fd);
+        vfu_ctx->ioeventfd_epoll_fd = -1;
+        vfu_ctx->ioeventfd_poll_fd = -1;
+    }
+    free(vfu_ctx->polled_ioeventfds);
+    vfu_ctx->polled_ioeventfds = NULL;
+    vfu_ctx->nr_polled_ioeventfds = 0;
+}
+
+static uint64_t
+ioeventfd_value(ioeventfd_t *ioefd)
+{
+    uint64_t value = 0;
+
+    if (ioefd->shadow != NULL && ioefd->size <= sizeof(value)) {
+        shadow_read((char *)&value, ioefd->shadow, ioefd->size);
+    }
+    return value;
+}
+
+/*
+ * Adds or removes @ioefd from the dispatcher's epoll set, if there is one,
+ * when it changes to or from having a handler and not being polled.
+ */
+static int
+ioeventfd_update_dispatch(vfu_ctx_t *vfu_ctx, ioeventfd_t *ioefd,
+                          bool has_handler, bool polled)
+{
+    bool was_dispatched = ioefd->handler != NULL && !ioefd->polled;
+    bool dispatched = has_handler && !polled;
+
+    if (vfu_ctx->ioeventfd_epoll_fd == -1 || was_dispatched == dispatched) {
+        return 0;
+    }
+    return ioeventfd_epoll_ctl(vfu_ctx,
+                               dispatched ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                               ioefd->fd, ioefd);
+}
+
+EXPORT int
+vfu_setup_ioeventfd_dispatch(vfu_ctx_t *vfu_ctx)
+{
+    size_t i, j;
+
+    assert(vfu_ctx != NULL);
+
+    if (!(vfu_ctx->flags & LIBVFIO_USER_FLAG_ATTACH_NB)) {
+        vfu_log(vfu_ctx, LOG_ERR, "ioeventfd dispatch requires "
+                "LIBVFIO_USER_FLAG_ATTACH_NB");
+        return ERROR_INT(EINVAL);
+    }
+
+    if (vfu_ctx->ioeventfd_epoll_fd != -1) {
+        return 0;
+    }
+
+    vfu_ctx->ioeventfd_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (vfu_ctx->ioeventfd_epoll_fd == -1) {
+        return -1;
+    }
+
+    for (i = 0; i < vfu_ctx->nr_regions; i++) {
+        vfu_reg_info_t *vfu_reg = &vfu_ctx->reg_info[i];
+
+        for (j = 0; j < vfu_reg->nr_ioeventfds; j++) {
+            ioeventfd_t *ioefd = vfu_reg->ioeventfds[j];
+
+            if (ioefd->handler != NULL && !ioefd->polled &&
+                ioeventfd_epoll_ctl(vfu_ctx, EPOLL_CTL_ADD, ioefd->fd,
+                                    ioefd) == -1) {
+                int err = errno;
+                close(vfu_ctx->ioeventfd_epoll_fd);
+                vfu_ctx->ioeventfd_epoll_fd = -1;
+                return ERROR_INT(err);
+            }
+        }
+    }
+
+    return 0;
+}
+
+EXPORT int
+vfu_get_ioeventfd_dispatch_fd(vfu_ctx_t *vfu_ctx)
+{
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->ioeventfd_epoll_fd == -1) {
+        return ERROR_INT(EINVAL);
+    }
+    return vfu_ctx->ioeventfd_epoll_fd;
+}
+
+EXPORT int
+vfu_set_ioeventfd_handler(vfu_ctx_t *vfu_ctx, int fd,
+                          vfu_ioeventfd_handler_t *handler, void *arg)
+{
+    ioeventfd_t *ioefd;
+    size_t nr;
+
+    assert(vfu_ctx != NULL);
+
+    ioefd = ioeventfd_find(vfu_ctx, fd, &nr);
+    if (ioefd == NULL) {
+        return ERROR_INT(ENOENT);
+    }
+    if (nr > 1) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "fd %d backs %zu ioeventfds", fd, nr);
+        return ERROR_INT(EINVAL);
+    }
+
+    if (handler != NULL && ioeventfd_map_shadow(vfu_ctx, ioefd) == -1) {
+        return -1;
+    }
+
+    if (ioeventfd_update_dispatch(vfu_ctx, ioefd, handler != NULL,
+                                  ioefd->polled) == -1) {
+        return -1;
+    }
+
+    ioefd->handler = handler;
+    ioefd->handler_arg = arg;
+    return 0;
+}
+
+static void
+ioeventfd_unpoll(vfu_ctx_t *vfu_ctx, ioeventfd_t *ioefd)
+{
+    size_t i;
+
+    for (i = 0; vfu_ctx->polled_ioeventfds[i] != ioefd; i++) {
+        assert(i < vfu_ctx->nr_polled_ioeventfds);
+    }
+    vfu_ctx->polled_ioeventfds[i] =
+        vfu_ctx->polled_ioeventfds[--vfu_ctx->nr_polled_ioeventfds];
+    ioefd->polled = false;
+}
+
+EXPORT int
+vfu_set_ioeventfd_polled(vfu_ctx_t *vfu_ctx, int fd, bool polled)
+{
+    ioeventfd_t **polled_ioeventfds;
+    ioeventfd_t *ioefd;
+    size_t nr;
+
+    assert(vfu_ctx != NULL);
+
+    ioefd = ioeventfd_find(vfu_ctx, fd, &nr);
+    if (ioefd == NULL) {
+        return ERROR_INT(ENOENT);
+    }
+    if (nr > 1 || ioefd->shadow_fd == -1) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "fd %d: can't poll %zu ioeventfd(s) "
+                "with shadow fd %d", fd, nr, ioefd->shadow_fd);
+        return ERROR_INT(EINVAL);
+    }
+    if (ioefd->polled == polled) {
+        return 0;
+    }
+
+    if (polled) {
+        if (ioeventfd_map_shadow(vfu_ctx, ioefd) == -1) {
+            return -1;
+        }
+        polled_ioeventfds = realloc(vfu_ctx->polled_ioeventfds,
+                                    (vfu_ctx->nr_polled_ioeventfds + 1) *
+                                    sizeof(*polled_ioeventfds));
+        if (polled_ioeventfds == NULL) {
+            return -1;
+        }
+        vfu_ctx->polled_ioeventfds = polled_ioeventfds;
+    }
+
+    if (ioeventfd_update_dispatch(vfu_ctx, ioefd, ioefd->handler != NULL,
+                                  polled) == -1) {
+        return -1;
+    }
+
+    if (polled) {
+        /* Only changes after this point are reported. */
+        ioefd->last_value = ioeventfd_value(ioefd);
+        vfu_ctx->polled_ioeventfds[vfu_ctx->nr_polled_ioeventfds++] = ioefd;
+        ioefd->polled = true;
+    } else {
+        ioeventfd_unpoll(vfu_ctx, ioefd);
+    }
+    return 0;
+}
+
+EXPORT int
+vfu_poll_ioeventfds(vfu_ctx_t *vfu_ctx)
+{
+    int handled = 0;
+    size_t i;
+
+    assert(vfu_ctx != NULL);
+
+    for (i = 0; i < vfu_ctx->nr_polled_ioeventfds; i++) {
+        ioeventfd_t *ioefd = vfu_ctx->polled_ioeventfds[i];
+        uint64_t value = ioeventfd_value(ioefd);
+
+        if (value == ioefd->last_value || ioefd->handler == NULL) {
+            continue;
+        }
+        /* order the handler's reads after the doorbell write it observed */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        ioefd->last_value = value;
+        ioefd->handler(vfu_ctx, ioefd->handler_arg, value, 0);
+        handled++;
+    }
+
+    return handled;
+}
+
+/*
+ * Takes @ioefd, already removed from its region, out of the dispatcher and the
+ * polled set and frees it. A dispatch in progress may still have it in its
+ * batch, in which case freeing is deferred until the dispatch is done.
+ */
+static void
+ioeventfd_remove(vfu_ctx_t *vfu_ctx, ioeventfd_t *ioefd)
+{
+    (void)ioeventfd_update_dispatch(vfu_ctx, ioefd, false, ioefd->polled);
+    if (ioefd->polled) {
+        ioeventfd_unpoll(vfu_ctx, ioefd);
+    }
+    ioefd->handler = NULL;
+
+    if (vfu_ctx->ioeventfd_dispatching) {
+        ioefd->next_deferred = vfu_ctx->deferred_ioeventfds;
+        vfu_ctx->deferred_ioeventfds = ioefd;
+    } else {
+        ioeventfd_free(ioefd);
+    }
+}
+
+EXPORT int
+vfu_delete_ioeventfd(vfu_ctx_t *vfu_ctx, uint32_t region_idx, int fd,
+                     size_t gpa_offset)
+{
+    vfu_reg_info_t *vfu_reg;
+    size_t i;
+
+    assert(vfu_ctx != NULL);
+
+    if (region_idx >= VFU_PCI_DEV_NUM_REGIONS) {
+        return ERROR_INT(EINVAL);
+    }
+
+    vfu_reg = &vfu_ctx->reg_info[region_idx];
+
+    i = ioeventfd_lookup(vfu_reg, fd, gpa_offset);
+    if (i == vfu_reg->nr_ioeventfds) {
+        return ERROR_INT(ENOENT);
+    }
+
+    do {
+        ioeventfd_t *ioefd = vfu_reg->ioeventfds[i];
+
+        memmove(&vfu_reg->ioeventfds[i], &vfu_reg->ioeventfds[i + 1],
+                (vfu_reg->nr_ioeventfds - i - 1) *
+                sizeof(*vfu_reg->ioeventfds));
+        vfu_reg->nr_ioeventfds--;
+        ioeventfd_remove(vfu_ctx, ioefd);
+        i = ioeventfd_lookup(vfu_reg, fd, gpa_offset);
+    } while (i < vfu_reg->nr_ioeventfds);
+
+    return 0;
+}
+
+EXPORT int
+vfu_update_ioeventfd(vfu_ctx_t *vfu_ctx, uint32_t region_idx, int fd,
+                     size_t gpa_offset, uint32_t size, uint32_t flags,
+                     uint64_t datamatch, int shadow_fd, size_t shadow_offset)
+{
+    vfu_reg_info_t *vfu_reg;
+    ioeventfd_t *ioefd;
+    ioeventfd_t new;
+    size_t i, pos;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+
+#ifndef SHADOW_IOEVENTFD
+    if (shadow_fd != -1) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "shadow ioeventfd not compiled");
+        return ERROR_INT(EINVAL);
+    }
+#endif
+
+    if (region_idx >= VFU_PCI_DEV_NUM_REGIONS) {
+        return ERROR_INT(EINVAL);
+    }
+
+    vfu_reg = &vfu_ctx->reg_info[region_idx];
+
+    /* A zero-sized ioeventfd would never overlap, see ioeventfds_overlap(). */
+    if (size == 0 || gpa_offset + size > vfu_reg->size) {
+        return ERROR_INT(EINVAL);
+    }
+
+    i = ioeventfd_lookup(vfu_reg, fd, gpa_offset);
+    if (i == vfu_reg->nr_ioeventfds) {
+        return ERROR_INT(ENOENT);
+    }
+    ioefd = vfu_reg->ioeventfds[i];
+    if ((i + 1 < vfu_reg->nr_ioeventfds &&
+         vfu_reg->ioeventfds[i + 1]->gpa_offset == gpa_offset &&
+         vfu_reg->ioeventfds[i + 1]->fd == fd) ||
+        (ioefd->polled && shadow_fd == -1)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    new = *ioefd;
+    new.size = size;
+    new.flags = flags;
+    new.datamatch = datamatch;
+    new.shadow_fd = shadow_fd;
+    new.shadow_offset = shadow_offset;
+    new.shadow = NULL;
+    new.shadow_map = NULL;
+    new.shadow_map_len = 0;
+
+    if ((ioefd->handler != NULL || ioefd->polled) &&
+        ioeventfd_map_shadow(vfu_ctx, &new) == -1) {
+        return -1;
+    }
+
+    /* Check for overlaps with everything but the entry being updated. */
+    memmove(&vfu_reg->ioeventfds[i], &vfu_reg->ioeventfds[i + 1],
+            (vfu_reg->nr_ioeventfds - i - 1) * sizeof(*vfu_reg->ioeventfds));
+    vfu_reg->nr_ioeventfds--;
+    ret = ioeventfd_find_slot(vfu_ctx, vfu_reg, &new, &pos);
+    memmove(&vfu_reg->ioeventfds[i + 1], &vfu_reg->ioeventfds[i],
+            (vfu_reg->nr_ioeventfds - i) * sizeof(*vfu_reg->ioeventfds));
+    vfu_reg->ioeventfds[i] = ioefd;
+    vfu_reg->nr_ioeventfds++;
+
+    if (ret == -1) {
+        int err = errno;
+
+        if (new.shadow_map != NULL) {
+            munmap(new.shadow_map, new.shadow_map_len);
+        }
+        return ERROR_INT(err);
+    }
+
+    /* The fd stays the same, so the dispatcher needs no update. */
+    if (ioefd->shadow_map != NULL) {
+        munmap(ioefd->shadow_map, ioefd->shadow_map_len);
+    }
+    *ioefd = new;
+    if (ioefd->polled) {
+        ioefd->last_value = ioeventfd_value(ioefd);
+    }
+    return 0;
+}
+
+EXPORT int
+vfu_notify_region_io_fds_changed(vfu_ctx_t *vfu_ctx, uint32_t region_idx)
+{
+    struct vfio_user_region_io_fds_changed changed = { .index = region_idx };
+    struct dma_chan *chan = &vfu_ctx->dma_chans[0];
+    uint16_t msg_id;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+
+    if (region_idx >= vfu_ctx->nr_regions) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (!vfu_ctx->io_fds_changed || vfu_ctx->tran->send_notify == NULL) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "client doesn't support IO fd change "
+                "notifications");
+        return ERROR_INT(ENOTSUP);
+    }
+
+    pthread_mutex_lock(&chan->lock);
+    msg_id = chan->msg_id++;
+    pthread_mutex_unlock(&chan->lock);
+
+    pthread_mutex_lock(&chan->send_lock);
+    ret = vfu_ctx->tran->send_notify(vfu_ctx, msg_id,
+                                     VFIO_USER_REGION_IO_FDS_CHANGED,
+                                     &changed, sizeof(changed));
+    pthread_mutex_unlock(&chan->send_lock);
+
+    return ret;
+}
+
+EXPORT int
+vfu_dispatch_ioeventfds(vfu_ctx_t *vfu_ctx, int timeout)
+{
+    struct epoll_event events[IOEVENTFD_DISPATCH_BATCH];
+    bool poll_fd_ready = false;
+    int handled = 0;
+    int i, n;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->ioeventfd_epoll_fd == -1) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (ioeventfd_dispatch_sync_poll_fd(vfu_ctx) == -1) {
+        return -1;
+    }
+
+    n = epoll_wait(vfu_ctx->ioeventfd_epoll_fd, events, ARRAY_SIZE(events),
+                   timeout);
+    if (n == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    vfu_ctx->ioeventfd_dispatching = true;
+
+    /*
+     * All ready ioeventfds are drained before the transport is serviced. The
+     * eventfd counter accumulates while the handler isn't running, so a
+     * single read collects every kick since the last one.
+     */
+    for (i = 0; i < n; i++) {
+        ioeventfd_t *ioefd = events[i].data.ptr;
+        eventfd_t kicks;
+
+        if (ioefd == NULL) {
+            poll_fd_ready = true;
+            continue;
+        }
+        /* an earlier handler in this batch might have removed it */
+        if (ioefd->handler == NULL || ioefd->polled) {
+            continue;
+        }
+        if (eventfd_read(ioefd->fd, &kicks) == -1) {
+            if (errno == EAGAIN) {
+                continue;
+            }
+            vfu_log(vfu_ctx, LOG_ERR, "failed to read ioeventfd %d: %m",
+                    ioefd->fd);
+            handled = -1;
+            break;
+        }
+        ioefd->handler(vfu_ctx, ioefd->handler_arg, ioeventfd_value(ioefd),
+                       kicks);
+        handled++;
+    }
+
+    vfu_ctx->ioeventfd_dispatching = false;
+    while (vfu_ctx->deferred_ioeventfds != NULL) {
+        ioeventfd_t *ioefd = vfu_ctx->deferred_ioeventfds;
+
+        vfu_ctx->deferred_ioeventfds = ioefd->next_deferred;
+        ioeventfd_free(ioefd);
+    }
+
+    if (handled == -1) {
+        return -1;
+    }
+
+    if (poll_fd_ready && vfu_run_ctx(vfu_ctx) == -1) {
+        return -1;
+    }
+
+    return handled;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
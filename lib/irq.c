@@ -34,12 +34,17 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/eventfd.h>
+#include <time.h>
 
 #include "irq.h"
+#include "msix.h"
 
 #define LM2VFIO_IRQT(type) (type - 1)
 
+#define IRQ_BITS_PER_WORD (sizeof(uint64_t) * CHAR_BIT)
+
 static const char *
 vfio_irq_idx_to_str(int index)
 {
@@ -123,6 +128,11 @@ irqs_disable(vfu_ctx_t *vfu_ctx, uint32_t index, uint32_t start, uint32_t count)
 
     for (i = start; i < count; i++) {
         close_safely(&efds[i]);
+        if (efds == vfu_ctx->irqs->efds && vfu_ctx->irqs->coalesce != NULL) {
+            vfu_ctx->irqs->coalesce[i].pending = 0;
+            vfu_ctx->irqs->coalesce_pending[i / IRQ_BITS_PER_WORD] &=
+                ~(1ULL << (i % IRQ_BITS_PER_WORD));
+        }
     }
 }
 
@@ -138,6 +148,27 @@ irqs_reset(vfu_ctx_t *vfu_ctx)
     for (i = 0; i < vfu_ctx->irqs->max_ivs; i++) {
         close_safely(&efds[i]);
     }
+
+    if (vfu_ctx->irqs->coalesce != NULL) {
+        for (i = 0; i < vfu_ctx->irqs->max_ivs; i++) {
+            vfu_ctx->irqs->coalesce[i].pending = 0;
+        }
+        memset(vfu_ctx->irqs->coalesce_pending, 0,
+               ROUND_UP(vfu_ctx->irqs->max_ivs, IRQ_BITS_PER_WORD) / CHAR_BIT);
+    }
+
+    msix_reset(vfu_ctx);
+}
+
+void
+irqs_free(vfu_ctx_t *vfu_ctx)
+{
+    if (vfu_ctx->irqs != NULL) {
+        free(vfu_ctx->irqs->coalesce);
+        free(vfu_ctx->irqs->coalesce_pending);
+    }
+    free(vfu_ctx->irqs);
+    vfu_ctx->irqs = NULL;
 }
 
 static void
@@ -253,6 +284,10 @@ irqs_set_data_eventfd(vfu_ctx_t *vfu_ctx, struct vfio_irq_set *irq_set,
         switch (irq_set->index) {
         case VFIO_PCI_ERR_IRQ_INDEX:
             vfu_log(vfu_ctx, LOG_DEBUG, "err fd=%d", *efd);
+            /* Report a posted write that failed while there was none. */
+            if (vfu_ctx->posted_write_err && eventfd_write(*efd, 1) == 0) {
+                vfu_ctx->posted_write_err = false;
+            }
             break;
         case VFIO_PCI_REQ_IRQ_INDEX:
             vfu_log(vfu_ctx, LOG_DEBUG, "req fd=%d", *efd);
@@ -433,10 +468,111 @@ validate_irq_subindex(vfu_ctx_t *vfu_ctx, uint32_t subindex)
     return true;
 }
 
+/*
+ * Signals the client's error eventfd (VFIO_PCI_ERR_IRQ_INDEX), if it has set
+ * one up.
+ */
+int
+irqs_trigger_err(vfu_ctx_t *vfu_ctx)
+{
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->irqs == NULL || vfu_ctx->irqs->err_efd == -1) {
+        return ERROR_INT(ENOENT);
+    }
+
+    return eventfd_write(vfu_ctx->irqs->err_efd, 1);
+}
+
+static uint64_t
+irq_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool
+irq_coalesce_expired(struct irq_coalesce *ic, uint64_t *now)
+{
+    if (ic->max_count != 0 && ic->pending >= ic->max_count) {
+        return true;
+    }
+    if (ic->max_delay_ns == 0) {
+        return false;
+    }
+    if (*now == 0) {
+        *now = irq_now_ns();
+    }
+    return *now - ic->first_ns >= ic->max_delay_ns;
+}
+
+/*
+ * Signals @subindex, unless it's a masked MSI-X vector, in which case it's
+ * left pending. Returns 1 if the eventfd was written, 0 if not, and -1 on
+ * error.
+ */
+static int
+irq_deliver(vfu_ctx_t *vfu_ctx, uint32_t subindex)
+{
+    struct irq_coalesce *ic;
+
+    if (vfu_ctx->irqs->coalesce != NULL) {
+        ic = &vfu_ctx->irqs->coalesce[subindex];
+        if (ic->pending != 0) {
+            ic->pending = 0;
+            vfu_ctx->irqs->coalesce_pending[subindex / IRQ_BITS_PER_WORD] &=
+                ~(1ULL << (subindex % IRQ_BITS_PER_WORD));
+        }
+    }
+
+    if (msix_vector_hold(vfu_ctx, subindex)) {
+        return 0;
+    }
+
+    if (eventfd_write(vfu_ctx->irqs->efds[subindex], 1) == -1) {
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Signals @subindex, or records it as pending if it has a coalescing policy
+ * that isn't yet satisfied. @now caches the current time across calls, 0 if
+ * not yet read. Returns 1 if the eventfd was written, 0 if coalesced, and -1
+ * on error.
+ */
+static int
+irq_fire(vfu_ctx_t *vfu_ctx, uint32_t subindex, uint64_t *now)
+{
+    struct irq_coalesce *ic = NULL;
+
+    if (vfu_ctx->irqs->coalesce != NULL) {
+        ic = &vfu_ctx->irqs->coalesce[subindex];
+    }
+
+    if (ic != NULL && (ic->max_count != 0 || ic->max_delay_ns != 0)) {
+        if (ic->pending++ == 0) {
+            if (*now == 0) {
+                *now = irq_now_ns();
+            }
+            ic->first_ns = *now;
+            vfu_ctx->irqs->coalesce_pending[subindex / IRQ_BITS_PER_WORD] |=
+                1ULL << (subindex % IRQ_BITS_PER_WORD);
+        }
+        if (!irq_coalesce_expired(ic, now)) {
+            return 0;
+        }
+    }
+
+    return irq_deliver(vfu_ctx, subindex);
+}
+
 EXPORT int
 vfu_irq_trigger(vfu_ctx_t *vfu_ctx, uint32_t subindex)
 {
-    eventfd_t val = 1;
+    uint64_t now = 0;
 
     assert(vfu_ctx != NULL);
 
@@ -449,7 +585,165 @@ vfu_irq_trigger(vfu_ctx_t *vfu_ctx, uint32_t subindex)
         return ERROR_INT(ENOENT);
     }
 
-    return eventfd_write(vfu_ctx->irqs->efds[subindex], val);
+    if (irq_fire(vfu_ctx, subindex, &now) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+EXPORT int
+vfu_irq_trigger_batch(vfu_ctx_t *vfu_ctx, const uint64_t *vectors,
+                      uint32_t nr_vectors)
+{
+    size_t nr_words = ROUND_UP(nr_vectors, IRQ_BITS_PER_WORD) /
+                      IRQ_BITS_PER_WORD;
+    uint64_t now = 0;
+    int signalled = 0;
+    uint64_t word;
+    uint32_t i;
+    size_t w;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+
+    if (vectors == NULL && nr_vectors != 0) {
+        return ERROR_INT(EINVAL);
+    }
+
+    /*
+     * Validate the whole set up front so that a bad vector doesn't leave the
+     * batch half delivered.
+     */
+    for (w = 0; w < nr_words; w++) {
+        word = vectors[w];
+        if (w == nr_words - 1 && nr_vectors % IRQ_BITS_PER_WORD != 0) {
+            word &= (1ULL << (nr_vectors % IRQ_BITS_PER_WORD)) - 1;
+        }
+        while (word != 0) {
+            i = w * IRQ_BITS_PER_WORD + __builtin_ctzll(word);
+            word &= word - 1;
+            if (!validate_irq_subindex(vfu_ctx, i)) {
+                return ERROR_INT(EINVAL);
+            }
+            if (vfu_ctx->irqs->efds[i] == -1) {
+                vfu_log(vfu_ctx, LOG_ERR, "no fd for interrupt %d", i);
+                return ERROR_INT(ENOENT);
+            }
+        }
+    }
+
+    for (w = 0; w < nr_words; w++) {
+        word = vectors[w];
+        if (w == nr_words - 1 && nr_vectors % IRQ_BITS_PER_WORD != 0) {
+            word &= (1ULL << (nr_vectors % IRQ_BITS_PER_WORD)) - 1;
+        }
+        while (word != 0) {
+            i = w * IRQ_BITS_PER_WORD + __builtin_ctzll(word);
+            word &= word - 1;
+            ret = irq_fire(vfu_ctx, i, &now);
+            if (ret == -1) {
+                return -1;
+            }
+            signalled += ret;
+        }
+    }
+
+    return signalled;
+}
+
+EXPORT int
+vfu_irq_set_coalescing(vfu_ctx_t *vfu_ctx, uint32_t subindex,
+                       uint32_t max_count, uint32_t max_delay_us)
+{
+    struct irq_coalesce *ic;
+    size_t nr_words;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->irqs == NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (!validate_irq_subindex(vfu_ctx, subindex)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (vfu_ctx->irqs->coalesce == NULL) {
+        if (max_count == 0 && max_delay_us == 0) {
+            return 0;
+        }
+        nr_words = ROUND_UP(vfu_ctx->irqs->max_ivs, IRQ_BITS_PER_WORD) /
+                   IRQ_BITS_PER_WORD;
+        vfu_ctx->irqs->coalesce = calloc(vfu_ctx->irqs->max_ivs,
+                                         sizeof(struct irq_coalesce));
+        vfu_ctx->irqs->coalesce_pending = calloc(nr_words, sizeof(uint64_t));
+        if (vfu_ctx->irqs->coalesce == NULL ||
+            vfu_ctx->irqs->coalesce_pending == NULL) {
+            free(vfu_ctx->irqs->coalesce);
+            free(vfu_ctx->irqs->coalesce_pending);
+            vfu_ctx->irqs->coalesce = NULL;
+            vfu_ctx->irqs->coalesce_pending = NULL;
+            return ERROR_INT(ENOMEM);
+        }
+    }
+
+    ic = &vfu_ctx->irqs->coalesce[subindex];
+    ic->max_count = max_count;
+    ic->max_delay_ns = (uint64_t)max_delay_us * 1000;
+
+    /* Don't strand interrupts that the old policy was holding back. */
+    if (ic->pending != 0 && max_count == 0 && max_delay_us == 0) {
+        if (vfu_ctx->irqs->efds[subindex] == -1) {
+            return ERROR_INT(ENOENT);
+        }
+        if (irq_deliver(vfu_ctx, subindex) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+EXPORT int
+vfu_irq_flush(vfu_ctx_t *vfu_ctx, bool force)
+{
+    uint64_t *pending;
+    uint64_t now = 0;
+    int signalled = 0;
+    uint64_t word;
+    size_t nr_words;
+    uint32_t i;
+    size_t w;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->irqs == NULL || vfu_ctx->irqs->coalesce == NULL) {
+        return 0;
+    }
+
+    pending = vfu_ctx->irqs->coalesce_pending;
+    nr_words = ROUND_UP(vfu_ctx->irqs->max_ivs, IRQ_BITS_PER_WORD) /
+               IRQ_BITS_PER_WORD;
+
+    for (w = 0; w < nr_words; w++) {
+        word = pending[w];
+        while (word != 0) {
+            i = w * IRQ_BITS_PER_WORD + __builtin_ctzll(word);
+            word &= word - 1;
+            if (!force &&
+                !irq_coalesce_expired(&vfu_ctx->irqs->coalesce[i], &now)) {
+                continue;
+            }
+            ret = irq_deliver(vfu_ctx, i);
+            if (ret == -1) {
+                return -1;
+            }
+            signalled += ret;
+        }
+    }
+
+    return signalled;
 }
 
 /* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
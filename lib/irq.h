@@ -38,12 +38,18 @@
 void
 irqs_reset(vfu_ctx_t *vfu_ctx);
 
+void
+irqs_free(vfu_ctx_t *vfu_ctx);
+
 int
 handle_device_get_irq_info(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg);
 
 int
 handle_device_set_irqs(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg);
 
+int
+irqs_trigger_err(vfu_ctx_t *vfu_ctx);
+
 #endif /* LIB_VFIO_USER_IRQ_H */
 
 /* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
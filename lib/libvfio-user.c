@@ -49,19 +49,28 @@
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <sys/eventfd.h>
+#include <poll.h>
 
+#include "config_events.h"
 #include "dma.h"
+#include "ioeventfd.h"
 #include "irq.h"
 #include "libvfio-user.h"
 #include "migration.h"
+#include "msix.h"
 #include "pci.h"
 #include "private.h"
+#include "reactor.h"
 #include "tran_pipe.h"
 #include "tran_sock.h"
+#include "worker.h"
 
 static int
 vfu_reset_ctx(vfu_ctx_t *vfu_ctx, int reason);
 
+static void
+dma_xfer_fail_all(vfu_ctx_t *vfu_ctx, int err);
+
 EXPORT void
 vfu_log(vfu_ctx_t *vfu_ctx, int level, const char *fmt, ...)
 {
@@ -181,6 +190,92 @@ debug_region_access(vfu_ctx_t *vfu_ctx UNUSED, size_t region UNUSED,
 }
 #endif
 
+/*
+ * Returns the first range of @reg that ends after @offset, or NULL if there is
+ * none. It either contains @offset or starts after it; as ranges don't
+ * overlap, their ends are sorted too.
+ */
+static struct region_range *
+region_range_find(vfu_reg_info_t *reg, uint64_t offset)
+{
+    size_t lo = 0;
+    size_t hi = reg->nr_ranges;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        struct region_range *range = &reg->ranges[mid];
+
+        if (offset - range->offset >= range->size &&
+            offset >= range->offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo < reg->nr_ranges ? &reg->ranges[lo] : NULL;
+}
+
+/*
+ * Copies @count bytes of shadow registers the device may be updating
+ * concurrently. Naturally aligned 2, 4 and 8 byte reads are single-copy
+ * atomic.
+ */
+void
+shadow_read(char *buf, const char *src, size_t count)
+{
+    if (((uintptr_t)src & (count - 1)) == 0) {
+        switch (count) {
+        case 2: {
+            uint16_t val = __atomic_load_n((uint16_t *)src, __ATOMIC_RELAXED);
+            memcpy(buf, &val, sizeof(val));
+            return;
+        }
+        case 4: {
+            uint32_t val = __atomic_load_n((uint32_t *)src, __ATOMIC_RELAXED);
+            memcpy(buf, &val, sizeof(val));
+            return;
+        }
+        case 8: {
+            uint64_t val = __atomic_load_n((uint64_t *)src, __ATOMIC_RELAXED);
+            memcpy(buf, &val, sizeof(val));
+            return;
+        }
+        }
+    }
+
+    memcpy(buf, src, count);
+}
+
+static ssize_t
+region_range_access(vfu_ctx_t *vfu_ctx, struct region_range *range, char *buf,
+                    size_t count, uint64_t offset, bool is_write)
+{
+    uint64_t range_offset = offset - range->offset;
+
+    if (unlikely(count > range->size - range_offset)) {
+        vfu_log(vfu_ctx, LOG_ERR, "access %#llx-%#llx straddles range end",
+                (ull_t)offset, (ull_t)(offset + count));
+        return ERROR_INT(EINVAL);
+    }
+
+    if (range->access_sizes != 0 &&
+        unlikely((count & (count - 1)) != 0 ||
+                 (count & range->access_sizes) == 0 ||
+                 (offset & (count - 1)) != 0)) {
+        vfu_log(vfu_ctx, LOG_ERR, "bad access size %zu at %#llx", count,
+                (ull_t)offset);
+        return ERROR_INT(EINVAL);
+    }
+
+    if (range->shadow != NULL) {
+        shadow_read(buf, range->shadow + range_offset, count);
+        return count;
+    }
+
+    return range->cb(vfu_ctx, range->arg, buf, count, range_offset, is_write);
+}
+
 static ssize_t
 region_access(vfu_ctx_t *vfu_ctx, size_t region, char *buf,
               size_t count, uint64_t offset, bool is_write)
@@ -198,7 +293,24 @@ region_access(vfu_ctx_t *vfu_ctx, size_t region, char *buf,
             goto out;
         }
     } else {
-        vfu_region_access_cb_t *cb = vfu_ctx->reg_info[region].cb;
+        vfu_reg_info_t *reg = &vfu_ctx->reg_info[region];
+        vfu_region_access_cb_t *cb = reg->cb;
+        struct region_range *range;
+
+        if (reg->nr_ranges > 0 &&
+            (range = region_range_find(reg, offset)) != NULL &&
+            (range->offset <= offset || range->offset - offset < count) &&
+            (range->shadow == NULL || !is_write)) {
+            if (unlikely(range->offset > offset)) {
+                vfu_log(vfu_ctx, LOG_ERR, "access %#llx-%#llx straddles range "
+                        "start", (ull_t)offset, (ull_t)(offset + count));
+                ret = ERROR_INT(EINVAL);
+            } else {
+                ret = region_range_access(vfu_ctx, range, buf, count, offset,
+                                          is_write);
+            }
+            goto out;
+        }
 
         if (cb == NULL) {
             vfu_log(vfu_ctx, LOG_ERR, "no callback for region %zu", region);
@@ -219,12 +331,42 @@ out:
     return ret;
 }
 
+/*
+ * Checks that @count bytes at @offset lie within region @index, and that the
+ * region can currently be accessed.
+ */
+static bool
+is_valid_region_range(vfu_ctx_t *vfu_ctx, size_t index, uint64_t offset,
+                      uint32_t count)
+{
+    if (unlikely(index >= vfu_ctx->nr_regions)) {
+        vfu_log(vfu_ctx, LOG_ERR, "bad region index %zu", index);
+        return false;
+    }
+
+    if (unlikely(satadd_u64(offset, count) > vfu_ctx->reg_info[index].size)) {
+        vfu_log(vfu_ctx, LOG_ERR,
+                "out of bounds region access %#llx-%#llx (size %llx)",
+                (ull_t)offset, (ull_t)(offset + count),
+                (ull_t)vfu_ctx->reg_info[index].size);
+
+        return false;
+    }
+
+    if (unlikely(device_is_stopped_and_copying(vfu_ctx->migration))) {
+        vfu_log(vfu_ctx, LOG_ERR,
+                "cannot access region %zu while device in stop-and-copy state",
+                index);
+        return false;
+    }
+
+    return true;
+}
+
 static bool
 is_valid_region_access(vfu_ctx_t *vfu_ctx, size_t size, uint16_t cmd,
                        struct vfio_user_region_access *ra)
 {
-    size_t index;
-
     assert(vfu_ctx != NULL);
     assert(ra != NULL);
 
@@ -246,32 +388,7 @@ is_valid_region_access(vfu_ctx_t *vfu_ctx, size_t size, uint16_t cmd,
         return false;
     }
 
-    index = ra->region;
-
-    if (unlikely(index >= vfu_ctx->nr_regions)) {
-        vfu_log(vfu_ctx, LOG_ERR, "bad region index %zu", index);
-        return false;
-    }
-
-    if (unlikely(satadd_u64(ra->offset, ra->count)
-                 > vfu_ctx->reg_info[index].size)) {
-        vfu_log(vfu_ctx, LOG_ERR,
-                "out of bounds region access %#llx-%#llx (size %llx)",
-                (ull_t)ra->offset,
-                (ull_t)(ra->offset + ra->count),
-                (ull_t)vfu_ctx->reg_info[index].size);
-
-        return false;
-    }
-
-    if (unlikely(device_is_stopped_and_copying(vfu_ctx->migration))) {
-        vfu_log(vfu_ctx, LOG_ERR,
-                "cannot access region %zu while device in stop-and-copy state",
-                index);
-        return false;
-    }
-
-    return true;
+    return is_valid_region_range(vfu_ctx, ra->region, ra->offset, ra->count);
 }
 
 static int
@@ -293,10 +410,50 @@ handle_region_access(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
         return 0;
     }
 
-    msg->out.iov.iov_len = sizeof(*in_ra);
-    if (msg->hdr.cmd == VFIO_USER_REGION_READ) {
-        msg->out.iov.iov_len += in_ra->count;
+    if (likely(msg->hdr.cmd == VFIO_USER_REGION_WRITE ||
+               in_ra->count <= sizeof(vfu_ctx->inline_read_buf))) {
+        /*
+         * The reply header is identical to the request header, so send it
+         * straight from the request buffer, followed by the read data (if
+         * any) from the per-context buffer.
+         */
+        msg->inline_iovecs[0].iov_base = in_ra;
+        msg->inline_iovecs[0].iov_len = sizeof(*in_ra);
+        msg->out_iovecs = msg->inline_iovecs;
+        msg->nr_out_iovecs = 1;
+
+        if (msg->hdr.cmd == VFIO_USER_REGION_WRITE) {
+            buf = (char *)(&in_ra->data);
+        } else {
+            buf = (char *)vfu_ctx->inline_read_buf;
+            /*
+             * Like the calloc()ed buffer below, so bytes the callback doesn't
+             * fill in can't leak data from a previous read.
+             */
+            memset(buf, 0, in_ra->count);
+            msg->inline_iovecs[1].iov_base = buf;
+            msg->inline_iovecs[1].iov_len = in_ra->count;
+            msg->nr_out_iovecs = 2;
+        }
+
+        ret = region_access(vfu_ctx, in_ra->region, buf, in_ra->count,
+                            in_ra->offset,
+                            msg->hdr.cmd == VFIO_USER_REGION_WRITE);
+        if (ret != (ssize_t)in_ra->count) {
+            /* don't send back whatever is left in the inline buffer */
+            msg->out_iovecs = NULL;
+            msg->nr_out_iovecs = 0;
+            /* FIXME we should return whatever has been accessed, not an error */
+            if (unlikely(ret >= 0)) {
+                ret = ERROR_INT(EINVAL);
+            }
+            return ret;
+        }
+
+        return 0;
     }
+
+    msg->out.iov.iov_len = sizeof(*in_ra) + in_ra->count;
     msg->out.iov.iov_base = calloc(1, msg->out.iov.iov_len);
     if (unlikely(msg->out.iov.iov_base == NULL)) {
         return -1;
@@ -307,14 +464,10 @@ handle_region_access(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
     out_ra->offset = in_ra->offset;
     out_ra->count = in_ra->count;
 
-    if (msg->hdr.cmd == VFIO_USER_REGION_READ) {
-        buf = (char *)(&out_ra->data);
-    } else {
-        buf = (char *)(&in_ra->data);
-    }
+    buf = (char *)(&out_ra->data);
 
     ret = region_access(vfu_ctx, in_ra->region, buf, in_ra->count,
-                        in_ra->offset, msg->hdr.cmd == VFIO_USER_REGION_WRITE);
+                        in_ra->offset, false);
     if (ret != (ssize_t)in_ra->count) {
         /* FIXME we should return whatever has been accessed, not an error */
         if (unlikely(ret >= 0)) {
@@ -328,6 +481,71 @@ handle_region_access(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
     return 0;
 }
 
+static bool
+is_valid_write_multi_size(size_t size, struct vfio_user_write_multi *wm)
+{
+    return size >= sizeof(*wm) && wm->wr_cnt <= VFIO_USER_MULTI_MAX &&
+           size >= sizeof(*wm) + wm->wr_cnt * sizeof(wm->wrs[0]);
+}
+
+/*
+ * Handles VFIO_USER_REGION_WRITE_MULTI: a batch of small writes, performed in
+ * order as if sent as separate VFIO_USER_REGION_WRITE requests, with a single
+ * (payload-less) reply.
+ */
+static int
+handle_region_write_multi(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
+{
+    struct vfio_user_write_multi *wm = msg->in.iov.iov_base;
+    struct vfio_user_write_multi_data *wr;
+    ssize_t ret;
+    uint64_t i;
+
+    assert(vfu_ctx != NULL);
+    assert(msg != NULL);
+
+    if (unlikely(!is_valid_write_multi_size(msg->in.iov.iov_len, wm))) {
+        vfu_log(vfu_ctx, LOG_ERR, "bad write multi message size %zu",
+                msg->in.iov.iov_len);
+        return ERROR_INT(EINVAL);
+    }
+
+    /* Validate everything first so that a bad request has no effect. */
+    for (i = 0; i < wm->wr_cnt; i++) {
+        wr = &wm->wrs[i];
+
+        if (unlikely(wr->count > VFIO_USER_MULTI_DATA)) {
+            vfu_log(vfu_ctx, LOG_ERR, "write multi count too large (%u)",
+                    wr->count);
+            return ERROR_INT(EINVAL);
+        }
+
+        if (unlikely(!is_valid_region_range(vfu_ctx, wr->region, wr->offset,
+                                            wr->count))) {
+            return ERROR_INT(EINVAL);
+        }
+    }
+
+    for (i = 0; i < wm->wr_cnt; i++) {
+        wr = &wm->wrs[i];
+
+        if (unlikely(wr->count == 0)) {
+            continue;
+        }
+
+        ret = region_access(vfu_ctx, wr->region, (char *)wr->data, wr->count,
+                            wr->offset, true);
+        if (ret != (ssize_t)wr->count) {
+            if (unlikely(ret >= 0)) {
+                ret = ERROR_INT(EINVAL);
+            }
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 static int
 handle_device_get_info(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
 {
@@ -443,49 +661,6 @@ handle_device_get_region_info(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
     return 0;
 }
 
-EXPORT int
-vfu_create_ioeventfd(vfu_ctx_t *vfu_ctx, uint32_t region_idx, int fd,
-                     size_t gpa_offset, uint32_t size, uint32_t flags,
-                     uint64_t datamatch, int shadow_fd, size_t shadow_offset)
-{
-    vfu_reg_info_t *vfu_reg;
-
-    assert(vfu_ctx != NULL);
-
-#ifndef SHADOW_IOEVENTFD
-    if (shadow_fd != -1) {
-        vfu_log(vfu_ctx, LOG_DEBUG, "shadow ioeventfd not compiled");
-        return ERROR_INT(EINVAL);
-    }
-#endif
-
-    if (region_idx >= VFU_PCI_DEV_NUM_REGIONS) {
-        return ERROR_INT(EINVAL);
-    }
-
-    vfu_reg = &vfu_ctx->reg_info[region_idx];
-
-    if (gpa_offset + size > vfu_reg->size) {
-        return ERROR_INT(EINVAL);
-    }
-
-    ioeventfd_t *elem = malloc(sizeof(ioeventfd_t));
-    if (elem == NULL) {
-        return -1;
-    }
-
-    elem->fd = fd;
-    elem->gpa_offset = gpa_offset;
-    elem->size = size;
-    elem->flags = flags;
-    elem->datamatch = datamatch;
-    elem->shadow_fd = shadow_fd;
-    elem->shadow_offset = shadow_offset;
-    LIST_INSERT_HEAD(&vfu_reg->subregions, elem, entry);
-
-    return 0;
-}
-
 static void
 free_regions(vfu_ctx_t *vfu_ctx)
 {
@@ -496,21 +671,51 @@ free_regions(vfu_ctx_t *vfu_ctx)
     for (index = 0; index < VFU_PCI_DEV_NUM_REGIONS; index++) {
         vfu_reg_info_t *vfu_reg = &vfu_ctx->reg_info[index];
 
-        while (!LIST_EMPTY(&vfu_reg->subregions)) {
-            ioeventfd_t *n = LIST_FIRST(&vfu_reg->subregions);
-            LIST_REMOVE(n, entry);
-            free(n);
-        }
+        ioeventfds_free(vfu_reg);
+        free(vfu_reg->ranges);
     }
     free(vfu_ctx->reg_info);
 }
 
+/*
+ * Open-addressed hash table from fd to its index in a reply's fd array, so
+ * that duplicate fds are found in constant time.
+ */
+struct fd_index_map {
+    struct {
+        int fd;
+        int index;
+    } *slots;
+    size_t mask;
+};
+
+static int
+fd_index_map_init(struct fd_index_map *map, size_t nr_fds)
+{
+    size_t nr_slots = 1;
+    size_t i;
+
+    while (nr_slots < nr_fds * 2) {
+        nr_slots <<= 1;
+    }
+    map->slots = malloc(nr_slots * sizeof(*map->slots));
+    if (map->slots == NULL) {
+        return -1;
+    }
+    for (i = 0; i < nr_slots; i++) {
+        map->slots[i].fd = -1;
+    }
+    map->mask = nr_slots - 1;
+    return 0;
+}
+
 /*
  * This function is used to add fd's to the fd return array and gives you back
  * the index of the fd that has been added. If the fd is already present it will
  * return the index to that duplicate fd to reduce the number of fd's sent.
  * The fd must be a valid fd or -1, any other negative value is not permitted.
  *
+ * map: fd to index map of the fds already in the array
  * out_fds: an array where the fd is stored
  * nr_out_fds: pointer to memory that contains the size of the array
  * fd_search: the fd to add
@@ -520,10 +725,12 @@ free_regions(vfu_ctx_t *vfu_ctx)
  *  returns -1.
  */
 static int
-add_fd_index(int *out_fds, size_t *nr_out_fds, int fd_search)
+add_fd_index(struct fd_index_map *map, int *out_fds, size_t *nr_out_fds,
+             int fd_search)
 {
-    size_t i = 0;
+    size_t i;
 
+    assert(map != NULL);
     assert(out_fds != NULL);
     assert(nr_out_fds != NULL);
 
@@ -532,12 +739,17 @@ add_fd_index(int *out_fds, size_t *nr_out_fds, int fd_search)
         return -1;
     }
 
-    for (i = 0; i < *nr_out_fds; i++) {
-        if (out_fds[i] == fd_search) {
-            return i;
+    /* Fibonacci hashing spreads consecutive fd numbers across the table. */
+    i = ((uint32_t)fd_search * 2654435769U) & map->mask;
+    while (map->slots[i].fd != -1) {
+        if (map->slots[i].fd == fd_search) {
+            return map->slots[i].index;
         }
+        i = (i + 1) & map->mask;
     }
 
+    map->slots[i].fd = fd_search;
+    map->slots[i].index = *nr_out_fds;
     out_fds[*nr_out_fds] = fd_search;
     (*nr_out_fds)++;
 
@@ -553,6 +765,7 @@ handle_device_get_region_io_fds(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
     vfio_user_region_io_fds_reply_t *reply = NULL;
     vfio_user_sub_region_ioeventfd_t *ioefd = NULL;
     vfio_user_region_io_fds_request_t *req = NULL;
+    struct fd_index_map fd_map;
     ioeventfd_t *sub_reg = NULL;
     size_t nr_sub_reg = 0;
     size_t i = 0;
@@ -588,9 +801,9 @@ handle_device_get_region_io_fds(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
         return ERROR_INT(EINVAL);
     }
 
-    LIST_FOREACH(sub_reg, &vfu_reg->subregions, entry) {
-        nr_sub_reg++;
-        if (sub_reg->shadow_fd != -1) {
+    nr_sub_reg = vfu_reg->nr_ioeventfds;
+    for (i = 0; i < nr_sub_reg; i++) {
+        if (vfu_reg->ioeventfds[i]->shadow_fd != -1) {
             nr_shadow_reg++;
         }
     }
@@ -628,31 +841,34 @@ handle_device_get_region_io_fds(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
         if (msg->out.fds == NULL) {
             return -1;
         }
-
-        sub_reg = LIST_FIRST(&vfu_reg->subregions);
+        if (fd_index_map_init(&fd_map,
+                              max_sent_sub_regions + nr_shadow_reg) == -1) {
+            return -1;
+        }
 
         for (i = 0; i < max_sent_sub_regions; i++) {
             int fdi;
 
+            sub_reg = vfu_reg->ioeventfds[i];
             ioefd = &reply->sub_regions[i].ioeventfd;
             ioefd->gpa_offset = sub_reg->gpa_offset;
             ioefd->size = sub_reg->size;
-            fdi = add_fd_index(msg->out.fds, &msg->out.nr_fds, sub_reg->fd);
+            fdi = add_fd_index(&fd_map, msg->out.fds, &msg->out.nr_fds,
+                               sub_reg->fd);
             ioefd->fd_index = fdi;
             if (sub_reg->shadow_fd == -1) {
                 ioefd->type = VFIO_USER_IO_FD_TYPE_IOEVENTFD;
             } else {
                 ioefd->type = VFIO_USER_IO_FD_TYPE_IOEVENTFD_SHADOW;
-                fdi = add_fd_index(msg->out.fds, &msg->out.nr_fds,
+                fdi = add_fd_index(&fd_map, msg->out.fds, &msg->out.nr_fds,
                                    sub_reg->shadow_fd);
                 ioefd->shadow_mem_fd_index = fdi;
             }
             ioefd->flags = sub_reg->flags;
             ioefd->datamatch = sub_reg->datamatch;
             ioefd->shadow_offset = sub_reg->shadow_offset;
-
-            sub_reg = LIST_NEXT(sub_reg, entry);
         }
+        free(fd_map.slots);
     }
 
     return 0;
@@ -1271,13 +1487,31 @@ free_msg(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
      * Each iov_base refers to data we don't want to free, but we *do* want to
      * free the allocated array of iovecs if there is one.
      */
-    free(msg->out_iovecs);
+    if (msg->out_iovecs != msg->inline_iovecs) {
+        free(msg->out_iovecs);
+    }
 
     free(msg);
 
     errno = saved_errno;
 }
 
+/*
+ * With the "posted_writes" capability, region writes are never replied to.
+ * Requests are still handled strictly in order, so the reply to a later
+ * request (typically a region read) tells the client that all earlier writes
+ * have been performed. Failed writes are reported via the error IRQ instead.
+ * This only depends on what was negotiated, so that the client always knows
+ * which requests get a reply.
+ */
+static bool
+is_posted_write(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
+{
+    return vfu_ctx->posted_writes &&
+           (msg->hdr.cmd == VFIO_USER_REGION_WRITE ||
+            msg->hdr.cmd == VFIO_USER_REGION_WRITE_MULTI);
+}
+
 static int
 do_reply(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg, int reply_errno)
 {
@@ -1286,6 +1520,23 @@ do_reply(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg, int reply_errno)
     assert(vfu_ctx != NULL);
     assert(msg != NULL);
 
+    if (is_posted_write(vfu_ctx, msg)) {
+        if (reply_errno == 0 || irqs_trigger_err(vfu_ctx) == 0) {
+            return 0;
+        }
+        if (errno == ENOENT) {
+            /* Signalled once the client sets up the error eventfd. */
+            vfu_log(vfu_ctx, LOG_WARNING, "msg%#hx: posted write failed: %s",
+                    msg->hdr.msg_id, strerror(reply_errno));
+            vfu_ctx->posted_write_err = true;
+        } else {
+            vfu_log(vfu_ctx, LOG_WARNING,
+                    "msg%#hx: failed to report posted write error: %m",
+                    msg->hdr.msg_id);
+        }
+        return 0;
+    }
+
     if (msg->hdr.flags & VFIO_USER_F_NO_REPLY) {
         /*
          * A failed client request is not a failure of handle_request() itself.
@@ -1293,12 +1544,19 @@ do_reply(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg, int reply_errno)
         return 0;
     }
 
+    pthread_mutex_lock(&vfu_ctx->reply_lock);
     ret = vfu_ctx->tran->reply(vfu_ctx, msg, reply_errno);
+    pthread_mutex_unlock(&vfu_ctx->reply_lock);
 
     if (ret < 0) {
         vfu_log(vfu_ctx, LOG_ERR, "failed to reply: %m");
 
-        if (errno == ECONNRESET || errno == ENOMSG) {
+        /*
+         * A worker leaves the reset to vfu_run_ctx(), which will find the
+         * connection gone too.
+         */
+        if ((errno == ECONNRESET || errno == ENOMSG) &&
+            !worker_in_worker(vfu_ctx)) {
             ret = vfu_reset_ctx(vfu_ctx, errno);
             if (ret < 0) {
                 if (errno != EBUSY) {
@@ -1361,6 +1619,10 @@ handle_request(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
         ret = handle_region_access(vfu_ctx, msg);
         break;
 
+    case VFIO_USER_REGION_WRITE_MULTI:
+        ret = handle_region_write_multi(vfu_ctx, msg);
+        break;
+
     case VFIO_USER_DEVICE_RESET:
         vfu_log(vfu_ctx, LOG_INFO, "device reset by client");
         ret = device_reset(vfu_ctx, VFU_RESET_DEVICE);
@@ -1393,6 +1655,14 @@ handle_request(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
     return do_reply(vfu_ctx, msg, ret == 0 ? 0 : errno);
 }
 
+void
+handle_offloaded_request(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
+{
+    /* Failures have been replied to, there's no one else to tell. */
+    (void) handle_request(vfu_ctx, msg);
+    free_msg(vfu_ctx, msg);
+}
+
 /*
  * Note that we avoid any malloc() before we see data, as this is used for
  * polling by SPDK.
@@ -1406,7 +1676,13 @@ get_request_header(vfu_ctx_t *vfu_ctx, vfu_msg_t **msgp)
     size_t i;
     int ret;
 
-    ret = vfu_ctx->tran->get_request_header(vfu_ctx, &hdr, fds, &nr_fds);
+    /* A DMA transfer may have found the client gone, see dma_xfer_conn_err(). */
+    ret = __atomic_load_n(&vfu_ctx->dma_conn_err, __ATOMIC_ACQUIRE);
+    if (unlikely(ret != 0)) {
+        ret = ERROR_INT(ret);
+    } else {
+        ret = vfu_ctx->tran->get_request_header(vfu_ctx, &hdr, fds, &nr_fds);
+    }
 
     if (unlikely(ret < 0)) {
         switch (errno) {
@@ -1479,6 +1755,7 @@ MOCK_DEFINE(cmd_allowed_when_stopped_and_copying)(uint16_t cmd)
 {
     return cmd == VFIO_USER_REGION_READ ||
            cmd == VFIO_USER_REGION_WRITE ||
+           cmd == VFIO_USER_REGION_WRITE_MULTI ||
            cmd == VFIO_USER_DEVICE_FEATURE ||
            cmd == VFIO_USER_MIG_DATA_READ;
 }
@@ -1506,7 +1783,9 @@ static bool
 access_needs_quiesce(const vfu_ctx_t *vfu_ctx, size_t region_index,
                      uint64_t offset)
 {
-    return access_is_pci_cap_exp(vfu_ctx, region_index, offset);
+    /* With config events, the device handles FLR in its own time. */
+    return access_is_pci_cap_exp(vfu_ctx, region_index, offset) &&
+           !config_events_enabled(vfu_ctx);
 }
 
 static bool
@@ -1514,6 +1793,8 @@ command_needs_quiesce(vfu_ctx_t *vfu_ctx, const vfu_msg_t *msg)
 {
     struct vfio_user_region_access *reg;
     struct vfio_user_device_feature *feature;
+    struct vfio_user_write_multi *wm;
+    uint64_t i;
 
     if (vfu_ctx->quiesce == NULL) {
         return false;
@@ -1521,8 +1802,23 @@ command_needs_quiesce(vfu_ctx_t *vfu_ctx, const vfu_msg_t *msg)
 
     switch (msg->hdr.cmd) {
     case VFIO_USER_DMA_MAP:
+        return vfu_ctx->dma != NULL &&
+               !(vfu_ctx->flags & LIBVFIO_USER_FLAG_DMA_MAP_NO_QUIESCE);
+
     case VFIO_USER_DMA_UNMAP:
-        return vfu_ctx->dma != NULL;
+        if (vfu_ctx->dma == NULL) {
+            return false;
+        }
+        /*
+         * With I/O contexts, plain unmaps only wait for the I/O contexts using
+         * the region, see dma_controller_remove_region().
+         */
+        if (vfu_ctx->nr_io_ctxs > 0 &&
+            msg->in.iov.iov_len >= sizeof(struct vfio_user_dma_unmap)) {
+            return ((struct vfio_user_dma_unmap *)msg->in.iov.iov_base)->flags
+                   != 0;
+        }
+        return true;
 
     case VFIO_USER_DEVICE_RESET:
         return true;
@@ -1541,6 +1837,23 @@ command_needs_quiesce(vfu_ctx_t *vfu_ctx, const vfu_msg_t *msg)
         }
         break;
 
+    case VFIO_USER_REGION_WRITE_MULTI:
+        wm = msg->in.iov.iov_base;
+        if (!is_valid_write_multi_size(msg->in.iov.iov_len, wm)) {
+            /*
+             * bad request, it will be eventually failed by
+             * handle_region_write_multi
+             */
+            return false;
+        }
+        for (i = 0; i < wm->wr_cnt; i++) {
+            if (access_needs_quiesce(vfu_ctx, wm->wrs[i].region,
+                                     wm->wrs[i].offset)) {
+                return true;
+            }
+        }
+        break;
+
     case VFIO_USER_DEVICE_FEATURE:
         if (msg->in.iov.iov_len < sizeof(*feature)) {
             /*
@@ -1561,20 +1874,75 @@ command_needs_quiesce(vfu_ctx_t *vfu_ctx, const vfu_msg_t *msg)
 }
 
 /*
- * Acquire a request from the vfio-user socket. Returns 0 on success, or -1 with
- * errno set as follows:
- *
- * EAGAIN/EWOULDBLOCK: no request was ready to read from the socket
- * ENOMSG: a message was read and replied to, no further handling is needed.
- * E*: other errors that should be returned to the caller
+ * Requests that never wait for offloaded requests to complete, see
+ * vfu_setup_worker_pool().
  */
-static int
-get_request(vfu_ctx_t *vfu_ctx, vfu_msg_t **msgp)
+static bool
+is_fast_path_request(const vfu_msg_t *msg)
 {
-    vfu_msg_t *msg = NULL;
-    int ret;
+    switch (msg->hdr.cmd) {
+    case VFIO_USER_REGION_READ:
+    case VFIO_USER_REGION_WRITE:
+    case VFIO_USER_REGION_WRITE_MULTI:
+    case VFIO_USER_DEVICE_GET_INFO:
+    case VFIO_USER_DEVICE_GET_REGION_INFO:
+    case VFIO_USER_DEVICE_GET_REGION_IO_FDS:
+    case VFIO_USER_DEVICE_GET_IRQ_INFO:
+    case VFIO_USER_DEVICE_SET_IRQS:
+        return true;
+    default:
+        return false;
+    }
+}
 
-    assert(vfu_ctx != NULL);
+/* Returns true if requests like @msg are handed to the worker pool. */
+static bool
+is_offloaded_request(const vfu_ctx_t *vfu_ctx, const vfu_msg_t *msg)
+{
+    int cmd_class;
+
+    switch (msg->hdr.cmd) {
+    case VFIO_USER_MIG_DATA_READ:
+    case VFIO_USER_MIG_DATA_WRITE:
+        cmd_class = VFU_WORKER_CMD_MIGRATION_DATA;
+        break;
+    case VFIO_USER_DMA_MAP:
+        /*
+         * Only a map published atomically can run alongside vfu_addr_to_sgl()
+         * and friends on the context's thread; unmaps never can.
+         */
+        if (!(vfu_ctx->flags & LIBVFIO_USER_FLAG_DMA_MAP_NO_QUIESCE)) {
+            return false;
+        }
+        cmd_class = VFU_WORKER_CMD_DMA;
+        break;
+    case VFIO_USER_DEVICE_FEATURE:
+        cmd_class = VFU_WORKER_CMD_DEVICE_FEATURE;
+        break;
+    default:
+        return false;
+    }
+
+    return vfu_ctx->worker.pool != NULL &&
+           (vfu_ctx->worker.cmd_classes & cmd_class) != 0;
+}
+
+/*
+ * Acquire a request from the vfio-user socket. Returns 0 on success, or -1 with
+ * errno set as follows:
+ *
+ * EAGAIN/EWOULDBLOCK: no request was ready to read from the socket
+ * ENOMSG: a message was read and replied to, no further handling is needed.
+ * E*: other errors that should be returned to the caller
+ */
+static int
+get_request(vfu_ctx_t *vfu_ctx, vfu_msg_t **msgp)
+{
+    vfu_msg_t *msg = NULL;
+    bool needs_quiesce;
+    int ret;
+
+    assert(vfu_ctx != NULL);
 
     *msgp = NULL;
 
@@ -1604,7 +1972,19 @@ get_request(vfu_ctx_t *vfu_ctx, vfu_msg_t **msgp)
         goto err;
     }
 
-    if (command_needs_quiesce(vfu_ctx, msg)) {
+    /* We may already be quiesced while handling a batch, see below. */
+    needs_quiesce = !vfu_ctx->quiesced && command_needs_quiesce(vfu_ctx, msg);
+
+    /*
+     * Offloaded requests must have completed before the device quiesces, and
+     * before any request that might depend on them.
+     */
+    if (needs_quiesce || !(is_fast_path_request(msg) ||
+                           is_offloaded_request(vfu_ctx, msg))) {
+        worker_drain(vfu_ctx);
+    }
+
+    if (needs_quiesce) {
         vfu_log(vfu_ctx, LOG_DEBUG, "quiescing device");
         vfu_ctx->in_cb = CB_QUIESCE;
         ret = vfu_ctx->quiesce(vfu_ctx);
@@ -1640,6 +2020,68 @@ err:
     return ERROR_INT(ENOMSG);
 }
 
+static bool
+is_dma_request(const struct vfio_user_header *hdr)
+{
+    return hdr->cmd == VFIO_USER_DMA_MAP || hdr->cmd == VFIO_USER_DMA_UNMAP;
+}
+
+/*
+ * Called while the device is quiesced for a DMA map or unmap. Memory
+ * reconfiguration typically comes as a burst of such requests, so handle
+ * those the client has already queued before unquiescing: the whole burst
+ * then costs a single quiesce cycle, with the dma_register/dma_unregister
+ * callbacks all called within it. Stops when no request is immediately
+ * available, or when the next one isn't a DMA map or unmap: that one is left
+ * for once the device is unquiesced, so the transport must be able to peek at
+ * it.
+ *
+ * Returns the number of requests handled, or -1 on error with errno set.
+ */
+static int
+handle_dma_batch(vfu_ctx_t *vfu_ctx)
+{
+    struct vfio_user_header hdr;
+    vfu_msg_t *msg;
+    int nr = 0;
+    int ret;
+
+    assert(vfu_ctx->quiesced);
+
+    if (vfu_ctx->tran->peek_request_header == NULL) {
+        return 0;
+    }
+
+    /* Failures to peek show up again once vfu_run_ctx() gets the request. */
+    while (nr < DMA_BATCH_MAX &&
+           vfu_ctx->tran->peek_request_header(vfu_ctx, &hdr) == 0 &&
+           is_dma_request(&hdr)) {
+        ret = get_request(vfu_ctx, &msg);
+        if (ret < 0) {
+            if (errno == ENOMSG) {
+                nr++;
+                continue;
+            }
+            return errno == EAGAIN ? nr : -1;
+        }
+
+        ret = handle_request(vfu_ctx, msg);
+        free_msg(vfu_ctx, msg);
+        nr++;
+
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (nr > 0) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "handled %d queued requests while "
+                "quiesced", nr);
+    }
+
+    return nr;
+}
+
 EXPORT int
 vfu_run_ctx(vfu_ctx_t *vfu_ctx)
 {
@@ -1656,6 +2098,10 @@ vfu_run_ctx(vfu_ctx_t *vfu_ctx)
 
     blocking = !(vfu_ctx->flags & LIBVFIO_USER_FLAG_ATTACH_NB);
 
+    /*
+     * A non-blocking context also handles requests received along with the
+     * first one, rather than have the caller poll for them.
+     */
     do {
         vfu_msg_t *msg;
 
@@ -1666,6 +2112,15 @@ vfu_run_ctx(vfu_ctx_t *vfu_ctx)
         err = get_request(vfu_ctx, &msg);
 
         if (err == 0) {
+            bool dma = is_dma_request(&msg->hdr);
+
+            /* Requests that needed the device to quiesce aren't offloaded. */
+            if (!vfu_ctx->quiesced && is_offloaded_request(vfu_ctx, msg)) {
+                worker_enqueue(vfu_ctx, msg);
+                reqs_processed++;
+                continue;
+            }
+
             err = handle_request(vfu_ctx, msg);
             free_msg(vfu_ctx, msg);
             reqs_processed++;
@@ -1675,6 +2130,15 @@ vfu_run_ctx(vfu_ctx_t *vfu_ctx)
              * be called at all.
              */
             if (vfu_ctx->quiesced) {
+                if (err == 0 && dma) {
+                    int ret = handle_dma_batch(vfu_ctx);
+
+                    if (ret < 0) {
+                        err = ret;
+                    } else {
+                        reqs_processed += ret;
+                    }
+                }
 		    // FIXME?
                 vfu_log(vfu_ctx, LOG_DEBUG, "device unquiesced");
                 vfu_ctx->quiesced = false;
@@ -1691,7 +2155,7 @@ vfu_run_ctx(vfu_ctx_t *vfu_ctx)
                 break;
             }
         }
-    } while (err == 0 && blocking);
+    } while (err == 0 && (blocking || tran_has_buffered_request(vfu_ctx)));
 
     return err == 0 ? reqs_processed : err;
 }
@@ -1780,6 +2244,8 @@ vfu_realize_ctx(vfu_ctx_t *vfu_ctx)
         vfu_ctx->pci.config_space->hdr.sts.cl = 0x1;
     }
 
+    cap_map_build(vfu_ctx);
+
     vfu_ctx->realized = true;
 
     return 0;
@@ -1812,9 +2278,15 @@ vfu_reset_ctx_quiesced(vfu_ctx_t *vfu_ctx)
         irqs_reset(vfu_ctx);
     }
 
+    dma_xfer_fail_all(vfu_ctx, ENOTCONN);
+
+    ioeventfd_dispatch_detach(vfu_ctx);
+
     if (vfu_ctx->tran->detach != NULL) {
         vfu_ctx->tran->detach(vfu_ctx);
     }
+
+    __atomic_store_n(&vfu_ctx->dma_conn_err, 0, __ATOMIC_RELAXED);
 }
 
 static int
@@ -1822,6 +2294,8 @@ vfu_reset_ctx(vfu_ctx_t *vfu_ctx, int reason)
 {
     vfu_log(vfu_ctx, LOG_INFO, "%s: %s", __func__,  strerror(reason));
 
+    worker_drain(vfu_ctx);
+
     if (vfu_ctx->quiesce != NULL
         && vfu_ctx->pending.state == VFU_CTX_PENDING_NONE) {
         vfu_ctx->in_cb = CB_QUIESCE;
@@ -1840,6 +2314,49 @@ vfu_reset_ctx(vfu_ctx_t *vfu_ctx, int reason)
     return 0;
 }
 
+/*
+ * Allocates @nr DMA channels. There's one per command socket, so more than one
+ * is only needed after vfu_setup_cmd_sockets().
+ */
+static struct dma_chan *
+dma_chans_alloc(size_t nr)
+{
+    struct dma_chan *chans;
+    size_t i;
+
+    chans = calloc(nr, sizeof(*chans));
+    if (chans == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < nr; i++) {
+        struct dma_chan *chan = &chans[i];
+
+        chan->index = i;
+        chan->msg_id = 1;
+        LIST_INIT(&chan->xfers);
+        pthread_mutex_init(&chan->lock, NULL);
+        pthread_mutex_init(&chan->send_lock, NULL);
+        pthread_cond_init(&chan->cond, NULL);
+    }
+
+    return chans;
+}
+
+static void
+dma_chans_free(struct dma_chan *chans, size_t nr)
+{
+    size_t i;
+
+    for (i = 0; i < nr; i++) {
+        assert(LIST_EMPTY(&chans[i].xfers));
+        pthread_mutex_destroy(&chans[i].lock);
+        pthread_mutex_destroy(&chans[i].send_lock);
+        pthread_cond_destroy(&chans[i].cond);
+    }
+    free(chans);
+}
+
 EXPORT void
 vfu_destroy_ctx(vfu_ctx_t *vfu_ctx)
 {
@@ -1847,6 +2364,10 @@ vfu_destroy_ctx(vfu_ctx_t *vfu_ctx)
         return;
     }
 
+    if (vfu_ctx->reactor != NULL) {
+        vfu_reactor_remove_ctx(vfu_ctx->reactor, vfu_ctx);
+    }
+
     vfu_ctx->quiesce = NULL;
     if (vfu_reset_ctx(vfu_ctx, ESHUTDOWN) < 0) {
         vfu_log(vfu_ctx, LOG_WARNING, "failed to reset context: %m");
@@ -1861,11 +2382,19 @@ vfu_destroy_ctx(vfu_ctx_t *vfu_ctx)
     if (vfu_ctx->dma != NULL) {
         dma_controller_destroy(vfu_ctx->dma);
     }
+    ioeventfd_dispatch_fini(vfu_ctx);
     free_sparse_mmap_areas(vfu_ctx);
     free_regions(vfu_ctx);
     free(vfu_ctx->migration);
-    free(vfu_ctx->irqs);
+    irqs_free(vfu_ctx);
+    msix_free(vfu_ctx);
+    config_events_free(vfu_ctx);
     free(vfu_ctx->uuid);
+    dma_chans_free(vfu_ctx->dma_chans, vfu_ctx->nr_dma_chans);
+    if (vfu_ctx->cmd_socket_key_created) {
+        pthread_key_delete(vfu_ctx->cmd_socket_key);
+    }
+    pthread_mutex_destroy(&vfu_ctx->reply_lock);
     free(vfu_ctx);
 }
 
@@ -1885,19 +2414,24 @@ vfu_create_ctx(vfu_trans_t trans, const char *path, int flags, void *pvt,
     int err = 0;
     size_t i;
 
-    if ((flags & ~(LIBVFIO_USER_FLAG_ATTACH_NB)) != 0) {
+    if ((flags & ~(LIBVFIO_USER_FLAG_ATTACH_NB |
+                   LIBVFIO_USER_FLAG_DMA_MAP_NO_QUIESCE |
+                   LIBVFIO_USER_FLAG_POSTED_WRITES)) != 0) {
         return ERROR_PTR(EINVAL);
     }
 
+    switch (trans) {
+    case VFU_TRANS_SOCK:
 #ifdef WITH_TRAN_PIPE
-    if (trans != VFU_TRANS_SOCK && trans != VFU_TRANS_PIPE) {
-        return ERROR_PTR(ENOTSUP);
-    }
-#else
-    if (trans != VFU_TRANS_SOCK) {
+    case VFU_TRANS_PIPE:
+#endif
+#ifdef WITH_TRAN_URING
+    case VFU_TRANS_SOCK_URING:
+#endif
+        break;
+    default:
         return ERROR_PTR(ENOTSUP);
     }
-#endif
 
     if (dev_type != VFU_DEV_TYPE_PCI) {
         return ERROR_PTR(ENOTSUP);
@@ -1909,18 +2443,37 @@ vfu_create_ctx(vfu_trans_t trans, const char *path, int flags, void *pvt,
     }
 
     vfu_ctx->dev_type = dev_type;
-    if (trans == VFU_TRANS_SOCK) {
-        vfu_ctx->tran = &tran_sock_ops;
-    } else {
+    switch (trans) {
 #ifdef WITH_TRAN_PIPE
+    case VFU_TRANS_PIPE:
         vfu_ctx->tran = &tran_pipe_ops;
+        break;
+#endif
+#ifdef WITH_TRAN_URING
+    case VFU_TRANS_SOCK_URING:
+        vfu_ctx->tran = &tran_sock_uring_ops;
+        break;
 #endif
+    default:
+        vfu_ctx->tran = &tran_sock_ops;
+        break;
     }
     vfu_ctx->tran_data = NULL;
     vfu_ctx->pvt = pvt;
     vfu_ctx->flags = flags;
     vfu_ctx->log_level = LOG_ERR;
     vfu_ctx->pci_cap_exp_off = -1;
+    vfu_ctx->dma_xfer_window = 1;
+    vfu_ctx->max_cmd_sockets = 1;
+    vfu_ctx->ioeventfd_epoll_fd = -1;
+    vfu_ctx->ioeventfd_poll_fd = -1;
+    pthread_mutex_init(&vfu_ctx->reply_lock, NULL);
+
+    vfu_ctx->dma_chans = dma_chans_alloc(1);
+    if (vfu_ctx->dma_chans == NULL) {
+        goto err_out;
+    }
+    vfu_ctx->nr_dma_chans = 1;
 
     vfu_ctx->uuid = strdup(path);
     if (vfu_ctx->uuid == NULL) {
@@ -1940,7 +2493,6 @@ vfu_create_ctx(vfu_trans_t trans, const char *path, int flags, void *pvt,
 
     for (i = 0; i < vfu_ctx->nr_regions; i++) {
         vfu_ctx->reg_info[i].fd = -1;
-        LIST_INIT(&vfu_ctx->reg_info[i].subregions);
     }
 
     if (vfu_setup_device_nr_irqs(vfu_ctx, VFU_DEV_ERR_IRQ, 1) == -1) {
@@ -2205,10 +2757,177 @@ vfu_setup_region(vfu_ctx_t *vfu_ctx, int region_idx, size_t size,
 err:
     ret = errno;
     free(reg->mmap_areas);
+    free(reg->ranges);
     memset(reg, 0, sizeof(*reg));
     return ERROR_INT(ret);
 }
 
+/*
+ * Adds @new to the ranges of region @region_idx, keeping them sorted.
+ */
+static int
+region_range_add(vfu_ctx_t *vfu_ctx, int region_idx, struct region_range *new)
+{
+    struct region_range *ranges;
+    vfu_reg_info_t *reg;
+    size_t i;
+
+    if (region_idx < VFU_PCI_DEV_BAR0_REGION_IDX ||
+        region_idx >= VFU_PCI_DEV_NUM_REGIONS ||
+        region_idx == VFU_PCI_DEV_CFG_REGION_IDX) {
+        vfu_log(vfu_ctx, LOG_ERR, "invalid region index %d", region_idx);
+        return ERROR_INT(EINVAL);
+    }
+
+    reg = &vfu_ctx->reg_info[region_idx];
+
+    if (new->size == 0 || satadd_u64(new->offset, new->size) > reg->size) {
+        vfu_log(vfu_ctx, LOG_ERR, "invalid range %#llx-%#llx of region %d",
+                (ull_t)new->offset, (ull_t)(new->offset + new->size),
+                region_idx);
+        return ERROR_INT(EINVAL);
+    }
+
+    /* Find the insertion point. */
+    for (i = 0; i < reg->nr_ranges; i++) {
+        if (reg->ranges[i].offset >= new->offset) {
+            break;
+        }
+    }
+
+    if ((i > 0 && reg->ranges[i - 1].offset + reg->ranges[i - 1].size >
+                  new->offset) ||
+        (i < reg->nr_ranges &&
+         reg->ranges[i].offset < new->offset + new->size)) {
+        vfu_log(vfu_ctx, LOG_ERR, "range %#llx-%#llx of region %d overlaps",
+                (ull_t)new->offset, (ull_t)(new->offset + new->size),
+                region_idx);
+        return ERROR_INT(EEXIST);
+    }
+
+    ranges = realloc(reg->ranges, (reg->nr_ranges + 1) * sizeof(*ranges));
+    if (ranges == NULL) {
+        return ERROR_INT(ENOMEM);
+    }
+
+    memmove(&ranges[i + 1], &ranges[i],
+            (reg->nr_ranges - i) * sizeof(*ranges));
+    ranges[i] = *new;
+
+    reg->ranges = ranges;
+    reg->nr_ranges++;
+    return 0;
+}
+
+/*
+ * Removes the range of region @region_idx starting at @offset, if any.
+ */
+void
+region_range_remove(vfu_ctx_t *vfu_ctx, int region_idx, uint64_t offset)
+{
+    vfu_reg_info_t *reg = &vfu_ctx->reg_info[region_idx];
+    size_t i;
+
+    for (i = 0; i < reg->nr_ranges; i++) {
+        if (reg->ranges[i].offset == offset) {
+            memmove(&reg->ranges[i], &reg->ranges[i + 1],
+                    (reg->nr_ranges - i - 1) * sizeof(*reg->ranges));
+            reg->nr_ranges--;
+            return;
+        }
+    }
+}
+
+EXPORT int
+vfu_setup_region_range(vfu_ctx_t *vfu_ctx, int region_idx, uint64_t offset,
+                       uint64_t size, uint32_t access_sizes,
+                       vfu_region_range_access_cb_t *range_access, void *arg)
+{
+    struct region_range range = {
+        .offset = offset,
+        .size = size,
+        .access_sizes = access_sizes,
+        .cb = range_access,
+        .arg = arg,
+    };
+
+    assert(vfu_ctx != NULL);
+
+    if (range_access == NULL || (access_sizes & ~(1 | 2 | 4 | 8)) != 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "invalid range arguments");
+        return ERROR_INT(EINVAL);
+    }
+
+    return region_range_add(vfu_ctx, region_idx, &range);
+}
+
+EXPORT int
+vfu_setup_region_shadow(vfu_ctx_t *vfu_ctx, int region_idx, uint64_t offset,
+                        uint64_t size, void *shadow, int flags)
+{
+    struct region_range range = {
+        .offset = offset,
+        .size = size,
+        .shadow = shadow,
+    };
+    struct iovec *mmap_areas;
+    vfu_reg_info_t *reg;
+    int i;
+
+    assert(vfu_ctx != NULL);
+
+    if (shadow == NULL || (flags & ~VFU_REGION_SHADOW_FLAG_MMAP) != 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "invalid shadow arguments");
+        return ERROR_INT(EINVAL);
+    }
+
+    if (!(flags & VFU_REGION_SHADOW_FLAG_MMAP)) {
+        return region_range_add(vfu_ctx, region_idx, &range);
+    }
+
+    if (region_idx < VFU_PCI_DEV_BAR0_REGION_IDX ||
+        region_idx >= VFU_PCI_DEV_NUM_REGIONS) {
+        return ERROR_INT(EINVAL);
+    }
+
+    reg = &vfu_ctx->reg_info[region_idx];
+
+    if (reg->fd == -1 || !PAGE_ALIGNED(offset) || !PAGE_ALIGNED(size)) {
+        vfu_log(vfu_ctx, LOG_ERR, "shadow range %#llx-%#llx of region %d "
+                "cannot be mapped", (ull_t)offset, (ull_t)(offset + size),
+                region_idx);
+        return ERROR_INT(EINVAL);
+    }
+
+    for (i = 0; i < reg->nr_mmap_areas; i++) {
+        struct iovec *iov = &reg->mmap_areas[i];
+
+        if ((uintptr_t)iov->iov_base < offset + size &&
+            (uintptr_t)iov_end(iov) > offset) {
+            vfu_log(vfu_ctx, LOG_ERR, "shadow range %#llx-%#llx of region %d "
+                    "overlaps mmap area", (ull_t)offset,
+                    (ull_t)(offset + size), region_idx);
+            return ERROR_INT(EEXIST);
+        }
+    }
+
+    mmap_areas = realloc(reg->mmap_areas,
+                         (reg->nr_mmap_areas + 1) * sizeof(*mmap_areas));
+    if (mmap_areas == NULL) {
+        return ERROR_INT(ENOMEM);
+    }
+    reg->mmap_areas = mmap_areas;
+
+    if (region_range_add(vfu_ctx, region_idx, &range) < 0) {
+        return -1;
+    }
+
+    mmap_areas[reg->nr_mmap_areas].iov_base = (void *)(uintptr_t)offset;
+    mmap_areas[reg->nr_mmap_areas].iov_len = size;
+    reg->nr_mmap_areas++;
+    return 0;
+}
+
 EXPORT int
 vfu_setup_device_reset_cb(vfu_ctx_t *vfu_ctx, vfu_reset_cb_t *reset)
 {
@@ -2332,6 +3051,83 @@ vfu_addr_to_sgl(vfu_ctx_t *vfu_ctx, vfu_dma_addr_t dma_addr,
     return dma_addr_to_sgl(vfu_ctx->dma, dma_addr, len, sgl, max_nr_sgs, prot);
 }
 
+EXPORT int
+vfu_setup_io_ctx(vfu_ctx_t *vfu_ctx, vfu_io_ctx_quiesce_cb_t *quiesce,
+                 void *arg)
+{
+    assert(vfu_ctx != NULL);
+
+    if (quiesce == NULL || vfu_ctx->realized) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (vfu_ctx->nr_io_ctxs == VFU_MAX_IO_CTXS) {
+        return ERROR_INT(ENOSPC);
+    }
+
+    vfu_ctx->io_ctxs[vfu_ctx->nr_io_ctxs].quiesce = quiesce;
+    vfu_ctx->io_ctxs[vfu_ctx->nr_io_ctxs].arg = arg;
+
+    return vfu_ctx->nr_io_ctxs++;
+}
+
+EXPORT int
+vfu_io_ctx_addr_to_sgl(vfu_ctx_t *vfu_ctx, int io_ctx, vfu_dma_addr_t dma_addr,
+                       size_t len, dma_sg_t *sgl, size_t max_nr_sgs, int prot)
+{
+    dma_memory_region_t *region;
+    int ret;
+    int i;
+
+#ifdef DEBUG
+    assert(vfu_ctx != NULL);
+
+    if (unlikely(vfu_ctx->dma == NULL ||
+                 io_ctx < 0 || (size_t)io_ctx >= vfu_ctx->nr_io_ctxs)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    quiesce_check_allowed(vfu_ctx, __func__);
+#endif
+
+    ret = dma_addr_to_sgl(vfu_ctx->dma, dma_addr, len, sgl, max_nr_sgs, prot);
+
+    /*
+     * Mark the regions as used before checking they are still alive, see
+     * dma_region_quiesce_users().
+     */
+    for (i = 0; i < ret; i++) {
+        region = &vfu_ctx->dma->regions[sgl[i].region];
+        __atomic_fetch_or(&region->io_ctx_users, 1ULL << io_ctx,
+                          __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&region->dead, __ATOMIC_SEQ_CST)) {
+            return ERROR_INT(ENOENT);
+        }
+    }
+
+    return ret;
+}
+
+EXPORT void
+vfu_io_ctx_quiescent(vfu_ctx_t *vfu_ctx, int io_ctx)
+{
+    dma_controller_t *dma = vfu_ctx->dma;
+    int i;
+
+    assert(io_ctx >= 0 && (size_t)io_ctx < vfu_ctx->nr_io_ctxs);
+
+    if (dma == NULL) {
+        return;
+    }
+
+    for (i = 0; i < dma_nregions(dma); i++) {
+        __atomic_fetch_and(&dma->regions[i].io_ctx_users, ~(1ULL << io_ctx),
+                           __ATOMIC_RELEASE);
+        __atomic_fetch_and(&dma->regions[i].io_ctx_pending, ~(1ULL << io_ctx),
+                           __ATOMIC_RELEASE);
+    }
+}
+
 EXPORT int
 vfu_sgl_get(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, struct iovec *iov, size_t cnt,
             int flags UNUSED)
@@ -2376,27 +3172,22 @@ vfu_sgl_put(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl,
     return dma_sgl_put(vfu_ctx->dma, sgl, cnt);
 }
 
-static int
-vfu_dma_transfer(vfu_ctx_t *vfu_ctx, enum vfio_user_command cmd,
-                 dma_sg_t *sg, void *data)
+/*
+ * Message-based DMA for transports that don't support sending several
+ * requests at once: one synchronous round trip per chunk.
+ */
+static int
+vfu_dma_transfer_sync(vfu_ctx_t *vfu_ctx, enum vfio_user_command cmd,
+                      dma_sg_t *sg, void *data)
 {
     struct vfio_user_dma_region_access *dma_reply;
     struct vfio_user_dma_region_access *dma_req;
     struct vfio_user_dma_region_access dma;
-    static int msg_id = 1;
     size_t remaining;
     size_t count;
     size_t rlen;
     void *rbuf;
 
-    assert(cmd == VFIO_USER_DMA_READ || cmd == VFIO_USER_DMA_WRITE);
-    assert(vfu_ctx != NULL);
-    assert(sg != NULL);
-
-    if (cmd == VFIO_USER_DMA_WRITE && !sg->writeable) {
-        return ERROR_INT(EPERM);
-    }
-
     rlen = sizeof(struct vfio_user_dma_region_access) +
            MIN(sg->length, vfu_ctx->client_max_data_xfer_size);
 
@@ -2426,13 +3217,14 @@ vfu_dma_transfer(vfu_ctx_t *vfu_ctx, enum vfio_user_command cmd,
         if (cmd == VFIO_USER_DMA_WRITE) {
             memcpy(rbuf + sizeof(*dma_req), data + count, dma_req->count);
 
-            ret = vfu_ctx->tran->send_msg(vfu_ctx, msg_id++,
+            ret = vfu_ctx->tran->send_msg(vfu_ctx, vfu_ctx->dma_chans[0].msg_id++,
                                           VFIO_USER_DMA_WRITE, rbuf,
                                           dma_req->count + sizeof(*dma_req), NULL,
                                           dma_reply, sizeof(*dma_reply));
         } else {
-            ret = vfu_ctx->tran->send_msg(vfu_ctx, msg_id++, VFIO_USER_DMA_READ,
-                                          dma_req, sizeof(*dma_req), NULL, rbuf,
+            ret = vfu_ctx->tran->send_msg(vfu_ctx, vfu_ctx->dma_chans[0].msg_id++,
+                                          VFIO_USER_DMA_READ, dma_req,
+                                          sizeof(*dma_req), NULL, rbuf,
                                           dma_req->count + sizeof(*dma_reply));
         }
 
@@ -2473,6 +3265,539 @@ vfu_dma_transfer(vfu_ctx_t *vfu_ctx, enum vfio_user_command cmd,
     return 0;
 }
 
+/*
+ * Discard the remaining @len bytes of a reply payload on channel @chan.
+ */
+static int
+dma_xfer_drain_reply(vfu_ctx_t *vfu_ctx, size_t chan, size_t len)
+{
+    char buf[256];
+    struct iovec iov = { .iov_base = buf };
+
+    while (len > 0) {
+        iov.iov_len = MIN(len, sizeof(buf));
+        if (vfu_ctx->tran->recv_reply_data(vfu_ctx, chan, &iov, 1) < 0) {
+            return -1;
+        }
+        len -= iov.iov_len;
+    }
+    return 0;
+}
+
+/*
+ * Message-based DMA uses one DMA channel per client command socket, see
+ * vfu_setup_cmd_sockets(). Transfers in flight are kept on their channel's
+ * list, and replies are demultiplexed to them by message ID, so any number of
+ * threads can have transfers outstanding at the same time.
+ *
+ * chan->lock protects the transfer list, message ID allocation and the state
+ * of each transfer on the channel; functions below marked "Locked" must be
+ * called with it held. Only one thread at a time receives replies on a
+ * channel (chan->receiving): it drops the lock while waiting for the next
+ * reply header, and other threads waiting for their transfers sleep on
+ * chan->cond in the meantime. Requests are written to the socket under
+ * chan->send_lock only, so that a sender blocked on a full socket never keeps
+ * replies from being received. While a thread sends chunks of a transfer,
+ * xfer->busy keeps the transfer from being completed.
+ *
+ * Completion callbacks are called without any lock held: finished
+ * asynchronous transfers are collected on a local list and passed to
+ * dma_xfer_complete() once the lock has been dropped.
+ */
+
+/*
+ * Returns the DMA channel of the calling thread, see vfu_bind_cmd_socket().
+ */
+static struct dma_chan *
+dma_chan_get(vfu_ctx_t *vfu_ctx)
+{
+    uintptr_t index;
+    size_t nr;
+
+    if (!vfu_ctx->cmd_socket_key_created) {
+        return &vfu_ctx->dma_chans[0];
+    }
+
+    index = (uintptr_t)pthread_getspecific(vfu_ctx->cmd_socket_key);
+    nr = vfu_get_nr_cmd_sockets(vfu_ctx);
+    if (index == 0 || nr <= 1) {
+        return &vfu_ctx->dma_chans[0];
+    }
+
+    return &vfu_ctx->dma_chans[(index - 1) % nr];
+}
+
+/*
+ * Locked. Completes @xfer if it's done: it's removed from the list of
+ * transfers in flight and, if asynchronous, added to @done.
+ */
+static void
+dma_xfer_maybe_finish(struct dma_xfer *xfer, struct dma_xfer_list *done)
+{
+    if (xfer->finished || xfer->busy > 0 || xfer->acked != xfer->sent ||
+        (xfer->err == 0 && xfer->sent != xfer->nr_chunks)) {
+        return;
+    }
+
+    LIST_REMOVE(xfer, entry);
+    xfer->finished = true;
+
+    if (xfer->done != NULL) {
+        LIST_INSERT_HEAD(done, xfer, entry);
+    }
+
+    pthread_cond_broadcast(&xfer->chan->cond);
+}
+
+static void
+dma_xfer_complete(vfu_ctx_t *vfu_ctx, struct dma_xfer_list *done)
+{
+    struct dma_xfer *xfer;
+
+    while ((xfer = LIST_FIRST(done)) != NULL) {
+        LIST_REMOVE(xfer, entry);
+        xfer->done(vfu_ctx, xfer->arg, xfer->err);
+        free(xfer);
+    }
+}
+
+/*
+ * Locked. Fails all transfers in flight on @chan, abandoning their
+ * outstanding chunks.
+ */
+static void
+dma_xfer_fail_all_locked(struct dma_chan *chan, int err,
+                         struct dma_xfer_list *done)
+{
+    struct dma_xfer *xfer = LIST_FIRST(&chan->xfers);
+
+    while (xfer != NULL) {
+        struct dma_xfer *next = LIST_NEXT(xfer, entry);
+
+        if (xfer->err == 0) {
+            xfer->err = err;
+        }
+        xfer->acked = xfer->sent;
+        xfer->completed = 0;
+        dma_xfer_maybe_finish(xfer, done);
+        xfer = next;
+    }
+}
+
+static void
+dma_xfer_fail_all(vfu_ctx_t *vfu_ctx, int err)
+{
+    struct dma_xfer_list done = LIST_HEAD_INITIALIZER(done);
+    size_t i;
+
+    for (i = 0; i < vfu_ctx->nr_dma_chans; i++) {
+        struct dma_chan *chan = &vfu_ctx->dma_chans[i];
+
+        pthread_mutex_lock(&chan->lock);
+        dma_xfer_fail_all_locked(chan, err, &done);
+        pthread_mutex_unlock(&chan->lock);
+    }
+
+    dma_xfer_complete(vfu_ctx, &done);
+}
+
+/*
+ * Locked. Handles a failure to send or receive on @chan's socket: all
+ * transfers in flight on it fail. If the client went away, the error is
+ * latched for vfu_run_ctx() to reset the context, see get_request(): we may be
+ * on any device thread, which mustn't touch the connection itself.
+ */
+static void
+dma_xfer_conn_err(vfu_ctx_t *vfu_ctx, struct dma_chan *chan,
+                  struct dma_xfer_list *done)
+{
+    int expected = 0;
+    int err = errno;
+
+    if (err == ENOMSG || err == ECONNRESET) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "DMA transfer lost the client: %m");
+        __atomic_compare_exchange_n(&vfu_ctx->dma_conn_err, &expected, err,
+                                    false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        err = ENOTCONN;
+    }
+    dma_xfer_fail_all_locked(chan, err, done);
+}
+
+static void
+dma_xfer_chunk(struct dma_xfer *xfer, size_t chunk,
+               struct vfio_user_dma_region_access *dma)
+{
+    dma->addr = xfer->addr + chunk * xfer->chunk_size;
+    dma->count = MIN(xfer->length - chunk * xfer->chunk_size,
+                     xfer->chunk_size);
+}
+
+/*
+ * Locked. Sends chunk requests of @xfer until its window is full, dropping
+ * the lock while sending; the caller must hold a busy reference on @xfer.
+ * Payloads are sent directly from the caller's buffer. Once a chunk has failed
+ * no further requests are sent.
+ */
+static int
+dma_xfer_send(vfu_ctx_t *vfu_ctx, struct dma_xfer *xfer)
+{
+    struct dma_chan *chan = xfer->chan;
+    struct vfio_user_dma_region_access dma_req;
+    struct iovec iovecs[3];
+    size_t chunk;
+    int ret;
+
+    assert(xfer->busy > 0);
+
+    while (xfer->err == 0 && xfer->sent < xfer->nr_chunks &&
+           xfer->sent - xfer->acked < vfu_ctx->dma_xfer_window) {
+        chunk = xfer->sent++;
+        dma_xfer_chunk(xfer, chunk, &dma_req);
+
+        /* [0] is for the header. */
+        iovecs[1].iov_base = &dma_req;
+        iovecs[1].iov_len = sizeof(dma_req);
+        iovecs[2].iov_base = xfer->data + chunk * xfer->chunk_size;
+        iovecs[2].iov_len = dma_req.count;
+
+        pthread_mutex_unlock(&chan->lock);
+        pthread_mutex_lock(&chan->send_lock);
+        ret = vfu_ctx->tran->send_req(vfu_ctx, chan->index,
+                                      (uint16_t)(xfer->base_msg_id + chunk),
+                                      xfer->cmd, iovecs,
+                                      xfer->cmd == VFIO_USER_DMA_WRITE ? 3 : 2);
+        pthread_mutex_unlock(&chan->send_lock);
+        pthread_mutex_lock(&chan->lock);
+
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Locked. Looks up the transfer in flight on @chan the reply with @msg_id
+ * belongs to, and returns the chunk's index relative to xfer->acked in
+ * @chunkp.
+ */
+static struct dma_xfer *
+dma_xfer_find(struct dma_chan *chan, uint16_t msg_id, size_t *chunkp)
+{
+    struct dma_xfer *xfer;
+
+    LIST_FOREACH(xfer, &chan->xfers, entry) {
+        size_t chunk = (uint16_t)(msg_id -
+                                  (uint16_t)(xfer->base_msg_id + xfer->acked));
+
+        if (chunk < xfer->sent - xfer->acked &&
+            !(xfer->completed & (1ULL << chunk))) {
+            *chunkp = chunk;
+            return xfer;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Locked. Receives a single reply to a DMA read/write request on @chan and
+ * handles it:
+ * read data is received straight into the caller's buffer, further chunk
+ * requests of that transfer are sent, and the transfer is completed if this
+ * was its last outstanding chunk. The caller must make sure no other thread
+ * is receiving.
+ *
+ * Returns -1 only on transport errors, after failing all transfers in flight.
+ */
+static int
+dma_xfer_recv_reply(vfu_ctx_t *vfu_ctx, struct dma_chan *chan,
+                    struct dma_xfer_list *done)
+{
+    struct vfio_user_dma_region_access dma_reply;
+    struct vfio_user_dma_region_access dma_req;
+    struct vfio_user_header hdr;
+    struct dma_xfer *xfer;
+    struct iovec iovecs[2];
+    size_t chunk;
+    size_t len;
+    int ret;
+
+    assert(!chan->receiving);
+    chan->receiving = true;
+
+    pthread_mutex_unlock(&chan->lock);
+    ret = vfu_ctx->tran->recv_reply_hdr(vfu_ctx, chan->index, &hdr);
+    pthread_mutex_lock(&chan->lock);
+
+    if (ret < 0) {
+        goto conn_err;
+    }
+
+    len = hdr.msg_size - sizeof(hdr);
+
+    xfer = dma_xfer_find(chan, hdr.msg_id, &chunk);
+    if (xfer == NULL) {
+        vfu_log(vfu_ctx, LOG_ERR, "unexpected DMA reply msg_id %u",
+                hdr.msg_id);
+        pthread_mutex_unlock(&chan->lock);
+        ret = dma_xfer_drain_reply(vfu_ctx, chan->index, len);
+        pthread_mutex_lock(&chan->lock);
+        if (ret < 0) {
+            goto conn_err;
+        }
+        chan->receiving = false;
+        pthread_cond_broadcast(&chan->cond);
+        return 0;
+    }
+
+    xfer->completed |= 1ULL << chunk;
+    chunk += xfer->acked;
+    dma_xfer_chunk(xfer, chunk, &dma_req);
+
+    /*
+     * The rest of the reply is received unlocked too; xfer->busy keeps the
+     * transfer, and so its buffer, around meanwhile.
+     */
+    xfer->busy++;
+
+    if (hdr.flags & VFIO_USER_F_ERROR) {
+        if (xfer->err == 0) {
+            xfer->err = hdr.error_no;
+            if (xfer->err <= 0 || xfer->err > SERVER_MAX_ERROR_NO) {
+                xfer->err = EINVAL;
+            }
+        }
+    } else if (len != sizeof(dma_reply) +
+               (xfer->cmd == VFIO_USER_DMA_READ ? dma_req.count : 0)) {
+        vfu_log(vfu_ctx, LOG_ERR, "bad DMA reply size %zu", len);
+        xfer->err = xfer->err ? xfer->err : EINVAL;
+    } else {
+        len = 0;
+        iovecs[0].iov_base = &dma_reply;
+        iovecs[0].iov_len = sizeof(dma_reply);
+        iovecs[1].iov_base = xfer->data + chunk * xfer->chunk_size;
+        iovecs[1].iov_len = dma_req.count;
+
+        pthread_mutex_unlock(&chan->lock);
+        ret = vfu_ctx->tran->recv_reply_data(vfu_ctx, chan->index, iovecs,
+                                             xfer->cmd == VFIO_USER_DMA_READ ?
+                                             2 : 1);
+        pthread_mutex_lock(&chan->lock);
+        if (ret < 0) {
+            xfer->busy--;
+            goto conn_err;
+        }
+
+        if (dma_reply.addr != dma_req.addr ||
+            dma_reply.count != dma_req.count) {
+            vfu_log(vfu_ctx, LOG_ERR, "bad reply to DMA transfer: "
+                    "request:%#llx,%llu reply:%#llx,%llu",
+                    (ull_t)dma_req.addr,
+                    (ull_t)dma_req.count,
+                    (ull_t)dma_reply.addr,
+                    (ull_t)dma_reply.count);
+            xfer->err = xfer->err ? xfer->err : EINVAL;
+        }
+    }
+
+    pthread_mutex_unlock(&chan->lock);
+    ret = dma_xfer_drain_reply(vfu_ctx, chan->index, len);
+    pthread_mutex_lock(&chan->lock);
+    xfer->busy--;
+    if (ret < 0) {
+        goto conn_err;
+    }
+
+    while (xfer->completed & 1) {
+        xfer->completed >>= 1;
+        xfer->acked++;
+    }
+
+    /* Let others receive while we're sending. */
+    chan->receiving = false;
+    pthread_cond_broadcast(&chan->cond);
+
+    xfer->busy++;
+    ret = dma_xfer_send(vfu_ctx, xfer);
+    xfer->busy--;
+
+    if (ret < 0) {
+        dma_xfer_conn_err(vfu_ctx, chan, done);
+        return -1;
+    }
+
+    dma_xfer_maybe_finish(xfer, done);
+    return 0;
+
+conn_err:
+    chan->receiving = false;
+    pthread_cond_broadcast(&chan->cond);
+    dma_xfer_conn_err(vfu_ctx, chan, done);
+    return -1;
+}
+
+/*
+ * Locked. Transfers larger than the client's max_data_xfer_size are split into
+ * chunks, and up to vfu_ctx->dma_xfer_window chunk requests are kept in
+ * flight. Chunk i uses message ID (base_msg_id + i), which is how replies are
+ * matched back to their chunk; replies may arrive in any order.
+ *
+ * After the first failed chunk no further requests are sent, but replies to
+ * those still in flight are consumed so they don't confuse later transfers.
+ */
+static void
+dma_xfer_start(vfu_ctx_t *vfu_ctx, struct dma_chan *chan,
+               struct dma_xfer *xfer, enum vfio_user_command cmd,
+               dma_sg_t *sg, void *data, struct dma_xfer_list *done)
+{
+    int ret;
+
+    xfer->chan = chan;
+    xfer->cmd = cmd;
+    xfer->addr = (uintptr_t)sg->dma_addr + sg->offset;
+    xfer->data = data;
+    xfer->length = sg->length;
+    xfer->chunk_size = vfu_ctx->client_max_data_xfer_size;
+    xfer->nr_chunks = (sg->length + xfer->chunk_size - 1) / xfer->chunk_size;
+    xfer->base_msg_id = chan->msg_id;
+    chan->msg_id += xfer->nr_chunks;
+
+    LIST_INSERT_HEAD(&chan->xfers, xfer, entry);
+
+    xfer->busy++;
+    ret = dma_xfer_send(vfu_ctx, xfer);
+    xfer->busy--;
+
+    if (ret < 0) {
+        dma_xfer_conn_err(vfu_ctx, chan, done);
+        return;
+    }
+
+    dma_xfer_maybe_finish(xfer, done);
+}
+
+static int
+vfu_dma_transfer(vfu_ctx_t *vfu_ctx, enum vfio_user_command cmd,
+                 dma_sg_t *sg, void *data)
+{
+    struct dma_xfer_list done = LIST_HEAD_INITIALIZER(done);
+    struct dma_xfer xfer = { 0 };
+    struct dma_chan *chan;
+
+    assert(cmd == VFIO_USER_DMA_READ || cmd == VFIO_USER_DMA_WRITE);
+    assert(vfu_ctx != NULL);
+    assert(sg != NULL);
+
+    if (cmd == VFIO_USER_DMA_WRITE && !sg->writeable) {
+        return ERROR_INT(EPERM);
+    }
+
+    /* The client is gone, and vfu_run_ctx() has yet to notice. */
+    if (__atomic_load_n(&vfu_ctx->dma_conn_err, __ATOMIC_RELAXED) != 0) {
+        return ERROR_INT(ENOTCONN);
+    }
+
+    if (vfu_ctx->tran->send_req == NULL) {
+        int ret;
+
+        /* Replies can't be demultiplexed, so one transfer at a time. */
+        pthread_mutex_lock(&vfu_ctx->dma_chans[0].send_lock);
+        ret = vfu_dma_transfer_sync(vfu_ctx, cmd, sg, data);
+        pthread_mutex_unlock(&vfu_ctx->dma_chans[0].send_lock);
+        return ret;
+    }
+
+    chan = dma_chan_get(vfu_ctx);
+    pthread_mutex_lock(&chan->lock);
+
+    /*
+     * Replies to other threads' or asynchronous transfers may arrive while
+     * waiting for ours; they're handled as they come in.
+     */
+    dma_xfer_start(vfu_ctx, chan, &xfer, cmd, sg, data, &done);
+    while (!xfer.finished) {
+        if (chan->receiving) {
+            pthread_cond_wait(&chan->cond, &chan->lock);
+        } else {
+            dma_xfer_recv_reply(vfu_ctx, chan, &done);
+        }
+    }
+
+    pthread_mutex_unlock(&chan->lock);
+
+    dma_xfer_complete(vfu_ctx, &done);
+
+    if (xfer.err != 0) {
+        return ERROR_INT(xfer.err);
+    }
+
+    return 0;
+}
+
+static int
+vfu_dma_transfer_async(vfu_ctx_t *vfu_ctx, enum vfio_user_command cmd,
+                       dma_sg_t *sg, void *data, vfu_dma_done_cb_t *done_cb,
+                       void *arg)
+{
+    struct dma_xfer_list done = LIST_HEAD_INITIALIZER(done);
+    struct dma_chan *chan;
+    struct dma_xfer *xfer;
+
+    assert(cmd == VFIO_USER_DMA_READ || cmd == VFIO_USER_DMA_WRITE);
+    assert(vfu_ctx != NULL);
+    assert(sg != NULL);
+
+    if (done_cb == NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (cmd == VFIO_USER_DMA_WRITE && !sg->writeable) {
+        return ERROR_INT(EPERM);
+    }
+
+    /* The client is gone, and vfu_run_ctx() has yet to notice. */
+    if (__atomic_load_n(&vfu_ctx->dma_conn_err, __ATOMIC_RELAXED) != 0) {
+        return ERROR_INT(ENOTCONN);
+    }
+
+    if (vfu_get_dma_poll_fd(vfu_ctx) < 0) {
+        return -1;
+    }
+
+    xfer = calloc(1, sizeof(*xfer));
+    if (xfer == NULL) {
+        return -1;
+    }
+
+    xfer->done = done_cb;
+    xfer->arg = arg;
+
+    chan = dma_chan_get(vfu_ctx);
+    pthread_mutex_lock(&chan->lock);
+    dma_xfer_start(vfu_ctx, chan, xfer, cmd, sg, data, &done);
+    pthread_mutex_unlock(&chan->lock);
+
+    /* On failure, the callback is called here already. */
+    dma_xfer_complete(vfu_ctx, &done);
+
+    return 0;
+}
+
+EXPORT int
+vfu_setup_dma_transfer_window(vfu_ctx_t *vfu_ctx, size_t window)
+{
+    assert(vfu_ctx != NULL);
+
+    if (window == 0 || window > VFU_DMA_TRANSFER_MAX_WINDOW) {
+        return ERROR_INT(EINVAL);
+    }
+
+    vfu_ctx->dma_xfer_window = window;
+    return 0;
+}
+
 EXPORT int
 vfu_sgl_read(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, size_t cnt, void *data)
 {
@@ -2499,6 +3824,166 @@ vfu_sgl_write(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, size_t cnt, void *data)
     return vfu_dma_transfer(vfu_ctx, VFIO_USER_DMA_WRITE, sgl, data);
 }
 
+EXPORT int
+vfu_sgl_read_async(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, size_t cnt, void *data,
+                   vfu_dma_done_cb_t *done, void *arg)
+{
+    assert(vfu_ctx->pending.state == VFU_CTX_PENDING_NONE);
+
+    /* Not currently implemented. */
+    if (cnt != 1) {
+        return ERROR_INT(ENOTSUP);
+    }
+
+    return vfu_dma_transfer_async(vfu_ctx, VFIO_USER_DMA_READ, sgl, data,
+                                  done, arg);
+}
+
+EXPORT int
+vfu_sgl_write_async(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, size_t cnt, void *data,
+                    vfu_dma_done_cb_t *done, void *arg)
+{
+    assert(vfu_ctx->pending.state == VFU_CTX_PENDING_NONE);
+
+    /* Not currently implemented. */
+    if (cnt != 1) {
+        return ERROR_INT(ENOTSUP);
+    }
+
+    return vfu_dma_transfer_async(vfu_ctx, VFIO_USER_DMA_WRITE, sgl, data,
+                                  done, arg);
+}
+
+EXPORT int
+vfu_get_dma_poll_fd(vfu_ctx_t *vfu_ctx)
+{
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->tran->send_req == NULL ||
+        vfu_ctx->tran->get_cmd_poll_fd == NULL) {
+        return ERROR_INT(ENOTSUP);
+    }
+
+    return vfu_ctx->tran->get_cmd_poll_fd(vfu_ctx,
+                                          dma_chan_get(vfu_ctx)->index);
+}
+
+EXPORT int
+vfu_setup_cmd_sockets(vfu_ctx_t *vfu_ctx, size_t nr)
+{
+    struct dma_chan *chans;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+
+    if (nr == 0 || nr > VFU_MAX_CMD_SOCKETS) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (nr > 1 && !vfu_ctx->cmd_socket_key_created) {
+        ret = pthread_key_create(&vfu_ctx->cmd_socket_key, NULL);
+        if (ret != 0) {
+            return ERROR_INT(ret);
+        }
+        vfu_ctx->cmd_socket_key_created = true;
+    }
+
+    /* Not attached yet, so no transfers are in flight on the old channels. */
+    if (nr > vfu_ctx->nr_dma_chans) {
+        chans = dma_chans_alloc(nr);
+        if (chans == NULL) {
+            return ERROR_INT(ENOMEM);
+        }
+        dma_chans_free(vfu_ctx->dma_chans, vfu_ctx->nr_dma_chans);
+        vfu_ctx->dma_chans = chans;
+        vfu_ctx->nr_dma_chans = nr;
+    }
+
+    vfu_ctx->max_cmd_sockets = nr;
+    return 0;
+}
+
+EXPORT size_t
+vfu_get_nr_cmd_sockets(vfu_ctx_t *vfu_ctx)
+{
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->tran->get_nr_cmd_sockets == NULL) {
+        return 0;
+    }
+
+    return vfu_ctx->tran->get_nr_cmd_sockets(vfu_ctx);
+}
+
+EXPORT int
+vfu_bind_cmd_socket(vfu_ctx_t *vfu_ctx, size_t index)
+{
+    int ret;
+
+    assert(vfu_ctx != NULL);
+
+    if (index >= vfu_ctx->max_cmd_sockets) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (!vfu_ctx->cmd_socket_key_created) {
+        /* Only a single socket, nothing to bind. */
+        return 0;
+    }
+
+    ret = pthread_setspecific(vfu_ctx->cmd_socket_key,
+                              (void *)(uintptr_t)(index + 1));
+    if (ret != 0) {
+        return ERROR_INT(ret);
+    }
+
+    return 0;
+}
+
+EXPORT int
+vfu_process_dma_replies(vfu_ctx_t *vfu_ctx)
+{
+    struct dma_xfer_list done = LIST_HEAD_INITIALIZER(done);
+    struct pollfd pfd = { .events = POLLIN };
+    struct dma_chan *chan;
+    int ret = 0;
+    int err = 0;
+
+    assert(vfu_ctx != NULL);
+
+    pfd.fd = vfu_get_dma_poll_fd(vfu_ctx);
+    if (pfd.fd < 0) {
+        return -1;
+    }
+
+    chan = dma_chan_get(vfu_ctx);
+    pthread_mutex_lock(&chan->lock);
+
+    /* If another thread is receiving, it will handle any replies. */
+    while (!LIST_EMPTY(&chan->xfers) && !chan->receiving) {
+        ret = poll(&pfd, 1, 0);
+        if (ret <= 0) {
+            break;
+        }
+
+        ret = dma_xfer_recv_reply(vfu_ctx, chan, &done);
+        if (ret < 0) {
+            break;
+        }
+    }
+    err = errno;
+
+    pthread_mutex_unlock(&chan->lock);
+
+    dma_xfer_complete(vfu_ctx, &done);
+
+    if (ret < 0) {
+        return ERROR_INT(err);
+    }
+
+    return 0;
+}
+
 EXPORT bool
 vfu_sg_is_mappable(vfu_ctx_t *vfu_ctx, dma_sg_t *sg)
 {
@@ -2508,12 +3993,15 @@ vfu_sg_is_mappable(vfu_ctx_t *vfu_ctx, dma_sg_t *sg)
 EXPORT int
 vfu_device_quiesced(vfu_ctx_t *vfu_ctx, int quiesce_errno)
 {
+    bool detached = false;
+    bool dma = false;
     int ret;
 
     assert(vfu_ctx != NULL);
 
     if (vfu_ctx->quiesce == NULL
-        || vfu_ctx->pending.state == VFU_CTX_PENDING_NONE) {
+        || vfu_ctx->pending.state == VFU_CTX_PENDING_NONE
+        || vfu_ctx->pending.state == VFU_CTX_PENDING_DMA_BATCH) {
         vfu_log(vfu_ctx, LOG_DEBUG,
                 "invalid call to quiesce callback, state=%d",
                 vfu_ctx->pending.state);
@@ -2526,11 +4014,13 @@ vfu_device_quiesced(vfu_ctx_t *vfu_ctx, int quiesce_errno)
     if (quiesce_errno == 0) {
         switch (vfu_ctx->pending.state) {
         case VFU_CTX_PENDING_MSG:
+            dma = is_dma_request(&vfu_ctx->pending.msg->hdr);
             ret = handle_request(vfu_ctx, vfu_ctx->pending.msg);
             free_msg(vfu_ctx, vfu_ctx->pending.msg);
             break;
         case VFU_CTX_PENDING_CTX_RESET:
             vfu_reset_ctx_quiesced(vfu_ctx);
+            detached = true;
             ret = 0;
             break;
         default:
@@ -2542,11 +4032,28 @@ vfu_device_quiesced(vfu_ctx_t *vfu_ctx, int quiesce_errno)
     }
 
     vfu_ctx->pending.msg = NULL;
+
+    /*
+     * We may be called from a device thread: the context stays pending, so
+     * that vfu_run_ctx() keeps returning EBUSY, until we're done reading
+     * requests for the batch.
+     */
+    if (ret == 0 && dma) {
+        vfu_ctx->pending.state = VFU_CTX_PENDING_DMA_BATCH;
+        if (handle_dma_batch(vfu_ctx) < 0) {
+            ret = -1;
+        }
+    }
+
     vfu_ctx->pending.state = VFU_CTX_PENDING_NONE;
 
     vfu_log(vfu_ctx, LOG_DEBUG, "device unquiesced");
     vfu_ctx->quiesced = false;
 
+    if (vfu_ctx->reactor != NULL) {
+        reactor_ctx_resume(vfu_ctx, detached);
+    }
+
     return ret;
 }
 
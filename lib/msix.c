@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2023 Rivos Inc. All rights reserved.
+ *
+ * Authors: Mattias Nissler <mnissler@rivosinc.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include <linux/pci_regs.h>
+
+#include "common.h"
+#include "libvfio-user.h"
+#include "msix.h"
+#include "pci_caps.h"
+#include "private.h"
+
+#define MSIX_CTRL_DWORD (PCI_MSIX_ENTRY_VECTOR_CTRL / sizeof(uint32_t))
+#define MSIX_ENTRY_DWORDS (PCI_MSIX_ENTRY_SIZE / sizeof(uint32_t))
+#define MSIX_PBA_BITS (sizeof(uint64_t) * CHAR_BIT)
+
+static bool
+msix_vector_masked(struct msix *msix, uint32_t vector)
+{
+    uint32_t ctrl;
+
+    if (!__atomic_load_n(&msix->enabled, __ATOMIC_SEQ_CST)) {
+        return false;
+    }
+    if (__atomic_load_n(&msix->masked, __ATOMIC_SEQ_CST)) {
+        return true;
+    }
+    ctrl = __atomic_load_n(&msix->table[vector * MSIX_ENTRY_DWORDS +
+                                        MSIX_CTRL_DWORD], __ATOMIC_SEQ_CST);
+    return (ctrl & PCI_MSIX_ENTRY_CTRL_MASKBIT) != 0;
+}
+
+/*
+ * Called when @vector may have been unmasked: delivers its pending interrupt,
+ * unless a concurrent msix_vector_hold() claimed it first.
+ */
+static void
+msix_deliver_pending(vfu_ctx_t *vfu_ctx, uint32_t vector)
+{
+    struct msix *msix = vfu_ctx->msix;
+    uint64_t bit = 1ULL << (vector % MSIX_PBA_BITS);
+
+    if (msix_vector_masked(msix, vector)) {
+        return;
+    }
+
+    if (!(__atomic_fetch_and(&msix->pba[vector / MSIX_PBA_BITS], ~bit,
+                             __ATOMIC_SEQ_CST) & bit)) {
+        return;
+    }
+
+    if (vfu_ctx->irqs == NULL || vector >= vfu_ctx->irqs->max_ivs ||
+        vfu_ctx->irqs->efds[vector] == -1) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "dropping pending MSI-X vector %u",
+                vector);
+        return;
+    }
+
+    vfu_log(vfu_ctx, LOG_DEBUG, "delivering pending MSI-X vector %u", vector);
+    if (eventfd_write(vfu_ctx->irqs->efds[vector], 1) == -1) {
+        vfu_log(vfu_ctx, LOG_ERR, "failed to signal MSI-X vector %u: %m",
+                vector);
+    }
+}
+
+static void
+msix_deliver_all_pending(vfu_ctx_t *vfu_ctx)
+{
+    struct msix *msix = vfu_ctx->msix;
+    uint64_t word;
+    size_t w;
+
+    for (w = 0; w < ROUND_UP(msix->nr_vectors, MSIX_PBA_BITS) / MSIX_PBA_BITS;
+         w++) {
+        word = __atomic_load_n(&msix->pba[w], __ATOMIC_SEQ_CST);
+        while (word != 0) {
+            msix_deliver_pending(vfu_ctx,
+                                 w * MSIX_PBA_BITS + __builtin_ctzll(word));
+            word &= word - 1;
+        }
+    }
+}
+
+/*
+ * If @vector is masked, sets its pending bit instead of signalling it.
+ *
+ * The mask is checked again after setting the bit: if the vector was unmasked
+ * in between, whichever of us and msix_deliver_pending() clears the bit first
+ * delivers the interrupt, so it is neither lost nor duplicated.
+ */
+bool
+msix_vector_hold(vfu_ctx_t *vfu_ctx, uint32_t vector)
+{
+    struct msix *msix = vfu_ctx->msix;
+    uint64_t bit = 1ULL << (vector % MSIX_PBA_BITS);
+    uint64_t *word;
+
+    if (msix == NULL || vector >= msix->nr_vectors ||
+        !msix_vector_masked(msix, vector)) {
+        return false;
+    }
+
+    word = &msix->pba[vector / MSIX_PBA_BITS];
+    __atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST);
+
+    if (msix_vector_masked(msix, vector)) {
+        return true;
+    }
+
+    return !(__atomic_fetch_and(word, ~bit, __ATOMIC_SEQ_CST) & bit);
+}
+
+void
+msix_ctrl_changed(vfu_ctx_t *vfu_ctx, bool enabled, bool masked)
+{
+    struct msix *msix = vfu_ctx->msix;
+
+    if (msix == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&msix->enabled, enabled, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&msix->masked, masked, __ATOMIC_SEQ_CST);
+
+    if (enabled && !masked) {
+        msix_deliver_all_pending(vfu_ctx);
+    }
+}
+
+void
+msix_reset(vfu_ctx_t *vfu_ctx)
+{
+    struct msix *msix = vfu_ctx->msix;
+    uint32_t i;
+
+    if (msix == NULL) {
+        return;
+    }
+
+    for (i = 0; i < msix->nr_vectors; i++) {
+        __atomic_store_n(&msix->table[i * MSIX_ENTRY_DWORDS + MSIX_CTRL_DWORD],
+                         PCI_MSIX_ENTRY_CTRL_MASKBIT, __ATOMIC_SEQ_CST);
+    }
+    for (i = 0; i < ROUND_UP(msix->nr_vectors, MSIX_PBA_BITS) / MSIX_PBA_BITS;
+         i++) {
+        __atomic_store_n(&msix->pba[i], 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+void
+msix_free(vfu_ctx_t *vfu_ctx)
+{
+    if (vfu_ctx->msix != NULL) {
+        free(vfu_ctx->msix->table);
+        free(vfu_ctx->msix->pba);
+        free(vfu_ctx->msix);
+        vfu_ctx->msix = NULL;
+    }
+}
+
+static ssize_t
+msix_table_access(vfu_ctx_t *vfu_ctx, void *arg UNUSED, char *buf,
+                  size_t count, loff_t offset, bool is_write)
+{
+    struct msix *msix = vfu_ctx->msix;
+    uint32_t *dword;
+    uint32_t old;
+    uint32_t val;
+    size_t i;
+
+    if (msix == NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    for (i = 0; i < count; i += sizeof(uint32_t)) {
+        dword = &msix->table[(offset + i) / sizeof(uint32_t)];
+
+        if (!is_write) {
+            val = __atomic_load_n(dword, __ATOMIC_SEQ_CST);
+            memcpy(buf + i, &val, sizeof(val));
+            continue;
+        }
+
+        memcpy(&val, buf + i, sizeof(val));
+
+        if ((offset + i) % PCI_MSIX_ENTRY_SIZE != PCI_MSIX_ENTRY_VECTOR_CTRL) {
+            __atomic_store_n(dword, val, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        /* Only the mask bit of Vector Control is writable. */
+        old = __atomic_exchange_n(dword, val & PCI_MSIX_ENTRY_CTRL_MASKBIT,
+                                  __ATOMIC_SEQ_CST);
+        if ((old & PCI_MSIX_ENTRY_CTRL_MASKBIT) &&
+            !(val & PCI_MSIX_ENTRY_CTRL_MASKBIT)) {
+            msix_deliver_pending(vfu_ctx,
+                                 (offset + i) / PCI_MSIX_ENTRY_SIZE);
+        }
+    }
+
+    return count;
+}
+
+static ssize_t
+msix_pba_access(vfu_ctx_t *vfu_ctx, void *arg UNUSED, char *buf,
+                size_t count, loff_t offset, bool is_write)
+{
+    struct msix *msix = vfu_ctx->msix;
+    uint64_t word;
+
+    if (msix == NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (is_write) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "ignoring write to read-only MSI-X PBA");
+        return count;
+    }
+
+    /* Accesses are naturally aligned 4 or 8 bytes, see the range setup. */
+    word = __atomic_load_n(&msix->pba[offset / sizeof(uint64_t)],
+                           __ATOMIC_SEQ_CST);
+    word >>= (offset % sizeof(uint64_t)) * CHAR_BIT;
+    memcpy(buf, &word, count);
+
+    return count;
+}
+
+EXPORT int
+vfu_pci_setup_msix_emulation(vfu_ctx_t *vfu_ctx)
+{
+    struct pci_cap *cap = NULL;
+    struct msixcap *msixcap;
+    struct msix *msix;
+    uint64_t table_offset;
+    uint64_t pba_offset;
+    size_t pba_words;
+    size_t i;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->realized || vfu_ctx->msix != NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    for (i = 0; i < vfu_ctx->pci.nr_caps; i++) {
+        if (vfu_ctx->pci.caps[i].id == PCI_CAP_ID_MSIX) {
+            cap = &vfu_ctx->pci.caps[i];
+            break;
+        }
+    }
+
+    if (cap == NULL) {
+        vfu_log(vfu_ctx, LOG_ERR, "no MSI-X capability");
+        return ERROR_INT(ENOENT);
+    }
+
+    /* We need to see Message Control writes. */
+    if (cap->flags & VFU_CAP_FLAG_CALLBACK) {
+        vfu_log(vfu_ctx, LOG_ERR, "MSI-X capability is handled by the device");
+        return ERROR_INT(EINVAL);
+    }
+
+    msixcap = (struct msixcap *)((char *)vfu_ctx->pci.config_space + cap->off);
+
+    if (msixcap->mtab.tbir > 5 || msixcap->mpba.pbir > 5) {
+        vfu_log(vfu_ctx, LOG_ERR, "bad MSI-X table/PBA BIR");
+        return ERROR_INT(EINVAL);
+    }
+
+    msix = calloc(1, sizeof(*msix));
+    if (msix == NULL) {
+        return ERROR_INT(ENOMEM);
+    }
+
+    msix->nr_vectors = msixcap->mxc.ts + 1;
+    pba_words = ROUND_UP(msix->nr_vectors, MSIX_PBA_BITS) / MSIX_PBA_BITS;
+    msix->table = calloc(msix->nr_vectors, PCI_MSIX_ENTRY_SIZE);
+    msix->pba = calloc(pba_words, sizeof(uint64_t));
+    if (msix->table == NULL || msix->pba == NULL) {
+        ret = ERROR_INT(ENOMEM);
+        goto err;
+    }
+
+    msix->enabled = msixcap->mxc.mxe;
+    msix->masked = msixcap->mxc.fm;
+    for (i = 0; i < msix->nr_vectors; i++) {
+        msix->table[i * MSIX_ENTRY_DWORDS + MSIX_CTRL_DWORD] =
+            PCI_MSIX_ENTRY_CTRL_MASKBIT;
+    }
+
+    table_offset = (uint64_t)msixcap->mtab.to << 3;
+    pba_offset = (uint64_t)msixcap->mpba.pbao << 3;
+
+    ret = vfu_setup_region_range(vfu_ctx,
+                                 VFU_PCI_DEV_BAR0_REGION_IDX +
+                                 msixcap->mtab.tbir, table_offset,
+                                 (uint64_t)msix->nr_vectors *
+                                 PCI_MSIX_ENTRY_SIZE, 4 | 8,
+                                 msix_table_access, NULL);
+    if (ret != 0) {
+        goto err;
+    }
+
+    ret = vfu_setup_region_range(vfu_ctx,
+                                 VFU_PCI_DEV_BAR0_REGION_IDX +
+                                 msixcap->mpba.pbir, pba_offset,
+                                 pba_words * sizeof(uint64_t), 4 | 8,
+                                 msix_pba_access, NULL);
+    if (ret != 0) {
+        region_range_remove(vfu_ctx, VFU_PCI_DEV_BAR0_REGION_IDX +
+                            msixcap->mtab.tbir, table_offset);
+        goto err;
+    }
+
+    vfu_ctx->msix = msix;
+
+    vfu_log(vfu_ctx, LOG_DEBUG, "emulating MSI-X table (BAR%u %#llx) and PBA "
+            "(BAR%u %#llx) for %u vectors", msixcap->mtab.tbir,
+            (ull_t)table_offset, msixcap->mpba.pbir, (ull_t)pba_offset,
+            msix->nr_vectors);
+
+    return 0;
+
+err:
+    free(msix->table);
+    free(msix->pba);
+    free(msix);
+    return ret;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -32,6 +32,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +40,7 @@
 
 #include "pci_caps.h"
 #include "common.h"
+#include "config_events.h"
 #include "libvfio-user.h"
 #include "pci.h"
 #include "private.h"
@@ -115,7 +117,12 @@ pci_hdr_write_bar(vfu_ctx_t *vfu_ctx, uint16_t bar_index, const char *buf)
     vfu_log(vfu_ctx, LOG_DEBUG,
             "Write BAR%d: size 0x%lx, mask=0x%x, flag_mask=0x%x, value=0x%x",
             bar_index, effective_size, mask, flag_mask, cfg_addr);
-    
+
+    if (hdr->bars[bar_index].raw != htole32(cfg_addr) &&
+        config_events_enabled(vfu_ctx)) {
+        config_event_post(vfu_ctx, VFU_CONFIG_EVENT_BAR, bar_index, cfg_addr);
+    }
+
     hdr->bars[bar_index].raw = htole32(cfg_addr);
 }
 
@@ -326,7 +333,9 @@ pci_hdr_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count,
     assert(count <= PCI_STD_HEADER_SIZEOF);
 
     if (is_write) {
+        pci_config_space_write_begin(vfu_ctx);
         ret = pci_hdr_write(vfu_ctx, buf, offset);
+        pci_config_space_write_end(vfu_ctx);
         if (ret < 0) {
             vfu_log(vfu_ctx, LOG_ERR, "failed to write to PCI header: %m");
         } else {
@@ -428,7 +437,7 @@ pci_config_space_next_segment(vfu_ctx_t *ctx, size_t count, loff_t offset,
         return count;
     }
 
-    cap = cap_find_by_offset(ctx, offset, count);
+    cap = cap_lookup(ctx, offset, count);
 
     if (cap == NULL) {
         *cb = pci_nonstd_access;
@@ -493,6 +502,52 @@ pci_config_space_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count,
     return offset - start;
 }
 
+EXPORT uint64_t
+vfu_pci_config_space_generation(vfu_ctx_t *vfu_ctx)
+{
+    assert(vfu_ctx != NULL);
+
+    return __atomic_load_n(&vfu_ctx->pci.config_seq, __ATOMIC_ACQUIRE) >> 1;
+}
+
+EXPORT int
+vfu_pci_config_space_snapshot(vfu_ctx_t *vfu_ctx, void *buf, size_t offset,
+                              size_t count, uint64_t *generation)
+{
+    uint64_t seq;
+
+    assert(vfu_ctx != NULL);
+    assert(buf != NULL);
+
+    if (vfu_ctx->pci.config_space == NULL ||
+        offset + count < offset ||
+        offset + count > pci_config_space_size(vfu_ctx)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    for (;;) {
+        seq = __atomic_load_n(&vfu_ctx->pci.config_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            /* A write is in progress, let it finish. */
+            sched_yield();
+            continue;
+        }
+
+        memcpy(buf, (uint8_t *)vfu_ctx->pci.config_space + offset, count);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&vfu_ctx->pci.config_seq,
+                            __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+
+    if (generation != NULL) {
+        *generation = seq >> 1;
+    }
+    return 0;
+}
+
 EXPORT int
 vfu_pci_init(vfu_ctx_t *vfu_ctx, vfu_pci_type_t pci_type,
              int hdr_type, int revision UNUSED)
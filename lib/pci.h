@@ -62,6 +62,27 @@ pci_config_space_ptr(vfu_ctx_t *vfu_ctx, loff_t offset)
     return (uint8_t *)vfu_ctx->pci.config_space + offset;
 }
 
+/*
+ * Brackets a modification of config space, so that concurrent
+ * vfu_pci_config_space_snapshot() callers retry rather than see it half done.
+ * Only called from the thread running the context, and never around device
+ * callbacks, which may take snapshots themselves.
+ */
+static inline void
+pci_config_space_write_begin(vfu_ctx_t *vfu_ctx)
+{
+    __atomic_store_n(&vfu_ctx->pci.config_seq, vfu_ctx->pci.config_seq + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+pci_config_space_write_end(vfu_ctx_t *vfu_ctx)
+{
+    __atomic_store_n(&vfu_ctx->pci.config_seq, vfu_ctx->pci.config_seq + 1,
+                     __ATOMIC_RELEASE);
+}
+
 #endif /* LIB_VFIO_USER_PCI_H */
 
 /* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -60,9 +60,12 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
+#include <sys/param.h>
 
 #include "common.h"
+#include "config_events.h"
 #include "libvfio-user.h"
+#include "msix.h"
 #include "pci_caps.h"
 #include "pci.h"
 #include "private.h"
@@ -128,6 +131,9 @@ handle_pmcs_write(vfu_ctx_t *vfu_ctx, struct pmcap *pm,
     if (pm->pmcs.pmes != pmcs->pmes) {
         vfu_log(vfu_ctx, LOG_DEBUG, "PME status set to %#x", pmcs->pmes);
     }
+    if (pm->pmcs.ps != pmcs->ps && config_events_enabled(vfu_ctx)) {
+        config_event_post(vfu_ctx, VFU_CONFIG_EVENT_POWER_STATE, 0, pmcs->ps);
+    }
     pm->pmcs = *pmcs;
     return 0;
 }
@@ -174,6 +180,8 @@ cap_write_msi(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, char *buf,
 {
     struct msicap *msi = cap_data(vfu_ctx, cap);
     struct msicap new_msi = *msi;
+    struct mc old_mc = msi->mc;
+    uint16_t mc;
 
     memcpy((char *)&new_msi + offset - cap->off, buf, count);
 
@@ -226,6 +234,12 @@ cap_write_msi(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, char *buf,
                 "MSI Mask Bits set to %x", msi->mmask);
     }
 
+    if ((old_mc.msie != msi->mc.msie || old_mc.mme != msi->mc.mme) &&
+        config_events_enabled(vfu_ctx)) {
+        memcpy(&mc, &msi->mc, sizeof(mc));
+        config_event_post(vfu_ctx, VFU_CONFIG_EVENT_MSI, 0, mc);
+    }
+
     return count;
 }
 
@@ -235,6 +249,8 @@ cap_write_msix(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, char *buf,
 {
     struct msixcap *msix = cap_data(vfu_ctx, cap);
     struct msixcap new_msix = *msix;
+    struct mxc old_mxc = msix->mxc;
+    uint16_t mxc;
 
     memcpy((char *)&new_msix + offset - cap->off, buf, count);
 
@@ -259,6 +275,14 @@ cap_write_msix(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, char *buf,
                 msix->mxc.mxe ? "enable" : "disable");
     }
 
+    msix_ctrl_changed(vfu_ctx, msix->mxc.mxe, msix->mxc.fm);
+
+    if ((old_mxc.fm != msix->mxc.fm || old_mxc.mxe != msix->mxc.mxe) &&
+        config_events_enabled(vfu_ctx)) {
+        memcpy(&mxc, &msix->mxc, sizeof(mxc));
+        config_event_post(vfu_ctx, VFU_CONFIG_EVENT_MSIX, 0, mxc);
+    }
+
     return count;
 }
 
@@ -331,9 +355,12 @@ handle_px_pxdc_write(vfu_ctx_t *vfu_ctx, struct pxcap *px,
             vfu_log(vfu_ctx, LOG_ERR, "FLR capability is not supported");
             return ERROR_INT(EINVAL);
         }
-        if (vfu_ctx->reset != NULL) {
+        if (config_events_enabled(vfu_ctx)) {
+            vfu_log(vfu_ctx, LOG_DEBUG, "function level reset requested");
+            config_event_post(vfu_ctx, VFU_CONFIG_EVENT_FLR, 0, 0);
+        } else if (vfu_ctx->reset != NULL) {
             vfu_log(vfu_ctx, LOG_DEBUG, "initiate function level reset");
-	    return call_reset_cb(vfu_ctx, VFU_RESET_PCI_FLR);
+            vfu_ctx->pci.flr_pending = true;
         } else {
             vfu_log(vfu_ctx, LOG_ERR, "FLR callback is not implemented");
         }
@@ -489,11 +516,88 @@ cap_find_by_offset(vfu_ctx_t *vfu_ctx, loff_t offset, size_t count)
     return NULL;
 }
 
+/*
+ * cap_map entries are 0 for config space not covered by a capability, 1 + i
+ * for caps[i], and 1 + VFU_MAX_CAPS + i for ext_caps[i].
+ */
+static void
+cap_map_add(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, uint16_t entry)
+{
+    size_t i;
+
+    assert(cap->off + cap->size <= PCI_CFG_SPACE_EXP_SIZE);
+
+    for (i = cap->off / 4; i < ROUND_UP(cap->off + cap->size, 4) / 4; i++) {
+        vfu_ctx->pci.cap_map[i] = entry;
+    }
+}
+
+void
+cap_map_build(vfu_ctx_t *vfu_ctx)
+{
+    size_t i;
+
+    memset(vfu_ctx->pci.cap_map, 0, sizeof(vfu_ctx->pci.cap_map));
+
+    for (i = 0; i < vfu_ctx->pci.nr_caps; i++) {
+        cap_map_add(vfu_ctx, &vfu_ctx->pci.caps[i], 1 + i);
+    }
+
+    for (i = 0; i < vfu_ctx->pci.nr_ext_caps; i++) {
+        cap_map_add(vfu_ctx, &vfu_ctx->pci.ext_caps[i], 1 + VFU_MAX_CAPS + i);
+    }
+
+    vfu_ctx->pci.cap_map_valid = true;
+}
+
+struct pci_cap *
+cap_lookup(vfu_ctx_t *vfu_ctx, loff_t offset, size_t count)
+{
+    size_t i, end;
+
+    if (!vfu_ctx->pci.cap_map_valid) {
+        return cap_find_by_offset(vfu_ctx, offset, count);
+    }
+
+    if (count == 0 || (size_t)offset >= PCI_CFG_SPACE_EXP_SIZE) {
+        return NULL;
+    }
+
+    end = MIN((size_t)offset + count, PCI_CFG_SPACE_EXP_SIZE);
+
+    /*
+     * Capabilities need not be a multiple of a dword in size, so the entry only
+     * tells us which capability to check; typical accesses are a dword or
+     * less, so this is usually a single iteration.
+     */
+    for (i = offset / 4; i < ROUND_UP(end, 4) / 4; i++) {
+        uint16_t entry = vfu_ctx->pci.cap_map[i];
+        struct pci_cap *cap;
+
+        if (entry == 0) {
+            continue;
+        }
+
+        if (entry <= VFU_MAX_CAPS) {
+            cap = &vfu_ctx->pci.caps[entry - 1];
+        } else {
+            cap = &vfu_ctx->pci.ext_caps[entry - 1 - VFU_MAX_CAPS];
+        }
+
+        if ((size_t)offset < cap->off + cap->size && cap->off < end) {
+            return cap;
+        }
+    }
+
+    return NULL;
+}
+
 ssize_t
 pci_cap_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count, loff_t offset,
                bool is_write)
 {
-    struct pci_cap *cap = cap_find_by_offset(vfu_ctx, offset, count);
+    struct pci_cap *cap = cap_lookup(vfu_ctx, offset, count);
+    ssize_t ret;
 
     assert(cap != NULL);
     assert((size_t)offset >= cap->off);
@@ -521,17 +625,29 @@ pci_cap_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count, loff_t offset,
         return ERROR_INT(EPERM);
     }
 
-    return cap->cb(vfu_ctx, cap, buf, count, offset);
+    pci_config_space_write_begin(vfu_ctx);
+    ret = cap->cb(vfu_ctx, cap, buf, count, offset);
+    pci_config_space_write_end(vfu_ctx);
+
+    /* The device's reset callback is called outside the write. */
+    if (vfu_ctx->pci.flr_pending) {
+        vfu_ctx->pci.flr_pending = false;
+        if (ret >= 0 && call_reset_cb(vfu_ctx, VFU_RESET_PCI_FLR) < 0) {
+            return -1;
+        }
+    }
+
+    return ret;
 }
 
 /*
  * Place the new capability after the previous (or after the standard header if
  * this is the first capability).
  *
- * If cap->off is already provided, place it directly, but first check it
- * doesn't overlap an existing capability, or the PCI header. We still also need
- * to link it into the list. There's no guarantee that the list is ordered by
- * offset after doing so.
+ * If cap->off is already provided, place it directly, but first check it is
+ * dword-aligned, as cap_map requires, and doesn't overlap an existing
+ * capability, or the PCI header. We still also need to link it into the list.
+ * There's no guarantee that the list is ordered by offset after doing so.
  */
 static int
 cap_place(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, void *data)
@@ -545,7 +661,7 @@ cap_place(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, void *data)
     prevp = &config_space->hdr.cap;
 
     if (cap->off != 0) {
-        if (cap->off < PCI_STD_HEADER_SIZEOF) {
+        if (cap->off < PCI_STD_HEADER_SIZEOF || (cap->off & 0x3) != 0) {
             vfu_log(vfu_ctx, LOG_ERR, "invalid offset %zx for capability "
                     "%u (%s)", cap->off, cap->id, cap->name);
             return ERROR_INT(EINVAL);
@@ -596,10 +712,10 @@ cap_place(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, void *data)
  * Place the new extended capability after the previous (or at the beginning of
  * extended config space, replacing the initial zeroed capability).
  *
- * If cap->off is already provided, place it directly, but first check it
- * doesn't overlap an existing extended capability, and that the first one
- * replaces the initial zeroed capability. We also still need to link it into
- * the list.
+ * If cap->off is already provided, place it directly, but first check it is
+ * dword-aligned, doesn't overlap an existing extended capability, and that the
+ * first one replaces the initial zeroed capability. We also still need to link
+ * it into the list.
  */
 static int
 ext_cap_place(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, void *data)
@@ -609,7 +725,7 @@ ext_cap_place(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, void *data)
     hdr = (void *)pci_config_space_ptr(vfu_ctx, PCI_CFG_SPACE_SIZE);
 
     if (cap->off != 0) {
-        if (cap->off < PCI_CFG_SPACE_SIZE) {
+        if (cap->off < PCI_CFG_SPACE_SIZE || (cap->off & 0x3) != 0) {
             vfu_log(vfu_ctx, LOG_ERR, "invalid offset %zx for capability "
                     "%u (%s)", cap->off, cap->id, cap->name);
             return ERROR_INT(EINVAL);
@@ -726,7 +842,9 @@ vfu_pci_add_capability(vfu_ctx_t *vfu_ctx, size_t pos, int flags, void *data)
             return ERROR_INT(EINVAL);
         }
 
+        pci_config_space_write_begin(vfu_ctx);
         ret = ext_cap_place(vfu_ctx, &cap, data);
+        pci_config_space_write_end(vfu_ctx);
 
     } else {
         if (vfu_ctx->pci.nr_caps == VFU_MAX_CAPS) {
@@ -772,7 +890,9 @@ vfu_pci_add_capability(vfu_ctx_t *vfu_ctx, size_t pos, int flags, void *data)
             return ERROR_INT(EINVAL);
         }
 
+        pci_config_space_write_begin(vfu_ctx);
         ret = cap_place(vfu_ctx, &cap, data);
+        pci_config_space_write_end(vfu_ctx);
     }
 
     if (ret != 0) {
@@ -785,9 +905,16 @@ vfu_pci_add_capability(vfu_ctx_t *vfu_ctx, size_t pos, int flags, void *data)
     if (extended) {
         memcpy(&vfu_ctx->pci.ext_caps[vfu_ctx->pci.nr_ext_caps],
                &cap, sizeof(cap));
+        if (vfu_ctx->pci.cap_map_valid) {
+            cap_map_add(vfu_ctx, &cap,
+                        1 + VFU_MAX_CAPS + vfu_ctx->pci.nr_ext_caps);
+        }
         vfu_ctx->pci.nr_ext_caps++;
     } else {
         memcpy(&vfu_ctx->pci.caps[vfu_ctx->pci.nr_caps], &cap, sizeof(cap));
+        if (vfu_ctx->pci.cap_map_valid) {
+            cap_map_add(vfu_ctx, &cap, 1 + vfu_ctx->pci.nr_caps);
+        }
         vfu_ctx->pci.nr_caps++;
     }
 
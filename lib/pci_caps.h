@@ -64,6 +64,21 @@ struct pci_cap {
 struct pci_cap *
 cap_find_by_offset(vfu_ctx_t *ctx, loff_t off, size_t count);
 
+/*
+ * Build the per-dword table mapping config space offsets to capabilities, so
+ * that cap_lookup() doesn't need to scan the capability lists. Capabilities
+ * added afterwards are entered into the table as they are placed.
+ */
+void
+cap_map_build(vfu_ctx_t *vfu_ctx);
+
+/*
+ * Return the capability at the lowest offset (if any) that intersects with the
+ * [off, off+count) interval, using the table built by cap_map_build().
+ */
+struct pci_cap *
+cap_lookup(vfu_ctx_t *vfu_ctx, loff_t off, size_t count);
+
 /*
  * Handle an access to a capability.  The access is guaranteed to be entirely
  * within a capability.
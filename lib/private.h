@@ -34,6 +34,7 @@
 #define LIB_VFIO_USER_PRIVATE_H
 
 #include <errno.h>
+#include <pthread.h>
 #include <sys/queue.h>
 
 #include "common.h"
@@ -67,6 +68,18 @@
  */
 #define SERVER_MAX_ERROR_NO (4096)
 
+/*
+ * Region reads up to this size are replied to directly from a per-context
+ * buffer, avoiding a reply allocation on the MMIO read path.
+ */
+#define INLINE_READ_REPLY_SIZE (64)
+
+/*
+ * Maximum number of queued requests handled under a single quiesce after a
+ * DMA map or unmap, see handle_dma_batch().
+ */
+#define DMA_BATCH_MAX (MAX_DMA_REGIONS)
+
 /*
  * Structure used to hold an in-flight request+reply.
  *
@@ -74,6 +87,7 @@
  *
  * Outgoing requests are either stored in out.iov.iov_base, or out_iovecs. In
  * the latter case, the iovecs refer to data that should not be freed.
+ * out_iovecs may point to inline_iovecs, in which case it is not freed either.
  */
 typedef struct vfu_msg {
     /* in/out */
@@ -89,17 +103,78 @@ typedef struct vfu_msg {
 
     struct iovec *out_iovecs;
     size_t nr_out_iovecs;
+    struct iovec inline_iovecs[2];
+
+    TAILQ_ENTRY(vfu_msg) entry; /* on struct worker_queue::msgs */
 } vfu_msg_t;
 
+/*
+ * Per-vector interrupt coalescing state, see vfu_irq_set_coalescing().
+ */
+struct irq_coalesce {
+    uint32_t    max_count;      /* deliver after this many triggers */
+    uint64_t    max_delay_ns;   /* deliver this long after the first trigger */
+    uint32_t    pending;        /* triggers not yet delivered */
+    uint64_t    first_ns;       /* time of the first pending trigger */
+};
+
 typedef struct {
     int         err_efd;    /* eventfd for irq err */
     int         req_efd;    /* eventfd for irq req */
     uint32_t    max_ivs;    /* maximum number of ivs supported */
+    struct irq_coalesce *coalesce;  /* NULL until coalescing is configured */
+    uint64_t    *coalesce_pending;  /* bitmap of vectors with pending > 0 */
     int         efds[0];    /* must be last */
 } vfu_irqs_t;
 
 struct migration;
 
+/*
+ * Library-emulated MSI-X table and PBA, see vfu_pci_setup_msix_emulation().
+ * The vector control words, PBA and the enable/function mask bits are
+ * accessed atomically, as interrupts can be triggered from any thread.
+ */
+struct msix {
+    uint32_t    nr_vectors;
+    uint32_t    *table;     /* 4 dwords per vector, as in the BAR */
+    uint64_t    *pba;
+    bool        enabled;    /* MSI-X Enable */
+    bool        masked;     /* Function Mask */
+};
+
+/*
+ * Single-producer, single-consumer ring of config space events, see
+ * vfu_setup_config_events(). head and tail are free-running indices; only the
+ * thread running the context advances tail, only the consumer advances head.
+ */
+struct config_events {
+    uint32_t            nr_events;  /* power of two */
+    uint32_t            head;
+    uint32_t            tail;
+    bool                overflow;
+    /*
+     * A pending FLR is kept out of the queue, so that it's never dropped, but
+     * is still delivered in order: see config_event_post().
+     */
+    uint64_t            flr;
+    uint64_t            flr_generation;
+    vfu_config_event_t  events[];
+};
+
+/*
+ * A range of a region with its own access handler, see
+ * vfu_setup_region_range().
+ */
+struct region_range {
+    uint64_t                        offset;
+    uint64_t                        size;
+    uint32_t                        access_sizes;
+    vfu_region_range_access_cb_t    *cb;
+    void                            *arg;
+    /* if set, reads are served from here, see vfu_setup_region_shadow() */
+    const char                      *shadow;
+};
+
 typedef struct  {
     /* Region flags, see VFU_REGION_FLAG_READ and friends. */
     uint32_t            flags;
@@ -107,6 +182,9 @@ typedef struct  {
     uint64_t            size;
     /* Callback that is called when the region is read or written. */
     vfu_region_access_cb_t  *cb;
+    /* Ranges with their own callback, sorted by offset. */
+    struct region_range *ranges;
+    size_t nr_ranges;
     /* Sparse mmap areas if set. */
     struct iovec *mmap_areas;
     int nr_mmap_areas;
@@ -114,8 +192,9 @@ typedef struct  {
     int fd;
     /* offset of region within fd. */
     uint64_t offset;
-    /* The subregions for ioregionfds and ioeventfds */
-    LIST_HEAD(, ioeventfd) subregions;
+    /* ioeventfds, sorted by gpa_offset, see vfu_create_ioeventfd() */
+    struct ioeventfd **ioeventfds;
+    size_t nr_ioeventfds;
 } vfu_reg_info_t;
 
 struct pci_dev {
@@ -125,15 +204,47 @@ struct pci_dev {
     size_t                  nr_caps;
     struct pci_cap          ext_caps[VFU_MAX_CAPS];
     size_t                  nr_ext_caps;
+    /*
+     * Sequence count for config space writes: odd while a write is in
+     * progress, see vfu_pci_config_space_snapshot().
+     */
+    uint64_t                config_seq;
+    /* FLR requested by the capability write in progress, see pci_cap_access() */
+    bool                    flr_pending;
+    /* Per-dword capability lookup table, see cap_map_build(). */
+    uint16_t                cap_map[PCI_CFG_SPACE_EXP_SIZE / 4];
+    bool                    cap_map_valid;
 };
 
 struct dma_controller;
 
+/*
+ * A context's requests offloaded to a worker pool, see
+ * vfu_setup_worker_pool(). Protected by the pool's lock.
+ */
+struct worker_queue {
+    struct vfu_worker_pool      *pool;
+    struct vfu_ctx              *vfu_ctx;
+    int                         cmd_classes;
+    TAILQ_HEAD(, vfu_msg)       msgs;
+    TAILQ_ENTRY(worker_queue)   entry;      /* on the pool's ready list */
+    bool                        scheduled;  /* on the pool's ready list */
+    bool                        busy;       /* a worker is handling a msg */
+};
+
+/* An I/O context, see vfu_setup_io_ctx(). */
+struct io_ctx {
+    vfu_io_ctx_quiesce_cb_t *quiesce;
+    void                    *arg;
+};
+
 enum vfu_ctx_pending_state {
     VFU_CTX_PENDING_NONE,
     VFU_CTX_PENDING_MSG,
     VFU_CTX_PENDING_DEVICE_RESET,
-    VFU_CTX_PENDING_CTX_RESET
+    VFU_CTX_PENDING_CTX_RESET,
+    /* vfu_device_quiesced() is handling DMA requests queued behind the MSG */
+    VFU_CTX_PENDING_DMA_BATCH
 };
 
 struct vfu_ctx_pending_info {
@@ -153,6 +264,49 @@ enum cb_type {
     CB_MIGR_STATE
 };
 
+/*
+ * A message-based DMA transfer (vfu_sgl_read() and friends). It's split into
+ * chunks of at most chunk_size bytes, chunk i being sent with message ID
+ * (base_msg_id + i). Bit n of completed is set if chunk (acked + n) has been
+ * replied to.
+ */
+struct dma_xfer {
+    struct dma_chan         *chan;
+    enum vfio_user_command  cmd;
+    uint64_t                addr;
+    char                    *data;
+    size_t                  length;
+    size_t                  chunk_size;
+    size_t                  nr_chunks;
+    size_t                  sent;
+    size_t                  acked;
+    uint64_t                completed;
+    uint16_t                base_msg_id;
+    int                     err;
+    bool                    finished;
+    unsigned int            busy;
+    /* only for asynchronous transfers */
+    vfu_dma_done_cb_t       *done;
+    void                    *arg;
+    LIST_ENTRY(dma_xfer)    entry;
+};
+
+LIST_HEAD(dma_xfer_list, dma_xfer);
+
+/*
+ * Message-based DMA state of a client command socket, see
+ * vfu_dma_transfer().
+ */
+struct dma_chan {
+    size_t                  index;
+    pthread_mutex_t         lock;
+    pthread_mutex_t         send_lock;
+    pthread_cond_t          cond;
+    bool                    receiving;
+    uint16_t                msg_id;
+    struct dma_xfer_list    xfers;
+};
+
 struct vfu_ctx {
     void                    *pvt;
     struct dma_controller   *dma;
@@ -174,6 +328,25 @@ struct vfu_ctx {
 
     int                     client_max_fds;
     size_t                  client_max_data_xfer_size;
+    /* region writes are not replied to, see do_reply() */
+    bool                    posted_writes;
+    /* a posted write failed before the error eventfd was set up */
+    bool                    posted_write_err;
+    /* client accepts VFIO_USER_REGION_IO_FDS_CHANGED */
+    bool                    io_fds_changed;
+    size_t                  dma_xfer_window;
+    /* set when a DMA transfer finds the client gone, see get_request() */
+    int                     dma_conn_err;
+    /* client command sockets, see vfu_setup_cmd_sockets() */
+    size_t                  max_cmd_sockets;
+    pthread_key_t           cmd_socket_key;
+    bool                    cmd_socket_key_created;
+    /* one per command socket, see dma_chans_alloc() */
+    struct dma_chan         *dma_chans;
+    size_t                  nr_dma_chans;
+
+    struct io_ctx           io_ctxs[VFU_MAX_IO_CTXS];
+    size_t                  nr_io_ctxs;
 
     struct vfu_ctx_pending_info pending;
     bool                    quiesced;
@@ -184,10 +357,32 @@ struct vfu_ctx {
     uint32_t                irq_count[VFU_DEV_NUM_IRQS];
     vfu_dev_irq_state_cb_t  *irq_state_cbs[VFU_DEV_NUM_IRQS];
     vfu_irqs_t              *irqs;
+    /* library-emulated MSI-X table and PBA, see msix.c */
+    struct msix             *msix;
+    struct config_events    *config_events;
+    struct vfu_reactor      *reactor;
+    struct worker_queue     worker;
+    /* serializes replies from vfu_run_ctx() and workers */
+    pthread_mutex_t         reply_lock;
     bool                    realized;
     vfu_dev_type_t          dev_type;
 
     ssize_t                 pci_cap_exp_off;
+
+    /* ioeventfd dispatcher, see vfu_setup_ioeventfd_dispatch() */
+    int                     ioeventfd_epoll_fd;
+    /* transport poll fd currently registered with ioeventfd_epoll_fd */
+    int                     ioeventfd_poll_fd;
+    /* shadow ioeventfds scanned by vfu_poll_ioeventfds() */
+    struct ioeventfd        **polled_ioeventfds;
+    size_t                  nr_polled_ioeventfds;
+    /* ioeventfds deleted by handlers, freed once the dispatch is done */
+    bool                    ioeventfd_dispatching;
+    struct ioeventfd        *deferred_ioeventfds;
+
+    /* reply payload for small region reads, see handle_region_access() */
+    uint64_t                inline_read_buf[INLINE_READ_REPLY_SIZE /
+                                            sizeof(uint64_t)];
 };
 
 typedef struct ioeventfd {
@@ -198,7 +393,17 @@ typedef struct ioeventfd {
     uint64_t datamatch;
     int32_t shadow_fd;
     size_t shadow_offset;
-    LIST_ENTRY(ioeventfd) entry;
+    /* set by vfu_set_ioeventfd_handler() */
+    vfu_ioeventfd_handler_t *handler;
+    void *handler_arg;
+    /* shadow_offset mapped for the dispatcher, if shadow_fd is set */
+    const char *shadow;
+    void *shadow_map;
+    size_t shadow_map_len;
+    /* set by vfu_set_ioeventfd_polled() */
+    bool polled;
+    uint64_t last_value;
+    struct ioeventfd *next_deferred;
 } ioeventfd_t;
 
 int
@@ -218,6 +423,12 @@ call_reset_cb(vfu_ctx_t *vfu_ctx, vfu_reset_type_t reason);
 int
 handle_device_get_region_info(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg);
 
+void
+shadow_read(char *buf, const char *src, size_t count);
+
+void
+region_range_remove(vfu_ctx_t *vfu_ctx, int region_idx, uint64_t offset);
+
 MOCK_DECLARE(bool, cmd_allowed_when_stopped_and_copying, uint16_t cmd);
 
 MOCK_DECLARE(bool, should_exec_command, vfu_ctx_t *vfu_ctx, uint16_t cmd);
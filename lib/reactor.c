@@ -0,0 +1,519 @@
+/*
+ * Copyright (c) 2023 Rivos Inc. All rights reserved.
+ *
+ * Authors: Mattias Nissler <mnissler@rivosinc.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * The reactor: many contexts served from one epoll set by a pool of workers.
+ *
+ * Each context's poll fd is registered with EPOLLONESHOT, so once a worker
+ * has been woken for a context, no other worker is until the first re-arms
+ * it: this is what keeps a context from being handled concurrently. Workers
+ * take one event per epoll_wait(), so ready contexts spread across them.
+ *
+ * The epoll data is the entry's id rather than a pointer, so a worker woken
+ * for a context that has just been removed finds nothing rather than freed
+ * memory. The entry list and entry state are protected by reactor->lock.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "libvfio-user.h"
+#include "private.h"
+#include "reactor.h"
+
+/* Most requests handled for one context before others get a turn. */
+#define REACTOR_BATCH (16)
+
+/* epoll data of the stop eventfd; entry ids start from 1. */
+#define REACTOR_STOP_ID (0)
+
+struct reactor_entry {
+    LIST_ENTRY(reactor_entry)   entry;
+    vfu_ctx_t                   *vfu_ctx;
+    uint64_t                    id;
+    int                         fd;         /* registered with epoll */
+    bool                        attached;
+    bool                        busy;       /* being handled by a worker */
+    bool                        stalled;    /* waiting for quiesce */
+    bool                        resume;     /* quiesced while busy */
+    bool                        removed;
+};
+
+struct vfu_reactor {
+    pthread_mutex_t                 lock;
+    pthread_cond_t                  cond;
+    LIST_HEAD(, reactor_entry)      entries;
+    uint64_t                        next_id;
+    unsigned int                    nr_workers;
+    int                             epoll_fd;
+    int                             stop_fd;
+    /* first failure to re-arm a context, see reactor_rearm_locked() */
+    int                             err;
+};
+
+EXPORT vfu_reactor_t *
+vfu_reactor_create(unsigned int nr_workers)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = REACTOR_STOP_ID };
+    vfu_reactor_t *reactor;
+    int ret;
+
+    if (nr_workers == 0) {
+        return ERROR_PTR(EINVAL);
+    }
+
+    reactor = calloc(1, sizeof(*reactor));
+    if (reactor == NULL) {
+        return NULL;
+    }
+
+    reactor->nr_workers = nr_workers;
+    reactor->next_id = REACTOR_STOP_ID + 1;
+    reactor->stop_fd = -1;
+    LIST_INIT(&reactor->entries);
+
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd == -1) {
+        goto fail;
+    }
+
+    reactor->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (reactor->stop_fd == -1) {
+        goto fail;
+    }
+
+    /* Level-triggered: once signalled, it wakes every worker. */
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->stop_fd,
+                  &ev) == -1) {
+        goto fail;
+    }
+
+    if ((ret = pthread_mutex_init(&reactor->lock, NULL)) != 0) {
+        errno = ret;
+        goto fail;
+    }
+
+    if ((ret = pthread_cond_init(&reactor->cond, NULL)) != 0) {
+        pthread_mutex_destroy(&reactor->lock);
+        errno = ret;
+        goto fail;
+    }
+
+    return reactor;
+
+fail:
+    ret = errno;
+    close_safely(&reactor->stop_fd);
+    close_safely(&reactor->epoll_fd);
+    free(reactor);
+    return ERROR_PTR(ret);
+}
+
+/*
+ * Locked. Re-arms @entry for the context's current poll fd, which changes on
+ * attach and on disconnect.
+ */
+static int
+reactor_arm_locked(vfu_reactor_t *reactor, struct reactor_entry *entry)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLONESHOT,
+        .data.u64 = entry->id,
+    };
+    int fd = vfu_get_poll_fd(entry->vfu_ctx);
+
+    if (fd == entry->fd &&
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+        return 0;
+    }
+
+    /*
+     * Either the fd changed, or it was closed (which removes it from the epoll
+     * set) and the number reused. Removing a closed fd fails, which is fine.
+     */
+    if (entry->fd != -1) {
+        (void) epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, entry->fd, NULL);
+        entry->fd = -1;
+    }
+
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        vfu_log(entry->vfu_ctx, LOG_ERR, "failed to add fd %d to reactor: %m",
+                fd);
+        return -1;
+    }
+
+    entry->fd = fd;
+    return 0;
+}
+
+/*
+ * Locked. Like reactor_arm_locked(), but a context that can't be re-armed
+ * would never be handled again, so stop the reactor instead: the failure is
+ * returned by vfu_reactor_run(), and calling it again retries.
+ */
+static void
+reactor_rearm_locked(vfu_reactor_t *reactor, struct reactor_entry *entry)
+{
+    if (reactor_arm_locked(reactor, entry) == 0) {
+        return;
+    }
+
+    if (reactor->err == 0) {
+        reactor->err = errno;
+    }
+    vfu_reactor_stop(reactor);
+}
+
+static struct reactor_entry *
+reactor_find_locked(vfu_reactor_t *reactor, uint64_t id)
+{
+    struct reactor_entry *entry;
+
+    LIST_FOREACH(entry, &reactor->entries, entry) {
+        if (entry->id == id) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+EXPORT int
+vfu_reactor_add_ctx(vfu_reactor_t *reactor, vfu_ctx_t *vfu_ctx)
+{
+    struct reactor_entry *entry;
+    int ret;
+
+    assert(reactor != NULL);
+    assert(vfu_ctx != NULL);
+
+    if (!vfu_ctx->realized || vfu_ctx->reactor != NULL ||
+        !(vfu_ctx->flags & LIBVFIO_USER_FLAG_ATTACH_NB)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL) {
+        return -1;
+    }
+
+    entry->vfu_ctx = vfu_ctx;
+    entry->fd = -1;
+
+    pthread_mutex_lock(&reactor->lock);
+
+    entry->id = reactor->next_id++;
+
+    if (reactor_arm_locked(reactor, entry) < 0) {
+        ret = errno;
+        pthread_mutex_unlock(&reactor->lock);
+        free(entry);
+        return ERROR_INT(ret);
+    }
+
+    LIST_INSERT_HEAD(&reactor->entries, entry, entry);
+    vfu_ctx->reactor = reactor;
+
+    pthread_mutex_unlock(&reactor->lock);
+
+    return 0;
+}
+
+static void
+reactor_remove_locked(vfu_reactor_t *reactor, struct reactor_entry *entry)
+{
+    entry->removed = true;
+
+    while (entry->busy) {
+        pthread_cond_wait(&reactor->cond, &reactor->lock);
+    }
+
+    if (entry->fd != -1) {
+        (void) epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, entry->fd, NULL);
+    }
+
+    LIST_REMOVE(entry, entry);
+    entry->vfu_ctx->reactor = NULL;
+    free(entry);
+}
+
+EXPORT int
+vfu_reactor_remove_ctx(vfu_reactor_t *reactor, vfu_ctx_t *vfu_ctx)
+{
+    struct reactor_entry *entry;
+
+    assert(reactor != NULL);
+    assert(vfu_ctx != NULL);
+
+    pthread_mutex_lock(&reactor->lock);
+
+    LIST_FOREACH(entry, &reactor->entries, entry) {
+        if (entry->vfu_ctx == vfu_ctx && !entry->removed) {
+            reactor_remove_locked(reactor, entry);
+            pthread_mutex_unlock(&reactor->lock);
+            return 0;
+        }
+    }
+
+    pthread_mutex_unlock(&reactor->lock);
+
+    return ERROR_INT(ENOENT);
+}
+
+void
+reactor_ctx_resume(vfu_ctx_t *vfu_ctx, bool detached)
+{
+    vfu_reactor_t *reactor = vfu_ctx->reactor;
+    struct reactor_entry *entry;
+
+    pthread_mutex_lock(&reactor->lock);
+
+    LIST_FOREACH(entry, &reactor->entries, entry) {
+        if (entry->vfu_ctx != vfu_ctx) {
+            continue;
+        }
+        if (detached) {
+            entry->attached = false;
+        }
+        if (entry->stalled) {
+            entry->stalled = false;
+            reactor_rearm_locked(reactor, entry);
+        } else if (entry->busy) {
+            entry->resume = true;
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&reactor->lock);
+}
+
+/*
+ * Handles the context of @entry outside the lock; only this worker touches it
+ * while entry->busy is set, but entry->attached may also be cleared by
+ * reactor_ctx_resume(), so it's only accessed with the lock held. @attached is
+ * its value when the worker took the entry. Returns false if the context must
+ * not be re-armed until it has quiesced.
+ */
+static bool
+reactor_handle(vfu_reactor_t *reactor, struct reactor_entry *entry,
+               bool attached)
+{
+    vfu_ctx_t *vfu_ctx = entry->vfu_ctx;
+    int i, ret;
+
+    if (!attached) {
+        if (vfu_attach_ctx(vfu_ctx) == 0) {
+            vfu_log(vfu_ctx, LOG_DEBUG, "reactor: client attached");
+            pthread_mutex_lock(&reactor->lock);
+            entry->attached = true;
+            pthread_mutex_unlock(&reactor->lock);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            vfu_log(vfu_ctx, LOG_ERR, "reactor: failed to attach: %m");
+        }
+        return true;
+    }
+
+    for (i = 0; i < REACTOR_BATCH; i++) {
+        ret = vfu_run_ctx(vfu_ctx);
+        if (ret == 0) {
+            break;
+        }
+        if (ret > 0) {
+            continue;
+        }
+
+        switch (errno) {
+        case ENOTCONN:
+            vfu_log(vfu_ctx, LOG_DEBUG, "reactor: client disconnected");
+            pthread_mutex_lock(&reactor->lock);
+            entry->attached = false;
+            pthread_mutex_unlock(&reactor->lock);
+            return true;
+        case EBUSY:
+            return false;
+        default:
+            vfu_log(vfu_ctx, LOG_ERR, "reactor: failed to run context: %m");
+            return true;
+        }
+    }
+
+    return true;
+}
+
+static void *
+reactor_worker(void *arg)
+{
+    vfu_reactor_t *reactor = arg;
+    struct reactor_entry *entry;
+    struct epoll_event ev;
+    bool attached;
+    bool rearm;
+    int ret;
+
+    for (;;) {
+        ret = epoll_wait(reactor->epoll_fd, &ev, 1, -1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (void *)(uintptr_t)errno;
+        }
+
+        if (ev.data.u64 == REACTOR_STOP_ID) {
+            return NULL;
+        }
+
+        pthread_mutex_lock(&reactor->lock);
+        entry = reactor_find_locked(reactor, ev.data.u64);
+        if (entry == NULL || entry->removed) {
+            pthread_mutex_unlock(&reactor->lock);
+            continue;
+        }
+        entry->busy = true;
+        entry->resume = false;
+        attached = entry->attached;
+        pthread_mutex_unlock(&reactor->lock);
+
+        rearm = reactor_handle(reactor, entry, attached);
+
+        pthread_mutex_lock(&reactor->lock);
+        entry->busy = false;
+        if (entry->removed) {
+            pthread_cond_broadcast(&reactor->cond);
+        } else if (rearm || entry->resume) {
+            reactor_rearm_locked(reactor, entry);
+        } else {
+            entry->stalled = true;
+        }
+        pthread_mutex_unlock(&reactor->lock);
+    }
+}
+
+EXPORT int
+vfu_reactor_run(vfu_reactor_t *reactor)
+{
+    struct reactor_entry *entry;
+    pthread_t *threads;
+    unsigned int i, nr_threads;
+    uint64_t val;
+    void *res;
+    int ret = 0;
+
+    assert(reactor != NULL);
+
+    /* Retry contexts that failed to be re-armed last time. */
+    pthread_mutex_lock(&reactor->lock);
+    LIST_FOREACH(entry, &reactor->entries, entry) {
+        if (entry->fd == -1 && reactor_arm_locked(reactor, entry) < 0) {
+            ret = errno;
+            pthread_mutex_unlock(&reactor->lock);
+            return ERROR_INT(ret);
+        }
+    }
+    pthread_mutex_unlock(&reactor->lock);
+
+    threads = calloc(reactor->nr_workers, sizeof(*threads));
+    if (threads == NULL) {
+        return -1;
+    }
+
+    for (nr_threads = 0; nr_threads < reactor->nr_workers - 1; nr_threads++) {
+        ret = pthread_create(&threads[nr_threads], NULL, reactor_worker,
+                             reactor);
+        if (ret != 0) {
+            vfu_reactor_stop(reactor);
+            break;
+        }
+    }
+
+    if (ret == 0) {
+        ret = (int)(uintptr_t)reactor_worker(reactor);
+    }
+
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i], &res);
+        if (ret == 0) {
+            ret = (int)(uintptr_t)res;
+        }
+    }
+
+    free(threads);
+
+    /* Reset the stop request, so the reactor can be run again. */
+    (void) read(reactor->stop_fd, &val, sizeof(val));
+
+    if (ret == 0) {
+        ret = reactor->err;
+    }
+    reactor->err = 0;
+
+    return ret == 0 ? 0 : ERROR_INT(ret);
+}
+
+EXPORT void
+vfu_reactor_stop(vfu_reactor_t *reactor)
+{
+    uint64_t val = 1;
+
+    assert(reactor != NULL);
+
+    (void) write(reactor->stop_fd, &val, sizeof(val));
+}
+
+EXPORT void
+vfu_reactor_destroy(vfu_reactor_t *reactor)
+{
+    struct reactor_entry *entry;
+
+    if (reactor == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&reactor->lock);
+    while ((entry = LIST_FIRST(&reactor->entries)) != NULL) {
+        reactor_remove_locked(reactor, entry);
+    }
+    pthread_mutex_unlock(&reactor->lock);
+
+    pthread_cond_destroy(&reactor->cond);
+    pthread_mutex_destroy(&reactor->lock);
+    close_safely(&reactor->stop_fd);
+    close_safely(&reactor->epoll_fd);
+    free(reactor);
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
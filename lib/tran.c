@@ -44,9 +44,6 @@
 #include "migration.h"
 #include "tran.h"
 
-// FIXME: is this the value we want?
-#define SERVER_MAX_FDS 8
-
 /*
  * Expected JSON is of the form:
  *
@@ -59,18 +56,31 @@
  *         },
  *         "twin_socket": {
  *             "supported": true,
- *             "fd_index": 0
- *         }
+ *             "fd_index": 0,
+ *             "nr_sockets": 4
+ *         },
+ *         "write_multiple": true,
+ *         "posted_writes": true,
+ *         "io_fds_changed": true
  *     }
  * }
  *
- * with everything being optional. Note that json_object_get_uint64() is only
- * available in newer library versions, so we don't use it.
+ * with everything being optional. "nr_sockets" is the number of twin sockets
+ * the client is prepared to accept, from 1 to VFU_MAX_CMD_SOCKETS (defaulting
+ * to one); the server passes that many consecutive file descriptors starting
+ * at "fd_index". If the client asks for "posted_writes", region writes are
+ * not replied to; the server echoes the capability if it agrees (see
+ * LIBVFIO_USER_FLAG_POSTED_WRITES). Likewise "io_fds_changed" means the client
+ * handles VFIO_USER_REGION_IO_FDS_CHANGED notifications. Note that
+ * json_object_get_uint64() is only available in newer library versions, so we
+ * don't use it.
  */
 int
 tran_parse_version_json(const char *json_str, int *client_max_fdsp,
                         size_t *client_max_data_xfer_sizep, size_t *pgsizep,
-                        bool *twin_socket_supportedp)
+                        bool *twin_socket_supportedp,
+                        size_t *twin_socket_nrp, bool *posted_writesp,
+                        bool *io_fds_changedp)
 {
     struct json_object *jo_caps = NULL;
     struct json_object *jo_top = NULL;
@@ -138,6 +148,7 @@ tran_parse_version_json(const char *json_str, int *client_max_fdsp,
 
     if (json_object_object_get_ex(jo_caps, "twin_socket", &jo)) {
         struct json_object *jo2 = NULL;
+        int64_t nr;
 
         if (json_object_get_type(jo) != json_type_object) {
             goto out;
@@ -155,6 +166,49 @@ tran_parse_version_json(const char *json_str, int *client_max_fdsp,
                 goto out;
             }
         }
+
+        if (json_object_object_get_ex(jo, "nr_sockets", &jo2) &&
+            twin_socket_nrp != NULL) {
+            if (json_object_get_type(jo2) != json_type_int) {
+                goto out;
+            }
+
+            errno = 0;
+            nr = json_object_get_int64(jo2);
+
+            if (errno != 0 || nr < 1 || nr > VFU_MAX_CMD_SOCKETS) {
+                goto out;
+            }
+            *twin_socket_nrp = (size_t)nr;
+        }
+    }
+
+    if (json_object_object_get_ex(jo_caps, "posted_writes", &jo) &&
+        posted_writesp != NULL) {
+        if (json_object_get_type(jo) != json_type_boolean) {
+            goto out;
+        }
+
+        errno = 0;
+        *posted_writesp = json_object_get_boolean(jo);
+
+        if (errno != 0) {
+            goto out;
+        }
+    }
+
+    if (json_object_object_get_ex(jo_caps, "io_fds_changed", &jo) &&
+        io_fds_changedp != NULL) {
+        if (json_object_get_type(jo) != json_type_boolean) {
+            goto out;
+        }
+
+        errno = 0;
+        *io_fds_changedp = json_object_get_boolean(jo);
+
+        if (errno != 0) {
+            goto out;
+        }
     }
 
     ret = 0;
@@ -170,7 +224,8 @@ out:
 
 static int
 recv_version(vfu_ctx_t *vfu_ctx, uint16_t *msg_idp,
-             struct vfio_user_version **versionp, bool *twin_socket_supportedp)
+             struct vfio_user_version **versionp, bool *twin_socket_supportedp,
+             size_t *twin_socket_nrp)
 {
     struct vfio_user_version *cversion = NULL;
     vfu_msg_t msg = { { 0 } };
@@ -221,6 +276,9 @@ recv_version(vfu_ctx_t *vfu_ctx, uint16_t *msg_idp,
 
     vfu_ctx->client_max_fds = 1;
     vfu_ctx->client_max_data_xfer_size = VFIO_USER_DEFAULT_MAX_DATA_XFER_SIZE;
+    vfu_ctx->posted_writes = false;
+    vfu_ctx->posted_write_err = false;
+    vfu_ctx->io_fds_changed = false;
 
     if (msg.in.iov.iov_len > sizeof(*cversion)) {
         const char *json_str = (const char *)cversion->data;
@@ -235,7 +293,10 @@ recv_version(vfu_ctx_t *vfu_ctx, uint16_t *msg_idp,
 
         ret = tran_parse_version_json(json_str, &vfu_ctx->client_max_fds,
                                       &vfu_ctx->client_max_data_xfer_size,
-                                      &pgsize, twin_socket_supportedp);
+                                      &pgsize, twin_socket_supportedp,
+                                      twin_socket_nrp,
+                                      &vfu_ctx->posted_writes,
+                                      &vfu_ctx->io_fds_changed);
 
         if (ret < 0) {
             /* No client-supplied strings in the log for release build. */
@@ -249,6 +310,12 @@ recv_version(vfu_ctx_t *vfu_ctx, uint16_t *msg_idp,
             goto out;
         }
 
+        /* Only if the device allows it, and can report failed writes. */
+        if (!(vfu_ctx->flags & LIBVFIO_USER_FLAG_POSTED_WRITES) ||
+            vfu_ctx->irq_count[VFU_DEV_ERR_IRQ] == 0) {
+            vfu_ctx->posted_writes = false;
+        }
+
         if (vfu_ctx->migration != NULL && pgsize != 0) {
             ret = migration_set_pgsize(vfu_ctx->migration, pgsize);
 
@@ -339,8 +406,10 @@ json_add_uint64(struct json_object *jso, const char *key, uint64_t value)
  * be freed by the caller.
  */
 static char *
-format_server_capabilities(vfu_ctx_t *vfu_ctx, int twin_socket_fd_index)
+format_server_capabilities(vfu_ctx_t *vfu_ctx, int twin_socket_fd_index,
+                           size_t nr_twin_sockets)
 {
+    struct json_object *jo_write_multiple = NULL;
     struct json_object *jo_twin_socket = NULL;
     struct json_object *jo_migration = NULL;
     struct json_object *jo_caps = NULL;
@@ -360,6 +429,29 @@ format_server_capabilities(vfu_ctx_t *vfu_ctx, int twin_socket_fd_index)
         goto out;
     }
 
+    if ((jo_write_multiple = json_object_new_boolean(true)) == NULL ||
+        json_add(jo_caps, "write_multiple", &jo_write_multiple) < 0) {
+        goto out;
+    }
+
+    if (vfu_ctx->posted_writes) {
+        struct json_object *jo_posted_writes = json_object_new_boolean(true);
+
+        if (jo_posted_writes == NULL ||
+            json_add(jo_caps, "posted_writes", &jo_posted_writes) < 0) {
+            goto out;
+        }
+    }
+
+    if (vfu_ctx->io_fds_changed) {
+        struct json_object *jo_io_fds_changed = json_object_new_boolean(true);
+
+        if (jo_io_fds_changed == NULL ||
+            json_add(jo_caps, "io_fds_changed", &jo_io_fds_changed) < 0) {
+            goto out;
+        }
+    }
+
     if (vfu_ctx->migration != NULL) {
         if ((jo_migration = json_object_new_object()) == NULL) {
             goto out;
@@ -385,7 +477,9 @@ format_server_capabilities(vfu_ctx_t *vfu_ctx, int twin_socket_fd_index)
         if ((jo_supported = json_object_new_boolean(true)) == NULL ||
             json_add(jo_twin_socket, "supported", &jo_supported) < 0 ||
             json_add_uint64(jo_twin_socket, "fd_index",
-                            twin_socket_fd_index) < 0) {
+                            twin_socket_fd_index) < 0 ||
+            json_add_uint64(jo_twin_socket, "nr_sockets",
+                            nr_twin_sockets) < 0) {
             goto out;
         }
 
@@ -402,6 +496,7 @@ format_server_capabilities(vfu_ctx_t *vfu_ctx, int twin_socket_fd_index)
     caps_str = strdup(json_object_to_json_string(jo_top));
 
 out:
+    json_object_put(jo_write_multiple);
     json_object_put(jo_twin_socket);
     json_object_put(jo_migration);
     json_object_put(jo_caps);
@@ -411,16 +506,18 @@ out:
 
 static int
 send_version(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
-             struct vfio_user_version *cversion, int client_cmd_socket_fd)
+             struct vfio_user_version *cversion, int *client_cmd_socket_fds,
+             size_t nr_client_cmd_sockets)
 {
-    int twin_socket_fd_index = client_cmd_socket_fd >= 0 ? 0 : -1;
+    int twin_socket_fd_index = nr_client_cmd_sockets > 0 ? 0 : -1;
     struct vfio_user_version sversion = { 0 };
     struct iovec iovecs[2] = { { 0 } };
     vfu_msg_t msg = { { 0 } };
     char *server_caps = NULL;
     int ret;
 
-    server_caps = format_server_capabilities(vfu_ctx, twin_socket_fd_index);
+    server_caps = format_server_capabilities(vfu_ctx, twin_socket_fd_index,
+                                             nr_client_cmd_sockets);
     if (server_caps == NULL) {
         errno = ENOMEM;
         return -1;
@@ -441,10 +538,10 @@ send_version(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
     msg.hdr.msg_id = msg_id;
     msg.out_iovecs = iovecs;
     msg.nr_out_iovecs = 2;
-    if (client_cmd_socket_fd >= 0) {
-        msg.out.fds = &client_cmd_socket_fd;
-        msg.out.nr_fds = 1;
-        assert(msg.out.fds[twin_socket_fd_index] == client_cmd_socket_fd);
+    if (nr_client_cmd_sockets > 0) {
+        msg.out.fds = client_cmd_socket_fds;
+        msg.out.nr_fds = nr_client_cmd_sockets;
+        assert(twin_socket_fd_index == 0);
     }
 
     ret = vfu_ctx->tran->reply(vfu_ctx, &msg, 0);
@@ -453,48 +550,79 @@ send_version(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
 }
 
 int
-tran_negotiate(vfu_ctx_t *vfu_ctx, int *client_cmd_socket_fdp)
+tran_negotiate(vfu_ctx_t *vfu_ctx, int *client_cmd_socket_fds,
+               size_t *nr_client_cmd_socketsp)
 {
     struct vfio_user_version *client_version = NULL;
-    int client_cmd_socket_fds[2] = { -1, -1 };
+    int remote_fds[VFU_MAX_CMD_SOCKETS];
+    int local_fds[VFU_MAX_CMD_SOCKETS];
     bool twin_socket_supported = false;
+    size_t twin_socket_nr = 1;
     uint16_t msg_id = 0x0bad;
+    size_t nr = 0;
+    size_t i;
     int ret;
 
     ret = recv_version(vfu_ctx, &msg_id, &client_version,
-                       &twin_socket_supported);
+                       &twin_socket_supported, &twin_socket_nr);
 
     if (ret < 0) {
         vfu_log(vfu_ctx, LOG_ERR, "failed to recv version: %m");
         return ret;
     }
 
-    if (twin_socket_supported && client_cmd_socket_fdp != NULL &&
+    if (twin_socket_supported && client_cmd_socket_fds != NULL &&
         vfu_ctx->client_max_fds > 0) {
-        if (socketpair(AF_UNIX, SOCK_STREAM, 0, client_cmd_socket_fds) == -1) {
+        nr = MIN(vfu_ctx->max_cmd_sockets, twin_socket_nr);
+        nr = MIN(nr, (size_t)vfu_ctx->client_max_fds);
+    }
+
+    for (i = 0; i < nr; i++) {
+        int fds[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
             vfu_log(vfu_ctx, LOG_ERR, "failed to create cmd socket: %m");
-            return -1;
+            ret = -1;
+            nr = i;
+            goto out;
         }
+        remote_fds[i] = fds[0];
+        local_fds[i] = fds[1];
     }
 
-    ret = send_version(vfu_ctx, msg_id, client_version,
-                       client_cmd_socket_fds[0]);
+    ret = send_version(vfu_ctx, msg_id, client_version, remote_fds, nr);
+    if (ret < 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "failed to send version: %m");
+    }
 
+out:
     free(client_version);
 
     /*
-     * The remote end of the client command socket pair is no longer needed.
-     * The local end is kept only if passed to the caller on successful return.
+     * The remote ends of the client command socket pairs are no longer
+     * needed. The local ends are kept only if passed to the caller on
+     * successful return.
      */
-    close_safely(&client_cmd_socket_fds[0]);
-    if (ret < 0) {
-        vfu_log(vfu_ctx, LOG_ERR, "failed to send version: %m");
-        close_safely(&client_cmd_socket_fds[1]);
-    } else if (client_cmd_socket_fdp != NULL) {
-        *client_cmd_socket_fdp = client_cmd_socket_fds[1];
+    for (i = 0; i < nr; i++) {
+        close_safely(&remote_fds[i]);
+        if (ret < 0) {
+            close_safely(&local_fds[i]);
+        } else {
+            client_cmd_socket_fds[i] = local_fds[i];
+        }
+    }
+    if (ret == 0 && nr_client_cmd_socketsp != NULL) {
+        *nr_client_cmd_socketsp = nr;
     }
 
     return ret;
 }
 
+bool
+tran_has_buffered_request(vfu_ctx_t *vfu_ctx)
+{
+    return vfu_ctx->tran->has_buffered_request != NULL &&
+           vfu_ctx->tran->has_buffered_request(vfu_ctx);
+}
+
 /* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -58,6 +58,65 @@ struct transport_ops {
                     struct vfio_user_header *hdr,
                     void *recv_data, size_t recv_len);
 
+    /*
+     * Optional split version of send_msg(), allowing several requests to be
+     * in flight at once: send_req() sends a request whose payload is given by
+     * iovecs[1..nr_iovecs - 1] (iovecs[0] is used for the header),
+     * recv_reply_hdr() receives the header of the next reply, and
+     * recv_reply_data() then receives (part of) its payload.
+     *
+     * recv_reply_hdr() does not fail for error replies: it's up to the caller
+     * to check VFIO_USER_F_ERROR and consume any payload.
+     *
+     * @chan selects the client command socket to use, and must be less than
+     * the number returned by get_nr_cmd_sockets().
+     */
+    int (*send_req)(vfu_ctx_t *vfu_ctx, size_t chan, uint16_t msg_id,
+                    enum vfio_user_command cmd,
+                    struct iovec *iovecs, size_t nr_iovecs);
+
+    int (*recv_reply_hdr)(vfu_ctx_t *vfu_ctx, size_t chan,
+                          struct vfio_user_header *hdr);
+
+    int (*recv_reply_data)(vfu_ctx_t *vfu_ctx, size_t chan,
+                           struct iovec *iovecs, size_t nr_iovecs);
+
+    /*
+     * Optional: sends a server-to-client request with VFIO_USER_F_NO_REPLY
+     * set, on the first client command socket.
+     */
+    int (*send_notify)(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
+                       enum vfio_user_command cmd, void *data, size_t len);
+
+    /*
+     * Optional: returns a file descriptor that becomes readable when replies
+     * to server-to-client requests sent on @chan are available, if these
+     * don't arrive on the same channel as client requests.
+     */
+    int (*get_cmd_poll_fd)(vfu_ctx_t *vfu_ctx, size_t chan);
+
+    /*
+     * Optional: returns the number of client command sockets negotiated with
+     * the client, or 0 if server-to-client requests share the channel used
+     * for client requests.
+     */
+    size_t (*get_nr_cmd_sockets)(vfu_ctx_t *vfu_ctx);
+
+    /*
+     * Optional: copies the header of the next request into @hdr, without
+     * receiving the request or blocking. Fails with EAGAIN if the header
+     * hasn't arrived yet.
+     */
+    int (*peek_request_header)(vfu_ctx_t *vfu_ctx,
+                               struct vfio_user_header *hdr);
+
+    /*
+     * Optional: returns true if the header of another request has already
+     * been received. The poll fd is readable meanwhile, but checking this is
+     * cheaper.
+     */
+    bool (*has_buffered_request)(vfu_ctx_t *vfu_ctx);
+
     void (*detach)(vfu_ctx_t *vfu_ctx);
     void (*fini)(vfu_ctx_t *vfu_ctx);
 };
@@ -66,6 +125,10 @@ struct transport_ops {
 // FIXME: value?
 #define VFIO_USER_CLIENT_MAX_MSG_FDS_LIMIT (1024)
 
+/* The largest number of fd's the client may send us in a message. */
+// FIXME: is this the value we want?
+#define SERVER_MAX_FDS 8
+
 /*
  * Parse JSON supplied from the other side into the known parameters. Note: they
  * will not be set if not found in the JSON.
@@ -73,10 +136,26 @@ struct transport_ops {
 int
 tran_parse_version_json(const char *json_str, int *client_max_fdsp,
                         size_t *client_max_data_xfer_sizep, size_t *pgsizep,
-                        bool *twin_socket_supportedp);
+                        bool *twin_socket_supportedp,
+                        size_t *twin_socket_nrp, bool *posted_writesp,
+                        bool *io_fds_changedp);
 
+/*
+ * Negotiates the protocol version with the client. If @client_cmd_socket_fds
+ * is not NULL, up to vfu_ctx->max_cmd_sockets twin sockets are set up if the
+ * client supports them: the server ends are stored in @client_cmd_socket_fds
+ * and their number in @nr_client_cmd_socketsp.
+ */
 int
-tran_negotiate(vfu_ctx_t *vfu_ctx, int *client_cmd_socket_fdp);
+tran_negotiate(vfu_ctx_t *vfu_ctx, int *client_cmd_socket_fds,
+               size_t *nr_client_cmd_socketsp);
+
+/*
+ * Returns true if the transport has already received another request, which
+ * the poll fd doesn't necessarily signal.
+ */
+bool
+tran_has_buffered_request(vfu_ctx_t *vfu_ctx);
 
 #endif /* LIB_VFIO_USER_TRAN_H */
 
@@ -286,7 +286,7 @@ tran_pipe_attach(vfu_ctx_t *vfu_ctx)
     tp->in_fd = STDIN_FILENO;
     tp->out_fd = STDOUT_FILENO;
 
-    ret = tran_negotiate(vfu_ctx, NULL);
+    ret = tran_negotiate(vfu_ctx, NULL, NULL);
     if (ret < 0) {
         ret = errno;
         tp->in_fd = -1;
@@ -30,6 +30,8 @@
  *
  */
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -42,18 +44,59 @@
 #include <stdio.h>
 
 #include "tran_sock.h"
+#include "tran_uring.h"
 
 typedef struct {
     int listen_fd;
     int conn_fd;
-    int client_cmd_socket_fd;
+    int client_cmd_socket_fds[VFU_MAX_CMD_SOCKETS];
+    size_t nr_client_cmd_sockets;
+    /* conn_fd I/O goes through io_uring, see tran_sock_uring_attach() */
+    struct tran_uring *uring;
+    /*
+     * Staging buffer for received requests, see rx_fill(): rx_head is the
+     * start of the next request, rx_tail the end of the data received so far.
+     */
+    char *rx_buf;
+    size_t rx_head;
+    size_t rx_tail;
+    /* fds received with the request starting at rx_fds_pos */
+    int rx_fds[VFIO_USER_CLIENT_MAX_MSG_FDS_LIMIT];
+    size_t rx_nr_fds;
+    size_t rx_fds_pos;
+    /* staged payload of the reply at rx_reply_pos, see rx_get_reply_header() */
+    size_t rx_reply_pos;
+    size_t rx_reply_len;
+    /*
+     * Non-blocking contexts poll conn_fd and rx_efd through poll_fd, and
+     * rx_efd is signalled while a request is staged, see rx_signal().
+     */
+    int poll_fd;
+    int rx_efd;
+    bool rx_signalled;
 } tran_sock_t;
 
-int
-tran_sock_send_iovec(int sock, uint16_t msg_id, bool is_reply,
-                     enum vfio_user_command cmd,
-                     struct iovec *iovecs, size_t nr_iovecs,
-                     int *fds, int count, int err)
+static void
+tran_sock_detach(vfu_ctx_t *vfu_ctx);
+
+static ssize_t
+sock_sendmsg(int sock, struct tran_uring *uring UNUSED,
+             const struct msghdr *msg)
+{
+#ifdef WITH_TRAN_URING
+    if (uring != NULL) {
+        return tran_uring_sendmsg(uring, msg);
+    }
+#else
+    assert(uring == NULL);
+#endif
+    return sendmsg(sock, msg, MSG_NOSIGNAL);
+}
+
+static int
+send_iovec(int sock, struct tran_uring *uring, uint16_t msg_id, bool is_reply,
+           enum vfio_user_command cmd, struct iovec *iovecs, size_t nr_iovecs,
+           int *fds, int count, int err)
 {
     int ret;
     struct vfio_user_header hdr = { .msg_id = msg_id };
@@ -107,7 +150,7 @@ tran_sock_send_iovec(int sock, uint16_t msg_id, bool is_reply,
         memcpy(CMSG_DATA(cmsg), fds, size);
     }
 
-    ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    ret = sock_sendmsg(sock, uring, &msg);
 
     if (ret == -1) {
         /* Treat a failed write due to EPIPE the same as a short write. */
@@ -122,6 +165,16 @@ tran_sock_send_iovec(int sock, uint16_t msg_id, bool is_reply,
     return 0;
 }
 
+int
+tran_sock_send_iovec(int sock, uint16_t msg_id, bool is_reply,
+                     enum vfio_user_command cmd,
+                     struct iovec *iovecs, size_t nr_iovecs,
+                     int *fds, int count, int err)
+{
+    return send_iovec(sock, NULL, msg_id, is_reply, cmd, iovecs, nr_iovecs,
+                      fds, count, err);
+}
+
 int
 tran_sock_send(int sock, uint16_t msg_id, bool is_reply,
                enum vfio_user_command cmd,
@@ -381,7 +434,8 @@ tran_sock_init(vfu_ctx_t *vfu_ctx)
 
     ts->listen_fd = -1;
     ts->conn_fd = -1;
-    ts->client_cmd_socket_fd = -1;
+    ts->poll_fd = -1;
+    ts->rx_efd = -1;
 
     if ((ts->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
         ret = errno;
@@ -437,6 +491,16 @@ tran_sock_get_poll_fd(vfu_ctx_t *vfu_ctx)
 {
     tran_sock_t *ts = vfu_ctx->tran_data;
 
+#ifdef WITH_TRAN_URING
+    if (ts->uring != NULL) {
+        return tran_uring_get_poll_fd(ts->uring);
+    }
+#endif
+
+    if (ts->poll_fd != -1) {
+        return ts->poll_fd;
+    }
+
     if (ts->conn_fd != -1) {
         return ts->conn_fd;
     }
@@ -444,6 +508,39 @@ tran_sock_get_poll_fd(vfu_ctx_t *vfu_ctx)
     return ts->listen_fd;
 }
 
+/*
+ * Sets up the poll fd of a non-blocking context: requests already in the
+ * staging buffer don't make conn_fd readable, so the poll fd also waits on
+ * rx_efd, which is signalled meanwhile.
+ */
+static int
+tran_sock_setup_poll_fd(tran_sock_t *ts)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    ts->rx_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ts->rx_efd == -1) {
+        return -1;
+    }
+
+    ts->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ts->poll_fd == -1) {
+        goto err;
+    }
+
+    if (epoll_ctl(ts->poll_fd, EPOLL_CTL_ADD, ts->conn_fd, &ev) == -1 ||
+        epoll_ctl(ts->poll_fd, EPOLL_CTL_ADD, ts->rx_efd, &ev) == -1) {
+        goto err;
+    }
+
+    return 0;
+
+err:
+    close_safely(&ts->poll_fd);
+    close_safely(&ts->rx_efd);
+    return -1;
+}
+
 static int
 tran_sock_attach(vfu_ctx_t *vfu_ctx)
 {
@@ -466,12 +563,351 @@ tran_sock_attach(vfu_ctx_t *vfu_ctx)
         return -1;
     }
 
-    ret = tran_negotiate(vfu_ctx, &ts->client_cmd_socket_fd);
+    ret = tran_negotiate(vfu_ctx, ts->client_cmd_socket_fds,
+                         &ts->nr_client_cmd_sockets);
     if (ret < 0) {
         close_safely(&ts->conn_fd);
         return -1;
     }
 
+    if ((vfu_ctx->flags & LIBVFIO_USER_FLAG_ATTACH_NB) &&
+        tran_sock_setup_poll_fd(ts) < 0) {
+        ret = errno;
+        vfu_log(vfu_ctx, LOG_ERR, "failed to set up poll fd: %m");
+        tran_sock_detach(vfu_ctx);
+        return ERROR_INT(ret);
+    }
+
+    return 0;
+}
+
+static void
+rx_close_fds(tran_sock_t *ts)
+{
+    size_t i;
+
+    for (i = 0; i < ts->rx_nr_fds; i++) {
+        close_safely(&ts->rx_fds[i]);
+    }
+    ts->rx_nr_fds = 0;
+}
+
+/*
+ * Returns the offset in the staging buffer of the last request starting at or
+ * after @start, or SIZE_MAX if there's none.
+ */
+static size_t
+rx_last_request(tran_sock_t *ts, size_t start)
+{
+    size_t pos = ts->rx_head;
+    size_t last = SIZE_MAX;
+    uint32_t msg_size;
+
+    while (pos < ts->rx_tail) {
+        if (pos >= start) {
+            last = pos;
+        }
+        if (ts->rx_tail - pos < sizeof(struct vfio_user_header)) {
+            break;
+        }
+        memcpy(&msg_size, ts->rx_buf + pos +
+               offsetof(struct vfio_user_header, msg_size), sizeof(msg_size));
+        if (msg_size < sizeof(struct vfio_user_header)) {
+            /* Invalid, and will be rejected once we get to it. */
+            break;
+        }
+        pos += msg_size;
+    }
+
+    return last;
+}
+
+/*
+ * Receives up to @len bytes into the staging buffer with a single recvmsg(),
+ * which may pick up the payload of the request along with its header, or
+ * several requests.
+ *
+ * fds are sent along with the header of their request, and the kernel doesn't
+ * merge data past the point where they arrived, so they belong to the last
+ * request starting in the data received.
+ */
+static int
+rx_fill(tran_sock_t *ts, size_t len, int sock_flags)
+{
+    struct iovec iov = {
+        .iov_base = ts->rx_buf + ts->rx_tail,
+        .iov_len = len
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_controllen = CMSG_SPACE(sizeof(int) *
+                                     VFIO_USER_CLIENT_MAX_MSG_FDS_LIMIT),
+    };
+    struct cmsghdr *cmsg;
+    size_t start = ts->rx_tail;
+    size_t size;
+    int ret;
+
+    msg.msg_control = alloca(msg.msg_controllen);
+
+    ret = recvmsg(ts->conn_fd, &msg, sock_flags);
+    if (ret == -1) {
+        return -1;
+    } else if (ret == 0) {
+        return ERROR_INT(ENOMSG);
+    }
+
+    ts->rx_tail += ret;
+
+    if (msg.msg_flags & MSG_CTRUNC) {
+        return ERROR_INT(EFAULT);
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        if (cmsg->cmsg_len < CMSG_LEN(sizeof(int))) {
+            return ERROR_INT(EINVAL);
+        }
+        size = cmsg->cmsg_len - CMSG_LEN(0);
+        if (size % sizeof(int) != 0) {
+            return ERROR_INT(EINVAL);
+        }
+
+        /*
+         * We never read past the request pending fds belong to, so more fds
+         * mean the client sent some in the middle of a request.
+         */
+        if (ts->rx_nr_fds > 0) {
+            rx_close_fds(ts);
+            ts->rx_nr_fds = size / sizeof(int);
+            memcpy(ts->rx_fds, CMSG_DATA(cmsg), size);
+            rx_close_fds(ts);
+            return ERROR_INT(ECONNRESET);
+        }
+
+        ts->rx_nr_fds = size / sizeof(int);
+        memcpy(ts->rx_fds, CMSG_DATA(cmsg), size);
+
+        ts->rx_fds_pos = rx_last_request(ts, start);
+        if (ts->rx_fds_pos == SIZE_MAX) {
+            rx_close_fds(ts);
+            return ERROR_INT(ECONNRESET);
+        }
+        break;
+    }
+
+    return ret;
+}
+
+/*
+ * Makes rx_efd, and so the poll fd, readable if and only if the header of a
+ * request starting at @next is already staged.
+ */
+static void
+rx_signal(tran_sock_t *ts, size_t next)
+{
+    bool staged = next <= ts->rx_tail &&
+                  ts->rx_tail - next >= sizeof(struct vfio_user_header);
+    eventfd_t val;
+
+    if (ts->rx_efd == -1 || staged == ts->rx_signalled) {
+        return;
+    }
+
+    if (staged) {
+        (void) eventfd_write(ts->rx_efd, 1);
+    } else {
+        (void) eventfd_read(ts->rx_efd, &val);
+    }
+    ts->rx_signalled = staged;
+}
+
+static int
+rx_alloc(tran_sock_t *ts)
+{
+    if (ts->rx_buf == NULL) {
+        ts->rx_buf = malloc(SERVER_MAX_MSG_SIZE);
+        if (ts->rx_buf == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Moves the unconsumed data to the start of the staging buffer.
+ */
+static void
+rx_compact(tran_sock_t *ts)
+{
+    if (ts->rx_head == 0) {
+        return;
+    }
+
+    memmove(ts->rx_buf, ts->rx_buf + ts->rx_head, ts->rx_tail - ts->rx_head);
+    ts->rx_tail -= ts->rx_head;
+    if (ts->rx_nr_fds > 0) {
+        ts->rx_fds_pos -= ts->rx_head;
+    }
+    ts->rx_reply_pos -= MIN(ts->rx_reply_pos, ts->rx_head);
+    ts->rx_head = 0;
+}
+
+/*
+ * Removes @len bytes at @pos from the staging buffer.
+ */
+static void
+rx_cut(tran_sock_t *ts, size_t pos, size_t len)
+{
+    memmove(ts->rx_buf + pos, ts->rx_buf + pos + len,
+            ts->rx_tail - pos - len);
+    ts->rx_tail -= len;
+    if (ts->rx_nr_fds > 0 && ts->rx_fds_pos > pos) {
+        ts->rx_fds_pos -= len;
+    }
+}
+
+/*
+ * Makes sure the header of the next request is in the staging buffer, reading
+ * more data only if it isn't.
+ */
+static int
+rx_get_header(tran_sock_t *ts, int sock_flags)
+{
+    size_t len;
+
+    if (rx_alloc(ts) < 0) {
+        return -1;
+    }
+
+    while (ts->rx_tail - ts->rx_head < sizeof(struct vfio_user_header)) {
+        if (ts->rx_nr_fds > 0 && ts->rx_fds_pos != ts->rx_head) {
+            /* A rejected request was shorter than its msg_size claimed. */
+            rx_close_fds(ts);
+            return ERROR_INT(ECONNRESET);
+        }
+
+        /* Move the partial header, if any, to the start of the buffer. */
+        rx_compact(ts);
+
+        len = SERVER_MAX_MSG_SIZE - ts->rx_tail;
+        if (ts->rx_nr_fds > 0) {
+            /* Don't pick up the fds of a later request just yet. */
+            len = sizeof(struct vfio_user_header) - ts->rx_tail;
+        }
+
+        if (rx_fill(ts, len, sock_flags) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Takes the header of the next reply out of the staging buffer, for replies
+ * sent on conn_fd. The client may have sent requests ahead of it, which stay
+ * staged for vfu_run_ctx(). Those are read exactly up to their end, so their
+ * fds are still received along with them, see rx_fill(). Whatever part of the
+ * reply payload is already staged is left at rx_reply_pos for
+ * rx_get_reply_data().
+ */
+static int
+rx_get_reply_header(tran_sock_t *ts, struct vfio_user_header *hdr)
+{
+    size_t pos;
+    size_t len;
+
+    if (rx_alloc(ts) < 0) {
+        return -1;
+    }
+
+    pos = ts->rx_head;
+
+    for (;;) {
+        len = ts->rx_tail - pos;
+        if (len >= sizeof(*hdr)) {
+            memcpy(hdr, ts->rx_buf + pos, sizeof(*hdr));
+            if (hdr->msg_size < sizeof(*hdr)) {
+                return ERROR_INT(EINVAL);
+            }
+            if ((hdr->flags & VFIO_USER_F_TYPE_MASK) ==
+                VFIO_USER_F_TYPE_REPLY) {
+                break;
+            }
+            if (len >= hdr->msg_size) {
+                pos += hdr->msg_size;
+                continue;
+            }
+            len = hdr->msg_size - len;
+        } else {
+            len = sizeof(*hdr) - len;
+        }
+
+        if (ts->rx_tail + len > SERVER_MAX_MSG_SIZE) {
+            pos -= ts->rx_head;
+            rx_compact(ts);
+            if (ts->rx_tail + len > SERVER_MAX_MSG_SIZE) {
+                return ERROR_INT(ENOBUFS);
+            }
+        }
+
+        if (rx_fill(ts, len, 0) < 0) {
+            return -1;
+        }
+    }
+
+    rx_cut(ts, pos, sizeof(*hdr));
+    ts->rx_reply_pos = pos;
+    ts->rx_reply_len = MIN(ts->rx_tail - pos, hdr->msg_size - sizeof(*hdr));
+    return 0;
+}
+
+/*
+ * Receives reply payload into @iovecs, first what's staged, then the rest
+ * straight from conn_fd: the staged part always ends at rx_tail.
+ */
+static int
+rx_get_reply_data(tran_sock_t *ts, struct iovec *iovecs, size_t nr_iovecs,
+                  size_t len)
+{
+    struct msghdr msg = { .msg_iov = iovecs, .msg_iovlen = nr_iovecs };
+    size_t staged = MIN(ts->rx_reply_len, len);
+    size_t n;
+    ssize_t ret;
+
+    while (staged > 0) {
+        n = MIN(staged, msg.msg_iov->iov_len);
+        memcpy(msg.msg_iov->iov_base, ts->rx_buf + ts->rx_reply_pos, n);
+        rx_cut(ts, ts->rx_reply_pos, n);
+        ts->rx_reply_len -= n;
+        staged -= n;
+        len -= n;
+        msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+        msg.msg_iov->iov_len -= n;
+        if (msg.msg_iov->iov_len == 0) {
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+
+    ret = recvmsg(ts->conn_fd, &msg, MSG_WAITALL);
+    if (ret < 0) {
+        return -1;
+    } else if (ret == 0) {
+        return ERROR_INT(ENOMSG);
+    } else if ((size_t)ret != len) {
+        return ERROR_INT(ECONNRESET);
+    }
+
     return 0;
 }
 
@@ -481,6 +917,7 @@ tran_sock_get_request_header(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
 {
     tran_sock_t *ts;
     int sock_flags = 0;
+    int ret;
 
     assert(vfu_ctx != NULL);
     assert(vfu_ctx->tran_data != NULL);
@@ -492,21 +929,84 @@ tran_sock_get_request_header(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
         return ERROR_INT(ENOTCONN);
     }
 
+#ifdef WITH_TRAN_URING
+    if (ts->uring != NULL) {
+        return tran_uring_recv_hdr(ts->uring, hdr, fds, nr_fds,
+                                   vfu_ctx->flags & LIBVFIO_USER_FLAG_ATTACH_NB);
+    }
+#endif
+
     /*
-     * TODO ideally we should set O_NONBLOCK on the fd so that the syscall is
-     * faster (?). I tried that and get short reads, so we need to store the
-     * partially received buffer somewhere and retry.
+     * A partially received header stays in the staging buffer, so there's no
+     * need for MSG_WAITALL.
      */
     if (vfu_ctx->flags & LIBVFIO_USER_FLAG_ATTACH_NB) {
-        sock_flags = MSG_DONTWAIT | MSG_WAITALL;
+        sock_flags = MSG_DONTWAIT;
+    }
+
+    ret = rx_get_header(ts, sock_flags);
+    if (ret < 0) {
+        return ret;
+    }
+
+    memcpy(hdr, ts->rx_buf + ts->rx_head, sizeof(*hdr));
+
+    if (ts->rx_nr_fds > 0 && ts->rx_fds_pos == ts->rx_head) {
+        assert(ts->rx_nr_fds <= *nr_fds);
+        memcpy(fds, ts->rx_fds, ts->rx_nr_fds * sizeof(int));
+        *nr_fds = ts->rx_nr_fds;
+        ts->rx_nr_fds = 0;
+    } else {
+        *nr_fds = 0;
+    }
+
+    ts->rx_head += sizeof(*hdr);
+
+    if (hdr->msg_size >= sizeof(*hdr)) {
+        rx_signal(ts, ts->rx_head + hdr->msg_size - sizeof(*hdr));
+    } else {
+        rx_signal(ts, SIZE_MAX);
     }
-    return get_msg(hdr, sizeof(*hdr), fds, nr_fds, ts->conn_fd, sock_flags);
+    return 0;
+}
+
+static int
+tran_sock_peek_request_header(vfu_ctx_t *vfu_ctx,
+                              struct vfio_user_header *hdr)
+{
+    tran_sock_t *ts;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    if (ts->conn_fd == -1) {
+        return ERROR_INT(ENOTCONN);
+    }
+
+#ifdef WITH_TRAN_URING
+    if (ts->uring != NULL) {
+        return tran_uring_peek_hdr(ts->uring, hdr);
+    }
+#endif
+
+    ret = rx_get_header(ts, MSG_DONTWAIT);
+    rx_signal(ts, ts->rx_head);
+    if (ret < 0) {
+        return ret;
+    }
+
+    memcpy(hdr, ts->rx_buf + ts->rx_head, sizeof(*hdr));
+    return 0;
 }
 
 static int
 tran_sock_recv_body(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
 {
     tran_sock_t *ts;
+    size_t len;
     int ret;
 
     assert(vfu_ctx != NULL);
@@ -528,7 +1028,31 @@ tran_sock_recv_body(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
         return -1;
     }
 
-    ret = recv(ts->conn_fd, msg->in.iov.iov_base, msg->in.iov.iov_len, 0);
+#ifdef WITH_TRAN_URING
+    if (ts->uring != NULL) {
+        ret = tran_uring_recv(ts->uring, msg->in.iov.iov_base,
+                              msg->in.iov.iov_len);
+        if (ret < 0) {
+            ret = errno;
+            free(msg->in.iov.iov_base);
+            msg->in.iov.iov_base = NULL;
+            return ERROR_INT(ret);
+        }
+        return 0;
+    }
+#endif
+
+    /* Usually the whole payload was received along with the header. */
+    len = MIN(ts->rx_tail - ts->rx_head, msg->in.iov.iov_len);
+    memcpy(msg->in.iov.iov_base, ts->rx_buf + ts->rx_head, len);
+    ts->rx_head += len;
+
+    if (len == msg->in.iov.iov_len) {
+        return 0;
+    }
+
+    ret = recv(ts->conn_fd, (char *)msg->in.iov.iov_base + len,
+               msg->in.iov.iov_len - len, MSG_WAITALL);
 
     if (ret < 0) {
         ret = errno;
@@ -539,9 +1063,9 @@ tran_sock_recv_body(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
         free(msg->in.iov.iov_base);
         msg->in.iov.iov_base = NULL;
         return ERROR_INT(ENOMSG);
-    } else if (ret != (int)msg->in.iov.iov_len)  {
-        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: short read: expected=%zu, actual=%d",
-                msg->hdr.msg_id, msg->in.iov.iov_len, ret);
+    } else if (ret != (int)(msg->in.iov.iov_len - len))  {
+        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: short read: expected=%zu, actual=%zu",
+                msg->hdr.msg_id, msg->in.iov.iov_len, len + ret);
         free(msg->in.iov.iov_base);
         msg->in.iov.iov_base = NULL;
         return ERROR_INT(EINVAL);
@@ -600,9 +1124,9 @@ tran_sock_reply(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg, int err)
         iovecs[1].iov_len = msg->out.iov.iov_len;
     }
 
-    ret = tran_sock_send_iovec(ts->conn_fd, msg->hdr.msg_id, true, msg->hdr.cmd,
-                               iovecs, nr_iovecs,
-                               msg->out.fds, msg->out.nr_fds, err);
+    ret = send_iovec(ts->conn_fd, ts->uring, msg->hdr.msg_id, true,
+                     msg->hdr.cmd, iovecs, nr_iovecs,
+                     msg->out.fds, msg->out.nr_fds, err);
 
     free(iovecs);
 
@@ -624,6 +1148,76 @@ static void maybe_print_cmd_collision_warning(vfu_ctx_t *vfu_ctx) {
     }
 }
 
+/*
+ * Returns the socket used for server-to-client requests on channel @chan.
+ */
+static int
+tran_sock_cmd_fd(vfu_ctx_t *vfu_ctx, size_t chan)
+{
+    tran_sock_t *ts;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    if (ts->nr_client_cmd_sockets == 0) {
+        /* Replies on conn_fd would be taken by the io_uring receive. */
+        if (ts->uring != NULL) {
+            return ERROR_INT(ENOTSUP);
+        }
+        maybe_print_cmd_collision_warning(vfu_ctx);
+        return ts->conn_fd;
+    }
+
+    assert(chan < ts->nr_client_cmd_sockets);
+    return ts->client_cmd_socket_fds[chan];
+}
+
+static int
+tran_sock_get_cmd_poll_fd(vfu_ctx_t *vfu_ctx, size_t chan)
+{
+    tran_sock_t *ts;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    if (ts->nr_client_cmd_sockets == 0) {
+        return ERROR_INT(ENOTSUP);
+    }
+
+    assert(chan < ts->nr_client_cmd_sockets);
+    return ts->client_cmd_socket_fds[chan];
+}
+
+static size_t
+tran_sock_get_nr_cmd_sockets(vfu_ctx_t *vfu_ctx)
+{
+    tran_sock_t *ts;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    return ts->nr_client_cmd_sockets;
+}
+
+static bool
+tran_sock_has_buffered_request(vfu_ctx_t *vfu_ctx)
+{
+    tran_sock_t *ts;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    return ts->rx_tail - ts->rx_head >= sizeof(struct vfio_user_header);
+}
+
 static int
 tran_sock_send_msg(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
               enum vfio_user_command cmd,
@@ -631,22 +1225,144 @@ tran_sock_send_msg(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
               struct vfio_user_header *hdr,
               void *recv_data, size_t recv_len)
 {
-    tran_sock_t *ts;
+    int fd = tran_sock_cmd_fd(vfu_ctx, 0);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    return tran_sock_msg(fd, msg_id, cmd, send_data, send_len, hdr,
+                         recv_data, recv_len);
+}
+
+static int
+tran_sock_send_req(vfu_ctx_t *vfu_ctx, size_t chan, uint16_t msg_id,
+                   enum vfio_user_command cmd,
+                   struct iovec *iovecs, size_t nr_iovecs)
+{
+    int fd = tran_sock_cmd_fd(vfu_ctx, chan);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    return tran_sock_send_iovec(fd, msg_id, false, cmd, iovecs, nr_iovecs,
+                                NULL, 0, 0);
+}
+
+static int
+tran_sock_send_notify(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
+                      enum vfio_user_command cmd, void *data, size_t len)
+{
+    struct vfio_user_header hdr = {
+        .msg_id = msg_id,
+        .cmd = cmd,
+        .msg_size = sizeof(hdr) + len,
+        .flags = VFIO_USER_F_TYPE_COMMAND | VFIO_USER_F_NO_REPLY,
+    };
+    struct iovec iovecs[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = data, .iov_len = len },
+    };
+    struct msghdr msg = { .msg_iov = iovecs, .msg_iovlen = 2 };
+    tran_sock_t *ts = vfu_ctx->tran_data;
+    ssize_t ret;
+
+    /* Needs no reply, so it can go on conn_fd even with io_uring. */
+    if (ts->nr_client_cmd_sockets == 0 && ts->uring != NULL) {
+        ret = sock_sendmsg(ts->conn_fd, ts->uring, &msg);
+    } else {
+        ret = sendmsg(tran_sock_cmd_fd(vfu_ctx, 0), &msg, MSG_NOSIGNAL);
+    }
+
+    if (ret == -1) {
+        /* Treat a failed write due to EPIPE the same as a short write. */
+        if (errno == EPIPE) {
+            return ERROR_INT(ECONNRESET);
+        }
+        return -1;
+    } else if ((size_t)ret < hdr.msg_size) {
+        return ERROR_INT(ECONNRESET);
+    }
+
+    return 0;
+}
+
+static int
+tran_sock_recv_reply_hdr(vfu_ctx_t *vfu_ctx, size_t chan,
+                         struct vfio_user_header *hdr)
+{
+    tran_sock_t *ts = vfu_ctx->tran_data;
+    int ret;
     int fd;
 
-    assert(vfu_ctx != NULL);
-    assert(vfu_ctx->tran_data != NULL);
+    assert(hdr != NULL);
 
-    ts = vfu_ctx->tran_data;
+    fd = tran_sock_cmd_fd(vfu_ctx, chan);
+    if (fd == -1) {
+        return -1;
+    }
+
+    /* Replies on conn_fd may already be staged behind requests. */
+    if (fd == ts->conn_fd) {
+        ret = rx_get_reply_header(ts, hdr);
+        rx_signal(ts, ts->rx_head);
+    } else {
+        ret = get_msg(hdr, sizeof(*hdr), NULL, NULL, fd, 0);
+    }
+    if (ret < 0) {
+        return ret;
+    }
 
-    fd = ts->client_cmd_socket_fd;
+    if ((hdr->flags & VFIO_USER_F_TYPE_MASK) != VFIO_USER_F_TYPE_REPLY) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (hdr->msg_size < sizeof(*hdr) || hdr->msg_size > SERVER_MAX_MSG_SIZE) {
+        return ERROR_INT(EINVAL);
+    }
+
+    return 0;
+}
+
+static int
+tran_sock_recv_reply_data(vfu_ctx_t *vfu_ctx, size_t chan,
+                          struct iovec *iovecs, size_t nr_iovecs)
+{
+    struct msghdr msg = { .msg_iov = iovecs, .msg_iovlen = nr_iovecs };
+    tran_sock_t *ts = vfu_ctx->tran_data;
+    size_t len = 0;
+    ssize_t ret;
+    size_t i;
+    int fd;
+
+    for (i = 0; i < nr_iovecs; i++) {
+        len += iovecs[i].iov_len;
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+
+    fd = tran_sock_cmd_fd(vfu_ctx, chan);
     if (fd == -1) {
-        maybe_print_cmd_collision_warning(vfu_ctx);
-        fd = ts->conn_fd;
+        return -1;
     }
 
-    return tran_sock_msg(fd, msg_id, cmd, send_data, send_len, hdr, recv_data,
-                         recv_len);
+    if (fd == ts->conn_fd) {
+        return rx_get_reply_data(ts, iovecs, nr_iovecs, len);
+    }
+
+    ret = recvmsg(fd, &msg, MSG_WAITALL);
+    if (ret < 0) {
+        return -1;
+    } else if (ret == 0) {
+        return ERROR_INT(ENOMSG);
+    } else if ((size_t)ret != len) {
+        return ERROR_INT(ECONNRESET);
+    }
+
+    return 0;
 }
 
 static void
@@ -659,8 +1375,25 @@ tran_sock_detach(vfu_ctx_t *vfu_ctx)
     ts = vfu_ctx->tran_data;
 
     if (ts != NULL) {
+        size_t i;
+
+#ifdef WITH_TRAN_URING
+        tran_uring_destroy(ts->uring);
+        ts->uring = NULL;
+#endif
+        close_safely(&ts->poll_fd);
+        close_safely(&ts->rx_efd);
+        ts->rx_signalled = false;
         close_safely(&ts->conn_fd);
-        close_safely(&ts->client_cmd_socket_fd);
+        rx_close_fds(ts);
+        free(ts->rx_buf);
+        ts->rx_buf = NULL;
+        ts->rx_head = ts->rx_tail = 0;
+        ts->rx_reply_len = 0;
+        for (i = 0; i < ts->nr_client_cmd_sockets; i++) {
+            close_safely(&ts->client_cmd_socket_fds[i]);
+        }
+        ts->nr_client_cmd_sockets = 0;
     }
 }
 
@@ -687,12 +1420,76 @@ struct transport_ops tran_sock_ops = {
     .get_poll_fd = tran_sock_get_poll_fd,
     .attach = tran_sock_attach,
     .get_request_header = tran_sock_get_request_header,
+    .peek_request_header = tran_sock_peek_request_header,
+    .recv_body = tran_sock_recv_body,
+    .reply = tran_sock_reply,
+    .recv_msg = tran_sock_recv_msg,
+    .send_msg = tran_sock_send_msg,
+    .send_req = tran_sock_send_req,
+    .send_notify = tran_sock_send_notify,
+    .recv_reply_hdr = tran_sock_recv_reply_hdr,
+    .recv_reply_data = tran_sock_recv_reply_data,
+    .get_cmd_poll_fd = tran_sock_get_cmd_poll_fd,
+    .get_nr_cmd_sockets = tran_sock_get_nr_cmd_sockets,
+    .has_buffered_request = tran_sock_has_buffered_request,
+    .detach = tran_sock_detach,
+    .fini = tran_sock_fini
+};
+
+#ifdef WITH_TRAN_URING
+
+/*
+ * Version negotiation is done on the plain socket, after which requests and
+ * replies go through io_uring.
+ */
+static int
+tran_sock_uring_attach(vfu_ctx_t *vfu_ctx)
+{
+    tran_sock_t *ts;
+    int ret;
+
+    ret = tran_sock_attach(vfu_ctx);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ts = vfu_ctx->tran_data;
+    ts->uring = tran_uring_create(ts->conn_fd);
+    if (ts->uring == NULL) {
+        ret = errno;
+        vfu_log(vfu_ctx, LOG_ERR, "failed to set up io_uring: %m");
+        tran_sock_detach(vfu_ctx);
+        return ERROR_INT(ret);
+    }
+
+    /* The ring has a poll fd of its own, and doesn't use the staging buffer. */
+    close_safely(&ts->poll_fd);
+    close_safely(&ts->rx_efd);
+
+    return 0;
+}
+
+struct transport_ops tran_sock_uring_ops = {
+    .init = tran_sock_init,
+    .get_poll_fd = tran_sock_get_poll_fd,
+    .attach = tran_sock_uring_attach,
+    .get_request_header = tran_sock_get_request_header,
+    .peek_request_header = tran_sock_peek_request_header,
     .recv_body = tran_sock_recv_body,
     .reply = tran_sock_reply,
     .recv_msg = tran_sock_recv_msg,
     .send_msg = tran_sock_send_msg,
+    .send_req = tran_sock_send_req,
+    .send_notify = tran_sock_send_notify,
+    .recv_reply_hdr = tran_sock_recv_reply_hdr,
+    .recv_reply_data = tran_sock_recv_reply_data,
+    .get_cmd_poll_fd = tran_sock_get_cmd_poll_fd,
+    .get_nr_cmd_sockets = tran_sock_get_nr_cmd_sockets,
+    .has_buffered_request = tran_sock_has_buffered_request,
     .detach = tran_sock_detach,
     .fini = tran_sock_fini
 };
 
+#endif /* WITH_TRAN_URING */
+
 /* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
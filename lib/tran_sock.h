@@ -38,6 +38,10 @@
 
 extern struct transport_ops tran_sock_ops;
 
+#ifdef WITH_TRAN_URING
+extern struct transport_ops tran_sock_uring_ops;
+#endif
+
 /*
  * These are not public routines, but for convenience, they are used by the
  * sample/test code as well as privately within libvfio-user.
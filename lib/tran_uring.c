@@ -0,0 +1,901 @@
+/*
+ * Copyright (c) 2023 Rivos Inc. All rights reserved.
+ *
+ * Authors: Mattias Nissler <mnissler@rivosinc.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * io_uring data path for the socket transport.
+ *
+ * A multishot recvmsg stays posted on the connection socket, taking buffers
+ * from a provided buffer ring, so receiving a request normally needs no system
+ * call at all: its bytes (and any fds sent with it) are already in a
+ * completion. Completed buffers are copied into a staging buffer, which
+ * requests are then parsed from, and recycled straight away. A reply is a
+ * single IORING_OP_SENDMSG, which is submitted and (as a send on a UNIX socket
+ * normally completes inline) reaped with one io_uring_enter(); that also
+ * reaps any receive completions.
+ *
+ * The poll fd is an eventfd registered with the ring, which the kernel signals
+ * for every completion. It's only cleared once a receive finds nothing to do,
+ * so it stays readable for as long as staged requests remain.
+ *
+ * Everything is protected by uring->lock, except for the wait for data, which
+ * polls the eventfd without it so that replies can still be sent.
+ */
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "tran_uring.h"
+
+/* At most the receive, a send and a cancel are submitted at any time. */
+#define URING_SQ_ENTRIES (4)
+
+/*
+ * Each receive completion takes a buffer, so there's never more than
+ * URING_NR_BUFS of them outstanding and the CQ ring can't overflow.
+ */
+#define URING_CQ_ENTRIES (32)
+#define URING_NR_BUFS (16)
+#define URING_BUF_SIZE (16 * 1024)
+#define URING_BGID (0)
+
+/*
+ * Once this much is staged, completed buffers are held back instead of being
+ * recycled, so that the receive eventually stops for lack of buffers rather
+ * than the staging buffer growing without bounds.
+ */
+#define URING_RX_MAX (SERVER_MAX_MSG_SIZE)
+
+/* user_data of our submissions */
+enum {
+    URING_RECV = 1,
+    URING_SEND,
+    URING_CANCEL,
+};
+
+/* The fds received along with the stream bytes [start, end). */
+struct uring_fds {
+    TAILQ_ENTRY(uring_fds)  entry;
+    uint64_t                start;
+    uint64_t                end;
+    size_t                  nr;
+    int                     fds[SERVER_MAX_FDS];
+};
+
+struct tran_uring {
+    pthread_mutex_t             lock;
+    int                         ring_fd;
+    int                         event_fd;
+    int                         conn_fd;
+
+    void                        *sq_ring;
+    size_t                      sq_ring_size;
+    void                        *cq_ring;
+    size_t                      cq_ring_size;
+    struct io_uring_sqe         *sqes;
+    size_t                      sqes_size;
+    unsigned                    *sq_head;
+    unsigned                    *sq_tail;
+    unsigned                    *sq_array;
+    unsigned                    sq_mask;
+    unsigned                    *cq_head;
+    unsigned                    *cq_tail;
+    struct io_uring_cqe         *cqes;
+    unsigned                    cq_mask;
+
+    struct io_uring_buf_ring    *buf_ring;
+    size_t                      buf_ring_size;
+    char                        *bufs;
+    uint16_t                    held[URING_NR_BUFS];
+    size_t                      nr_held;
+
+    /* template of the multishot receive */
+    struct msghdr               recv_msg;
+    bool                        armed;
+    bool                        eof;
+    int                         err;
+
+    /* received bytes not consumed yet */
+    char                        *rx;
+    size_t                      rx_size;
+    size_t                      rx_start;
+    size_t                      rx_end;
+    uint64_t                    rx_pos;     /* stream position of rx_start */
+    TAILQ_HEAD(, uring_fds)     fds;
+
+    bool                        send_pending;
+    int                         send_res;
+};
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+sys_io_uring_enter(int ring_fd, unsigned int to_submit,
+                   unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+static int
+sys_io_uring_register(int ring_fd, unsigned int opcode, void *arg,
+                      unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static size_t
+rx_avail(const struct tran_uring *uring)
+{
+    return uring->rx_end - uring->rx_start;
+}
+
+/* Locked. */
+static struct io_uring_sqe *
+uring_get_sqe(struct tran_uring *uring)
+{
+    unsigned tail = *uring->sq_tail;
+    unsigned idx = tail & uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[idx];
+
+    assert(tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) <=
+           uring->sq_mask);
+
+    memset(sqe, 0, sizeof(*sqe));
+    uring->sq_array[idx] = idx;
+    return sqe;
+}
+
+/* Locked. Makes the SQE from uring_get_sqe() visible to the kernel. */
+static void
+uring_push_sqe(struct tran_uring *uring)
+{
+    __atomic_store_n(uring->sq_tail, *uring->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Locked. Submits pushed SQEs, and waits for at least @min_complete
+ * completions. Returns the number of SQEs submitted, or -1 with errno set.
+ */
+static int
+uring_enter(struct tran_uring *uring, unsigned int min_complete)
+{
+    unsigned int to_submit;
+    int ret;
+
+    do {
+        to_submit = *uring->sq_tail -
+                    __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+        ret = sys_io_uring_enter(uring->ring_fd, to_submit, min_complete,
+                                 min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret;
+}
+
+/* Locked. */
+static void
+uring_buf_push(struct tran_uring *uring, uint16_t bid)
+{
+    uint16_t tail = uring->buf_ring->tail;
+    struct io_uring_buf *buf;
+
+    buf = &uring->buf_ring->bufs[tail & (URING_NR_BUFS - 1)];
+    buf->addr = (uintptr_t)(uring->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&uring->buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Locked. */
+static void
+uring_buf_recycle(struct tran_uring *uring, uint16_t bid)
+{
+    if (rx_avail(uring) >= URING_RX_MAX) {
+        assert(uring->nr_held < URING_NR_BUFS);
+        uring->held[uring->nr_held++] = bid;
+        return;
+    }
+    uring_buf_push(uring, bid);
+}
+
+/* Locked. */
+static void
+uring_buf_release_held(struct tran_uring *uring)
+{
+    if (rx_avail(uring) >= URING_RX_MAX) {
+        return;
+    }
+    while (uring->nr_held > 0) {
+        uring_buf_push(uring, uring->held[--uring->nr_held]);
+    }
+}
+
+/* Locked. */
+static int
+uring_arm_recv(struct tran_uring *uring)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = uring->conn_fd;
+    sqe->addr = (uintptr_t)&uring->recv_msg;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_RECV;
+    uring_push_sqe(uring);
+
+    if (uring_enter(uring, 0) < 1) {
+        /* Not consumed by the kernel, so we can take it back. */
+        __atomic_store_n(uring->sq_tail, *uring->sq_tail - 1, __ATOMIC_RELEASE);
+        uring->err = errno;
+        return -1;
+    }
+
+    uring->armed = true;
+    return 0;
+}
+
+/* Locked. */
+static void
+uring_add_fds(struct tran_uring *uring, void *control, size_t controllen,
+              uint64_t start, uint64_t end)
+{
+    struct msghdr msg = { .msg_control = control, .msg_controllen = controllen };
+    struct uring_fds *fds;
+    struct cmsghdr *cmsg;
+    size_t nr;
+    size_t i;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len < CMSG_LEN(sizeof(int))) {
+            continue;
+        }
+
+        nr = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        fds = calloc(1, sizeof(*fds));
+        if (fds == NULL) {
+            for (i = 0; i < nr; i++) {
+                close(((int *)CMSG_DATA(cmsg))[i]);
+            }
+            uring->err = ENOMEM;
+            continue;
+        }
+
+        /* The template's control length is only enough for SERVER_MAX_FDS. */
+        assert(nr <= SERVER_MAX_FDS);
+        fds->start = start;
+        fds->end = end;
+        fds->nr = nr;
+        memcpy(fds->fds, CMSG_DATA(cmsg), nr * sizeof(int));
+        TAILQ_INSERT_TAIL(&uring->fds, fds, entry);
+    }
+}
+
+/* Locked. */
+static int
+uring_rx_append(struct tran_uring *uring, const char *data, size_t len)
+{
+    size_t size;
+    char *rx;
+
+    if (uring->rx_end + len > uring->rx_size) {
+        memmove(uring->rx, uring->rx + uring->rx_start, rx_avail(uring));
+        uring->rx_end -= uring->rx_start;
+        uring->rx_start = 0;
+    }
+
+    if (uring->rx_end + len > uring->rx_size) {
+        size = MAX(uring->rx_size * 2, uring->rx_end + len);
+        rx = realloc(uring->rx, size);
+        if (rx == NULL) {
+            return -1;
+        }
+        uring->rx = rx;
+        uring->rx_size = size;
+    }
+
+    memcpy(uring->rx + uring->rx_end, data, len);
+    uring->rx_end += len;
+    return 0;
+}
+
+/* Locked. */
+static void
+uring_complete_recv(struct tran_uring *uring, const struct io_uring_cqe *cqe)
+{
+    struct io_uring_recvmsg_out *out;
+    uint64_t start;
+    uint16_t bid;
+    char *control;
+    char *payload;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring->armed = false;
+    }
+
+    if (cqe->res < 0) {
+        /* If out of buffers, it's re-armed once they have been recycled. */
+        if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+            uring->err = -cqe->res;
+        }
+        return;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+        uring->eof = true;
+        return;
+    }
+
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    out = (struct io_uring_recvmsg_out *)(uring->bufs +
+                                          (size_t)bid * URING_BUF_SIZE);
+    control = (char *)(out + 1) + uring->recv_msg.msg_namelen;
+    payload = control + uring->recv_msg.msg_controllen;
+
+    if (out->payloadlen == 0) {
+        uring->eof = true;
+    } else if (out->flags & MSG_CTRUNC) {
+        uring->err = EFAULT;
+    } else {
+        start = uring->rx_pos + rx_avail(uring);
+        if (uring_rx_append(uring, payload, out->payloadlen) < 0) {
+            uring->err = errno;
+        }
+        uring_add_fds(uring, control, out->controllen, start,
+                      start + out->payloadlen);
+    }
+
+    uring_buf_recycle(uring, bid);
+}
+
+/* Locked. Processes all completions, and re-arms the receive if needed. */
+static void
+uring_reap(struct tran_uring *uring)
+{
+    unsigned head = *uring->cq_head;
+    unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *cqe;
+
+    for (; head != tail; head++) {
+        cqe = &uring->cqes[head & uring->cq_mask];
+
+        switch (cqe->user_data) {
+        case URING_RECV:
+            uring_complete_recv(uring, cqe);
+            break;
+        case URING_SEND:
+            uring->send_res = cqe->res;
+            uring->send_pending = false;
+            break;
+        default:
+            break;
+        }
+    }
+
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (!uring->armed && !uring->eof && uring->err == 0) {
+        (void) uring_arm_recv(uring);
+    }
+}
+
+/* Locked. Consumes @len staged bytes into @data. */
+static void
+uring_rx_consume(struct tran_uring *uring, void *data, size_t len)
+{
+    assert(rx_avail(uring) >= len);
+
+    memcpy(data, uring->rx + uring->rx_start, len);
+    uring->rx_start += len;
+    uring->rx_pos += len;
+    if (uring->rx_start == uring->rx_end) {
+        uring->rx_start = uring->rx_end = 0;
+    }
+
+    uring_buf_release_held(uring);
+}
+
+/*
+ * Locked. Waits until @len bytes are staged, or just checks if @nonblock is
+ * set. Returns 0 if they are, otherwise -1 with errno set as for
+ * tran_sock_get_request_header().
+ */
+static int
+uring_wait_rx(struct tran_uring *uring, size_t len, bool nonblock)
+{
+    struct pollfd pfd = { .fd = uring->event_fd, .events = POLLIN };
+    bool cleared = false;
+    eventfd_t val;
+
+    for (;;) {
+        uring_reap(uring);
+
+        if (rx_avail(uring) >= len) {
+            return 0;
+        }
+        if (uring->err != 0) {
+            return ERROR_INT(uring->err);
+        }
+        if (uring->eof) {
+            return ERROR_INT(rx_avail(uring) == 0 ? ENOMSG : ECONNRESET);
+        }
+
+        /*
+         * Clear the eventfd, then check once more, so that a completion
+         * posted in between isn't missed.
+         */
+        if (!cleared) {
+            (void) eventfd_read(uring->event_fd, &val);
+            cleared = true;
+            continue;
+        }
+
+        if (nonblock) {
+            return ERROR_INT(EAGAIN);
+        }
+
+        pthread_mutex_unlock(&uring->lock);
+        (void) poll(&pfd, 1, -1);
+        pthread_mutex_lock(&uring->lock);
+        cleared = false;
+    }
+}
+
+/*
+ * Locked. Finds the fds sent with the message whose header is at @pos: the
+ * kernel stops a receive after bytes that came with fds, so those belong to
+ * the last message starting within a receive.
+ */
+static void
+uring_take_fds(struct tran_uring *uring, uint64_t pos, uint32_t msg_size,
+               int *fds, size_t *nr_fds)
+{
+    struct uring_fds *f;
+    size_t max = *nr_fds;
+    size_t i;
+
+    *nr_fds = 0;
+
+    while ((f = TAILQ_FIRST(&uring->fds)) != NULL && f->start <= pos) {
+        if (pos < f->end && pos + msg_size < f->end) {
+            /* Another message starts within the same receive. */
+            break;
+        }
+
+        TAILQ_REMOVE(&uring->fds, f, entry);
+
+        for (i = 0; i < f->nr; i++) {
+            if (pos < f->end && i < max) {
+                fds[(*nr_fds)++] = f->fds[i];
+            } else {
+                /* Too many, or sent with a message we've already handled. */
+                close(f->fds[i]);
+            }
+        }
+        free(f);
+    }
+}
+
+int
+tran_uring_recv_hdr(struct tran_uring *uring, struct vfio_user_header *hdr,
+                    int *fds, size_t *nr_fds, bool nonblock)
+{
+    uint64_t pos;
+    int ret;
+
+    pthread_mutex_lock(&uring->lock);
+
+    ret = uring_wait_rx(uring, sizeof(*hdr), nonblock);
+    if (ret == 0) {
+        pos = uring->rx_pos;
+        uring_rx_consume(uring, hdr, sizeof(*hdr));
+        if (nr_fds != NULL) {
+            uring_take_fds(uring, pos, hdr->msg_size, fds, nr_fds);
+        }
+    }
+
+    pthread_mutex_unlock(&uring->lock);
+    return ret;
+}
+
+int
+tran_uring_peek_hdr(struct tran_uring *uring, struct vfio_user_header *hdr)
+{
+    int ret;
+
+    pthread_mutex_lock(&uring->lock);
+
+    ret = uring_wait_rx(uring, sizeof(*hdr), true);
+    if (ret == 0) {
+        memcpy(hdr, uring->rx + uring->rx_start, sizeof(*hdr));
+    }
+
+    pthread_mutex_unlock(&uring->lock);
+    return ret;
+}
+
+int
+tran_uring_recv(struct tran_uring *uring, void *data, size_t len)
+{
+    int ret;
+
+    pthread_mutex_lock(&uring->lock);
+
+    ret = uring_wait_rx(uring, len, false);
+    if (ret == 0) {
+        uring_rx_consume(uring, data, len);
+    }
+
+    pthread_mutex_unlock(&uring->lock);
+    return ret;
+}
+
+/*
+ * Locked. Forces the send in flight to fail, and waits for its completion, so
+ * that the kernel no longer references the message. io_uring_enter() may keep
+ * failing, so this waits on the eventfd instead if needed.
+ */
+static void
+uring_abort_send(struct tran_uring *uring)
+{
+    struct pollfd pfd = { .fd = uring->event_fd, .events = POLLIN };
+
+    (void) shutdown(uring->conn_fd, SHUT_RDWR);
+
+    for (;;) {
+        uring_reap(uring);
+        if (!uring->send_pending) {
+            break;
+        }
+        if (uring_enter(uring, 1) == -1) {
+            (void) poll(&pfd, 1, 1);
+        }
+    }
+}
+
+ssize_t
+tran_uring_sendmsg(struct tran_uring *uring, const struct msghdr *msg)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+    int ret;
+
+    pthread_mutex_lock(&uring->lock);
+
+    assert(!uring->send_pending);
+
+    tail = *uring->sq_tail;
+    sqe = uring_get_sqe(uring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = uring->conn_fd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = URING_SEND;
+    uring_push_sqe(uring);
+    uring->send_pending = true;
+
+    ret = uring_enter(uring, 1);
+    if (ret == -1 &&
+        __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) == tail) {
+        /* Not consumed by the kernel, so we can take it back. */
+        __atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+        uring->send_pending = false;
+        pthread_mutex_unlock(&uring->lock);
+        return -1;
+    }
+
+    /* @msg must stay valid until the send completes. */
+    for (;;) {
+        uring_reap(uring);
+        if (!uring->send_pending) {
+            break;
+        }
+        if (ret == -1) {
+            /*
+             * uring_enter() already retried on EINTR. The send may still be
+             * in flight, so fail the connection, which also gets the send to
+             * complete.
+             */
+            ret = errno;
+            if (uring->err == 0) {
+                uring->err = ret;
+            }
+            uring_abort_send(uring);
+            pthread_mutex_unlock(&uring->lock);
+            return ERROR_INT(ret);
+        }
+        ret = uring_enter(uring, 1);
+    }
+
+    ret = uring->send_res;
+    pthread_mutex_unlock(&uring->lock);
+
+    if (ret < 0) {
+        return ERROR_INT(-ret);
+    }
+    return ret;
+}
+
+int
+tran_uring_get_poll_fd(struct tran_uring *uring)
+{
+    return uring->event_fd;
+}
+
+/* Locked. Waits for the multishot receive to be cancelled. */
+static void
+uring_cancel_recv(struct tran_uring *uring)
+{
+    struct io_uring_sqe *sqe;
+
+    /* Don't re-arm it. */
+    if (uring->err == 0) {
+        uring->err = ESHUTDOWN;
+    }
+
+    if (!uring->armed) {
+        return;
+    }
+
+    sqe = uring_get_sqe(uring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = URING_RECV;
+    sqe->user_data = URING_CANCEL;
+    uring_push_sqe(uring);
+
+    while (uring->armed) {
+        if (uring_enter(uring, 1) == -1) {
+            break;
+        }
+        uring_reap(uring);
+    }
+}
+
+void
+tran_uring_destroy(struct tran_uring *uring)
+{
+    struct uring_fds *f;
+    size_t i;
+
+    if (uring == NULL) {
+        return;
+    }
+
+    if (uring->ring_fd != -1) {
+        pthread_mutex_lock(&uring->lock);
+        uring_cancel_recv(uring);
+        pthread_mutex_unlock(&uring->lock);
+    }
+
+    while ((f = TAILQ_FIRST(&uring->fds)) != NULL) {
+        TAILQ_REMOVE(&uring->fds, f, entry);
+        for (i = 0; i < f->nr; i++) {
+            close(f->fds[i]);
+        }
+        free(f);
+    }
+
+    /* Closing the ring unregisters the eventfd and buffer ring. */
+    close_safely(&uring->ring_fd);
+    close_safely(&uring->event_fd);
+
+    if (uring->sqes != MAP_FAILED) {
+        munmap(uring->sqes, uring->sqes_size);
+    }
+    if (uring->cq_ring != MAP_FAILED && uring->cq_ring != uring->sq_ring) {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    if (uring->sq_ring != MAP_FAILED) {
+        munmap(uring->sq_ring, uring->sq_ring_size);
+    }
+    if (uring->buf_ring != MAP_FAILED) {
+        munmap(uring->buf_ring, uring->buf_ring_size);
+    }
+
+    free(uring->bufs);
+    free(uring->rx);
+    pthread_mutex_destroy(&uring->lock);
+    free(uring);
+}
+
+/* Maps the SQ and CQ rings and the SQE array. */
+static int
+uring_map(struct tran_uring *uring, const struct io_uring_params *p)
+{
+    uring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    uring->cq_ring_size = p->cq_off.cqes +
+                          p->cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        uring->sq_ring_size = MAX(uring->sq_ring_size, uring->cq_ring_size);
+        uring->cq_ring_size = uring->sq_ring_size;
+    }
+
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+                          IORING_OFF_SQ_RING);
+    if (uring->sq_ring == MAP_FAILED) {
+        return -1;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_ring = uring->sq_ring;
+    } else {
+        uring->cq_ring = mmap(NULL, uring->cq_ring_size,
+                              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              uring->ring_fd, IORING_OFF_CQ_RING);
+        if (uring->cq_ring == MAP_FAILED) {
+            return -1;
+        }
+    }
+
+    uring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+                       IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        return -1;
+    }
+
+    uring->sq_head = (unsigned *)((char *)uring->sq_ring + p->sq_off.head);
+    uring->sq_tail = (unsigned *)((char *)uring->sq_ring + p->sq_off.tail);
+    uring->sq_array = (unsigned *)((char *)uring->sq_ring + p->sq_off.array);
+    uring->sq_mask = *(unsigned *)((char *)uring->sq_ring +
+                                   p->sq_off.ring_mask);
+    uring->cq_head = (unsigned *)((char *)uring->cq_ring + p->cq_off.head);
+    uring->cq_tail = (unsigned *)((char *)uring->cq_ring + p->cq_off.tail);
+    uring->cqes = (struct io_uring_cqe *)((char *)uring->cq_ring +
+                                          p->cq_off.cqes);
+    uring->cq_mask = *(unsigned *)((char *)uring->cq_ring +
+                                   p->cq_off.ring_mask);
+    return 0;
+}
+
+/* Registers the provided buffer ring, and fills it. */
+static int
+uring_setup_bufs(struct tran_uring *uring)
+{
+    struct io_uring_buf_reg reg = {
+        .ring_entries = URING_NR_BUFS,
+        .bgid = URING_BGID,
+    };
+    uint16_t bid;
+
+    uring->bufs = malloc((size_t)URING_NR_BUFS * URING_BUF_SIZE);
+    if (uring->bufs == NULL) {
+        return -1;
+    }
+
+    /* Must be page aligned. */
+    uring->buf_ring_size = URING_NR_BUFS * sizeof(struct io_uring_buf);
+    uring->buf_ring = mmap(NULL, uring->buf_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->buf_ring == MAP_FAILED) {
+        return -1;
+    }
+
+    reg.ring_addr = (uintptr_t)uring->buf_ring;
+    if (sys_io_uring_register(uring->ring_fd, IORING_REGISTER_PBUF_RING,
+                              &reg, 1) == -1) {
+        return -1;
+    }
+
+    for (bid = 0; bid < URING_NR_BUFS; bid++) {
+        uring_buf_push(uring, bid);
+    }
+    return 0;
+}
+
+struct tran_uring *
+tran_uring_create(int conn_fd)
+{
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_CQSIZE,
+        .cq_entries = URING_CQ_ENTRIES,
+    };
+    struct tran_uring *uring;
+    int ret;
+
+    uring = calloc(1, sizeof(*uring));
+    if (uring == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&uring->lock, NULL);
+    uring->conn_fd = conn_fd;
+    uring->event_fd = -1;
+    uring->sq_ring = MAP_FAILED;
+    uring->cq_ring = MAP_FAILED;
+    uring->sqes = MAP_FAILED;
+    uring->buf_ring = MAP_FAILED;
+    uring->recv_msg.msg_controllen = CMSG_SPACE(sizeof(int) * SERVER_MAX_FDS);
+    TAILQ_INIT(&uring->fds);
+
+    uring->ring_fd = sys_io_uring_setup(URING_SQ_ENTRIES, &params);
+    if (uring->ring_fd == -1) {
+        goto fail;
+    }
+
+    /* Dropped receive completions would mean lost bytes. */
+    if (!(params.features & IORING_FEAT_NODROP)) {
+        errno = ENOTSUP;
+        goto fail;
+    }
+
+    if (uring_map(uring, &params) < 0 || uring_setup_bufs(uring) < 0) {
+        goto fail;
+    }
+
+    uring->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (uring->event_fd == -1) {
+        goto fail;
+    }
+
+    if (sys_io_uring_register(uring->ring_fd, IORING_REGISTER_EVENTFD,
+                              &uring->event_fd, 1) == -1) {
+        goto fail;
+    }
+
+    pthread_mutex_lock(&uring->lock);
+    ret = uring_arm_recv(uring);
+    pthread_mutex_unlock(&uring->lock);
+    if (ret < 0) {
+        errno = uring->err;
+        goto fail;
+    }
+
+    return uring;
+
+fail:
+    ret = errno;
+    tran_uring_destroy(uring);
+    return ERROR_PTR(ret);
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
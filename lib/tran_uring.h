@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2023 Rivos Inc. All rights reserved.
+ *
+ * Authors: Mattias Nissler <mnissler@rivosinc.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_TRAN_URING_H
+#define LIB_VFIO_USER_TRAN_URING_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "tran.h"
+
+/*
+ * io_uring data path for a connected socket, used by the VFU_TRANS_SOCK_URING
+ * transport once version negotiation is done. All functions are thread safe.
+ */
+struct tran_uring;
+
+struct tran_uring *
+tran_uring_create(int conn_fd);
+
+void
+tran_uring_destroy(struct tran_uring *uring);
+
+/*
+ * Returns an fd that is readable when data may have arrived, to be polled
+ * instead of the socket.
+ */
+int
+tran_uring_get_poll_fd(struct tran_uring *uring);
+
+/*
+ * Receives a message header, and if @nr_fds is not NULL, the fds sent along
+ * with the message (up to *@nr_fds of them). Fails with EAGAIN if @nonblock is
+ * set and the header hasn't arrived yet, otherwise like recvmsg().
+ */
+int
+tran_uring_recv_hdr(struct tran_uring *uring, struct vfio_user_header *hdr,
+                    int *fds, size_t *nr_fds, bool nonblock);
+
+/*
+ * Copies the next message header into @hdr, leaving it to be received. Fails
+ * with EAGAIN if it hasn't arrived yet.
+ */
+int
+tran_uring_peek_hdr(struct tran_uring *uring, struct vfio_user_header *hdr);
+
+/* Receives exactly @len bytes into @data, waiting for them if needed. */
+int
+tran_uring_recv(struct tran_uring *uring, void *data, size_t len);
+
+/* Like sendmsg(..., MSG_NOSIGNAL), but short sends are retried. */
+ssize_t
+tran_uring_sendmsg(struct tran_uring *uring, const struct msghdr *msg);
+
+#endif /* LIB_VFIO_USER_TRAN_URING_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
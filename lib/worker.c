@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2023 Rivos Inc. All rights reserved.
+ *
+ * Authors: Mattias Nissler <mnissler@rivosinc.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Worker pools: slow requests handled off the vfu_run_ctx() thread.
+ *
+ * Each context has a queue of offloaded requests, which is on the pool's ready
+ * list while it has requests and no worker is handling one of them. A worker
+ * takes a single request off the first ready queue, and only puts the queue
+ * back once that request has been handled: a context's offloaded requests are
+ * thus handled one at a time and in order, while different contexts sharing
+ * the pool are handled in parallel. Everything is protected by pool->lock.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+
+#include "common.h"
+#include "libvfio-user.h"
+#include "private.h"
+#include "worker.h"
+
+struct vfu_worker_pool {
+    pthread_mutex_t                 lock;
+    pthread_cond_t                  cond;       /* ready list or stop */
+    pthread_cond_t                  idle;       /* a request was handled */
+    TAILQ_HEAD(, worker_queue)      ready;
+    bool                            stop;
+    unsigned int                    nr_threads;
+    pthread_t                       *threads;
+};
+
+/* The context whose request the calling worker is handling, if any. */
+static __thread const vfu_ctx_t *worker_current_ctx;
+
+/* Locked. */
+static void
+worker_schedule_locked(vfu_worker_pool_t *pool, struct worker_queue *queue)
+{
+    assert(!queue->scheduled && !queue->busy);
+    assert(!TAILQ_EMPTY(&queue->msgs));
+
+    TAILQ_INSERT_TAIL(&pool->ready, queue, entry);
+    queue->scheduled = true;
+    pthread_cond_signal(&pool->cond);
+}
+
+static void *
+worker_thread(void *arg)
+{
+    vfu_worker_pool_t *pool = arg;
+    struct worker_queue *queue;
+    vfu_msg_t *msg;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (;;) {
+        while (!pool->stop && TAILQ_EMPTY(&pool->ready)) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+
+        if (pool->stop) {
+            break;
+        }
+
+        queue = TAILQ_FIRST(&pool->ready);
+        TAILQ_REMOVE(&pool->ready, queue, entry);
+        queue->scheduled = false;
+        queue->busy = true;
+
+        msg = TAILQ_FIRST(&queue->msgs);
+        TAILQ_REMOVE(&queue->msgs, msg, entry);
+
+        pthread_mutex_unlock(&pool->lock);
+
+        worker_current_ctx = queue->vfu_ctx;
+        handle_offloaded_request(queue->vfu_ctx, msg);
+        worker_current_ctx = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+
+        queue->busy = false;
+        if (!TAILQ_EMPTY(&queue->msgs)) {
+            worker_schedule_locked(pool, queue);
+        }
+        pthread_cond_broadcast(&pool->idle);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void
+worker_pool_stop(vfu_worker_pool_t *pool, unsigned int nr_threads)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+}
+
+EXPORT vfu_worker_pool_t *
+vfu_worker_pool_create(unsigned int nr_threads)
+{
+    vfu_worker_pool_t *pool;
+    unsigned int i;
+    int ret;
+
+    if (nr_threads == 0) {
+        return ERROR_PTR(EINVAL);
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->threads = calloc(nr_threads, sizeof(*pool->threads));
+    if (pool->threads == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    TAILQ_INIT(&pool->ready);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for (i = 0; i < nr_threads; i++) {
+        ret = pthread_create(&pool->threads[i], NULL, worker_thread, pool);
+        if (ret != 0) {
+            worker_pool_stop(pool, i);
+            pool->nr_threads = 0;
+            vfu_worker_pool_destroy(pool);
+            return ERROR_PTR(ret);
+        }
+    }
+
+    pool->nr_threads = nr_threads;
+    return pool;
+}
+
+EXPORT void
+vfu_worker_pool_destroy(vfu_worker_pool_t *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    /* Contexts drain their queues when destroyed. */
+    assert(TAILQ_EMPTY(&pool->ready));
+
+    if (pool->nr_threads > 0) {
+        worker_pool_stop(pool, pool->nr_threads);
+    }
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+EXPORT int
+vfu_setup_worker_pool(vfu_ctx_t *vfu_ctx, vfu_worker_pool_t *pool,
+                      int cmd_classes)
+{
+    struct worker_queue *queue;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->realized || vfu_ctx->worker.pool != NULL || pool == NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (cmd_classes == 0 ||
+        (cmd_classes & ~(VFU_WORKER_CMD_MIGRATION_DATA | VFU_WORKER_CMD_DMA |
+                         VFU_WORKER_CMD_DEVICE_FEATURE)) != 0) {
+        return ERROR_INT(EINVAL);
+    }
+
+    queue = &vfu_ctx->worker;
+    queue->pool = pool;
+    queue->vfu_ctx = vfu_ctx;
+    queue->cmd_classes = cmd_classes;
+    TAILQ_INIT(&queue->msgs);
+
+    return 0;
+}
+
+void
+worker_enqueue(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
+{
+    struct worker_queue *queue = &vfu_ctx->worker;
+    vfu_worker_pool_t *pool = queue->pool;
+
+    assert(pool != NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    TAILQ_INSERT_TAIL(&queue->msgs, msg, entry);
+    if (!queue->busy && !queue->scheduled) {
+        worker_schedule_locked(pool, queue);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+worker_drain(vfu_ctx_t *vfu_ctx)
+{
+    struct worker_queue *queue = &vfu_ctx->worker;
+    vfu_worker_pool_t *pool = queue->pool;
+
+    if (pool == NULL || worker_in_worker(vfu_ctx)) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (queue->busy || !TAILQ_EMPTY(&queue->msgs)) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+bool
+worker_in_worker(const vfu_ctx_t *vfu_ctx)
+{
+    return worker_current_ctx == vfu_ctx;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2023 Rivos Inc. All rights reserved.
+ *
+ * Authors: Mattias Nissler <mnissler@rivosinc.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_WORKER_H
+#define LIB_VFIO_USER_WORKER_H
+
+#include <stdbool.h>
+
+#include "private.h"
+
+/* Hands @msg to the context's worker pool, which frees it once handled. */
+void
+worker_enqueue(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg);
+
+/*
+ * Waits until all requests offloaded for the context have been handled. Does
+ * nothing if called by the worker handling them.
+ */
+void
+worker_drain(vfu_ctx_t *vfu_ctx);
+
+/* Returns true if the calling thread is a worker handling the context. */
+bool
+worker_in_worker(const vfu_ctx_t *vfu_ctx);
+
+/* Handles and frees an offloaded request, defined in libvfio-user.c. */
+void
+handle_offloaded_request(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg);
+
+#endif /* LIB_VFIO_USER_WORKER_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -31,13 +31,23 @@
  * shadow_ioeventfd_server.c: an example of how to use a shadow ioeventfd.
  * There is no Linux kernel driver, use samples/shadow_ioeventfd_speed_test.c
  * in the guest instead.
+ *
+ * With -l no client is needed: a thread plays the part of KVM, writing a
+ * sequence number to shadow memory and signalling the eventfd for each guest
+ * doorbell write, and the doorbell latency of eventfd dispatch is compared
+ * against polling shadow memory.
  */
 
 #include <stdio.h>
 #include <err.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/poll.h>
 #include <sys/eventfd.h>
 #include <sys/mman.h>
@@ -60,19 +70,149 @@ bar0_cb(vfu_ctx_t *vfu_ctx UNUSED, char * const buf UNUSED,
     return count;
 }
 
+static void
+ioeventfd_handler(vfu_ctx_t *vfu_ctx, void *arg UNUSED, uint64_t value,
+                  uint64_t kicks UNUSED)
+{
+    uint32_t val = value;
+
+    bar0_cb(vfu_ctx, (char *)&val, sizeof(val), 0, true);
+}
+
+#define LATENCY_ITERATIONS 100000
+
+struct latency_test {
+    int fd;
+    uint32_t *shadow;
+    uint32_t seq;
+    /* last value seen by the handler */
+    uint32_t seen;
+    bool done;
+    uint64_t total_ns;
+};
+
+static void
+latency_handler(vfu_ctx_t *vfu_ctx UNUSED, void *arg, uint64_t value,
+                uint64_t kicks UNUSED)
+{
+    struct latency_test *test = arg;
+
+    __atomic_store_n(&test->seen, (uint32_t)value, __ATOMIC_RELEASE);
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Does what KVM does on each guest write to the shadow ioeventfd. */
+static void *
+latency_kicker(void *arg)
+{
+    struct latency_test *test = arg;
+    int i;
+
+    test->total_ns = 0;
+    for (i = 0; i < LATENCY_ITERATIONS; i++) {
+        uint32_t seq = ++test->seq;
+        uint64_t start = now_ns();
+
+        __atomic_store_n(test->shadow, seq, __ATOMIC_RELEASE);
+        eventfd_write(test->fd, 1);
+        while (__atomic_load_n(&test->seen, __ATOMIC_ACQUIRE) != seq) {
+            sched_yield();
+        }
+        test->total_ns += now_ns() - start;
+    }
+    __atomic_store_n(&test->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void
+run_latency_test(vfu_ctx_t *vfu_ctx, struct latency_test *test, bool polled)
+{
+    pthread_t thread;
+    int ret;
+
+    ret = vfu_set_ioeventfd_polled(vfu_ctx, test->fd, polled);
+    if (ret == -1) {
+        err(EXIT_FAILURE, "failed to set ioeventfd polling mode");
+    }
+
+    test->done = false;
+    ret = pthread_create(&thread, NULL, latency_kicker, test);
+    if (ret != 0) {
+        errx(EXIT_FAILURE, "failed to create thread: %s", strerror(ret));
+    }
+
+    while (!__atomic_load_n(&test->done, __ATOMIC_ACQUIRE)) {
+        if (polled) {
+            if (vfu_poll_ioeventfds(vfu_ctx) == 0) {
+                sched_yield();
+            }
+        } else {
+            ret = vfu_dispatch_ioeventfds(vfu_ctx, 10);
+            if (ret < 0 && errno != EINTR) {
+                err(EXIT_FAILURE, "vfu_dispatch_ioeventfds() failed");
+            }
+        }
+    }
+
+    pthread_join(thread, NULL);
+    printf("%s:\t%llu ns\n", polled ? "polled" : "eventfd",
+           (unsigned long long)(test->total_ns / LATENCY_ITERATIONS));
+}
+
+static void
+latency_test(vfu_ctx_t *vfu_ctx, int fd, int bar0_fd)
+{
+    struct latency_test test = { .fd = fd };
+    int ret;
+
+    test.shadow = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, bar0_fd, 0);
+    if (test.shadow == MAP_FAILED) {
+        err(EXIT_FAILURE, "failed to map BAR0 file");
+    }
+
+    ret = vfu_set_ioeventfd_handler(vfu_ctx, fd, latency_handler, &test);
+    if (ret == -1) {
+        err(EXIT_FAILURE, "failed to set ioeventfd handler");
+    }
+
+    run_latency_test(vfu_ctx, &test, false);
+    run_latency_test(vfu_ctx, &test, true);
+}
+
 int
 main(int argc, char *argv[])
 {
     int ret;
     vfu_ctx_t *vfu_ctx;
-    struct pollfd fds[2]; /* one for vfu_ctx, one for shadow_ioeventfd */
+    struct pollfd fds[1];
     int fd, bar0_fd;
+    bool latency = false;
+    int opt;
 
-    if (argc != 2) {
+    while ((opt = getopt(argc, argv, "l")) != -1) {
+        switch (opt) {
+        case 'l':
+            latency = true;
+            break;
+        default: /* '?' */
+            errx(EXIT_FAILURE, "Usage: %s [-l] <socketpath>", argv[0]);
+        }
+    }
+
+    if (optind >= argc) {
         errx(EXIT_FAILURE, "missing vfio-user socket path");
     }
 
-    vfu_ctx = vfu_create_ctx(VFU_TRANS_SOCK, argv[1],
+    vfu_ctx = vfu_create_ctx(VFU_TRANS_SOCK, argv[optind],
                              LIBVFIO_USER_FLAG_ATTACH_NB, NULL,
                              VFU_DEV_TYPE_PCI);
 
@@ -106,17 +246,6 @@ main(int argc, char *argv[])
         err(EXIT_FAILURE, "failed to realize device");
     }
 
-    fds[0] = (struct pollfd) {
-        .fd = vfu_get_poll_fd(vfu_ctx),
-        .events = POLLIN | POLLOUT
-    };
-    ret = poll(fds, 1, -1);
-    assert(ret == 1);
-    ret = vfu_attach_ctx(vfu_ctx);
-    if (ret < 0) {
-         err(EXIT_FAILURE, "failed to attach device");
-    }
-
     fd = eventfd(0, 0);
     if (fd == -1) {
         err(EXIT_FAILURE, "failed to create eventfd");
@@ -136,37 +265,43 @@ main(int argc, char *argv[])
         err(EXIT_FAILURE, "failed to create shadow ioeventfd");
     }
 
+    ret = vfu_setup_ioeventfd_dispatch(vfu_ctx);
+    if (ret == -1) {
+        err(EXIT_FAILURE, "failed to setup ioeventfd dispatch");
+    }
+
+    if (latency) {
+        latency_test(vfu_ctx, fd, bar0_fd);
+        vfu_destroy_ctx(vfu_ctx);
+        return 0;
+    }
+
     fds[0] = (struct pollfd) {
         .fd = vfu_get_poll_fd(vfu_ctx),
-        .events = POLLIN
-    };
-    fds[1] = (struct pollfd) {
-        .fd = fd,
-        .events = POLLIN
+        .events = POLLIN | POLLOUT
     };
+    ret = poll(fds, 1, -1);
+    assert(ret == 1);
+    ret = vfu_attach_ctx(vfu_ctx);
+    if (ret < 0) {
+         err(EXIT_FAILURE, "failed to attach device");
+    }
+
+    ret = vfu_set_ioeventfd_handler(vfu_ctx, fd, ioeventfd_handler, NULL);
+    if (ret == -1) {
+        err(EXIT_FAILURE, "failed to set ioeventfd handler");
+    }
 
     do {
-        ret = poll(fds, 2, -1);
+        ret = vfu_dispatch_ioeventfds(vfu_ctx, -1);
         if (ret < 0) {
-            err(EXIT_FAILURE, "failed to poll(2)");
-        }
-        assert(ret > 0);
-        if (fds[0].revents & (POLLIN)) {
-            ret = vfu_run_ctx(vfu_ctx);
-            if (ret < 0) {
-                if (errno == EAGAIN) {
-                    continue;
-                }
-                if (errno == ENOTCONN) {
-                    return 0;
-                }
-                err(EXIT_FAILURE, "vfu_run_ctx() failed");
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
             }
-        }
-        if (fds[1].revents & POLLIN) {
-            eventfd_t value;
-            eventfd_read(fd, &value);
-            bar0_cb(vfu_ctx, NULL, 4, 0, true);
+            if (errno == ENOTCONN) {
+                return 0;
+            }
+            err(EXIT_FAILURE, "vfu_dispatch_ioeventfds() failed");
         }
     } while (true);
     return 0;
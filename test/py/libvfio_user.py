@@ -39,6 +39,7 @@ import errno
 import json
 import mmap
 import os
+import select
 import socket
 import struct
 import syslog
@@ -55,6 +56,8 @@ UINT64_MAX = 18446744073709551615
 
 # from linux/pci_regs.h and linux/pci_defs.h
 
+PCI_COMMAND = 0x04
+
 PCI_HEADER_TYPE_NORMAL = 0
 
 PCI_STD_HEADER_SIZEOF = 64
@@ -84,6 +87,7 @@ PCI_EXT_CAP_DSN_SIZEOF = 12
 
 PCI_EXT_CAP_VNDR_HDR_SIZEOF = 8
 
+PCI_BASE_ADDRESS_0 = 0x10
 PCI_BASE_ADDRESS_SPACE_IO = 0x01
 PCI_BASE_ADDRESS_SPACE_MEMORY = 0x00
 PCI_BASE_ADDRESS_MEM_TYPE_32 = 0x00
@@ -137,9 +141,12 @@ VFIO_DMA_UNMAP_FLAG_ALL = (1 << 1)
 
 VFU_TRANS_SOCK = 0
 VFU_TRANS_PIPE = 1
-VFU_TRANS_MAX = 2
+VFU_TRANS_SOCK_URING = 2
+VFU_TRANS_MAX = 3
 
 LIBVFIO_USER_FLAG_ATTACH_NB = (1 << 0)
+LIBVFIO_USER_FLAG_DMA_MAP_NO_QUIESCE = (1 << 1)
+LIBVFIO_USER_FLAG_POSTED_WRITES = (1 << 2)
 VFU_DEV_TYPE_PCI = 0
 
 LIBVFIO_USER_MAJOR = 0
@@ -163,6 +170,11 @@ def is_32bit():
 MAX_DMA_REGIONS = 64
 # FIXME get from libvfio-user.h
 MAX_DMA_SIZE = sys.maxsize << 1 if is_32bit() else (8 * ONE_TB)
+VFU_DMA_TRANSFER_MAX_WINDOW = 64
+VFU_MAX_CMD_SOCKETS = 64
+
+VFIO_USER_MULTI_DATA = 8
+VFIO_USER_MULTI_MAX = 200
 
 # enum vfio_user_command
 VFIO_USER_VERSION = 1
@@ -182,7 +194,8 @@ VFIO_USER_REGION_WRITE_MULTI = 15
 VFIO_USER_DEVICE_FEATURE = 16
 VFIO_USER_MIG_DATA_READ = 17
 VFIO_USER_MIG_DATA_WRITE = 18
-VFIO_USER_MAX = 19
+VFIO_USER_REGION_IO_FDS_CHANGED = 19
+VFIO_USER_MAX = 20
 
 VFIO_USER_F_TYPE = 0xf
 VFIO_USER_F_TYPE_COMMAND = 0
@@ -208,6 +221,7 @@ VFU_REGION_FLAG_WRITE = 2
 VFU_REGION_FLAG_RW = (VFU_REGION_FLAG_READ | VFU_REGION_FLAG_WRITE)
 VFU_REGION_FLAG_MEM = 4
 VFU_REGION_FLAG_ALWAYS_CB = 8
+VFU_REGION_SHADOW_FLAG_MMAP = 1
 VFU_REGION_FLAG_64_BITS = 16
 VFU_REGION_FLAG_PREFETCH = 32
 
@@ -245,6 +259,8 @@ VFIO_USER_IO_FD_TYPE_IOEVENTFD = 0
 VFIO_USER_IO_FD_TYPE_IOREGIONFD = 1
 VFIO_USER_IO_FD_TYPE_IOEVENTFD_SHADOW = 2
 
+VFIO_USER_IO_FD_FLAG_DATAMATCH = (1 << 0)
+
 # enum vfu_migr_state_t
 VFU_MIGR_STATE_STOP = 0
 VFU_MIGR_STATE_RUNNING = 1
@@ -266,6 +282,18 @@ VFU_RESET_DEVICE = 0
 VFU_RESET_LOST_CONN = 1
 VFU_RESET_PCI_FLR = 2
 
+# vfu_config_event_type_t
+VFU_CONFIG_EVENT_OVERFLOW = 0
+VFU_CONFIG_EVENT_FLR = 1
+VFU_CONFIG_EVENT_BAR = 2
+VFU_CONFIG_EVENT_MSI = 3
+VFU_CONFIG_EVENT_MSIX = 4
+VFU_CONFIG_EVENT_POWER_STATE = 5
+
+VFU_WORKER_CMD_MIGRATION_DATA = (1 << 0)
+VFU_WORKER_CMD_DMA = (1 << 1)
+VFU_WORKER_CMD_DEVICE_FEATURE = (1 << 2)
+
 # vfu_pci_type_t
 VFU_PCI_TYPE_CONVENTIONAL = 0
 VFU_PCI_TYPE_PCI_X_1 = 1
@@ -663,6 +691,15 @@ class dma_sg_t(Structure):
                 hex(self.offset), self.writeable)
 
 
+class vfu_config_event_t(Structure):
+    _fields_ = [
+        ("type", c.c_int),
+        ("index", c.c_uint32),
+        ("value", c.c_uint64),
+        ("generation", c.c_uint64),
+    ]
+
+
 #
 # Util functions
 #
@@ -674,6 +711,7 @@ lib.vfu_create_ctx.restype = (c.c_void_p)
 lib.vfu_setup_log.argtypes = (c.c_void_p, c.c_void_p, c.c_int)
 lib.vfu_realize_ctx.argtypes = (c.c_void_p,)
 lib.vfu_attach_ctx.argtypes = (c.c_void_p,)
+lib.vfu_get_poll_fd.argtypes = (c.c_void_p,)
 lib.vfu_run_ctx.argtypes = (c.c_void_p,)
 lib.vfu_destroy_ctx.argtypes = (c.c_void_p,)
 vfu_region_access_cb_t = c.CFUNCTYPE(c.c_int, c.c_void_p, c.POINTER(c.c_char),
@@ -681,10 +719,38 @@ vfu_region_access_cb_t = c.CFUNCTYPE(c.c_int, c.c_void_p, c.POINTER(c.c_char),
 lib.vfu_setup_region.argtypes = (c.c_void_p, c.c_int, c.c_ulong,
                                  vfu_region_access_cb_t, c.c_int, c.c_void_p,
                                  c.c_uint32, c.c_int, c.c_uint64)
+vfu_region_range_access_cb_t = c.CFUNCTYPE(c.c_ssize_t, c.c_void_p,
+                                           c.c_void_p, c.POINTER(c.c_char),
+                                           c.c_ulong, c.c_long, c.c_bool)
+lib.vfu_setup_region_range.argtypes = (c.c_void_p, c.c_int, c.c_uint64,
+                                       c.c_uint64, c.c_uint32,
+                                       vfu_region_range_access_cb_t,
+                                       c.c_void_p)
+lib.vfu_setup_region_shadow.argtypes = (c.c_void_p, c.c_int, c.c_uint64,
+                                        c.c_uint64, c.c_void_p, c.c_int)
 vfu_reset_cb_t = c.CFUNCTYPE(c.c_int, c.c_void_p, c.c_int)
 lib.vfu_setup_device_reset_cb.argtypes = (c.c_void_p, vfu_reset_cb_t)
 lib.vfu_pci_get_config_space.argtypes = (c.c_void_p,)
 lib.vfu_pci_get_config_space.restype = (c.c_void_p)
+lib.vfu_setup_config_events.argtypes = (c.c_void_p, c.c_uint32)
+lib.vfu_reactor_create.argtypes = (c.c_uint,)
+lib.vfu_reactor_create.restype = c.c_void_p
+lib.vfu_reactor_add_ctx.argtypes = (c.c_void_p, c.c_void_p)
+lib.vfu_reactor_remove_ctx.argtypes = (c.c_void_p, c.c_void_p)
+lib.vfu_reactor_run.argtypes = (c.c_void_p,)
+lib.vfu_reactor_stop.argtypes = (c.c_void_p,)
+lib.vfu_reactor_destroy.argtypes = (c.c_void_p,)
+lib.vfu_worker_pool_create.argtypes = (c.c_uint,)
+lib.vfu_worker_pool_create.restype = c.c_void_p
+lib.vfu_worker_pool_destroy.argtypes = (c.c_void_p,)
+lib.vfu_setup_worker_pool.argtypes = (c.c_void_p, c.c_void_p, c.c_int)
+
+lib.vfu_get_config_event.argtypes = (c.c_void_p, c.POINTER(vfu_config_event_t))
+lib.vfu_pci_config_space_generation.argtypes = (c.c_void_p,)
+lib.vfu_pci_config_space_generation.restype = (c.c_uint64)
+lib.vfu_pci_config_space_snapshot.argtypes = (c.c_void_p, c.c_void_p,
+                                              c.c_size_t, c.c_size_t,
+                                              c.POINTER(c.c_uint64))
 lib.vfu_setup_device_nr_irqs.argtypes = (c.c_void_p, c.c_int, c.c_uint32)
 lib.vfu_pci_init.argtypes = (c.c_void_p, c.c_int, c.c_int, c.c_int)
 lib.vfu_pci_add_capability.argtypes = (c.c_void_p, c.c_ulong, c.c_int,
@@ -695,6 +761,12 @@ lib.vfu_pci_find_next_capability.argtypes = (c.c_void_p, c.c_bool, c.c_ulong,
                                              c.c_int)
 lib.vfu_pci_find_next_capability.restype = (c.c_ulong)
 lib.vfu_irq_trigger.argtypes = (c.c_void_p, c.c_uint)
+lib.vfu_irq_trigger_batch.argtypes = (c.c_void_p, c.POINTER(c.c_uint64),
+                                      c.c_uint32)
+lib.vfu_irq_set_coalescing.argtypes = (c.c_void_p, c.c_uint32, c.c_uint32,
+                                       c.c_uint32)
+lib.vfu_irq_flush.argtypes = (c.c_void_p, c.c_bool)
+lib.vfu_pci_setup_msix_emulation.argtypes = (c.c_void_p,)
 vfu_device_quiesce_cb_t = c.CFUNCTYPE(c.c_int, c.c_void_p, use_errno=True)
 lib.vfu_setup_device_quiesce_cb.argtypes = (c.c_void_p,
                                             vfu_device_quiesce_cb_t)
@@ -712,16 +784,52 @@ lib.vfu_addr_to_sgl.argtypes = (c.c_void_p, c.c_void_p, c.c_size_t,
                                 c.POINTER(dma_sg_t), c.c_size_t, c.c_int)
 lib.vfu_sgl_get.argtypes = (c.c_void_p, c.POINTER(dma_sg_t),
                             c.POINTER(iovec_t), c.c_size_t, c.c_int)
+vfu_io_ctx_quiesce_cb_t = c.CFUNCTYPE(None, c.c_void_p, c.c_void_p)
+lib.vfu_setup_io_ctx.argtypes = (c.c_void_p, vfu_io_ctx_quiesce_cb_t,
+                                 c.c_void_p)
+lib.vfu_io_ctx_addr_to_sgl.argtypes = (c.c_void_p, c.c_int, c.c_void_p,
+                                       c.c_size_t, c.POINTER(dma_sg_t),
+                                       c.c_size_t, c.c_int)
+lib.vfu_io_ctx_quiescent.argtypes = (c.c_void_p, c.c_int)
 lib.vfu_sgl_put.argtypes = (c.c_void_p, c.POINTER(dma_sg_t),
                             c.POINTER(iovec_t), c.c_size_t)
 lib.vfu_sgl_read.argtypes = (c.c_void_p, c.POINTER(dma_sg_t), c.c_size_t,
                              c.c_void_p)
 lib.vfu_sgl_write.argtypes = (c.c_void_p, c.POINTER(dma_sg_t), c.c_size_t,
                               c.c_void_p)
+lib.vfu_setup_dma_transfer_window.argtypes = (c.c_void_p, c.c_size_t)
+vfu_dma_done_cb_t = c.CFUNCTYPE(None, c.c_void_p, c.c_void_p, c.c_int)
+lib.vfu_sgl_read_async.argtypes = (c.c_void_p, c.POINTER(dma_sg_t),
+                                   c.c_size_t, c.c_void_p, vfu_dma_done_cb_t,
+                                   c.c_void_p)
+lib.vfu_sgl_write_async.argtypes = (c.c_void_p, c.POINTER(dma_sg_t),
+                                    c.c_size_t, c.c_void_p, vfu_dma_done_cb_t,
+                                    c.c_void_p)
+lib.vfu_get_dma_poll_fd.argtypes = (c.c_void_p,)
+lib.vfu_process_dma_replies.argtypes = (c.c_void_p,)
+lib.vfu_setup_cmd_sockets.argtypes = (c.c_void_p, c.c_size_t)
+lib.vfu_get_nr_cmd_sockets.argtypes = (c.c_void_p,)
+lib.vfu_get_nr_cmd_sockets.restype = c.c_size_t
+lib.vfu_bind_cmd_socket.argtypes = (c.c_void_p, c.c_size_t)
 
 lib.vfu_create_ioeventfd.argtypes = (c.c_void_p, c.c_uint32, c.c_int,
                                      c.c_size_t, c.c_uint32, c.c_uint32,
                                      c.c_uint64, c.c_int32, c.c_uint64)
+lib.vfu_delete_ioeventfd.argtypes = (c.c_void_p, c.c_uint32, c.c_int,
+                                     c.c_size_t)
+lib.vfu_update_ioeventfd.argtypes = (c.c_void_p, c.c_uint32, c.c_int,
+                                     c.c_size_t, c.c_uint32, c.c_uint32,
+                                     c.c_uint64, c.c_int32, c.c_uint64)
+lib.vfu_notify_region_io_fds_changed.argtypes = (c.c_void_p, c.c_uint32)
+vfu_ioeventfd_handler_t = c.CFUNCTYPE(None, c.c_void_p, c.c_void_p,
+                                      c.c_uint64, c.c_uint64)
+lib.vfu_setup_ioeventfd_dispatch.argtypes = (c.c_void_p,)
+lib.vfu_get_ioeventfd_dispatch_fd.argtypes = (c.c_void_p,)
+lib.vfu_set_ioeventfd_handler.argtypes = (c.c_void_p, c.c_int,
+                                          vfu_ioeventfd_handler_t, c.c_void_p)
+lib.vfu_dispatch_ioeventfds.argtypes = (c.c_void_p, c.c_int)
+lib.vfu_set_ioeventfd_polled.argtypes = (c.c_void_p, c.c_int, c.c_bool)
+lib.vfu_poll_ioeventfds.argtypes = (c.c_void_p,)
 
 lib.vfu_device_quiesced.argtypes = (c.c_void_p, c.c_int)
 
@@ -758,9 +866,9 @@ def eventfd(initval=0, flags=0):
     return libc.eventfd(initval, flags)
 
 
-def connect_sock():
+def connect_sock(sock_path=SOCK_PATH):
     sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
-    sock.connect(SOCK_PATH)
+    sock.connect(sock_path)
     return sock
 
 
@@ -770,9 +878,15 @@ class Client:
     def __init__(self, sock=None):
         self.sock = sock
         self.client_cmd_socket = None
+        self.client_cmd_sockets = []
+        self.server_caps = None
 
-    def connect(self, ctx, capabilities={}):
-        self.sock = connect_sock()
+    def connect(self, ctx, capabilities={}, sock_path=SOCK_PATH, attach=True):
+        """
+        If @attach is False, something else (such as a reactor) is expected to
+        call vfu_attach_ctx().
+        """
+        self.sock = connect_sock(sock_path)
 
         client_caps = {
             "capabilities": {
@@ -797,15 +911,21 @@ class Client:
                               LIBVFIO_USER_MINOR, caps_json.encode(), b'\0')
         hdr = vfio_user_header(VFIO_USER_VERSION, size=len(payload))
         self.sock.send(hdr + payload)
-        vfu_attach_ctx(ctx, expect=0)
+        if attach:
+            vfu_attach_ctx(ctx, expect=0)
         fds, payload = get_reply_fds(self.sock, expect=0)
 
         server_caps = json.loads(payload[struct.calcsize("HH"):-1].decode())
+        self.server_caps = server_caps["capabilities"]
         try:
             if (client_caps["capabilities"]["twin_socket"]["supported"] and
                server_caps["capabilities"]["twin_socket"]["supported"]):
-                index = server_caps["capabilities"]["twin_socket"]["fd_index"]
-                self.client_cmd_socket = socket.socket(fileno=fds[index])
+                twin_socket = server_caps["capabilities"]["twin_socket"]
+                index = twin_socket["fd_index"]
+                nr = twin_socket.get("nr_sockets", 1)
+                self.client_cmd_sockets = [socket.socket(fileno=fd)
+                                           for fd in fds[index:index + nr]]
+                self.client_cmd_socket = self.client_cmd_sockets[0]
         except KeyError:
             pass
 
@@ -814,9 +934,10 @@ class Client:
     def disconnect(self, ctx):
         self.sock.close()
         self.sock = None
-        if self.client_cmd_socket is not None:
-            self.client_cmd_socket.close()
-            self.client_cmd_socket = None
+        for sock in self.client_cmd_sockets:
+            sock.close()
+        self.client_cmd_sockets = []
+        self.client_cmd_socket = None
 
         # notice client closed connection
         vfu_run_ctx(ctx, errno.ENOTCONN)
@@ -992,6 +1113,77 @@ def read_region(ctx, sock, region, offset, count, expect=0, rsp=True,
         expect=expect, rsp=rsp, busy=busy)
 
 
+def write_region_multi(ctx, sock, writes, expect=0, rsp=True):
+    """
+    Sends a VFIO_USER_REGION_WRITE_MULTI request; @writes is a list of
+    (region, offset, data) tuples.
+    """
+    # struct vfio_user_write_multi
+    payload = struct.pack("Q", len(writes))
+    for region, offset, data in writes:
+        # struct vfio_user_write_multi_data
+        payload += struct.pack("QII", offset, region, len(data))
+        payload += bytes(data).ljust(VFIO_USER_MULTI_DATA, b'\0')
+
+    msg(ctx, sock, VFIO_USER_REGION_WRITE_MULTI, payload, expect=expect,
+        rsp=rsp)
+
+
+def region_access_msg(msg_id, is_write, offset, data=b'', count=None,
+                      region=VFU_PCI_DEV_BAR0_REGION_IDX):
+    """Returns a region read or write request, without sending it."""
+    if count is None:
+        count = len(data)
+    payload = struct.pack("QII", offset, region, count)
+    payload += data
+    cmd = VFIO_USER_REGION_WRITE if is_write else VFIO_USER_REGION_READ
+    return vfio_user_header(cmd, size=len(payload), msg_id=msg_id) + payload
+
+
+def get_reply_id(sock):
+    """Returns the msg_id and payload of the next reply."""
+    buf = sock.recv(16, socket.MSG_WAITALL)
+    (msg_id, cmd, msg_size, flags, err) = struct.unpack("HHIII", buf)
+    assert (flags & VFIO_USER_F_TYPE_REPLY) != 0
+    assert err == 0
+    return (msg_id, sock.recv(msg_size - 16, socket.MSG_WAITALL))
+
+
+def poll_fd_ready(ctx):
+    (ready, _, _) = select.select([vfu_get_poll_fd(ctx)], [], [], 0)
+    return ready != []
+
+
+def setup_posted_writes_ctx(bar0_cb, bar0_size, trans=VFU_TRANS_SOCK,
+                            setup=None):
+    """
+    Creates a non-blocking context whose BAR0 is handled by @bar0_cb, calls
+    @setup on it (if given) before realizing it, and connects a client that
+    negotiates posted writes. Returns the context and the client.
+    """
+    ctx = vfu_create_ctx(trans=trans,
+                         flags=LIBVFIO_USER_FLAG_ATTACH_NB |
+                         LIBVFIO_USER_FLAG_POSTED_WRITES)
+    assert ctx is not None
+
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR0_REGION_IDX,
+                            size=bar0_size, cb=bar0_cb,
+                            flags=VFU_REGION_FLAG_RW) == 0
+    assert vfu_setup_device_nr_irqs(ctx, VFU_DEV_ERR_IRQ, 1) == 0
+    if setup is not None:
+        setup(ctx)
+    assert vfu_realize_ctx(ctx) == 0
+
+    client = connect_client(ctx, {"capabilities": {"posted_writes": True}})
+    return (ctx, client)
+
+
+def teardown_ctx(ctx, client):
+    client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+
+
 def ext_cap_hdr(buf, offset):
     """Read an extended cap header."""
 
@@ -1064,8 +1256,9 @@ def vfu_setup_device_reset_cb(ctx, cb=_reset_cb):
 
 def prepare_ctx_for_dma(dma_register=__dma_register,
                         dma_unregister=__dma_unregister, quiesce=_quiesce_cb,
-                        reset=_reset_cb, migration_callbacks=False):
-    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+                        reset=_reset_cb, migration_callbacks=False,
+                        flags=LIBVFIO_USER_FLAG_ATTACH_NB):
+    ctx = vfu_create_ctx(flags=flags)
     assert ctx is not None
 
     ret = vfu_pci_init(ctx)
@@ -1170,6 +1363,12 @@ def vfu_attach_ctx(ctx, expect=0):
     return ret
 
 
+def vfu_get_poll_fd(ctx):
+    assert ctx is not None
+
+    return lib.vfu_get_poll_fd(ctx)
+
+
 def vfu_run_ctx(ctx, expect=0):
     ret = lib.vfu_run_ctx(ctx)
     if expect == 0:
@@ -1226,6 +1425,18 @@ def vfu_setup_region(ctx, index, size, cb=__pci_region_cb, flags=0,
     return ret
 
 
+def vfu_setup_region_range(ctx, index, offset, size, cb, access_sizes=0,
+                           arg=None):
+    assert ctx is not None
+    return lib.vfu_setup_region_range(ctx, index, offset, size, access_sizes,
+                                      cb, arg)
+
+
+def vfu_setup_region_shadow(ctx, index, offset, size, shadow, flags=0):
+    assert ctx is not None
+    return lib.vfu_setup_region_shadow(ctx, index, offset, size, shadow, flags)
+
+
 def vfu_setup_device_nr_irqs(ctx, irqtype, count):
     assert ctx is not None
     return lib.vfu_setup_device_nr_irqs(ctx, irqtype, count)
@@ -1264,6 +1475,75 @@ def vfu_pci_find_capability(ctx, extended, cap_id):
     return lib.vfu_pci_find_capability(ctx, extended, cap_id)
 
 
+def vfu_reactor_create(nr_workers):
+    return lib.vfu_reactor_create(nr_workers)
+
+
+def vfu_reactor_add_ctx(reactor, ctx):
+    return lib.vfu_reactor_add_ctx(reactor, ctx)
+
+
+def vfu_reactor_remove_ctx(reactor, ctx):
+    return lib.vfu_reactor_remove_ctx(reactor, ctx)
+
+
+def vfu_reactor_run(reactor):
+    return lib.vfu_reactor_run(reactor)
+
+
+def vfu_reactor_stop(reactor):
+    lib.vfu_reactor_stop(reactor)
+
+
+def vfu_reactor_destroy(reactor):
+    lib.vfu_reactor_destroy(reactor)
+
+
+def vfu_worker_pool_create(nr_threads):
+    return lib.vfu_worker_pool_create(nr_threads)
+
+
+def vfu_worker_pool_destroy(pool):
+    lib.vfu_worker_pool_destroy(pool)
+
+
+def vfu_setup_worker_pool(ctx, pool, cmd_classes):
+    assert ctx is not None
+
+    return lib.vfu_setup_worker_pool(ctx, pool, cmd_classes)
+
+
+def vfu_setup_config_events(ctx, nr_events):
+    assert ctx is not None
+
+    return lib.vfu_setup_config_events(ctx, nr_events)
+
+
+def vfu_get_config_event(ctx):
+    """Returns (ret, event)."""
+    assert ctx is not None
+
+    event = vfu_config_event_t()
+    return (lib.vfu_get_config_event(ctx, c.byref(event)), event)
+
+
+def vfu_pci_config_space_generation(ctx):
+    assert ctx is not None
+
+    return lib.vfu_pci_config_space_generation(ctx)
+
+
+def vfu_pci_config_space_snapshot(ctx, offset, count):
+    """Returns (ret, data, generation)."""
+    assert ctx is not None
+
+    buf = c.create_string_buffer(count)
+    generation = c.c_uint64()
+    ret = lib.vfu_pci_config_space_snapshot(ctx, buf, offset, count,
+                                            c.byref(generation))
+    return (ret, buf.raw, generation.value)
+
+
 def vfu_pci_find_next_capability(ctx, extended, offset, cap_id):
     assert ctx is not None
 
@@ -1276,6 +1556,37 @@ def vfu_irq_trigger(ctx, subindex):
     return lib.vfu_irq_trigger(ctx, subindex)
 
 
+def vfu_irq_trigger_batch(ctx, subindices, nr_vectors=None):
+    assert ctx is not None
+
+    nr_bits = max(subindices, default=-1) + 1
+    if nr_vectors is None:
+        nr_vectors = nr_bits
+    bitmap = (c.c_uint64 * max(1, (max(nr_bits, nr_vectors) + 63) // 64))()
+    for i in subindices:
+        bitmap[i // 64] |= 1 << (i % 64)
+
+    return lib.vfu_irq_trigger_batch(ctx, bitmap, nr_vectors)
+
+
+def vfu_irq_set_coalescing(ctx, subindex, max_count, max_delay_us):
+    assert ctx is not None
+
+    return lib.vfu_irq_set_coalescing(ctx, subindex, max_count, max_delay_us)
+
+
+def vfu_irq_flush(ctx, force=False):
+    assert ctx is not None
+
+    return lib.vfu_irq_flush(ctx, force)
+
+
+def vfu_pci_setup_msix_emulation(ctx):
+    assert ctx is not None
+
+    return lib.vfu_pci_setup_msix_emulation(ctx)
+
+
 def vfu_setup_device_dma(ctx, register_cb=None, unregister_cb=None):
     assert ctx is not None
 
@@ -1342,6 +1653,28 @@ def vfu_addr_to_sgl(ctx, dma_addr, length, max_nr_sgs=1,
                                 sg, max_nr_sgs, prot), sg)
 
 
+def vfu_setup_io_ctx(ctx, quiesce_cb, arg=None):
+    assert ctx is not None
+
+    return lib.vfu_setup_io_ctx(ctx, quiesce_cb, arg)
+
+
+def vfu_io_ctx_addr_to_sgl(ctx, io_ctx, dma_addr, length, max_nr_sgs=1,
+                           prot=(mmap.PROT_READ | mmap.PROT_WRITE)):
+    assert ctx is not None
+
+    sg = (dma_sg_t * max_nr_sgs)()
+
+    return (lib.vfu_io_ctx_addr_to_sgl(ctx, io_ctx, dma_addr, length,
+                                       sg, max_nr_sgs, prot), sg)
+
+
+def vfu_io_ctx_quiescent(ctx, io_ctx):
+    assert ctx is not None
+
+    lib.vfu_io_ctx_quiescent(ctx, io_ctx)
+
+
 def vfu_sgl_get(ctx, sg, iovec, cnt=1, flags=0):
     return lib.vfu_sgl_get(ctx, sg, iovec, cnt, flags)
 
@@ -1362,6 +1695,43 @@ def vfu_sgl_write(ctx, sg, cnt=1, data=bytearray()):
     return lib.vfu_sgl_write(ctx, sg, cnt, buf)
 
 
+def vfu_sgl_read_async(ctx, sg, cnt, data, done, arg=None):
+    buf = (c.c_byte * len(data)).from_buffer(data)
+    return lib.vfu_sgl_read_async(ctx, sg, cnt, buf, done, arg)
+
+
+def vfu_sgl_write_async(ctx, sg, cnt, data, done, arg=None):
+    assert len(data) == sum([sge.length for sge in sg])
+    buf = (c.c_byte * len(data)).from_buffer(data)
+    return lib.vfu_sgl_write_async(ctx, sg, cnt, buf, done, arg)
+
+
+def vfu_get_dma_poll_fd(ctx):
+    return lib.vfu_get_dma_poll_fd(ctx)
+
+
+def vfu_process_dma_replies(ctx):
+    return lib.vfu_process_dma_replies(ctx)
+
+
+def vfu_setup_cmd_sockets(ctx, nr):
+    return lib.vfu_setup_cmd_sockets(ctx, nr)
+
+
+def vfu_get_nr_cmd_sockets(ctx):
+    return lib.vfu_get_nr_cmd_sockets(ctx)
+
+
+def vfu_bind_cmd_socket(ctx, index):
+    return lib.vfu_bind_cmd_socket(ctx, index)
+
+
+def vfu_setup_dma_transfer_window(ctx, window):
+    assert ctx is not None
+
+    return lib.vfu_setup_dma_transfer_window(ctx, window)
+
+
 def vfu_create_ioeventfd(ctx, region_idx, fd, gpa_offset, size, flags,
                          datamatch, shadow_fd=-1, shadow_offset=0):
     assert ctx is not None
@@ -1370,6 +1740,56 @@ def vfu_create_ioeventfd(ctx, region_idx, fd, gpa_offset, size, flags,
                                     flags, datamatch, shadow_fd, shadow_offset)
 
 
+def vfu_delete_ioeventfd(ctx, region_idx, fd, gpa_offset):
+    assert ctx is not None
+    return lib.vfu_delete_ioeventfd(ctx, region_idx, fd, gpa_offset)
+
+
+def vfu_update_ioeventfd(ctx, region_idx, fd, gpa_offset, size, flags,
+                         datamatch, shadow_fd=-1, shadow_offset=0):
+    assert ctx is not None
+    return lib.vfu_update_ioeventfd(ctx, region_idx, fd, gpa_offset, size,
+                                    flags, datamatch, shadow_fd, shadow_offset)
+
+
+def vfu_notify_region_io_fds_changed(ctx, region_idx):
+    assert ctx is not None
+    return lib.vfu_notify_region_io_fds_changed(ctx, region_idx)
+
+
+def vfu_setup_ioeventfd_dispatch(ctx):
+    assert ctx is not None
+    return lib.vfu_setup_ioeventfd_dispatch(ctx)
+
+
+def vfu_get_ioeventfd_dispatch_fd(ctx):
+    assert ctx is not None
+    return lib.vfu_get_ioeventfd_dispatch_fd(ctx)
+
+
+def vfu_set_ioeventfd_handler(ctx, fd, handler, arg=None):
+    assert ctx is not None
+    # ctypes needs an explicit NULL function pointer to remove a handler
+    if handler is None:
+        handler = vfu_ioeventfd_handler_t()
+    return lib.vfu_set_ioeventfd_handler(ctx, fd, handler, arg)
+
+
+def vfu_dispatch_ioeventfds(ctx, timeout=0):
+    assert ctx is not None
+    return lib.vfu_dispatch_ioeventfds(ctx, timeout)
+
+
+def vfu_set_ioeventfd_polled(ctx, fd, polled=True):
+    assert ctx is not None
+    return lib.vfu_set_ioeventfd_polled(ctx, fd, polled)
+
+
+def vfu_poll_ioeventfds(ctx):
+    assert ctx is not None
+    return lib.vfu_poll_ioeventfds(ctx)
+
+
 def vfu_device_quiesced(ctx, err):
     return lib.vfu_device_quiesced(ctx, err)
 
@@ -0,0 +1,209 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+from unittest.mock import patch
+
+ctx = None
+client = None
+pm_off = None
+px_off = None
+msix_off = None
+
+
+def setup_function(function):
+    global ctx, client, pm_off, px_off, msix_off
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR0_REGION_IDX,
+                            size=0x1000,
+                            flags=VFU_REGION_FLAG_RW | VFU_REGION_FLAG_MEM) == 0
+    vfu_setup_device_quiesce_cb(ctx)
+    assert vfu_setup_device_reset_cb(ctx) == 0
+
+    pm_off = vfu_pci_add_capability(ctx, pos=0, flags=0,
+        data=struct.pack("ccHH", to_byte(PCI_CAP_ID_PM), b'\0', 0, 0))
+    assert pm_off > 0
+    # FLR capable
+    px_off = vfu_pci_add_capability(ctx, pos=0, flags=0,
+        data=struct.pack("ccHHcc52c", to_byte(PCI_CAP_ID_EXP), b'\0', 0, 0,
+                         b'\0', b'\x10', *[b'\0' for _ in range(52)]))
+    assert px_off > 0
+    msix_off = vfu_pci_add_capability(ctx, pos=0, flags=0,
+        data=struct.pack("ccHII", to_byte(PCI_CAP_ID_MSIX), b'\0', 0, 0, 0))
+    assert msix_off > 0
+
+    assert vfu_setup_config_events(ctx, 4) == 0
+
+    assert vfu_realize_ctx(ctx) == 0
+    client = connect_client(ctx)
+
+
+def teardown_function(function):
+    client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+
+
+def get_event(expect=0):
+    ret, event = vfu_get_config_event(ctx)
+    if expect != 0:
+        assert ret == -1
+        assert c.get_errno() == expect
+        return None
+    assert ret == 0
+    return event
+
+
+def cfg_write(offset, data):
+    write_region(ctx, client.sock, VFU_PCI_DEV_CFG_REGION_IDX, offset=offset,
+                 count=len(data), data=data)
+
+
+def test_setup_config_events_bad():
+    ctx2 = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx2 is not None
+    assert vfu_pci_init(ctx2) == 0
+
+    ret, _ = vfu_get_config_event(ctx2)
+    assert ret == -1
+    assert c.get_errno() == errno.EINVAL
+
+    for nr_events in (0, 3):
+        assert vfu_setup_config_events(ctx2, nr_events) == -1
+        assert c.get_errno() == errno.EINVAL
+
+    assert vfu_realize_ctx(ctx2) == 0
+    assert vfu_setup_config_events(ctx2, 4) == -1
+    assert c.get_errno() == errno.EINVAL
+    vfu_destroy_ctx(ctx2)
+
+
+def test_config_events():
+    get_event(expect=errno.EAGAIN)
+    gen = vfu_pci_config_space_generation(ctx)
+
+    cfg_write(PCI_BASE_ADDRESS_0, to_bytes_le(0xfebf0000, 4))
+    event = get_event()
+    assert event.type == VFU_CONFIG_EVENT_BAR
+    assert event.index == 0
+    assert event.value == 0xfebf0000
+    assert event.generation == gen + 1
+
+    # no change, no event
+    cfg_write(PCI_BASE_ADDRESS_0, to_bytes_le(0xfebf0000, 4))
+    get_event(expect=errno.EAGAIN)
+
+    # struct pmcs: D3hot
+    cfg_write(pm_off + 4, b'\x03\x00')
+    event = get_event()
+    assert event.type == VFU_CONFIG_EVENT_POWER_STATE
+    assert event.value == 3
+
+    flags = PCI_MSIX_FLAGS_MASKALL | PCI_MSIX_FLAGS_ENABLE
+    cfg_write(msix_off + PCI_MSIX_FLAGS, to_bytes_le(flags, 2))
+    event = get_event()
+    assert event.type == VFU_CONFIG_EVENT_MSIX
+    assert event.value == flags
+    assert event.generation == vfu_pci_config_space_generation(ctx)
+
+    get_event(expect=errno.EAGAIN)
+
+
+@patch("libvfio_user.reset_cb")
+@patch("libvfio_user.quiesce_cb")
+def test_config_events_flr(mock_quiesce, mock_reset):
+    # iflr, twice
+    cfg_write(px_off + 8, b'\x00\x80')
+    cfg_write(px_off + 8, b'\x00\x80')
+
+    mock_quiesce.assert_not_called()
+    mock_reset.assert_not_called()
+
+    event = get_event()
+    assert event.type == VFU_CONFIG_EVENT_FLR
+    assert event.generation == vfu_pci_config_space_generation(ctx)
+    get_event(expect=errno.EAGAIN)
+
+
+@patch("libvfio_user.reset_cb")
+@patch("libvfio_user.quiesce_cb")
+def test_config_events_flr_order(mock_quiesce, mock_reset):
+    """An FLR is delivered in order with the other events."""
+    cfg_write(PCI_BASE_ADDRESS_0, to_bytes_le(0x10000, 4))
+    cfg_write(px_off + 8, b'\x00\x80')
+    gen = vfu_pci_config_space_generation(ctx)
+    cfg_write(PCI_BASE_ADDRESS_0, to_bytes_le(0x20000, 4))
+
+    event = get_event()
+    assert event.type == VFU_CONFIG_EVENT_BAR
+    assert event.value == 0x10000
+    event = get_event()
+    assert event.type == VFU_CONFIG_EVENT_FLR
+    assert event.generation == gen
+    event = get_event()
+    assert event.type == VFU_CONFIG_EVENT_BAR
+    assert event.value == 0x20000
+
+    # several FLRs are reported once, after the last
+    cfg_write(px_off + 8, b'\x00\x80')
+    cfg_write(PCI_BASE_ADDRESS_0, to_bytes_le(0x30000, 4))
+    cfg_write(px_off + 8, b'\x00\x80')
+
+    event = get_event()
+    assert event.type == VFU_CONFIG_EVENT_BAR
+    assert event.value == 0x30000
+    event = get_event()
+    assert event.type == VFU_CONFIG_EVENT_FLR
+    get_event(expect=errno.EAGAIN)
+
+
+def test_config_events_overflow():
+    for i in range(6):
+        cfg_write(PCI_BASE_ADDRESS_0, to_bytes_le((i + 1) << 12, 4))
+
+    event = get_event()
+    assert event.type == VFU_CONFIG_EVENT_OVERFLOW
+
+    for i in range(4):
+        event = get_event()
+        assert event.type == VFU_CONFIG_EVENT_BAR
+        assert event.value == (i + 1) << 12
+
+    get_event(expect=errno.EAGAIN)
+
+    # there's room again
+    cfg_write(PCI_BASE_ADDRESS_0, to_bytes_le(0x10000, 4))
+    event = get_event()
+    assert event.type == VFU_CONFIG_EVENT_BAR
+    assert event.value == 0x10000
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
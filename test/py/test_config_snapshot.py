@@ -0,0 +1,162 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import threading
+
+ctx = None
+client = None
+vsc_off = None
+
+VSC_DATA_LEN = 8
+NONSTD_OFF = 0x80
+
+snapshots = []
+
+
+@vfu_region_access_cb_t
+def cfg_cb(ctx, buf, count, offset, is_write):
+    ret, _, gen = vfu_pci_config_space_snapshot(ctx, vsc_off + 3, VSC_DATA_LEN)
+    snapshots.append((ret, gen))
+    return count
+
+
+def setup_function(function):
+    global ctx, client, vsc_off
+
+    snapshots.clear()
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_setup_region(ctx, index=VFU_PCI_DEV_CFG_REGION_IDX,
+                            size=PCI_CFG_SPACE_SIZE, cb=cfg_cb,
+                            flags=VFU_REGION_FLAG_RW) == 0
+
+    data = b'\0' * VSC_DATA_LEN
+    cap = struct.pack("ccc%ds" % len(data), to_byte(PCI_CAP_ID_VNDR), b'\0',
+                      to_byte(3 + len(data)), data)
+    vsc_off = vfu_pci_add_capability(ctx, pos=0, flags=0, data=cap)
+    assert vsc_off == PCI_STD_HEADER_SIZEOF
+
+    assert vfu_realize_ctx(ctx) == 0
+    client = connect_client(ctx)
+
+
+def teardown_function(function):
+    client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+
+
+def test_config_space_snapshot_bad_range():
+    for (offset, count) in ((PCI_CFG_SPACE_SIZE, 1),
+                            (PCI_CFG_SPACE_SIZE - 1, 2),
+                            (0xffffffffffffffff, 2)):
+        ret, _, _ = vfu_pci_config_space_snapshot(ctx, offset, count)
+        assert ret == -1
+        assert c.get_errno() == errno.EINVAL
+
+
+def test_config_space_generation():
+    gen = vfu_pci_config_space_generation(ctx)
+
+    ret, data, snap_gen = vfu_pci_config_space_snapshot(ctx, vsc_off + 3,
+                                                        VSC_DATA_LEN)
+    assert ret == 0
+    assert data == b'\0' * VSC_DATA_LEN
+    assert snap_gen == gen
+
+    # reads don't change the generation
+    read_region(ctx, client.sock, VFU_PCI_DEV_CFG_REGION_IDX,
+                offset=vsc_off + 3, count=VSC_DATA_LEN)
+    assert vfu_pci_config_space_generation(ctx) == gen
+
+    write_region(ctx, client.sock, VFU_PCI_DEV_CFG_REGION_IDX,
+                 offset=vsc_off + 3, count=VSC_DATA_LEN, data=b'\x42' * 8)
+    assert vfu_pci_config_space_generation(ctx) == gen + 1
+
+    ret, data, snap_gen = vfu_pci_config_space_snapshot(ctx, vsc_off + 3,
+                                                        VSC_DATA_LEN)
+    assert ret == 0
+    assert data == b'\x42' * VSC_DATA_LEN
+    assert snap_gen == gen + 1
+
+    # a rejected write doesn't count
+    write_region(ctx, client.sock, VFU_PCI_DEV_CFG_REGION_IDX,
+                 offset=vsc_off, count=1, data=b'\x01', expect=errno.EPERM)
+    assert vfu_pci_config_space_generation(ctx) == gen + 1
+
+    # adding a capability changes config space too
+    cap = struct.pack("ccHH", to_byte(PCI_CAP_ID_PM), b'\0', 0, 0)
+    assert vfu_pci_add_capability(ctx, pos=0, flags=0, data=cap) > 0
+    assert vfu_pci_config_space_generation(ctx) == gen + 2
+
+
+def test_config_space_snapshot_from_callback():
+    """
+    Device callbacks aren't part of a write, so they may take snapshots.
+    """
+    gen = vfu_pci_config_space_generation(ctx)
+
+    write_region(ctx, client.sock, VFU_PCI_DEV_CFG_REGION_IDX,
+                 offset=NONSTD_OFF, count=4, data=b'\x01\x02\x03\x04')
+
+    assert snapshots == [(0, gen)]
+    assert vfu_pci_config_space_generation(ctx) == gen
+
+
+def test_config_space_snapshot_concurrent():
+    """
+    Tests that a thread taking snapshots while the client rewrites a
+    capability never sees a partial write.
+    """
+    done = threading.Event()
+    bad = []
+
+    def reader():
+        while not done.is_set():
+            ret, data, _ = vfu_pci_config_space_snapshot(ctx, vsc_off + 3,
+                                                         VSC_DATA_LEN)
+            if ret != 0 or data != data[:1] * VSC_DATA_LEN:
+                bad.append(data)
+
+    thread = threading.Thread(target=reader)
+    thread.start()
+
+    for i in range(256):
+        write_region(ctx, client.sock, VFU_PCI_DEV_CFG_REGION_IDX,
+                     offset=vsc_off + 3, count=VSC_DATA_LEN,
+                     data=bytes([i]) * VSC_DATA_LEN)
+
+    done.set()
+    thread.join()
+    assert bad == []
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
@@ -225,7 +225,7 @@ def test_device_get_region_io_fds_full():
         [out] = struct.unpack("@Q", out)
         assert out == 1
         assert ioevents[i].size == IOEVENT_SIZE
-        assert ioevents[i].gpa_offset == 40 - (IOEVENT_SIZE * i)
+        assert ioevents[i].gpa_offset == IOEVENT_SIZE * i
         assert ioevents[i].type == VFIO_USER_IO_FD_TYPE_IOEVENTFD
 
     for i in newfds:
@@ -276,34 +276,34 @@ def test_device_get_region_io_fds_fds_read_write_dupe_fd():
         ioevent, ret = vfio_user_sub_region_ioeventfd.pop_from_buffer(ret)
         ioevents.append(ioevent)
 
-    for i in range(2, 8):
+    for i in range(0, 6):
         os.write(newfds[ioevents[i].fd_index], c.c_ulonglong(1))
 
-    for i in range(2, 8):
+    for i in range(0, 6):
         out = os.read(newfds[ioevents[i].fd_index], ioevent.size)
         [out] = struct.unpack("@Q", out)
         assert out == 1
         assert ioevents[i].size == IOEVENT_SIZE
-        assert ioevents[i].gpa_offset == 56 - (IOEVENT_SIZE * i)
+        assert ioevents[i].gpa_offset == IOEVENT_SIZE * i
         assert ioevents[i].type == VFIO_USER_IO_FD_TYPE_IOEVENTFD
 
-    assert ioevents[0].fd_index == ioevents[1].fd_index
-    assert ioevents[0].gpa_offset != ioevents[1].gpa_offset
+    assert ioevents[6].fd_index == ioevents[7].fd_index
+    assert ioevents[6].gpa_offset != ioevents[7].gpa_offset
 
-    os.write(newfds[ioevents[0].fd_index], c.c_ulonglong(1))
+    os.write(newfds[ioevents[6].fd_index], c.c_ulonglong(1))
 
-    out = os.read(newfds[ioevents[1].fd_index], ioevent.size)
+    out = os.read(newfds[ioevents[7].fd_index], ioevent.size)
     [out] = struct.unpack("@Q", out)
     assert out == 1
 
-    os.write(newfds[ioevents[1].fd_index], c.c_ulonglong(1))
+    os.write(newfds[ioevents[7].fd_index], c.c_ulonglong(1))
 
-    out = os.read(newfds[ioevents[0].fd_index], ioevent.size)
+    out = os.read(newfds[ioevents[6].fd_index], ioevent.size)
     [out] = struct.unpack("@Q", out)
     assert out == 1
 
-    os.write(newfds[ioevents[0].fd_index], c.c_ulonglong(1))
-    out = os.read(newfds[ioevents[1].fd_index], ioevent.size)
+    os.write(newfds[ioevents[6].fd_index], c.c_ulonglong(1))
+    out = os.read(newfds[ioevents[7].fd_index], ioevent.size)
     [out] = struct.unpack("@Q", out)
     assert out == 1
 
@@ -319,6 +319,41 @@ def test_device_get_region_io_fds_ioeventfd_invalid_size():
     os.close(t)
 
 
+def test_device_get_region_io_fds_ioeventfd_overlap():
+
+    t = eventfd(0, 0)
+    # partial overlap with the ioeventfd at IOEVENT_SIZE
+    c.set_errno(0)
+    assert vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR2_REGION_IDX, t,
+                                IOEVENT_SIZE + 4, IOEVENT_SIZE, 0, 0) == -1
+    assert c.get_errno() == errno.EEXIST
+    # same range without datamatch
+    c.set_errno(0)
+    assert vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR2_REGION_IDX, t,
+                                0, IOEVENT_SIZE, 0, 0) == -1
+    assert c.get_errno() == errno.EEXIST
+
+    # the same range may be shared by ioeventfds matching distinct values
+    offset = 0x7000
+    for datamatch in (1, 2):
+        assert vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR2_REGION_IDX, t,
+                                    offset, 4, VFIO_USER_IO_FD_FLAG_DATAMATCH,
+                                    datamatch) == 0
+    for (off, size, datamatch) in ((offset, 4, 2), (offset, 2, 3),
+                                   (offset + 2, 4, 3), (offset - 2, 4, 3)):
+        c.set_errno(0)
+        assert vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR2_REGION_IDX, t,
+                                    off, size, VFIO_USER_IO_FD_FLAG_DATAMATCH,
+                                    datamatch) == -1
+        assert c.get_errno() == errno.EEXIST
+    # adjacent ranges don't overlap
+    assert vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR2_REGION_IDX, t,
+                                offset + 4, 4, 0, 0) == 0
+    assert vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR2_REGION_IDX, t,
+                                offset - 4, 4, 0, 0) == 0
+    os.close(t)
+
+
 def test_device_get_region_info_cleanup():
     for i in fds:
         os.close(i)
@@ -384,28 +419,27 @@ def test_device_get_region_io_fds_invalid_fd():
         ioevent, ret = vfio_user_sub_region_ioeventfd.pop_from_buffer(ret)
         ioevents.append(ioevent)
 
-    # TODO this assumes that ioregionfds are returned in the reverse order
-    # they're created. It should be straightforward to compare based on IOVA.
+    # ioeventfds are returned sorted by offset
     assert ioevents[0].fd_index == 0
-    assert ioevents[0].gpa_offset == 4 * IOEVENT_SIZE
+    assert ioevents[0].gpa_offset == 0 * IOEVENT_SIZE
     assert ioevents[0].size == IOEVENT_SIZE
     assert fds_are_same(newfds[0], fds[0])
 
     assert ioevents[1].fd_index == UINT32_MAX
-    assert ioevents[1].gpa_offset == 3 * IOEVENT_SIZE
+    assert ioevents[1].gpa_offset == 1 * IOEVENT_SIZE
     assert ioevents[1].size == IOEVENT_SIZE
 
-    assert ioevents[2].fd_index == 0
+    assert ioevents[2].fd_index == 1
     assert ioevents[2].gpa_offset == 2 * IOEVENT_SIZE
     assert ioevents[2].size == IOEVENT_SIZE
-    assert fds_are_same(newfds[0], fds[0])
+    assert fds_are_same(newfds[1], fds[1])
 
     assert ioevents[3].fd_index == UINT32_MAX
-    assert ioevents[3].gpa_offset == 1 * IOEVENT_SIZE
+    assert ioevents[3].gpa_offset == 3 * IOEVENT_SIZE
     assert ioevents[3].size == IOEVENT_SIZE
 
     assert ioevents[4].fd_index == 1
-    assert ioevents[4].gpa_offset == 0 * IOEVENT_SIZE
+    assert ioevents[4].gpa_offset == 4 * IOEVENT_SIZE
     assert ioevents[4].size == IOEVENT_SIZE
     assert fds_are_same(newfds[1], fds[1])
 
@@ -0,0 +1,183 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import select
+from unittest.mock import patch
+
+ctx = None
+client = None
+
+
+def setup_function(function):
+    global ctx, client
+    ctx = prepare_ctx_for_dma()
+    assert ctx is not None
+    client = connect_client(ctx)
+
+
+def teardown_function(function):
+    client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+
+
+def send_map(addr, size=0x1000):
+    payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+        flags=(VFIO_USER_F_DMA_REGION_READ |
+               VFIO_USER_F_DMA_REGION_WRITE),
+        offset=0, addr=addr, size=size)
+    send_msg(client.sock, VFIO_USER_DMA_MAP, VFIO_USER_F_TYPE_COMMAND,
+             bytes(payload))
+
+
+def send_unmap(addr, size=0x1000):
+    payload = vfio_user_dma_unmap(argsz=len(vfio_user_dma_unmap()),
+                                  addr=addr, size=size)
+    send_msg(client.sock, VFIO_USER_DMA_UNMAP, VFIO_USER_F_TYPE_COMMAND,
+             bytes(payload))
+
+
+def get_replies(nr):
+    """Returns the (cmd, errno) of the next @nr replies."""
+    replies = []
+    for i in range(nr):
+        hdr = client.sock.recv(16, socket.MSG_WAITALL)
+        _, cmd, size, flags, err = struct.unpack("HHIII", hdr)
+        assert flags & VFIO_USER_F_TYPE_REPLY
+        if size > 16:
+            client.sock.recv(size - 16, socket.MSG_WAITALL)
+        replies.append((cmd, err))
+    return replies
+
+
+@patch('libvfio_user.dma_unregister')
+@patch('libvfio_user.dma_register')
+@patch('libvfio_user.quiesce_cb')
+def test_dma_batch(mock_quiesce, mock_dma_register, mock_dma_unregister):
+    for i in range(4):
+        send_map(0x10000 * (i + 1))
+
+    assert vfu_run_ctx(ctx) == 4
+    mock_quiesce.assert_called_once_with(ctx)
+    assert mock_dma_register.call_count == 4
+    assert get_replies(4) == [(VFIO_USER_DMA_MAP, 0)] * 4
+
+    mock_quiesce.reset_mock()
+    for i in range(4):
+        send_unmap(0x10000 * (i + 1))
+
+    assert vfu_run_ctx(ctx) == 4
+    mock_quiesce.assert_called_once_with(ctx)
+    assert mock_dma_unregister.call_count == 4
+    assert get_replies(4) == [(VFIO_USER_DMA_UNMAP, 0)] * 4
+
+
+@patch('libvfio_user.quiesce_cb')
+def test_dma_batch_failed_request(mock_quiesce):
+    send_map(0x10000)
+    send_map(0x10800)
+    send_map(0x20000)
+
+    # the overlapping map fails but the batch carries on
+    assert vfu_run_ctx(ctx) == 3
+    mock_quiesce.assert_called_once_with(ctx)
+    assert get_replies(3) == [(VFIO_USER_DMA_MAP, 0),
+                              (VFIO_USER_DMA_MAP, errno.EINVAL),
+                              (VFIO_USER_DMA_MAP, 0)]
+
+
+@patch('libvfio_user.quiesce_cb')
+def test_dma_batch_stops_at_other_request(mock_quiesce):
+    send_map(0x10000)
+    send_msg(client.sock, VFIO_USER_DEVICE_GET_INFO, VFIO_USER_F_TYPE_COMMAND,
+             bytes(vfio_user_device_info(argsz=len(vfio_user_device_info()))))
+    send_map(0x20000)
+
+    # The last DMA map was received along with the others, so it's handled by
+    # the same call, but needs a quiesce of its own.
+    assert vfu_run_ctx(ctx) == 3
+    assert mock_quiesce.call_count == 2
+    assert get_replies(3) == [(VFIO_USER_DMA_MAP, 0),
+                              (VFIO_USER_DEVICE_GET_INFO, 0),
+                              (VFIO_USER_DMA_MAP, 0)]
+
+
+@patch('libvfio_user.dma_register')
+@patch('libvfio_user.quiesce_cb', side_effect=fail_with_errno(errno.EBUSY))
+def test_dma_batch_busy(mock_quiesce, mock_dma_register):
+    for i in range(3):
+        send_map(0x10000 * (i + 1))
+
+    vfu_run_ctx(ctx, errno.EBUSY)
+    mock_dma_register.assert_not_called()
+
+    # vfu_device_quiesced() may be called from a device thread, so until it's
+    # done with the batch the context is still busy.
+    busy = []
+    mock_dma_register.side_effect = \
+        lambda ctx, info: busy.append(lib.vfu_run_ctx(ctx) == -1 and
+                                      c.get_errno() == errno.EBUSY)
+
+    assert vfu_device_quiesced(ctx, 0) == 0
+    mock_quiesce.assert_called_once_with(ctx)
+    assert mock_dma_register.call_count == 3
+    assert busy == [True] * 3
+    assert get_replies(3) == [(VFIO_USER_DMA_MAP, 0)] * 3
+
+
+@patch('libvfio_user.dma_register')
+@patch('libvfio_user.quiesce_cb', side_effect=fail_with_errno(errno.EBUSY))
+def test_dma_batch_region_write(mock_quiesce, mock_dma_register):
+    """
+    A region write received right after a batch of DMA maps isn't handled
+    while the device is quiesced for the batch, but by the next vfu_run_ctx().
+    """
+    cls_off = 0xc
+
+    send_map(0x10000)
+    send_map(0x20000)
+    send_msg(client.sock, VFIO_USER_REGION_WRITE, VFIO_USER_F_TYPE_COMMAND,
+             struct.pack("QII", cls_off, VFU_PCI_DEV_CFG_REGION_IDX, 1) +
+             b'\x10')
+
+    vfu_run_ctx(ctx, errno.EBUSY)
+    assert vfu_device_quiesced(ctx, 0) == 0
+    assert mock_dma_register.call_count == 2
+    assert get_replies(2) == [(VFIO_USER_DMA_MAP, 0)] * 2
+    assert get_pci_cfg_space(ctx)[cls_off] == 0
+
+    (ready, _, _) = select.select([vfu_get_poll_fd(ctx)], [], [], 0)
+    assert ready != []
+    assert vfu_run_ctx(ctx) == 1
+    assert get_replies(1) == [(VFIO_USER_REGION_WRITE, 0)]
+    assert get_pci_cfg_space(ctx)[cls_off] == 0x10
+    mock_quiesce.assert_called_once_with(ctx)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
@@ -0,0 +1,101 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+from unittest.mock import patch
+
+ctx = None
+client = None
+
+
+def setup_function(function):
+    global ctx, client
+    ctx = prepare_ctx_for_dma(flags=LIBVFIO_USER_FLAG_ATTACH_NB |
+                              LIBVFIO_USER_FLAG_DMA_MAP_NO_QUIESCE)
+    assert ctx is not None
+    client = connect_client(ctx)
+
+
+def teardown_function(function):
+    client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+
+
+def dma_map(addr, size, expect=0):
+    payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+        flags=(VFIO_USER_F_DMA_REGION_READ |
+               VFIO_USER_F_DMA_REGION_WRITE),
+        offset=0, addr=addr, size=size)
+
+    msg(ctx, client.sock, VFIO_USER_DMA_MAP, payload, expect=expect)
+
+
+def test_dma_map_no_quiesce_bad_flags():
+    c.set_errno(0)
+    assert vfu_create_ctx(flags=1 << 7) is None
+    assert c.get_errno() == errno.EINVAL
+
+
+@patch('libvfio_user.dma_register')
+@patch('libvfio_user.quiesce_cb')
+def test_dma_map_no_quiesce(mock_quiesce, mock_dma_register):
+    dma_map(0x10000, 0x1000)
+    dma_map(0x20000, 0x2000)
+
+    mock_quiesce.assert_not_called()
+    assert mock_dma_register.call_count == 2
+
+    count, sgs = vfu_addr_to_sgl(ctx, 0x20000, 0x2000)
+    assert count == 1
+    assert sgs[0].region == 1
+
+    # overlapping maps still fail, without quiescing
+    dma_map(0x10800, 0x1000, expect=errno.EINVAL)
+    mock_quiesce.assert_not_called()
+
+
+@patch('libvfio_user.dma_unregister')
+@patch('libvfio_user.quiesce_cb')
+def test_dma_unmap_quiesces(mock_quiesce, mock_dma_unregister):
+    dma_map(0x10000, 0x1000)
+    mock_quiesce.assert_not_called()
+
+    payload = vfio_user_dma_unmap(argsz=len(vfio_user_dma_unmap()),
+                                  addr=0x10000, size=0x1000)
+    msg(ctx, client.sock, VFIO_USER_DMA_UNMAP, payload)
+
+    mock_quiesce.assert_called_once_with(ctx)
+    mock_dma_unregister.assert_called_once()
+
+    count, sgs = vfu_addr_to_sgl(ctx, 0x10000, 0x1000)
+    assert count == -1
+    assert c.get_errno() == errno.ENOENT
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
@@ -0,0 +1,229 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import tempfile
+from unittest.mock import patch
+
+ctx = None
+client = None
+io_quiesces = []
+
+
+@vfu_io_ctx_quiesce_cb_t
+def io_ctx_quiesce(ctx, arg):
+    io_quiesces.append(arg)
+
+
+def setup_function(function):
+    global ctx, client
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_setup_device_dma(ctx) == 0
+    vfu_setup_device_quiesce_cb(ctx)
+
+    # arg is a void *, so avoid 0 which ctypes passes as None
+    assert vfu_setup_io_ctx(ctx, io_ctx_quiesce, 10) == 0
+    assert vfu_setup_io_ctx(ctx, io_ctx_quiesce, 11) == 1
+
+    assert vfu_realize_ctx(ctx) == 0
+
+    c.set_errno(0)
+    assert vfu_setup_io_ctx(ctx, io_ctx_quiesce, 12) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    io_quiesces.clear()
+    client = connect_client(ctx)
+
+
+def teardown_function(function):
+    client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+
+
+def dma_map(f, addr, size=PAGE_SIZE):
+    payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+        flags=(VFIO_USER_F_DMA_REGION_READ |
+               VFIO_USER_F_DMA_REGION_WRITE),
+        offset=0, addr=addr, size=size)
+    msg(ctx, client.sock, VFIO_USER_DMA_MAP, payload, fds=[f.fileno()])
+
+
+def dma_unmap(addr, size=PAGE_SIZE, flags=0):
+    payload = vfio_user_dma_unmap(argsz=len(vfio_user_dma_unmap()),
+                                  flags=flags, addr=addr, size=size)
+    msg(ctx, client.sock, VFIO_USER_DMA_UNMAP, payload)
+
+
+@patch('libvfio_user.quiesce_cb')
+def test_io_ctx_unmap(mock_quiesce):
+    f = tempfile.TemporaryFile()
+    f.truncate(4 * PAGE_SIZE)
+
+    dma_map(f, 0x10000)
+    dma_map(f, 0x20000)
+    dma_map(f, 0x30000)
+    assert mock_quiesce.call_count == 3
+    mock_quiesce.reset_mock()
+
+    count, sgs = vfu_io_ctx_addr_to_sgl(ctx, 0, 0x10000, PAGE_SIZE)
+    assert count == 1 and sgs[0].region == 0
+    count, sgs = vfu_io_ctx_addr_to_sgl(ctx, 1, 0x20000, PAGE_SIZE)
+    assert count == 1 and sgs[0].region == 1
+    count, sgs = vfu_io_ctx_addr_to_sgl(ctx, 0, 0x20000, PAGE_SIZE)
+    assert count == 1
+
+    # only the I/O contexts using the region are waited for
+    dma_unmap(0x30000)
+    assert io_quiesces == []
+    dma_unmap(0x10000)
+    assert io_quiesces == [10]
+    dma_unmap(0x20000)
+    assert io_quiesces == [10, 10, 11]
+    mock_quiesce.assert_not_called()
+
+    count, sgs = vfu_io_ctx_addr_to_sgl(ctx, 0, 0x10000, PAGE_SIZE)
+    assert count == -1
+    assert c.get_errno() == errno.ENOENT
+    count, sgs = vfu_addr_to_sgl(ctx, 0x20000, PAGE_SIZE)
+    assert count == -1
+    assert c.get_errno() == errno.ENOENT
+
+    # the dead slots are reclaimed once the device is quiesced again
+    dma_map(f, 0x40000)
+    mock_quiesce.assert_called_once_with(ctx)
+    count, sgs = vfu_io_ctx_addr_to_sgl(ctx, 1, 0x40000, PAGE_SIZE)
+    assert count == 1 and sgs[0].region == 0
+
+    # a mapping can reuse a range that was unmapped
+    dma_map(f, 0x10000)
+    count, sgs = vfu_io_ctx_addr_to_sgl(ctx, 0, 0x10000, PAGE_SIZE)
+    assert count == 1 and sgs[0].region == 1
+    f.close()
+
+
+@patch('libvfio_user.quiesce_cb')
+def test_io_ctx_quiescent(mock_quiesce):
+    f = tempfile.TemporaryFile()
+    f.truncate(PAGE_SIZE)
+
+    dma_map(f, 0x10000)
+    mock_quiesce.reset_mock()
+
+    count, sgs = vfu_io_ctx_addr_to_sgl(ctx, 0, 0x10000, PAGE_SIZE)
+    assert count == 1
+    count, sgs = vfu_io_ctx_addr_to_sgl(ctx, 1, 0x10000, PAGE_SIZE)
+    assert count == 1
+    vfu_io_ctx_quiescent(ctx, 0)
+
+    dma_unmap(0x10000)
+    assert io_quiesces == [11]
+    mock_quiesce.assert_not_called()
+    f.close()
+
+
+@patch('libvfio_user.quiesce_cb')
+def test_io_ctx_unmap_all(mock_quiesce):
+    f = tempfile.TemporaryFile()
+    f.truncate(PAGE_SIZE)
+
+    dma_map(f, 0x10000)
+    mock_quiesce.reset_mock()
+
+    count, sgs = vfu_io_ctx_addr_to_sgl(ctx, 0, 0x10000, PAGE_SIZE)
+    assert count == 1
+
+    # unmapping everything still quiesces the whole device
+    dma_unmap(0, 0, flags=VFIO_DMA_UNMAP_FLAG_ALL)
+    mock_quiesce.assert_called_once_with(ctx)
+    assert io_quiesces == []
+    count, sgs = vfu_addr_to_sgl(ctx, 0x10000, PAGE_SIZE)
+    assert count == -1
+    f.close()
+
+
+@patch('libvfio_user.quiesce_cb')
+def test_io_ctx_reuse_dead_slots(mock_quiesce):
+    """
+    Without the device quiescing, dead slots are reused once the I/O contexts
+    have reached a quiescent point, so map/unmap cycles don't fill the table.
+    """
+    path = SOCK_PATH + b".no_quiesce"
+    ctx2 = vfu_create_ctx(sock_path=path,
+                          flags=LIBVFIO_USER_FLAG_ATTACH_NB |
+                          LIBVFIO_USER_FLAG_DMA_MAP_NO_QUIESCE)
+    assert ctx2 is not None
+    assert vfu_pci_init(ctx2) == 0
+    assert vfu_setup_device_dma(ctx2) == 0
+    vfu_setup_device_quiesce_cb(ctx2)
+    assert vfu_setup_io_ctx(ctx2, io_ctx_quiesce, 10) == 0
+    assert vfu_setup_io_ctx(ctx2, io_ctx_quiesce, 11) == 1
+    assert vfu_realize_ctx(ctx2) == 0
+    client2 = connect_client(ctx2, sock_path=path)
+
+    f = tempfile.TemporaryFile()
+    f.truncate(PAGE_SIZE)
+
+    def map_unmap(addr):
+        payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+            flags=(VFIO_USER_F_DMA_REGION_READ |
+                   VFIO_USER_F_DMA_REGION_WRITE),
+            offset=0, addr=addr, size=PAGE_SIZE)
+        msg(ctx2, client2.sock, VFIO_USER_DMA_MAP, payload, fds=[f.fileno()])
+
+        count, sgs = vfu_io_ctx_addr_to_sgl(ctx2, 0, addr, PAGE_SIZE)
+        assert count == 1
+
+        payload = vfio_user_dma_unmap(argsz=len(vfio_user_dma_unmap()),
+                                      flags=0, addr=addr, size=PAGE_SIZE)
+        msg(ctx2, client2.sock, VFIO_USER_DMA_UNMAP, payload)
+
+    # I/O context 0 is a user, so it's waited for; 1 is quiescent anyway.
+    for i in range(2 * MAX_DMA_REGIONS):
+        map_unmap(0x10000 * (i + 1))
+        vfu_io_ctx_quiescent(ctx2, 1)
+    assert io_quiesces == [10] * (2 * MAX_DMA_REGIONS)
+
+    # If 1 never is, it's quiesced once the table fills up.
+    io_quiesces.clear()
+    for i in range(2 * MAX_DMA_REGIONS):
+        map_unmap(0x10000 * (i + 1))
+    assert io_quiesces.count(10) == 2 * MAX_DMA_REGIONS
+    assert io_quiesces.count(11) == 1
+
+    mock_quiesce.assert_not_called()
+
+    client2.disconnect(ctx2)
+    vfu_destroy_ctx(ctx2)
+    f.close()
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
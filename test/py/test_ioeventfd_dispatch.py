@@ -0,0 +1,226 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import os
+import tempfile
+
+ctx = None
+client = None
+efd = None
+shadow = None
+kicks = []
+
+
+@vfu_ioeventfd_handler_t
+def handler(ctx, arg, value, nr):
+    kicks.append((arg, value, nr))
+
+
+def kick(fd, times=1):
+    for _ in range(times):
+        os.write(fd, struct.pack("Q", 1))
+
+
+def setup_function(function):
+    global ctx, client, efd, shadow
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    ret = vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR0_REGION_IDX, size=0x1000,
+                           flags=(VFU_REGION_FLAG_RW | VFU_REGION_FLAG_MEM))
+    assert ret == 0
+
+    ret = vfu_realize_ctx(ctx)
+    assert ret == 0
+
+    shadow = tempfile.TemporaryFile()
+    shadow.truncate(PAGE_SIZE)
+
+    efd = eventfd(0, 0)
+    ret = vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, efd, 0x10, 4,
+                               0, 0, shadow.fileno(), 0x20)
+    assert ret == 0
+
+    kicks.clear()
+
+    client = connect_client(ctx)
+
+
+def teardown_function(function):
+    client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+    os.close(efd)
+    shadow.close()
+
+
+def test_ioeventfd_dispatch_bad():
+    c.set_errno(0)
+    assert vfu_get_ioeventfd_dispatch_fd(ctx) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    c.set_errno(0)
+    assert vfu_dispatch_ioeventfds(ctx) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    tmp = eventfd(0, 0)
+    c.set_errno(0)
+    assert vfu_set_ioeventfd_handler(ctx, tmp, handler) == -1
+    assert c.get_errno() == errno.ENOENT
+
+    # one fd backing two ioeventfds
+    assert vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, tmp, 0x40,
+                                4, 0, 0) == 0
+    assert vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, tmp, 0x48,
+                                4, 0, 0) == 0
+    c.set_errno(0)
+    assert vfu_set_ioeventfd_handler(ctx, tmp, handler) == -1
+    assert c.get_errno() == errno.EINVAL
+    os.close(tmp)
+
+
+def test_ioeventfd_dispatch_needs_nb():
+    ctx2 = vfu_create_ctx(flags=0, sock_path=SOCK_PATH + b".2")
+    assert ctx2 is not None
+    c.set_errno(0)
+    assert vfu_setup_ioeventfd_dispatch(ctx2) == -1
+    assert c.get_errno() == errno.EINVAL
+    vfu_destroy_ctx(ctx2)
+
+
+def test_ioeventfd_dispatch_batched_kicks():
+    # handlers set before and after the dispatcher are both picked up
+    assert vfu_set_ioeventfd_handler(ctx, efd, handler, 0x1234) == 0
+    assert vfu_setup_ioeventfd_dispatch(ctx) == 0
+    assert vfu_get_ioeventfd_dispatch_fd(ctx) >= 0
+
+    tmp = eventfd(0, 0)
+    assert vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, tmp, 0x40,
+                                4, 0, 0) == 0
+    assert vfu_set_ioeventfd_handler(ctx, tmp, handler, 0x5678) == 0
+
+    assert vfu_dispatch_ioeventfds(ctx, 0) == 0
+    assert kicks == []
+
+    os.pwrite(shadow.fileno(), struct.pack("I", 0xcafe), 0x20)
+    kick(efd, 3)
+    kick(tmp)
+
+    assert vfu_dispatch_ioeventfds(ctx, 0) == 2
+    assert sorted(kicks) == [(0x1234, 0xcafe, 3), (0x5678, 0, 1)]
+
+    # removed handlers are no longer dispatched
+    kicks.clear()
+    assert vfu_set_ioeventfd_handler(ctx, tmp, None) == 0
+    kick(tmp)
+    assert vfu_dispatch_ioeventfds(ctx, 0) == 0
+    assert kicks == []
+    os.close(tmp)
+
+
+def test_ioeventfd_dispatch_transport():
+    assert vfu_setup_ioeventfd_dispatch(ctx) == 0
+    assert vfu_set_ioeventfd_handler(ctx, efd, handler) == 0
+
+    payload = vfio_user_device_info(argsz=32, flags=0,
+                                    num_regions=0, num_irqs=0)
+    send_msg(client.sock, VFIO_USER_DEVICE_GET_INFO,
+             VFIO_USER_F_TYPE_COMMAND, payload)
+    kick(efd)
+
+    assert vfu_dispatch_ioeventfds(ctx, -1) == 1
+    assert len(kicks) == 1
+    get_reply(client.sock)
+
+
+def test_ioeventfd_dispatch_disconnect():
+    global client
+
+    assert vfu_setup_ioeventfd_dispatch(ctx) == 0
+    assert vfu_dispatch_ioeventfds(ctx, 0) == 0
+
+    client.sock.close()
+    c.set_errno(0)
+    assert vfu_dispatch_ioeventfds(ctx, -1) == -1
+    assert c.get_errno() == errno.ENOTCONN
+
+    # the new connection's poll fd is registered on the next dispatch
+    client = connect_client(ctx)
+    payload = vfio_user_device_info(argsz=32, flags=0,
+                                    num_regions=0, num_irqs=0)
+    send_msg(client.sock, VFIO_USER_DEVICE_GET_INFO,
+             VFIO_USER_F_TYPE_COMMAND, payload)
+    assert vfu_dispatch_ioeventfds(ctx, -1) == 0
+    get_reply(client.sock)
+
+
+def test_ioeventfd_poll_bad():
+    tmp = eventfd(0, 0)
+    c.set_errno(0)
+    assert vfu_set_ioeventfd_polled(ctx, tmp) == -1
+    assert c.get_errno() == errno.ENOENT
+
+    # only shadow ioeventfds can be polled
+    assert vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, tmp, 0x40,
+                                4, 0, 0) == 0
+    c.set_errno(0)
+    assert vfu_set_ioeventfd_polled(ctx, tmp) == -1
+    assert c.get_errno() == errno.EINVAL
+    os.close(tmp)
+
+
+def test_ioeventfd_poll():
+    assert vfu_setup_ioeventfd_dispatch(ctx) == 0
+    assert vfu_set_ioeventfd_handler(ctx, efd, handler, 0x1234) == 0
+
+    # a value already present when polling starts is not reported
+    os.pwrite(shadow.fileno(), struct.pack("I", 1), 0x20)
+    assert vfu_set_ioeventfd_polled(ctx, efd) == 0
+    assert vfu_poll_ioeventfds(ctx) == 0
+
+    os.pwrite(shadow.fileno(), struct.pack("I", 2), 0x20)
+    kick(efd)
+    assert vfu_poll_ioeventfds(ctx) == 1
+    assert vfu_poll_ioeventfds(ctx) == 0
+    assert kicks == [(0x1234, 2, 0)]
+
+    # the eventfd isn't dispatched while polled
+    assert vfu_dispatch_ioeventfds(ctx, 0) == 0
+
+    # back to the dispatcher, which picks up the pending kick
+    kicks.clear()
+    assert vfu_set_ioeventfd_polled(ctx, efd, False) == 0
+    assert vfu_dispatch_ioeventfds(ctx, 0) == 1
+    assert kicks == [(0x1234, 2, 1)]
+    os.pwrite(shadow.fileno(), struct.pack("I", 3), 0x20)
+    assert vfu_poll_ioeventfds(ctx) == 0
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
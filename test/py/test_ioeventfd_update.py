@@ -0,0 +1,241 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import os
+import tempfile
+
+ctx = None
+client = None
+fds = []
+kicks = []
+
+
+@vfu_ioeventfd_handler_t
+def handler(ctx, arg, value, nr):
+    kicks.append(arg)
+    # deleting another ready ioeventfd from a handler must be safe
+    if arg == 1:
+        assert vfu_delete_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[1],
+                                    IOEVENT_SIZE) == 0
+
+
+def setup_function(function):
+    global ctx, client
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    ret = vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR0_REGION_IDX, size=0x1000,
+                           flags=(VFU_REGION_FLAG_RW | VFU_REGION_FLAG_MEM))
+    assert ret == 0
+
+    ret = vfu_realize_ctx(ctx)
+    assert ret == 0
+
+    fds.clear()
+    for i in range(3):
+        fds.append(eventfd(0, 0))
+        assert vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[i],
+                                    i * IOEVENT_SIZE, IOEVENT_SIZE, 0, 0) == 0
+
+    kicks.clear()
+
+
+def teardown_function(function):
+    client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+    for fd in fds:
+        os.close(fd)
+
+
+def get_io_fds():
+    payload = vfio_user_region_io_fds_request(
+                argsz=len(vfio_user_region_io_fds_reply()) +
+                len(vfio_user_sub_region_ioeventfd()) * 8, flags=0,
+                index=VFU_PCI_DEV_BAR0_REGION_IDX, count=0)
+
+    newfds, ret = msg_fds(ctx, client.sock, VFIO_USER_DEVICE_GET_REGION_IO_FDS,
+                          payload, expect=0)
+    for fd in newfds:
+        os.close(fd)
+    reply, ret = vfio_user_region_io_fds_reply.pop_from_buffer(ret)
+    ioevents = []
+    for i in range(reply.count):
+        ioevent, ret = vfio_user_sub_region_ioeventfd.pop_from_buffer(ret)
+        ioevents.append(ioevent)
+    return ioevents
+
+
+def test_ioeventfd_delete():
+    global client
+
+    client = connect_client(ctx)
+
+    c.set_errno(0)
+    assert vfu_delete_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[1],
+                                0) == -1
+    assert c.get_errno() == errno.ENOENT
+
+    assert vfu_delete_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[1],
+                                IOEVENT_SIZE) == 0
+    assert [e.gpa_offset for e in get_io_fds()] == [0, 2 * IOEVENT_SIZE]
+
+    # the range can be reused
+    assert vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[1],
+                                IOEVENT_SIZE, IOEVENT_SIZE, 0, 0) == 0
+    assert len(get_io_fds()) == 3
+
+
+def test_ioeventfd_delete_dispatched():
+    global client
+
+    client = connect_client(ctx)
+
+    assert vfu_setup_ioeventfd_dispatch(ctx) == 0
+    for i in range(3):
+        assert vfu_set_ioeventfd_handler(ctx, fds[i], handler, i + 1) == 0
+        os.write(fds[i], struct.pack("Q", 1))
+
+    # fds[1] is deleted by the handler of fds[0] if that runs first
+    n = vfu_dispatch_ioeventfds(ctx, 0)
+    assert n in (2, 3)
+    assert 1 in kicks and 3 in kicks
+    assert vfu_delete_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[0],
+                                0) == 0
+    assert vfu_delete_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[2],
+                                2 * IOEVENT_SIZE) == 0
+
+    kicks.clear()
+    for fd in fds:
+        os.write(fd, struct.pack("Q", 1))
+    assert vfu_dispatch_ioeventfds(ctx, 0) == 0
+    assert kicks == []
+
+
+def test_ioeventfd_update():
+    global client
+
+    client = connect_client(ctx)
+
+    c.set_errno(0)
+    assert vfu_update_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[0],
+                                4, 4, 0, 0) == -1
+    assert c.get_errno() == errno.ENOENT
+
+    # would overlap fds[2]
+    c.set_errno(0)
+    assert vfu_update_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[1],
+                                IOEVENT_SIZE, 2 * IOEVENT_SIZE, 0, 0) == -1
+    assert c.get_errno() == errno.EEXIST
+
+    # a zero-sized ioeventfd would slip past the overlap check
+    c.set_errno(0)
+    assert vfu_update_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[1],
+                                IOEVENT_SIZE, 0, 0, 0) == -1
+    assert c.get_errno() == errno.EINVAL
+    c.set_errno(0)
+    assert vfu_create_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[0],
+                                IOEVENT_SIZE, 0, 0, 0) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_update_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[1],
+                                IOEVENT_SIZE, 4,
+                                VFIO_USER_IO_FD_FLAG_DATAMATCH, 0xab) == 0
+    ioevents = get_io_fds()
+    assert ioevents[1].gpa_offset == IOEVENT_SIZE
+    assert ioevents[1].size == 4
+    assert ioevents[1].flags == VFIO_USER_IO_FD_FLAG_DATAMATCH
+    assert ioevents[1].datamatch == 0xab
+
+
+def test_ioeventfd_update_shadow():
+    global client
+
+    client = connect_client(ctx)
+
+    shadow = tempfile.TemporaryFile()
+    shadow.truncate(PAGE_SIZE)
+    os.pwrite(shadow.fileno(), struct.pack("I", 0x1234), 0x100)
+
+    assert vfu_set_ioeventfd_handler(ctx, fds[0], handler, 0x10) == 0
+    assert vfu_update_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[0], 0,
+                                4, 0, 0, shadow.fileno(), 0x100) == 0
+    assert vfu_set_ioeventfd_polled(ctx, fds[0]) == 0
+
+    # polled ioeventfds need shadow memory
+    c.set_errno(0)
+    assert vfu_update_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[0], 0,
+                                4, 0, 0) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_poll_ioeventfds(ctx) == 0
+    os.pwrite(shadow.fileno(), struct.pack("I", 0x5678), 0x100)
+    assert vfu_poll_ioeventfds(ctx) == 1
+    assert kicks == [0x10]
+    shadow.close()
+
+
+def test_ioeventfd_notify_not_negotiated():
+    global client
+
+    client = connect_client(ctx)
+    assert "io_fds_changed" not in client.server_caps
+
+    c.set_errno(0)
+    assert vfu_notify_region_io_fds_changed(ctx,
+                                            VFU_PCI_DEV_BAR0_REGION_IDX) == -1
+    assert c.get_errno() == errno.ENOTSUP
+
+
+def test_ioeventfd_notify():
+    global client
+
+    client = connect_client(ctx, {"capabilities": {"io_fds_changed": True}})
+    assert client.server_caps["io_fds_changed"] is True
+
+    c.set_errno(0)
+    assert vfu_notify_region_io_fds_changed(ctx, VFU_PCI_DEV_NUM_REGIONS) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_delete_ioeventfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, fds[2],
+                                2 * IOEVENT_SIZE) == 0
+    assert vfu_notify_region_io_fds_changed(ctx,
+                                            VFU_PCI_DEV_BAR0_REGION_IDX) == 0
+
+    _, _, cmd, payload = get_msg_fds(client.sock, VFIO_USER_F_TYPE_COMMAND)
+    assert cmd == VFIO_USER_REGION_IO_FDS_CHANGED
+    index, flags = struct.unpack("II", payload)
+    assert index == VFU_PCI_DEV_BAR0_REGION_IDX
+    assert flags == 0
+
+    assert len(get_io_fds()) == 2
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
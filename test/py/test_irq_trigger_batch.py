@@ -0,0 +1,175 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import ctypes as c
+import errno
+import time
+
+ctx = None
+client = None
+fds = {}
+
+
+def setup_function(function):
+    global ctx, client
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_setup_device_nr_irqs(ctx, VFU_DEV_MSIX_IRQ, 128) == 0
+    assert vfu_realize_ctx(ctx) == 0
+
+    client = connect_client(ctx)
+
+    fds.clear()
+    for i in (0, 1, 63, 64, 100):
+        fds[i] = eventfd(0, 0)
+        # struct vfio_irq_set
+        payload = struct.pack("IIIII", 20, VFIO_IRQ_SET_ACTION_TRIGGER |
+                              VFIO_IRQ_SET_DATA_EVENTFD, VFU_DEV_MSIX_IRQ, i,
+                              1)
+        msg(ctx, client.sock, VFIO_USER_DEVICE_SET_IRQS, payload,
+            fds=[fds[i]])
+
+
+def teardown_function(function):
+    client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+    for fd in fds.values():
+        os.close(fd)
+
+
+def counts():
+    ret = {}
+    for i, fd in fds.items():
+        try:
+            ret[i] = struct.unpack("Q", os.read(fd, 8))[0]
+        except BlockingIOError:
+            ret[i] = 0
+    return ret
+
+
+def test_irq_trigger_batch():
+    for fd in fds.values():
+        os.set_blocking(fd, False)
+
+    assert vfu_irq_trigger_batch(ctx, [0, 63, 64, 100, 0, 64]) == 4
+    assert counts() == {0: 1, 1: 0, 63: 1, 64: 1, 100: 1}
+
+    assert vfu_irq_trigger_batch(ctx, []) == 0
+    assert counts() == {0: 0, 1: 0, 63: 0, 64: 0, 100: 0}
+
+
+def test_irq_trigger_batch_errors():
+    for fd in fds.values():
+        os.set_blocking(fd, False)
+
+    c.set_errno(0)
+    assert vfu_irq_trigger_batch(ctx, [0, 128]) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    # vector 2 has no eventfd, nothing is signalled
+    c.set_errno(0)
+    assert vfu_irq_trigger_batch(ctx, [0, 1, 2]) == -1
+    assert c.get_errno() == errno.ENOENT
+    assert counts() == {0: 0, 1: 0, 63: 0, 64: 0, 100: 0}
+
+    # bits past nr_vectors are ignored
+    assert vfu_irq_trigger_batch(ctx, [0, 63, 100], nr_vectors=60) == 1
+    assert counts() == {0: 1, 1: 0, 63: 0, 64: 0, 100: 0}
+
+
+def test_irq_coalescing_count():
+    for fd in fds.values():
+        os.set_blocking(fd, False)
+
+    c.set_errno(0)
+    assert vfu_irq_set_coalescing(ctx, 128, 4, 0) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_irq_set_coalescing(ctx, 64, 3, 0) == 0
+
+    assert vfu_irq_trigger_batch(ctx, [0, 64]) == 1
+    assert vfu_irq_trigger(ctx, 64) == 0
+    assert counts() == {0: 1, 1: 0, 63: 0, 64: 0, 100: 0}
+    assert vfu_irq_trigger_batch(ctx, [64]) == 1
+    assert counts()[64] == 1
+
+    assert vfu_irq_trigger(ctx, 64) == 0
+    assert vfu_irq_flush(ctx) == 0
+    assert vfu_irq_flush(ctx, force=True) == 1
+    assert counts()[64] == 1
+
+    # disabling coalescing delivers what was held back
+    assert vfu_irq_trigger(ctx, 64) == 0
+    assert vfu_irq_set_coalescing(ctx, 64, 0, 0) == 0
+    assert counts()[64] == 1
+    assert vfu_irq_trigger(ctx, 64) == 0
+    assert counts()[64] == 1
+
+
+def test_irq_coalescing_delay():
+    for fd in fds.values():
+        os.set_blocking(fd, False)
+
+    assert vfu_irq_set_coalescing(ctx, 1, 0, 10000) == 0
+
+    assert vfu_irq_trigger_batch(ctx, [1]) == 0
+    assert vfu_irq_trigger_batch(ctx, [1]) == 0
+    assert vfu_irq_flush(ctx) == 0
+    assert counts()[1] == 0
+
+    time.sleep(0.02)
+    assert vfu_irq_flush(ctx) == 1
+    assert counts()[1] == 1
+    assert vfu_irq_flush(ctx) == 0
+
+    # a trigger past the deadline is delivered directly
+    assert vfu_irq_trigger(ctx, 1) == 0
+    time.sleep(0.02)
+    assert vfu_irq_trigger_batch(ctx, [1]) == 1
+    assert counts()[1] == 1
+
+
+def test_irq_coalescing_reset():
+    for fd in fds.values():
+        os.set_blocking(fd, False)
+
+    assert vfu_irq_set_coalescing(ctx, 0, 2, 0) == 0
+    assert vfu_irq_trigger(ctx, 0) == 0
+
+    # disabling the vector drops the pending interrupt
+    payload = struct.pack("IIIII", 20, VFIO_IRQ_SET_ACTION_TRIGGER |
+                          VFIO_IRQ_SET_DATA_NONE, VFU_DEV_MSIX_IRQ, 0, 0)
+    msg(ctx, client.sock, VFIO_USER_DEVICE_SET_IRQS, payload)
+    assert vfu_irq_flush(ctx, force=True) == 0
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
@@ -0,0 +1,259 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import ctypes as c
+import errno
+
+ctx = None
+client = None
+fds = []
+cap_pos = None
+
+NR_VECTORS = 8
+PBA_OFFSET = 0x800
+
+
+def setup_function(function):
+    global ctx, cap_pos
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR0_REGION_IDX,
+                            size=0x1000, flags=VFU_REGION_FLAG_RW) == 0
+    assert vfu_setup_device_nr_irqs(ctx, VFU_DEV_MSIX_IRQ, NR_VECTORS) == 0
+
+    # table at BAR0 offset 0, PBA at BAR0 PBA_OFFSET
+    cap = struct.pack("BBHII", PCI_CAP_ID_MSIX, 0, NR_VECTORS - 1, 0,
+                      PBA_OFFSET)
+    cap_pos = vfu_pci_add_capability(ctx, pos=0, flags=0, data=cap)
+    assert cap_pos != -1
+
+
+def teardown_function(function):
+    if client is not None:
+        client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+    for fd in fds:
+        os.close(fd)
+    fds.clear()
+
+
+def setup_emulation():
+    global client
+
+    assert vfu_pci_setup_msix_emulation(ctx) == 0
+    assert vfu_realize_ctx(ctx) == 0
+
+    client = connect_client(ctx)
+
+    for i in range(2):
+        fds.append(eventfd(0, 0))
+        os.set_blocking(fds[i], False)
+        # struct vfio_irq_set
+        payload = struct.pack("IIIII", 20, VFIO_IRQ_SET_ACTION_TRIGGER |
+                              VFIO_IRQ_SET_DATA_EVENTFD, VFU_DEV_MSIX_IRQ, i,
+                              1)
+        msg(ctx, client.sock, VFIO_USER_DEVICE_SET_IRQS, payload,
+            fds=[fds[i]])
+
+
+def count(i):
+    try:
+        return struct.unpack("Q", os.read(fds[i], 8))[0]
+    except BlockingIOError:
+        return 0
+
+
+def write_msix_ctrl(flags):
+    write_region(ctx, client.sock, VFU_PCI_DEV_CFG_REGION_IDX,
+                 offset=cap_pos + PCI_MSIX_FLAGS, count=2,
+                 data=struct.pack("H", flags))
+
+
+def set_vector_mask(i, masked):
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                 offset=i * 16 + 12, count=4, data=struct.pack("I", masked))
+
+
+def read_pba():
+    data = read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                       offset=PBA_OFFSET, count=8)
+    return struct.unpack("Q", data)[0]
+
+
+def test_msix_emulation_errors():
+    global client
+
+    client = None
+
+    # already emulated
+    assert vfu_pci_setup_msix_emulation(ctx) == 0
+    c.set_errno(0)
+    assert vfu_pci_setup_msix_emulation(ctx) == -1
+    assert c.get_errno() == errno.EINVAL
+
+
+@vfu_region_range_access_cb_t
+def other_range_cb(ctx, arg, buf, count, offset, is_write):
+    return count
+
+
+def test_msix_emulation_pba_overlap():
+    global client
+
+    client = None
+
+    assert vfu_setup_region_range(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                  PBA_OFFSET, 8, other_range_cb) == 0
+    c.set_errno(0)
+    assert vfu_pci_setup_msix_emulation(ctx) == -1
+    assert c.get_errno() == errno.EEXIST
+
+    # The table range isn't left behind.
+    assert vfu_setup_region_range(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, 0,
+                                  NR_VECTORS * 16, other_range_cb) == 0
+
+
+def test_msix_emulation_no_cap():
+    global ctx, client
+
+    client = None
+    vfu_destroy_ctx(ctx)
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert vfu_pci_init(ctx) == 0
+
+    c.set_errno(0)
+    assert vfu_pci_setup_msix_emulation(ctx) == -1
+    assert c.get_errno() == errno.ENOENT
+
+
+def test_msix_emulation_table():
+    setup_emulation()
+
+    # vectors start out masked
+    data = read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                       offset=24, count=8)
+    assert struct.unpack("II", data) == (0, 1)
+
+    # 16-byte accesses aren't allowed
+    read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX, offset=16,
+                count=16, expect=errno.EINVAL)
+
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX, offset=16,
+                 count=8, data=struct.pack("II", 0xfee00000, 0))
+    data = read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                       offset=16, count=8)
+    assert struct.unpack("II", data) == (0xfee00000, 0)
+
+    # only the mask bit of Vector Control is writable
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX, offset=24,
+                 count=8, data=struct.pack("II", 0x41, 0xfffffffe))
+    data = read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                       offset=24, count=8)
+    assert struct.unpack("II", data) == (0x41, 0)
+
+    data = read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                       offset=28, count=4)
+    assert struct.unpack("I", data)[0] == 0
+
+    # the PBA is read-only
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                 offset=PBA_OFFSET, count=8, data=struct.pack("Q", 0xff))
+    assert read_pba() == 0
+
+
+def test_msix_emulation_disabled():
+    setup_emulation()
+
+    # masking only applies while MSI-X is enabled
+    assert vfu_irq_trigger(ctx, 0) == 0
+    assert count(0) == 1
+    assert read_pba() == 0
+
+
+def test_msix_emulation_vector_mask():
+    setup_emulation()
+    write_msix_ctrl(PCI_MSIX_FLAGS_ENABLE)
+
+    assert vfu_irq_trigger(ctx, 0) == 0
+    assert vfu_irq_trigger_batch(ctx, [0, 1]) == 0
+    assert count(0) == 0
+    assert count(1) == 0
+    assert read_pba() == 0b11
+
+    set_vector_mask(0, 0)
+    assert count(0) == 1
+    assert read_pba() == 0b10
+
+    assert vfu_irq_trigger(ctx, 0) == 0
+    assert count(0) == 1
+
+    # re-masking doesn't deliver anything
+    set_vector_mask(1, 1)
+    assert count(1) == 0
+    assert read_pba() == 0b10
+
+
+def test_msix_emulation_function_mask():
+    setup_emulation()
+    write_msix_ctrl(PCI_MSIX_FLAGS_ENABLE | PCI_MSIX_FLAGS_MASKALL)
+
+    set_vector_mask(0, 0)
+    assert vfu_irq_trigger_batch(ctx, [0, 1]) == 0
+    assert read_pba() == 0b11
+
+    # vector 1 is still masked by its own bit
+    write_msix_ctrl(PCI_MSIX_FLAGS_ENABLE)
+    assert count(0) == 1
+    assert count(1) == 0
+    assert read_pba() == 0b10
+
+
+def test_msix_emulation_reset():
+    global client
+
+    setup_emulation()
+    write_msix_ctrl(PCI_MSIX_FLAGS_ENABLE)
+
+    set_vector_mask(0, 0)
+    assert vfu_irq_trigger_batch(ctx, [0, 1]) == 1
+    assert read_pba() == 0b10
+
+    client.disconnect(ctx)
+    client = connect_client(ctx)
+
+    assert read_pba() == 0
+    data = read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                       offset=12, count=4)
+    assert struct.unpack("I", data)[0] == 1
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
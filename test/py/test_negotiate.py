@@ -158,6 +158,13 @@ def test_invalid_json_bad_pgsize2():
         b'{ "capabilities": { "migration": { "pgsize": 4095 } } }')
 
 
+def test_invalid_json_bad_twin_socket_nr():
+    for nr in [-1, 0, VFU_MAX_CMD_SOCKETS + 1]:
+        client_version_json(errno.EINVAL, b'{ "capabilities": ' +
+            b'{ "twin_socket": { "supported": true, "nr_sockets": %d } } }' %
+            nr)
+
+
 def test_valid_negotiate_no_json():
     client = Client(sock=connect_sock())
 
@@ -176,6 +183,7 @@ def test_valid_negotiate_no_json():
     assert json.capabilities.max_msg_fds == SERVER_MAX_FDS
     assert json.capabilities.max_data_xfer_size == SERVER_MAX_DATA_XFER_SIZE
     assert json.capabilities.migration.pgsize == PAGE_SIZE
+    assert json.capabilities.write_multiple is True
 
     client.disconnect(ctx)
 
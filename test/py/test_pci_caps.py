@@ -100,6 +100,12 @@ def test_pci_cap_bad_pos():
     assert pos == -1
     assert c.get_errno() == errno.EINVAL
 
+    # capabilities must be dword-aligned
+    pos = vfu_pci_add_capability(ctx, pos=PCI_STD_HEADER_SIZEOF + 2, flags=0,
+              data=struct.pack("ccHH", to_byte(PCI_CAP_ID_PM), b'\0', 0, 0))
+    assert pos == -1
+    assert c.get_errno() == errno.EINVAL
+
 
 def __pci_region_cb(ctx, buf, count, offset, is_write):
     if not is_write:
@@ -498,4 +504,45 @@ def test_pci_cap_write_pxlc2():
     assert payload == data
 
 
+@patch("libvfio_user.pci_region_cb", side_effect=__pci_region_cb)
+def test_pci_cap_lookup_after_realize(mock_pci_region_cb):
+    """
+    Tests that capabilities added after realization are found by config space
+    accesses, including when a capability ends part way through a dword.
+    """
+    setup_pci_dev(realize=True)
+    client = connect_client(ctx)
+
+    pos = vfu_pci_add_capability(ctx, pos=0, flags=0,
+              data=struct.pack("ccHH", to_byte(PCI_CAP_ID_PM), b'\0', 0, 0))
+    assert pos == PCI_STD_HEADER_SIZEOF
+
+    data = b"abc"
+    cap = struct.pack("ccc%ds" % len(data), to_byte(PCI_CAP_ID_VNDR), b'\0',
+                      to_byte(3 + len(data)), data)
+    pos = vfu_pci_add_capability(ctx, pos=0x80, flags=VFU_CAP_FLAG_READONLY,
+                                 data=cap)
+    assert pos == 0x80
+
+    write_region(ctx, client.sock, VFU_PCI_DEV_CFG_REGION_IDX,
+                 offset=PCI_STD_HEADER_SIZEOF, count=1, data=b'\x01',
+                 expect=errno.EPERM)
+
+    # last byte of the vendor capability
+    write_region(ctx, client.sock, VFU_PCI_DEV_CFG_REGION_IDX, offset=0x85,
+                 count=1, data=b'\x01', expect=errno.EPERM)
+
+    # same dword, but past the end of the capability
+    write_region(ctx, client.sock, VFU_PCI_DEV_CFG_REGION_IDX, offset=0x86,
+                 count=1, data=b'\x01')
+    mock_pci_region_cb.assert_called_once()
+    mock_pci_region_cb.reset_mock()
+
+    # a single read spanning non-standard space and the capability
+    payload = read_region(ctx, client.sock, VFU_PCI_DEV_CFG_REGION_IDX,
+                          offset=0x7c, count=12)
+    assert payload == b'\0' * 4 + cap + b'\x01\0'
+    assert mock_pci_region_cb.call_count == 2
+
+
 # ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
@@ -0,0 +1,209 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import select
+
+ctx = None
+client = None
+writes = []
+
+BAR0_SIZE = 0x1000
+
+
+@vfu_region_access_cb_t
+def bar0_cb(ctx, buf, count, offset, is_write):
+    if offset >= BAR0_SIZE // 2:
+        c.set_errno(errno.EIO)
+        return -1
+    if is_write:
+        writes.append((offset, bytes(buf[:count])))
+    else:
+        c.memset(buf, 0xab, count)
+    return count
+
+
+def setup_function(function):
+    global ctx, client
+    writes.clear()
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB |
+                         LIBVFIO_USER_FLAG_POSTED_WRITES)
+    assert ctx is not None
+
+    ret = vfu_pci_init(ctx)
+    assert ret == 0
+
+    ret = vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR0_REGION_IDX,
+                           size=BAR0_SIZE, cb=bar0_cb,
+                           flags=VFU_REGION_FLAG_RW)
+    assert ret == 0
+
+    ret = vfu_setup_device_nr_irqs(ctx, VFU_DEV_ERR_IRQ, 1)
+    assert ret == 0
+
+    ret = vfu_realize_ctx(ctx)
+    assert ret == 0
+
+    client = connect_client(ctx, {"capabilities": {"posted_writes": True}})
+
+
+def teardown_function(function):
+    client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+
+
+def assert_no_reply():
+    (ready, _, _) = select.select([client.sock], [], [], 0)
+    assert ready == []
+
+
+def set_err_eventfd():
+    payload = vfio_irq_set(argsz=c.sizeof(vfio_irq_set),
+                           flags=VFIO_IRQ_SET_ACTION_TRIGGER |
+                           VFIO_IRQ_SET_DATA_EVENTFD, index=VFU_DEV_ERR_IRQ,
+                           start=0, count=1)
+    fd = eventfd()
+    msg(ctx, client.sock, VFIO_USER_DEVICE_SET_IRQS, payload, fds=[fd])
+    return fd
+
+
+def test_posted_writes_not_negotiated():
+    client.disconnect(ctx)
+    client.connect(ctx)
+    assert "posted_writes" not in client.server_caps
+
+    # Writes are replied to as usual.
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX, offset=0,
+                 count=4, data=b'\x01\x02\x03\x04')
+    assert writes == [(0, b'\x01\x02\x03\x04')]
+
+
+def test_posted_writes_not_enabled():
+    other = vfu_create_ctx(sock_path=SOCK_PATH + b".other",
+                           flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert other is not None
+    assert vfu_realize_ctx(other) == 0
+
+    # The device didn't opt in.
+    other_client = connect_client(other,
+                                  {"capabilities": {"posted_writes": True}},
+                                  sock_path=SOCK_PATH + b".other")
+    assert "posted_writes" not in other_client.server_caps
+    other_client.disconnect(other)
+    vfu_destroy_ctx(other)
+
+
+def test_posted_writes_no_err_irq():
+    other = vfu_create_ctx(sock_path=SOCK_PATH + b".other",
+                           flags=LIBVFIO_USER_FLAG_ATTACH_NB |
+                           LIBVFIO_USER_FLAG_POSTED_WRITES)
+    assert other is not None
+    assert vfu_setup_device_nr_irqs(other, VFU_DEV_ERR_IRQ, 0) == 0
+    assert vfu_realize_ctx(other) == 0
+
+    # Failed writes couldn't be reported.
+    other_client = connect_client(other,
+                                  {"capabilities": {"posted_writes": True}},
+                                  sock_path=SOCK_PATH + b".other")
+    assert "posted_writes" not in other_client.server_caps
+    other_client.disconnect(other)
+    vfu_destroy_ctx(other)
+
+
+def test_posted_writes_no_err_eventfd():
+    assert client.server_caps["posted_writes"] is True
+
+    # Writes are posted whether or not the error eventfd is set up.
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                 offset=BAR0_SIZE // 2, count=4, data=b'\x01\x02\x03\x04',
+                 rsp=False)
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX, offset=0,
+                 count=4, data=b'\x01\x02\x03\x04', rsp=False)
+    assert_no_reply()
+    assert writes == [(0, b'\x01\x02\x03\x04')]
+
+    # The earlier failure is signalled as soon as there is one.
+    fd = set_err_eventfd()
+    assert os.read(fd, 8) == struct.pack("Q", 1)
+
+    # Disabling it doesn't change which requests are replied to either.
+    payload = vfio_irq_set(argsz=c.sizeof(vfio_irq_set),
+                           flags=VFIO_IRQ_SET_ACTION_TRIGGER |
+                           VFIO_IRQ_SET_DATA_NONE, index=VFU_DEV_ERR_IRQ,
+                           start=0, count=0)
+    msg(ctx, client.sock, VFIO_USER_DEVICE_SET_IRQS, payload)
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX, offset=0,
+                 count=4, data=b'\x01\x02\x03\x04', rsp=False)
+    assert_no_reply()
+    os.close(fd)
+
+
+def test_posted_writes():
+    assert client.server_caps["posted_writes"] is True
+    os.close(set_err_eventfd())
+
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX, offset=0,
+                 count=4, data=b'\x01\x02\x03\x04', rsp=False)
+    write_region_multi(ctx, client.sock, [
+        (VFU_PCI_DEV_BAR0_REGION_IDX, 0x10, b'\x05'),
+        (VFU_PCI_DEV_BAR0_REGION_IDX, 0x20, b'\x06'),
+    ], rsp=False)
+    assert_no_reply()
+
+    # A read replies after all earlier writes have been performed.
+    payload = read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                          offset=0, count=4)
+    assert payload == b'\xab' * 4
+    assert writes == [(0, b'\x01\x02\x03\x04'), (0x10, b'\x05'),
+                      (0x20, b'\x06')]
+    assert_no_reply()
+
+
+def test_posted_writes_error():
+    fd = set_err_eventfd()
+
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                 offset=BAR0_SIZE // 2, count=4, data=b'\x01\x02\x03\x04',
+                 rsp=False)
+    assert_no_reply()
+
+    assert os.read(fd, 8) == struct.pack("Q", 1)
+    os.close(fd)
+
+    # Subsequent requests are unaffected.
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX, offset=0,
+                 count=1, data=b'\x01', rsp=False)
+    read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX, offset=0,
+                count=1)
+    assert writes == [(0, b'\x01')]
+
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
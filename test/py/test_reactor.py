@@ -0,0 +1,171 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import threading
+import time
+from unittest.mock import patch
+
+NR_CTXS = 3
+
+reactor = None
+ctxs = []
+thread = None
+
+
+def sock_path(i):
+    return SOCK_PATH + b".%d" % i
+
+
+def setup_function(function):
+    global reactor, ctxs, thread
+
+    reactor = vfu_reactor_create(2)
+    assert reactor is not None
+
+    ctxs = []
+    for i in range(NR_CTXS):
+        ctx = vfu_create_ctx(sock_path=sock_path(i),
+                             flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+        assert ctx is not None
+        assert vfu_pci_init(ctx) == 0
+        vfu_setup_device_quiesce_cb(ctx)
+        assert vfu_realize_ctx(ctx) == 0
+        assert vfu_reactor_add_ctx(reactor, ctx) == 0
+        ctxs.append(ctx)
+
+    thread = threading.Thread(target=lambda: vfu_reactor_run(reactor))
+    thread.start()
+
+
+def teardown_function(function):
+    vfu_reactor_stop(reactor)
+    thread.join()
+    for ctx in ctxs:
+        vfu_destroy_ctx(ctx)
+    vfu_reactor_destroy(reactor)
+
+
+def connect(i):
+    client = Client()
+    client.connect(ctxs[i], sock_path=sock_path(i), attach=False)
+    return client
+
+
+def get_info(client):
+    payload = vfio_user_device_info(argsz=len(vfio_user_device_info()),
+                                    flags=0, num_regions=0, num_irqs=0)
+    send_msg(client.sock, VFIO_USER_DEVICE_GET_INFO,
+             VFIO_USER_F_TYPE_COMMAND, payload)
+    result = get_reply(client.sock)
+    (argsz, flags, num_regions, num_irqs) = struct.unpack("IIII", result)
+    assert num_regions == VFU_PCI_DEV_NUM_REGIONS
+
+
+def test_reactor_bad():
+    assert vfu_reactor_create(0) is None
+    assert c.get_errno() == errno.EINVAL
+
+    # not realized
+    ctx = vfu_create_ctx(sock_path=sock_path(NR_CTXS),
+                         flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_reactor_add_ctx(reactor, ctx) == -1
+    assert c.get_errno() == errno.EINVAL
+    vfu_destroy_ctx(ctx)
+
+    # blocking
+    ctx = vfu_create_ctx(sock_path=sock_path(NR_CTXS))
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_realize_ctx(ctx) == 0
+    assert vfu_reactor_add_ctx(reactor, ctx) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_reactor_remove_ctx(reactor, ctx) == -1
+    assert c.get_errno() == errno.ENOENT
+    vfu_destroy_ctx(ctx)
+
+    # already added
+    assert vfu_reactor_add_ctx(reactor, ctxs[0]) == -1
+    assert c.get_errno() == errno.EINVAL
+
+
+def test_reactor():
+    clients = [connect(i) for i in range(NR_CTXS)]
+
+    for _ in range(10):
+        for client in clients:
+            get_info(client)
+
+    # reconnect
+    clients[1].sock.close()
+    clients[1] = connect(1)
+    get_info(clients[1])
+
+    for client in clients:
+        client.sock.close()
+
+
+def test_reactor_remove_ctx():
+    client = connect(0)
+    get_info(client)
+
+    # the context is ours to run again
+    assert vfu_reactor_remove_ctx(reactor, ctxs[0]) == 0
+    client.disconnect(ctxs[0])
+
+    assert vfu_reactor_add_ctx(reactor, ctxs[0]) == 0
+    client = connect(0)
+    get_info(client)
+    client.sock.close()
+
+
+@patch('libvfio_user.quiesce_cb', side_effect=fail_with_errno(errno.EBUSY))
+def test_reactor_quiesce(mock_quiesce):
+    client = connect(2)
+    get_info(client)
+
+    # the reset on disconnect has to wait for the device to quiesce
+    client.sock.close()
+    for _ in range(500):
+        if mock_quiesce.call_count > 0:
+            break
+        time.sleep(0.01)
+    mock_quiesce.assert_called_once_with(ctxs[2])
+
+    mock_quiesce.side_effect = None
+    mock_quiesce.return_value = 0
+    assert vfu_device_quiesced(ctxs[2], 0) == 0
+
+    client = connect(2)
+    get_info(client)
+    client.sock.close()
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
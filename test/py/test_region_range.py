@@ -0,0 +1,242 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import tempfile
+
+ctx = None
+client = None
+accesses = []
+
+BAR0_SIZE = 0x1000
+REGS_OFFSET = 0x100
+DOORBELLS_OFFSET = 0x800
+SHADOW_OFFSET = 0x200
+BAR2_SIZE = 4 * PAGE_SIZE
+
+shadow = c.create_string_buffer(16)
+bar2_file = None
+bar2_mmap = None
+
+
+@vfu_region_access_cb_t
+def bar0_cb(ctx, buf, count, offset, is_write):
+    accesses.append(("region", offset, count, is_write))
+    return count
+
+
+@vfu_region_range_access_cb_t
+def range_cb(ctx, arg, buf, count, offset, is_write):
+    accesses.append((arg, offset, count, is_write))
+    if not is_write:
+        c.memset(buf, 0xcd, count)
+    return count
+
+
+def setup_function(function):
+    global ctx, client, bar2_file, bar2_mmap
+    accesses.clear()
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    ret = vfu_pci_init(ctx)
+    assert ret == 0
+
+    ret = vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR0_REGION_IDX,
+                           size=BAR0_SIZE, cb=bar0_cb,
+                           flags=VFU_REGION_FLAG_RW)
+    assert ret == 0
+
+    # Registered out of order on purpose.
+    ret = vfu_setup_region_range(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                 DOORBELLS_OFFSET, 0x100, range_cb,
+                                 access_sizes=4, arg=2)
+    assert ret == 0
+    ret = vfu_setup_region_range(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                 REGS_OFFSET, 0x40, range_cb, arg=1)
+    assert ret == 0
+
+    ret = vfu_setup_region_shadow(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                  SHADOW_OFFSET, len(shadow), shadow)
+    assert ret == 0
+
+    bar2_file = tempfile.TemporaryFile()
+    bar2_file.truncate(BAR2_SIZE)
+    ret = vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR2_REGION_IDX,
+                           size=BAR2_SIZE, cb=bar0_cb,
+                           flags=(VFU_REGION_FLAG_RW | VFU_REGION_FLAG_MEM),
+                           mmap_areas=[(0, PAGE_SIZE)],
+                           fd=os.dup(bar2_file.fileno()))
+    assert ret == 0
+
+    if bar2_mmap is None:
+        bar2_mmap = mmap.mmap(bar2_file.fileno(), BAR2_SIZE)
+    ret = vfu_setup_region_shadow(ctx, VFU_PCI_DEV_BAR2_REGION_IDX,
+                                  2 * PAGE_SIZE, PAGE_SIZE,
+                                  c.addressof(c.c_char.from_buffer(
+                                      bar2_mmap, 2 * PAGE_SIZE)),
+                                  flags=VFU_REGION_SHADOW_FLAG_MMAP)
+    assert ret == 0
+
+    ret = vfu_realize_ctx(ctx)
+    assert ret == 0
+
+    client = connect_client(ctx)
+
+
+def teardown_function(function):
+    client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+
+
+def test_region_range_bad():
+    for index in [VFU_PCI_DEV_CFG_REGION_IDX, VFU_PCI_DEV_NUM_REGIONS]:
+        assert vfu_setup_region_range(ctx, index, 0, 4, range_cb) == -1
+        assert c.get_errno() == errno.EINVAL
+
+    # Unconfigured region, zero size, beyond the region, bad access sizes.
+    for (index, offset, size, access_sizes) in [
+            (VFU_PCI_DEV_BAR1_REGION_IDX, 0, 4, 0),
+            (VFU_PCI_DEV_BAR0_REGION_IDX, 0, 0, 0),
+            (VFU_PCI_DEV_BAR0_REGION_IDX, BAR0_SIZE - 4, 8, 0),
+            (VFU_PCI_DEV_BAR0_REGION_IDX, 0, 4, 3 | 16)]:
+        assert vfu_setup_region_range(ctx, index, offset, size, range_cb,
+                                      access_sizes=access_sizes) == -1
+        assert c.get_errno() == errno.EINVAL
+
+    for (offset, size) in [(REGS_OFFSET, 4), (REGS_OFFSET - 4, 8),
+                           (REGS_OFFSET + 0x3c, 8), (0, BAR0_SIZE)]:
+        assert vfu_setup_region_range(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                      offset, size, range_cb) == -1
+        assert c.get_errno() == errno.EEXIST
+
+    assert vfu_setup_region_range(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                  REGS_OFFSET - 4, 4, range_cb) == 0
+
+    assert vfu_setup_region_shadow(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                   SHADOW_OFFSET + 8, 16, shadow) == -1
+    assert c.get_errno() == errno.EEXIST
+
+    # Not page-aligned, no fd, overlapping an mmap area.
+    for (index, offset, size) in [
+            (VFU_PCI_DEV_BAR2_REGION_IDX, PAGE_SIZE, 16),
+            (VFU_PCI_DEV_BAR0_REGION_IDX, 0, PAGE_SIZE),
+            (VFU_PCI_DEV_BAR2_REGION_IDX, 0, PAGE_SIZE)]:
+        ret = vfu_setup_region_shadow(ctx, index, offset, size, shadow,
+                                      flags=VFU_REGION_SHADOW_FLAG_MMAP)
+        assert ret == -1
+    assert c.get_errno() == errno.EEXIST
+
+
+def test_region_range_dispatch():
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                 offset=REGS_OFFSET + 0x3f, count=1, data=b'\x01')
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                 offset=DOORBELLS_OFFSET + 8, count=4, data=b'\x01' * 4)
+    payload = read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                          offset=REGS_OFFSET, count=8)
+    assert payload == b'\xcd' * 8
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                 offset=REGS_OFFSET + 0x40, count=2, data=b'\x01' * 2)
+
+    assert accesses == [(1, 0x3f, 1, True),
+                        (2, 8, 4, True),
+                        (1, 0, 8, False),
+                        ("region", REGS_OFFSET + 0x40, 2, True)]
+
+
+def test_region_range_bad_access():
+    # Wrong size, misaligned, straddling the end or start of the range.
+    for (offset, count) in [(DOORBELLS_OFFSET, 2),
+                            (DOORBELLS_OFFSET, 8),
+                            (DOORBELLS_OFFSET + 2, 4),
+                            (DOORBELLS_OFFSET + 0xfc, 8),
+                            (DOORBELLS_OFFSET - 4, 8)]:
+        write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                     offset=offset, count=count, data=b'\x01' * count,
+                     expect=errno.EINVAL)
+
+    for offset in [REGS_OFFSET + 0x3c, REGS_OFFSET - 4]:
+        write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                     offset=offset, count=8, data=b'\x01' * 8,
+                     expect=errno.EINVAL)
+
+    assert accesses == []
+
+
+def test_region_shadow():
+    shadow[0:8] = b'\x01\x02\x03\x04\x05\x06\x07\x08'
+    payload = read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                          offset=SHADOW_OFFSET, count=8)
+    assert payload == b'\x01\x02\x03\x04\x05\x06\x07\x08'
+
+    shadow[4:8] = b'\xaa\xbb\xcc\xdd'
+    payload = read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                          offset=SHADOW_OFFSET + 4, count=4)
+    assert payload == b'\xaa\xbb\xcc\xdd'
+
+    # Writes go to the region callback.
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                 offset=SHADOW_OFFSET + 4, count=4, data=b'\x01' * 4)
+    assert accesses == [("region", SHADOW_OFFSET + 4, 4, True)]
+
+    read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                offset=SHADOW_OFFSET + 12, count=8, expect=errno.EINVAL)
+
+
+def test_region_shadow_mmap():
+    bar2_mmap[2 * PAGE_SIZE:2 * PAGE_SIZE + 4] = b'\x11\x22\x33\x44'
+    payload = read_region(ctx, client.sock, VFU_PCI_DEV_BAR2_REGION_IDX,
+                          offset=2 * PAGE_SIZE, count=4)
+    assert payload == b'\x11\x22\x33\x44'
+    assert accesses == []
+
+    argsz = 32 + 16 + 2 * 16
+    payload = vfio_region_info(argsz=argsz, flags=0,
+                               index=VFU_PCI_DEV_BAR2_REGION_IDX,
+                               cap_offset=0, size=0, offset=0)
+    payload = bytes(payload) + b'\0' * (argsz - 32)
+    fds, result = msg_fds(ctx, client.sock,
+                          VFIO_USER_DEVICE_GET_REGION_INFO, payload)
+    for fd in fds:
+        os.close(fd)
+
+    info, result = vfio_region_info.pop_from_buffer(result)
+    cap, result = vfio_region_info_cap_sparse_mmap.pop_from_buffer(result)
+    area1, result = vfio_region_sparse_mmap_area.pop_from_buffer(result)
+    area2, result = vfio_region_sparse_mmap_area.pop_from_buffer(result)
+
+    assert cap.nr_areas == 2
+    assert (area1.offset, area1.size) == (0, PAGE_SIZE)
+    assert (area2.offset, area2.size) == (2 * PAGE_SIZE, PAGE_SIZE)
+
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
@@ -0,0 +1,146 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+
+ctx = None
+client = None
+writes = []
+
+BAR0_SIZE = 0x1000
+
+
+@vfu_region_access_cb_t
+def bar0_cb(ctx, buf, count, offset, is_write):
+    if not is_write:
+        return -1
+    writes.append((offset, bytes(buf[:count])))
+    return count
+
+
+def setup_function(function):
+    global ctx, client
+    writes.clear()
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    ret = vfu_pci_init(ctx)
+    assert ret == 0
+
+    ret = vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR0_REGION_IDX,
+                           size=BAR0_SIZE, cb=bar0_cb,
+                           flags=VFU_REGION_FLAG_RW)
+    assert ret == 0
+
+    ret = vfu_realize_ctx(ctx)
+    assert ret == 0
+
+    client = connect_client(ctx)
+
+
+def teardown_function(function):
+    client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+
+
+def test_write_multi():
+    write_region_multi(ctx, client.sock, [
+        (VFU_PCI_DEV_BAR0_REGION_IDX, 0x10, b'\x01\x02\x03\x04'),
+        (VFU_PCI_DEV_BAR0_REGION_IDX, 0x20, b'\x05' * 8),
+        (VFU_PCI_DEV_BAR0_REGION_IDX, 0x10, b'\x06\x07'),
+    ])
+
+    assert writes == [(0x10, b'\x01\x02\x03\x04'),
+                      (0x20, b'\x05' * 8),
+                      (0x10, b'\x06\x07')]
+
+
+def test_write_multi_config_space():
+    write_region_multi(ctx, client.sock, [
+        (VFU_PCI_DEV_CFG_REGION_IDX, PCI_COMMAND, b'\x06\x00'),
+        (VFU_PCI_DEV_BAR0_REGION_IDX, 0, b'\x01'),
+    ])
+
+    payload = read_region(ctx, client.sock, VFU_PCI_DEV_CFG_REGION_IDX,
+                          offset=PCI_COMMAND, count=2)
+    assert payload == b'\x06\x00'
+    assert writes == [(0, b'\x01')]
+
+
+def test_write_multi_max():
+    write_region_multi(ctx, client.sock,
+                       [(VFU_PCI_DEV_BAR0_REGION_IDX, i * 4,
+                         struct.pack("I", i))
+                        for i in range(VFIO_USER_MULTI_MAX)])
+
+    assert writes == [(i * 4, struct.pack("I", i))
+                      for i in range(VFIO_USER_MULTI_MAX)]
+
+
+def test_write_multi_too_many():
+    write_region_multi(ctx, client.sock,
+                       [(VFU_PCI_DEV_BAR0_REGION_IDX, 0, b'\x01')] *
+                       (VFIO_USER_MULTI_MAX + 1), expect=errno.EINVAL)
+    assert writes == []
+
+
+def test_write_multi_short():
+    payload = struct.pack("Q", 2) + struct.pack("QII", 0, 0, 1) + bytes(8)
+    msg(ctx, client.sock, VFIO_USER_REGION_WRITE_MULTI, payload,
+        expect=errno.EINVAL)
+    assert writes == []
+
+
+def test_write_multi_bad_count():
+    payload = struct.pack("Q", 1)
+    payload += struct.pack("QII", 0, VFU_PCI_DEV_BAR0_REGION_IDX,
+                           VFIO_USER_MULTI_DATA + 1) + bytes(8)
+    msg(ctx, client.sock, VFIO_USER_REGION_WRITE_MULTI, payload,
+        expect=errno.EINVAL)
+    assert writes == []
+
+
+def test_write_multi_bad_access():
+    # A single bad write fails the whole request without side effects.
+    write_region_multi(ctx, client.sock, [
+        (VFU_PCI_DEV_BAR0_REGION_IDX, 0, b'\x01'),
+        (VFU_PCI_DEV_BAR0_REGION_IDX, BAR0_SIZE - 2, b'\x01\x02\x03\x04'),
+    ], expect=errno.EINVAL)
+
+    write_region_multi(ctx, client.sock, [
+        (VFU_PCI_DEV_BAR0_REGION_IDX, 0, b'\x01'),
+        (VFU_PCI_DEV_NUM_REGIONS, 0, b'\x01'),
+    ], expect=errno.EINVAL)
+
+    assert writes == []
+
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
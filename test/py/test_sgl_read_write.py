@@ -46,40 +46,57 @@ class DMARegionHandler:
     takes place on a separate thread so as to not block the test code.
     """
 
-    def __handle_requests(sock, pipe, buf, lock, addr, error_no):
+    def __handle_requests(sock, pipe, buf, lock, addr, error_no, batch):
         while True:
             (ready, _, _) = select.select([sock, pipe], [], [])
             if pipe in ready:
                 break
 
-            # Read a command from the socket and service it.
-            _, msg_id, cmd, payload = get_msg_fds(sock,
-                                                  VFIO_USER_F_TYPE_COMMAND)
-            assert cmd in [VFIO_USER_DMA_READ, VFIO_USER_DMA_WRITE]
-            access, data = vfio_user_dma_region_access.pop_from_buffer(payload)
-
-            assert access.addr >= addr
-            assert access.addr + access.count <= addr + len(buf)
-
-            offset = access.addr - addr
-            with lock:
-                if cmd == VFIO_USER_DMA_READ:
-                    data = buf[offset:offset + access.count]
-                else:
-                    buf[offset:offset + access.count] = data
-                    data = bytearray()
-
-            send_msg(sock,
-                     cmd,
-                     VFIO_USER_F_TYPE_REPLY,
-                     payload=payload[:c.sizeof(access)] + data,
-                     msg_id=msg_id,
-                     error_no=error_no)
+            # Read up to batch commands from the socket and service them,
+            # replying in reverse order.
+            replies = []
+            while True:
+                # Several requests may be queued, so read exactly one.
+                hdr = sock.recv(16, socket.MSG_WAITALL)
+                msg_id, cmd, msg_size, flags, _ = struct.unpack("HHIII", hdr)
+                assert flags & VFIO_USER_F_TYPE == VFIO_USER_F_TYPE_COMMAND
+                payload = sock.recv(msg_size - 16, socket.MSG_WAITALL)
+                assert cmd in [VFIO_USER_DMA_READ, VFIO_USER_DMA_WRITE]
+                access, data = \
+                    vfio_user_dma_region_access.pop_from_buffer(payload)
+
+                assert access.addr >= addr
+                assert access.addr + access.count <= addr + len(buf)
+
+                offset = access.addr - addr
+                with lock:
+                    if cmd == VFIO_USER_DMA_READ:
+                        data = buf[offset:offset + access.count]
+                    else:
+                        buf[offset:offset + access.count] = data
+                        data = bytearray()
+
+                replies.insert(0, (cmd, payload[:c.sizeof(access)] + data,
+                                   msg_id))
+
+                if len(replies) == batch:
+                    break
+                (ready, _, _) = select.select([sock], [], [], 0.1)
+                if sock not in ready:
+                    break
+
+            for cmd, payload, msg_id in replies:
+                send_msg(sock,
+                         cmd,
+                         VFIO_USER_F_TYPE_REPLY,
+                         payload=payload,
+                         msg_id=msg_id,
+                         error_no=error_no)
 
         os.close(pipe)
         sock.close()
 
-    def __init__(self, sock, addr, size, error_no=0):
+    def __init__(self, sock, addr, size, error_no=0, batch=1):
         self.data = bytearray(size)
         self.data_lock = threading.Lock()
         self.addr = addr
@@ -89,7 +106,8 @@ class DMARegionHandler:
         sock = socket.socket(fileno=os.dup(sock.fileno()))
         thread = threading.Thread(
             target=DMARegionHandler.__handle_requests,
-            args=[sock, pipe_r, self.data, self.data_lock, addr, error_no])
+            args=[sock, pipe_r, self.data, self.data_lock, addr, error_no,
+                  batch])
         thread.start()
 
     def shutdown(self):
@@ -189,4 +207,264 @@ def test_dma_read_write_error():
     assert c.get_errno() == errno.EIO
 
 
+def test_dma_transfer_window_bad():
+    assert vfu_setup_dma_transfer_window(ctx, 0) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_setup_dma_transfer_window(ctx,
+                                         VFU_DMA_TRANSFER_MAX_WINDOW + 1) == -1
+    assert c.get_errno() == errno.EINVAL
+
+
+def test_dma_read_write_windowed():
+    # Reinitialize the handler to reply to up to 4 requests in reverse order.
+    global dma_handler
+    dma_handler.shutdown()
+    dma_handler = DMARegionHandler(client.client_cmd_socket, MAP_ADDR,
+                                   MAP_SIZE, batch=4)
+
+    assert vfu_setup_dma_transfer_window(ctx, 4) == 0
+
+    ret, sg = vfu_addr_to_sgl(ctx,
+                              dma_addr=MAP_ADDR + 0x1000,
+                              length=8 * PAGE_SIZE + 42,
+                              max_nr_sgs=1,
+                              prot=mmap.PROT_READ | mmap.PROT_WRITE)
+    assert ret == 1
+
+    data = bytearray([x & 0xff for x in range(0, sg[0].length)])
+    assert vfu_sgl_write(ctx, sg, 1, data) == 0
+
+    assert vfu_sgl_read(ctx, sg, 1) == (0, data)
+
+    assert dma_handler.read(sg[0].dma_addr + sg[0].offset,
+                            sg[0].length) == data
+
+
+def test_dma_read_write_windowed_error():
+    global dma_handler
+    dma_handler.shutdown()
+    dma_handler = DMARegionHandler(client.client_cmd_socket, MAP_ADDR,
+                                   MAP_SIZE, error_no=errno.EIO, batch=4)
+
+    assert vfu_setup_dma_transfer_window(ctx, 4) == 0
+
+    ret, sg = vfu_addr_to_sgl(ctx,
+                              dma_addr=MAP_ADDR + 0x1000,
+                              length=8 * PAGE_SIZE,
+                              max_nr_sgs=1,
+                              prot=mmap.PROT_READ | mmap.PROT_WRITE)
+    assert ret == 1
+
+    ret, _ = vfu_sgl_read(ctx, sg, 1)
+    assert ret == -1
+    assert c.get_errno() == errno.EIO
+
+    # All replies to the failed transfer must have been consumed.
+    dma_handler.shutdown()
+    dma_handler = DMARegionHandler(client.client_cmd_socket, MAP_ADDR,
+                                   MAP_SIZE, batch=4)
+    ret, sg = vfu_addr_to_sgl(ctx,
+                              dma_addr=MAP_ADDR,
+                              length=64,
+                              max_nr_sgs=1,
+                              prot=mmap.PROT_READ | mmap.PROT_WRITE)
+    assert ret == 1
+    assert vfu_sgl_read(ctx, sg, 1)[0] == 0
+
+
+dma_done = []
+
+
+@vfu_dma_done_cb_t
+def dma_done_cb(ctx, arg, err):
+    dma_done.append((arg, err))
+
+
+def wait_dma_done(count):
+    fd = vfu_get_dma_poll_fd(ctx)
+    assert fd >= 0
+    while len(dma_done) < count:
+        select.select([fd], [], [])
+        assert vfu_process_dma_replies(ctx) == 0
+
+
+def test_dma_read_write_async():
+    global dma_handler
+    dma_handler.shutdown()
+    dma_handler = DMARegionHandler(client.client_cmd_socket, MAP_ADDR,
+                                   MAP_SIZE, batch=4)
+    assert vfu_setup_dma_transfer_window(ctx, 2) == 0
+    dma_done.clear()
+
+    sgs = []
+    for i in range(2):
+        ret, sg = vfu_addr_to_sgl(ctx,
+                                  dma_addr=MAP_ADDR + i * 4 * PAGE_SIZE,
+                                  length=3 * PAGE_SIZE + 42,
+                                  max_nr_sgs=1,
+                                  prot=mmap.PROT_READ | mmap.PROT_WRITE)
+        assert ret == 1
+        sgs.append(sg)
+
+    datas = [bytearray([(x + i) & 0xff for x in range(0, sgs[i][0].length)])
+             for i in range(2)]
+    for i in range(2):
+        assert vfu_sgl_write_async(ctx, sgs[i], 1, datas[i], dma_done_cb,
+                                   i + 1) == 0
+    wait_dma_done(2)
+    assert sorted(dma_done) == [(1, 0), (2, 0)]
+
+    for i in range(2):
+        assert dma_handler.read(sgs[i][0].dma_addr + sgs[i][0].offset,
+                                sgs[i][0].length) == datas[i]
+
+    # Replies to an asynchronous read are handled by a synchronous one too.
+    dma_done.clear()
+    rdata = bytearray(sgs[0][0].length)
+    assert vfu_sgl_read_async(ctx, sgs[0], 1, rdata, dma_done_cb, 1) == 0
+    assert vfu_sgl_read(ctx, sgs[1], 1) == (0, datas[1])
+    wait_dma_done(1)
+    assert dma_done == [(1, 0)]
+    assert rdata == datas[0]
+
+
+def test_dma_read_async_error():
+    global dma_handler
+    dma_handler.shutdown()
+    dma_handler = DMARegionHandler(client.client_cmd_socket, MAP_ADDR,
+                                   MAP_SIZE, error_no=errno.EIO)
+    dma_done.clear()
+
+    ret, sg = vfu_addr_to_sgl(ctx,
+                              dma_addr=MAP_ADDR,
+                              length=64,
+                              max_nr_sgs=1,
+                              prot=mmap.PROT_READ | mmap.PROT_WRITE)
+    assert ret == 1
+
+    data = bytearray(64)
+    assert vfu_sgl_read_async(ctx, sg, 1, data, dma_done_cb) == 0
+    wait_dma_done(1)
+    assert dma_done == [(None, errno.EIO)]
+
+
+def test_dma_read_write_threads():
+    global dma_handler
+    dma_handler.shutdown()
+    dma_handler = DMARegionHandler(client.client_cmd_socket, MAP_ADDR,
+                                   MAP_SIZE, batch=4)
+    assert vfu_setup_dma_transfer_window(ctx, 2) == 0
+
+    nr_threads = 4
+    errors = []
+
+    def worker(i):
+        ret, sg = vfu_addr_to_sgl(ctx,
+                                  dma_addr=MAP_ADDR + i * 4 * PAGE_SIZE,
+                                  length=3 * PAGE_SIZE + i,
+                                  max_nr_sgs=1,
+                                  prot=mmap.PROT_READ | mmap.PROT_WRITE)
+        if ret != 1:
+            errors.append((i, "sgl", ret))
+            return
+        for j in range(8):
+            data = bytearray([(x + i + j) & 0xff
+                              for x in range(0, sg[0].length)])
+            if vfu_sgl_write(ctx, sg, 1, data) != 0:
+                errors.append((i, "write", c.get_errno()))
+            elif vfu_sgl_read(ctx, sg, 1) != (0, data):
+                errors.append((i, "read", c.get_errno()))
+
+    threads = [threading.Thread(target=worker, args=[i])
+               for i in range(nr_threads)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    assert errors == []
+
+
+def test_cmd_sockets_bad():
+    assert vfu_setup_cmd_sockets(ctx, 0) == -1
+    assert c.get_errno() == errno.EINVAL
+    assert vfu_setup_cmd_sockets(ctx, VFU_MAX_CMD_SOCKETS + 1) == -1
+    assert c.get_errno() == errno.EINVAL
+    assert vfu_bind_cmd_socket(ctx, 1) == -1
+    assert c.get_errno() == errno.EINVAL
+    assert vfu_bind_cmd_socket(ctx, 0) == 0
+    assert vfu_get_nr_cmd_sockets(ctx) == 1
+
+
+def test_dma_read_write_cmd_sockets():
+    global client, dma_handler
+    dma_handler.shutdown()
+    client.disconnect(ctx)
+
+    # The client provides fewer sockets than the server asks for.
+    assert vfu_setup_cmd_sockets(ctx, 4) == 0
+    caps = {
+        "capabilities": {
+            "max_data_xfer_size": PAGE_SIZE,
+            "twin_socket": {
+                "supported": True,
+                "nr_sockets": 3,
+            },
+        }
+    }
+    client = connect_client(ctx, caps)
+    assert len(client.client_cmd_sockets) == 3
+    assert vfu_get_nr_cmd_sockets(ctx) == 3
+
+    payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+                                flags=(VFIO_USER_F_DMA_REGION_READ
+                                       | VFIO_USER_F_DMA_REGION_WRITE),
+                                offset=0,
+                                addr=MAP_ADDR,
+                                size=MAP_SIZE)
+    msg(ctx, client.sock, VFIO_USER_DMA_MAP, payload)
+
+    handlers = [DMARegionHandler(sock, MAP_ADDR, MAP_SIZE)
+                for sock in client.client_cmd_sockets]
+    dma_handler = handlers[0]
+
+    nr_threads = 4
+    errors = []
+
+    def worker(i):
+        if vfu_bind_cmd_socket(ctx, i) != 0:
+            errors.append((i, "bind", c.get_errno()))
+            return
+        ret, sg = vfu_addr_to_sgl(ctx,
+                                  dma_addr=MAP_ADDR + i * 4 * PAGE_SIZE,
+                                  length=2 * PAGE_SIZE,
+                                  max_nr_sgs=1,
+                                  prot=mmap.PROT_READ | mmap.PROT_WRITE)
+        if ret != 1:
+            errors.append((i, "sgl", ret))
+            return
+        data = bytearray([(x + i) & 0xff for x in range(0, sg[0].length)])
+        if vfu_sgl_write(ctx, sg, 1, data) != 0:
+            errors.append((i, "write", c.get_errno()))
+        elif vfu_sgl_read(ctx, sg, 1) != (0, data):
+            errors.append((i, "read", c.get_errno()))
+        elif handlers[i % 3].read(MAP_ADDR + i * 4 * PAGE_SIZE,
+                                  sg[0].length) != data:
+            # Socket index 3 wraps around to the first socket.
+            errors.append((i, "socket"))
+
+    threads = [threading.Thread(target=worker, args=[i])
+               for i in range(nr_threads)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    for handler in handlers[1:]:
+        handler.shutdown()
+
+    assert errors == []
+
+
 # ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
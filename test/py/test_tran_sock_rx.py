@@ -0,0 +1,242 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import fcntl
+import termios
+import threading
+from unittest.mock import patch
+
+ctx = None
+client = None
+writes = []
+
+BAR0_SIZE = 0x20000
+
+
+@vfu_region_access_cb_t
+def bar0_cb(ctx, buf, count, offset, is_write):
+    if offset >= BAR0_SIZE // 2:
+        c.set_errno(errno.EIO)
+        return -1
+    if is_write:
+        writes.append((offset, bytes(buf[:count])))
+    else:
+        c.memset(buf, 0xab, count)
+    return count
+
+
+def setup_dma(ctx):
+    vfu_setup_device_quiesce_cb(ctx)
+    assert vfu_setup_device_dma(ctx) == 0
+
+
+def setup_function(function):
+    global ctx, client
+    writes.clear()
+
+    (ctx, client) = setup_posted_writes_ctx(bar0_cb, BAR0_SIZE,
+                                            setup=setup_dma)
+
+
+def teardown_function(function):
+    teardown_ctx(ctx, client)
+
+
+def test_tran_sock_rx_pipelined():
+    """Requests received together are all handled by one call."""
+    client.sock.send(b''.join(region_access_msg(i, False, i * 4, count=4)
+                              for i in range(1, 4)))
+
+    assert vfu_run_ctx(ctx) == 3
+    for i in range(1, 4):
+        (msg_id, payload) = get_reply_id(client.sock)
+        assert msg_id == i
+        assert payload[16:] == b'\xab' * 4
+
+    assert not poll_fd_ready(ctx)
+    assert vfu_run_ctx(ctx) == 0
+
+
+def test_tran_sock_rx_partial_header():
+    """A partially received header is kept until the rest arrives."""
+    req = region_access_msg(1, False, 0, count=4)
+    client.sock.send(req[:10])
+    assert vfu_run_ctx(ctx) == 0
+
+    client.sock.send(req[10:])
+    assert vfu_run_ctx(ctx) == 1
+    (msg_id, payload) = get_reply_id(client.sock)
+    assert msg_id == 1
+    assert payload[16:] == b'\xab' * 4
+
+
+def test_tran_sock_rx_split_body():
+    """The rest of a partially received body is read separately."""
+    data = bytes(i % 251 for i in range(BAR0_SIZE // 2))
+    req = region_access_msg(1, True, 0, data=data)
+    client.sock.send(req[:100])
+
+    thread = threading.Thread(target=vfu_run_ctx, args=(ctx,))
+    thread.start()
+
+    # Only send the rest once the server has read everything sent so far.
+    outq = bytearray(4)
+    while True:
+        fcntl.ioctl(client.sock, termios.TIOCOUTQ, outq)
+        if struct.unpack("i", outq)[0] == 0:
+            break
+    client.sock.sendall(req[100:])
+    thread.join()
+
+    # Posted, so there's no reply.
+    assert writes == [(0, data)]
+
+
+def test_tran_sock_rx_fds():
+    """fds arrive with their own message, even when it's queued behind one."""
+    irq_set = vfio_irq_set(argsz=c.sizeof(vfio_irq_set),
+                           flags=VFIO_IRQ_SET_ACTION_TRIGGER |
+                           VFIO_IRQ_SET_DATA_EVENTFD, index=VFU_DEV_ERR_IRQ,
+                           start=0, count=1)
+    fd = eventfd()
+
+    client.sock.send(region_access_msg(1, False, 0, count=4))
+    hdr = vfio_user_header(VFIO_USER_DEVICE_SET_IRQS, size=len(irq_set),
+                           msg_id=2)
+    client.sock.sendmsg([hdr + bytes(irq_set)],
+                        [(socket.SOL_SOCKET, socket.SCM_RIGHTS,
+                          struct.pack("I", fd))])
+    client.sock.send(region_access_msg(3, False, 0, count=4))
+
+    # Data isn't received past fds in one go, the rest is left in the socket.
+    assert vfu_run_ctx(ctx) == 2
+    assert poll_fd_ready(ctx)
+    assert vfu_run_ctx(ctx) == 1
+    assert get_reply_id(client.sock)[0] == 1
+    assert get_reply_id(client.sock)[0] == 2
+    assert get_reply_id(client.sock)[0] == 3
+
+    # A failed posted write signals the error IRQ through the eventfd.
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                 offset=BAR0_SIZE // 2, count=4, data=b'\x01\x02\x03\x04',
+                 rsp=False)
+    assert os.read(fd, 8) == struct.pack("Q", 1)
+    os.close(fd)
+
+
+@patch('libvfio_user.quiesce_cb', side_effect=fail_with_errno(errno.EBUSY))
+def test_tran_sock_rx_quiesced(mock_quiesce):
+    """
+    Requests received behind one that needed a quiesce are left for the next
+    vfu_run_ctx() call once the device has quiesced, and signalled by the poll
+    fd meanwhile.
+    """
+    client.sock.send(vfio_user_header(VFIO_USER_DEVICE_RESET, size=0,
+                                      msg_id=1) +
+                     region_access_msg(2, False, 0, count=4) +
+                     region_access_msg(3, False, 4, count=4))
+
+    vfu_run_ctx(ctx, errno.EBUSY)
+    assert vfu_device_quiesced(ctx, 0) == 0
+    assert get_reply_id(client.sock)[0] == 1
+
+    assert poll_fd_ready(ctx)
+    assert vfu_run_ctx(ctx) == 2
+    assert get_reply_id(client.sock)[0] == 2
+    assert get_reply_id(client.sock)[0] == 3
+    assert not poll_fd_ready(ctx)
+
+
+def test_tran_sock_rx_dma_reply():
+    """
+    Without a twin socket, DMA replies arrive on the main socket, possibly
+    behind requests: those stay staged, and are signalled by the poll fd.
+    """
+    payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+                                flags=(VFIO_USER_F_DMA_REGION_READ |
+                                       VFIO_USER_F_DMA_REGION_WRITE),
+                                offset=0, addr=0x10000000, size=PAGE_SIZE)
+    msg(ctx, client.sock, VFIO_USER_DMA_MAP, payload)
+
+    ret, sg = vfu_addr_to_sgl(ctx, dma_addr=0x10000000, length=8)
+    assert ret == 1
+
+    def serve():
+        hdr = client.sock.recv(16, socket.MSG_WAITALL)
+        msg_id, cmd, msg_size, _, _ = struct.unpack("HHIII", hdr)
+        assert cmd == VFIO_USER_DMA_READ
+        req = client.sock.recv(msg_size - 16, socket.MSG_WAITALL)
+        client.sock.send(region_access_msg(2, False, 0, count=4))
+        send_msg(client.sock, cmd, VFIO_USER_F_TYPE_REPLY,
+                 payload=req + b'\x5a' * 8, msg_id=msg_id)
+
+    thread = threading.Thread(target=serve)
+    thread.start()
+    assert vfu_sgl_read(ctx, sg, 1) == (0, b'\x5a' * 8)
+    thread.join()
+
+    assert poll_fd_ready(ctx)
+    assert vfu_run_ctx(ctx) == 1
+    assert get_reply_id(client.sock)[0] == 2
+
+
+def test_tran_sock_rx_split_fds():
+    """fds sent in the middle of a request are a protocol error."""
+    def nr_eventfds():
+        nr = 0
+        for fd in os.listdir("/proc/self/fd"):
+            try:
+                if os.readlink("/proc/self/fd/" + fd) == "anon_inode:[eventfd]":
+                    nr += 1
+            except FileNotFoundError:
+                pass
+        return nr
+
+    nr = nr_eventfds()
+    req = region_access_msg(1, False, 0, count=4)
+    fd1 = eventfd()
+    fd2 = eventfd()
+
+    client.sock.sendmsg([req[:10]], [(socket.SOL_SOCKET, socket.SCM_RIGHTS,
+                                      struct.pack("I", fd1))])
+    assert vfu_run_ctx(ctx) == 0
+
+    client.sock.sendmsg([req[10:]], [(socket.SOL_SOCKET, socket.SCM_RIGHTS,
+                                      struct.pack("I", fd2))])
+    vfu_run_ctx(ctx, errno.ENOTCONN)
+
+    os.close(fd1)
+    os.close(fd2)
+    # Neither the pending fd nor the new one is leaked, and the eventfd behind
+    # the poll fd went with the connection.
+    assert nr_eventfds() == nr - 1
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
@@ -0,0 +1,144 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import threading
+import time
+
+ctx = None
+client = None
+writes = []
+
+BAR0_SIZE = 0x20000
+
+
+@vfu_region_access_cb_t
+def bar0_cb(ctx, buf, count, offset, is_write):
+    if offset >= BAR0_SIZE // 2:
+        c.set_errno(errno.EIO)
+        return -1
+    if is_write:
+        writes.append((offset, bytes(buf[:count])))
+    else:
+        c.memset(buf, 0xab, count)
+    return count
+
+
+def setup_function(function):
+    global ctx, client
+    writes.clear()
+
+    (ctx, client) = setup_posted_writes_ctx(bar0_cb, BAR0_SIZE,
+                                            trans=VFU_TRANS_SOCK_URING)
+
+
+def teardown_function(function):
+    teardown_ctx(ctx, client)
+
+
+def test_tran_uring_region_access():
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX, offset=0,
+                 count=4, data=b'\x01\x02\x03\x04', rsp=False)
+    payload = read_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                          offset=0, count=4)
+    assert payload == b'\xab' * 4
+    assert writes == [(0, b'\x01\x02\x03\x04')]
+
+    # The poll fd is cleared once there's nothing left to handle.
+    assert vfu_run_ctx(ctx) == 0
+    assert not poll_fd_ready(ctx)
+
+
+def test_tran_uring_pipelined():
+    """Several requests arriving at once are handled one by one."""
+    client.sock.send(b''.join(region_access_msg(i, False, i * 4, count=4)
+                              for i in range(1, 4)))
+    for i in range(1, 4):
+        assert poll_fd_ready(ctx)
+        assert vfu_run_ctx(ctx) == 1
+        (msg_id, payload) = get_reply_id(client.sock)
+        assert msg_id == i
+        assert payload[16:] == b'\xab' * 4
+    assert vfu_run_ctx(ctx) == 0
+    assert not poll_fd_ready(ctx)
+
+
+def test_tran_uring_large_write():
+    """A request spanning several receive buffers is reassembled."""
+    data = bytes(i % 251 for i in range(BAR0_SIZE // 2))
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX, offset=0,
+                 count=len(data), data=data, rsp=False)
+    assert writes == [(0, data)]
+
+
+def test_tran_uring_split_request():
+    """A request whose body arrives late is waited for."""
+    req = region_access_msg(1, False, 0, count=8)
+    client.sock.send(req[:20])
+
+    thread = threading.Thread(target=vfu_run_ctx, args=(ctx,))
+    thread.start()
+    time.sleep(0.1)
+    client.sock.send(req[20:])
+    thread.join()
+
+    (msg_id, payload) = get_reply_id(client.sock)
+    assert msg_id == 1
+    assert payload[16:] == b'\xab' * 8
+
+
+def test_tran_uring_fds():
+    """fds arrive with their own message, even when it's queued behind one."""
+    irq_set = vfio_irq_set(argsz=c.sizeof(vfio_irq_set),
+                           flags=VFIO_IRQ_SET_ACTION_TRIGGER |
+                           VFIO_IRQ_SET_DATA_EVENTFD, index=VFU_DEV_ERR_IRQ,
+                           start=0, count=1)
+    fd = eventfd()
+
+    client.sock.send(region_access_msg(1, False, 0, count=4))
+    hdr = vfio_user_header(VFIO_USER_DEVICE_SET_IRQS, size=len(irq_set),
+                           msg_id=2)
+    client.sock.sendmsg([hdr + bytes(irq_set)],
+                        [(socket.SOL_SOCKET, socket.SCM_RIGHTS,
+                          struct.pack("I", fd))])
+
+    assert vfu_run_ctx(ctx) == 1
+    assert vfu_run_ctx(ctx) == 1
+    assert get_reply_id(client.sock)[0] == 1
+    assert get_reply_id(client.sock)[0] == 2
+
+    # A failed posted write signals the error IRQ through the eventfd.
+    write_region(ctx, client.sock, VFU_PCI_DEV_BAR0_REGION_IDX,
+                 offset=BAR0_SIZE // 2, count=4, data=b'\x01\x02\x03\x04',
+                 rsp=False)
+    assert os.read(fd, 8) == struct.pack("Q", 1)
+    os.close(fd)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
@@ -0,0 +1,199 @@
+#
+# Copyright (c) 2023 Rivos Inc. All rights reserved.
+#
+# Authors: Mattias Nissler <mnissler@rivosinc.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import threading
+
+ctx = None
+client = None
+pool = None
+released = None
+registered = []
+unregistered = []
+cb_threads = []
+
+
+@vfu_dma_register_cb_t
+def dma_register_cb(ctx, info):
+    # blocks the worker until the test lets it go
+    released.wait(10)
+    registered.append(info.contents.iova.iov_base)
+    cb_threads.append(threading.get_ident())
+
+
+@vfu_dma_unregister_cb_t
+def dma_unregister_cb(ctx, info):
+    unregistered.append(info.contents.iova.iov_base)
+    cb_threads.append(threading.get_ident())
+
+
+def setup_function(function):
+    global ctx, client, pool, released
+
+    released = threading.Event()
+    registered.clear()
+    unregistered.clear()
+    cb_threads.clear()
+
+    pool = vfu_worker_pool_create(2)
+    assert pool is not None
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB |
+                         LIBVFIO_USER_FLAG_DMA_MAP_NO_QUIESCE)
+    assert ctx is not None
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_setup_device_dma(ctx, dma_register_cb, dma_unregister_cb) == 0
+    vfu_setup_device_quiesce_cb(ctx)
+    assert vfu_setup_worker_pool(ctx, pool, VFU_WORKER_CMD_DMA) == 0
+    assert vfu_realize_ctx(ctx) == 0
+
+    client = connect_client(ctx)
+
+
+def teardown_function(function):
+    released.set()
+    client.disconnect(ctx)
+    vfu_destroy_ctx(ctx)
+    vfu_worker_pool_destroy(pool)
+
+
+def dma_map_payload(addr):
+    return vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+        flags=(VFIO_USER_F_DMA_REGION_READ | VFIO_USER_F_DMA_REGION_WRITE),
+        offset=0, addr=addr, size=PAGE_SIZE)
+
+
+def get_reply_hdr(sock):
+    """Returns (msg_id, cmd, errno) of the next reply, discarding its body."""
+    buf = sock.recv(16, socket.MSG_WAITALL)
+    (msg_id, cmd, msg_size, flags, err) = struct.unpack("HHIII", buf)
+    assert (flags & VFIO_USER_F_TYPE_REPLY) != 0
+    if msg_size > 16:
+        sock.recv(msg_size - 16, socket.MSG_WAITALL)
+    return (msg_id, cmd, err)
+
+
+def test_setup_worker_pool_bad():
+    assert vfu_worker_pool_create(0) is None
+    assert c.get_errno() == errno.EINVAL
+
+    # already realized
+    assert vfu_setup_worker_pool(ctx, pool, VFU_WORKER_CMD_DMA) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    other = vfu_create_ctx(sock_path=SOCK_PATH + b".other",
+                           flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert other is not None
+    assert vfu_setup_worker_pool(other, pool, 0) == -1
+    assert c.get_errno() == errno.EINVAL
+    assert vfu_setup_worker_pool(other, pool, 1 << 3) == -1
+    assert c.get_errno() == errno.EINVAL
+    vfu_destroy_ctx(other)
+
+
+def test_worker_pool_dma_map_overtaken():
+    """
+    While an offloaded DMA map is blocked in its callback, a device info
+    request is replied to; the DMA map reply follows once it's unblocked.
+    """
+
+    send_msg(client.sock, VFIO_USER_DMA_MAP, VFIO_USER_F_TYPE_COMMAND,
+             dma_map_payload(0x10 << PAGE_SHIFT), msg_id=0x1234)
+    assert vfu_run_ctx(ctx) == 1
+
+    payload = vfio_user_device_info(argsz=len(vfio_user_device_info()),
+                                    flags=0, num_regions=0, num_irqs=0)
+    msg(ctx, client.sock, VFIO_USER_DEVICE_GET_INFO, payload)
+    assert registered == []
+
+    released.set()
+
+    assert get_reply_hdr(client.sock) == (0x1234, VFIO_USER_DMA_MAP, 0)
+    assert registered == [0x10 << PAGE_SHIFT]
+
+
+def test_worker_pool_drain_before_quiesce():
+    """
+    A DMA unmap needs the device to quiesce, so it waits for the offloaded DMA
+    map before it, and is then handled by vfu_run_ctx() itself.
+    """
+
+    send_msg(client.sock, VFIO_USER_DMA_MAP, VFIO_USER_F_TYPE_COMMAND,
+             dma_map_payload(0x10 << PAGE_SHIFT), msg_id=1)
+    payload = vfio_user_dma_unmap(argsz=len(vfio_user_dma_unmap()),
+                                  addr=0x10 << PAGE_SHIFT, size=PAGE_SIZE)
+    send_msg(client.sock, VFIO_USER_DMA_UNMAP, VFIO_USER_F_TYPE_COMMAND,
+             payload, msg_id=2)
+
+    # Both requests arrive together, so a single call handles them.
+    timer = threading.Timer(0.2, released.set)
+    timer.start()
+    assert vfu_run_ctx(ctx) == 2
+    timer.join()
+
+    assert registered == [0x10 << PAGE_SHIFT]
+    assert unregistered == [0x10 << PAGE_SHIFT]
+
+    assert get_reply_hdr(client.sock) == (1, VFIO_USER_DMA_MAP, 0)
+    assert get_reply_hdr(client.sock) == (2, VFIO_USER_DMA_UNMAP, 0)
+
+def test_worker_pool_dma_not_offloaded():
+    """
+    Without LIBVFIO_USER_FLAG_DMA_MAP_NO_QUIESCE, DMA maps aren't offloaded,
+    and DMA unmaps never are, even without a quiesce callback: they'd race with
+    vfu_addr_to_sgl() on the context's thread.
+    """
+
+    path = SOCK_PATH + b".other"
+    other = vfu_create_ctx(sock_path=path, flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert other is not None
+    assert vfu_pci_init(other) == 0
+    assert vfu_setup_device_dma(other, dma_register_cb, dma_unregister_cb) == 0
+    assert vfu_setup_worker_pool(other, pool, VFU_WORKER_CMD_DMA) == 0
+    assert vfu_realize_ctx(other) == 0
+    other_client = connect_client(other, sock_path=path)
+    released.set()
+
+    send_msg(other_client.sock, VFIO_USER_DMA_MAP, VFIO_USER_F_TYPE_COMMAND,
+             dma_map_payload(0x10 << PAGE_SHIFT), msg_id=1)
+    payload = vfio_user_dma_unmap(argsz=len(vfio_user_dma_unmap()),
+                                  addr=0x10 << PAGE_SHIFT, size=PAGE_SIZE)
+    send_msg(other_client.sock, VFIO_USER_DMA_UNMAP, VFIO_USER_F_TYPE_COMMAND,
+             payload, msg_id=2)
+    assert vfu_run_ctx(other) == 2
+
+    assert get_reply_hdr(other_client.sock) == (1, VFIO_USER_DMA_MAP, 0)
+    assert get_reply_hdr(other_client.sock) == (2, VFIO_USER_DMA_UNMAP, 0)
+    assert cb_threads == [threading.get_ident()] * 2
+
+    other_client.disconnect(other)
+    vfu_destroy_ctx(other)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
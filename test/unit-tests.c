@@ -434,6 +434,7 @@ test_cmd_allowed_when_stopped_and_copying(UNUSED void **state)
         bool r = cmd_allowed_when_stopped_and_copying(i);
         if (i == VFIO_USER_REGION_READ ||
             i == VFIO_USER_REGION_WRITE ||
+            i == VFIO_USER_REGION_WRITE_MULTI ||
             i == VFIO_USER_DEVICE_FEATURE ||
             i == VFIO_USER_MIG_DATA_READ) {
             assert_true(r);